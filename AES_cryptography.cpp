@@ -1,14 +1,70 @@
 #include "AES_cryptography.h"
+#include "random_generator.h"
 
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
 #include <cstring>
 #include <iostream>
-#include <random>
+
+#if ( defined( __x86_64__ ) || defined( __i386__ ) ) && defined( __GNUC__ )
+#define AES_X86 1
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+namespace
+{
+     // столбец состояния как 32-битное слово, строка 0 в старшем байте
+     inline uint32_t loadColumn( const unsigned char* src )
+     {
+          return ( uint32_t( src[ 0 ] ) << 24 ) | ( uint32_t( src[ 1 ] ) << 16 ) | ( uint32_t( src[ 2 ] ) << 8 ) | src[ 3 ];
+     }
+
+     // умножение каждого байта слова на x в GF(2^8)
+     inline uint32_t xtimeWord( uint32_t word )
+     {
+          return ( ( word & 0x7f7f7f7f ) << 1 ) ^ ( ( ( word >> 7 ) & 0x01010101 ) * 0x1b );
+     }
+
+     inline uint32_t rotateWord( uint32_t word, int bits )
+     {
+          return ( word << bits ) | ( word >> ( 32 - bits ) );
+     }
+
+     // InvMixColumns столбца без таблиц: InvMixColumns = MixColumns после прибавления к строкам 0, 2 и 1, 3
+     // {04}(a0 ^ a2) и {04}(a1 ^ a3) соответственно. Только сдвиги и XOR без обращений к таблицам, поэтому столбцы
+     // разных раундов компилятор может обрабатывать векторными инструкциями
+     inline uint32_t invMixColumnWord( uint32_t column )
+     {
+          uint32_t quad = xtimeWord( xtimeWord( column ) );
+          column ^= quad ^ rotateWord( quad, 16 );
+          uint32_t next = rotateWord( column, 8 );
+          return xtimeWord( column ^ next ) ^ next ^ rotateWord( column, 16 ) ^ rotateWord( column, 24 );
+     }
+
+     inline void storeColumn( unsigned char* dst, uint32_t column )
+     {
+          dst[ 0 ] = static_cast< unsigned char >( column >> 24 );
+          dst[ 1 ] = static_cast< unsigned char >( column >> 16 );
+          dst[ 2 ] = static_cast< unsigned char >( column >> 8 );
+          dst[ 3 ] = static_cast< unsigned char >( column );
+     }
+
+     // выбранная реализация. Инициализируется при первом обращении, поэтому не зависит от порядка создания статических объектов
+     std::atomic< int >& backendSetting()
+     {
+          static std::atomic< int > setting( AESCryptography::bestBackend() );
+          return setting;
+     }
+
+     // число блоков счетчика, шифруемых за один вызов в режиме CTR
+     const size_t ctrBatchBlocks = 8;
+}
+
 AESCryptography::AESCryptography( AesKeyLength keyLength )
-:Nk( calculateNk( keyLength ) ), Nr( calculateNr( keyLength ) )
+:Nk( calculateNk( keyLength ) ), Nr( calculateNr( keyLength ) ), tables_( buildTables() )
 {
      // Nr и Nk зависят от размера ключа -> рассчитываем их при создании объекта в зависимости от размера ключа
 }
@@ -17,21 +73,14 @@ AESCryptography::AESCryptography( AesKeyLength keyLength )
 vector< unsigned char > AESCryptography::cryptDataECB( const vector< unsigned char >& data, const std::vector< unsigned char >& key )
 {
      // проверяем, что входные данные могут быть разбиты на блоки по oneBlockSize. Если нет - исключение
-     if( data.size() % oneBlockSize != 0 )
-     {
-          throw runtime_error( "data is not aligned" );
-     }
+     checkAligned( data.size() );
 
      // создаем набор раундовых ключей, которые исользуются для шифрования
-     Matrix roundKeyMatrix = KeyExpansion( key );
+     AesRoundKeys roundKeys = expandKey( key );
 
      // последовательно шифруем блоки открытого текста и шифртекст записываем в result
-     std::vector< unsigned char > result;
-     for( int block = 0; block < data.size(); block+= oneBlockSize )
-     {
-          std::vector< unsigned char > tmp = cryptBlock( { data.begin() + block, data.begin() + block + 16 }, roundKeyMatrix );
-          result.insert( result.end(), std::make_move_iterator( tmp.begin() ), std::make_move_iterator( tmp.end() ) );
-     }
+     std::vector< unsigned char > result( data.size() );
+     cryptBlocksECB( data.data(), result.data(), data.size(), roundKeys );
      return result;
 }
 
@@ -39,10 +88,7 @@ vector< unsigned char > AESCryptography::cryptDataECB( const vector< unsigned ch
 std::vector<unsigned char> AESCryptography::cryptDataCBC( const vector<unsigned char>& data, const vector<unsigned char>& key,
                                                            const vector<unsigned char>& iv )
 {
-     if( data.size() % 16 != 0 )
-     {
-          throw runtime_error( "data is not aligned" );
-     }
+     checkAligned( data.size() );
      // проверяем, что размер вектора инициализации равен размеру блока открытого текста. Если нет -> исключение
      // вектор инициализации в этом режиме используется для выполнения операции XOR над первым блоком открытого текста(т.к. первый блок не может выполнить
      // операцию XOR над предыдущим блоком шифртекста
@@ -52,203 +98,580 @@ std::vector<unsigned char> AESCryptography::cryptDataCBC( const vector<unsigned
      }
 
      // храним предыдущий блок шифртекста. Для первого блока используем IV
-     std::vector< unsigned char > lastEncryptedData = iv;
-     Matrix roundKeysMatrix = KeyExpansion( key );
+     unsigned char lastEncryptedData[ 16 ];
+     memcpy( lastEncryptedData, iv.data(), oneBlockSize );
+     AesRoundKeys roundKeys = expandKey( key );
 
-     std::vector< unsigned char > result;
-     for( int block = 0; block < data.size(); block+= 16 )
-     {
-          std::vector< unsigned char > src( data.begin() + block, data.begin() + block + 16 );
+     std::vector< unsigned char > result( data.size() );
+     cryptBlocksCBC( data.data(), result.data(), data.size(), roundKeys, lastEncryptedData );
+     return result;
+}
 
-          // выполняем операцию XOR над последним блоком шифртекста и текущим открытым текстом
-          src = vector_xor( src, lastEncryptedData );
-          std::vector< unsigned char > tmp_result = cryptBlock( src, roundKeysMatrix );
 
-          // записываем текущий блок шифртекста для использования при шифровании следующего блока
-          lastEncryptedData = tmp_result;
+std::vector< unsigned char > AESCryptography::decryptDataECB( const std::vector< unsigned char >& data, const std::vector< unsigned char >& key )
+{
+     checkAligned( data.size() );
+
+     AesRoundKeys roundKeys = expandKey( key );
 
-          result.insert( result.end(), std::make_move_iterator( tmp_result.begin() ), std::make_move_iterator( tmp_result.end() ) );
+     std::vector< unsigned char > result( data.size() );
+     decryptBlocksECB( data.data(), result.data(), data.size(), roundKeys );
+     return result;
+}
+
+std::vector<unsigned char> AESCryptography::decryptDataCBC( const std::vector<unsigned char>& data, const std::vector<unsigned char>& key, const std::vector<unsigned char>& iv )
+{
+     checkAligned( data.size() );
+     if( iv.size() != oneBlockSize )
+     {
+          throw runtime_error( "iv has not valid size" );
      }
 
+     AesRoundKeys roundKeys = expandKey( key );
+
+     unsigned char last_encrypted_data[ 16 ];
+     memcpy( last_encrypted_data, iv.data(), oneBlockSize );
+
+     std::vector< unsigned char > result( data.size() );
+     decryptBlocksCBC( data.data(), result.data(), data.size(), roundKeys, last_encrypted_data );
      return result;
 }
 
 
-std::vector< unsigned char > AESCryptography::cryptBlock( const vector< unsigned char >& data, const Matrix& roundKeysMatrix )
+AesRoundKeys AESCryptography::expandKey( const std::vector< unsigned char >& key, bool decryption )
 {
-     // проверям размер блока
-     if( data.size() != oneBlockSize )
+     if( key.size() != static_cast< size_t >( Nk * 4 ) )
      {
-          throw runtime_error( "invalid block size" );
+          throw runtime_error( "invalid key size" );
      }
+     AesRoundKeys result;
+     expandKeys( key.data(), 1, &result, decryption );
+     return result;
+}
 
-     // создаем матрицу, содержащую в себе открытый текст. С ней будем работать при шифровании и затем преобразуем обратной в массив байт
-     Matrix dataMatrix = block_to_matrix_4x4( data );
 
-     // выполняем операции для шифрования из стандарта(п. 5.1, стр 15)
-     int round_key_idx = 0;
-     addRoundKey( dataMatrix, roundKeysMatrix, round_key_idx );
-     round_key_idx += 4;
+void AESCryptography::expandKeys( const unsigned char* keys, size_t count, AesRoundKeys* roundKeys, bool decryption ) const
+{
+     if( backend() == ABAesNi )
+     {
+          expandKeysAesNi( keys, count, Nk, roundKeys );
+     }
+     else
+     {
+          expandKeysWords( keys, count, roundKeys );
+     }
+     for( size_t idx = 0; idx < count; idx++ )
+     {
+          roundKeys[ idx ].rounds = Nr;
+          roundKeys[ idx ].decryption = false;
+          if( decryption )
+          {
+               expandDecryptionKeys( roundKeys[ idx ] );
+          }
+     }
+}
 
-     for( int round = 0; round < Nr - 1; round++ )
+
+void AESCryptography::expandDecryptionKeys( AesRoundKeys& roundKeys ) const
+{
+     if( backend() == ABAesNi )
+     {
+          expandDecryptionKeysAesNi( roundKeys );
+     }
+     else
      {
-          subBytes( dataMatrix );
-          shiftRows( dataMatrix );
-          mixColumn( dataMatrix );
-          addRoundKey( dataMatrix, roundKeysMatrix, round_key_idx );
-          round_key_idx += 4;
+          expandDecryptionKeysWords( roundKeys );
      }
+     roundKeys.decryption = true;
+}
 
-     subBytes( dataMatrix );
-     shiftRows( dataMatrix );
-     addRoundKey( dataMatrix, roundKeysMatrix, round_key_idx );
 
+void AESCryptography::expandKeysWords( const unsigned char* keys, size_t count, AesRoundKeys* roundKeys ) const
+{
+     const int words = Nb * ( Nr + 1 );
+     auto subWord = [ this ]( uint32_t word )
+     {
+          return ( uint32_t( sboxValue( word >> 24, sbox ) ) << 24 ) | ( uint32_t( sboxValue( ( word >> 16 ) & 0xff, sbox ) ) << 16 ) |
+                 ( uint32_t( sboxValue( ( word >> 8 ) & 0xff, sbox ) ) << 8 ) | sboxValue( word & 0xff, sbox );
+     };
+
+     for( size_t first = 0; first < count; first += keyLanes )
+     {
+          const size_t lanes = std::min( static_cast< size_t >( keyLanes ), count - first );
+          const unsigned char* key = keys + first * 4 * Nk;
+
+          // слово idx расписания ключа lane группы - w[ idx ][ lane ](стандарт, п. 5.2). Ключи группы проходят
+          // расписание вместе, поэтому замены по sbox разных ключей не ждут друг друга
+          uint32_t w[ 60 ][ keyLanes ];
+          for( int idx = 0; idx < Nk; idx++ )
+          {
+               for( size_t lane = 0; lane < lanes; lane++ )
+               {
+                    w[ idx ][ lane ] = loadColumn( key + 4 * Nk * lane + 4 * idx );
+               }
+          }
+          // расписание идет шагами по Nk слов: первое слово шага - через RotWord, SubWord и rcon, для 256-битного ключа
+          // пятое - через SubWord, остальные - XOR. Вид слова выбирается до цикла по ключам группы, чтобы тот шел без ветвлений
+          uint32_t rcon = 0x01;
+          for( int start = Nk; start < words; start += Nk )
+          {
+               for( int idx = start; idx < start + Nk && idx < words; idx++ )
+               {
+                    if( idx == start )
+                    {
+                         for( size_t lane = 0; lane < lanes; lane++ )
+                         {
+                              w[ idx ][ lane ] = w[ idx - Nk ][ lane ] ^ subWord( rotateWord( w[ idx - 1 ][ lane ], 8 ) ) ^ ( rcon << 24 );
+                         }
+                    }
+                    else if( Nk > 6 && idx == start + 4 )
+                    {
+                         for( size_t lane = 0; lane < lanes; lane++ )
+                         {
+                              w[ idx ][ lane ] = w[ idx - Nk ][ lane ] ^ subWord( w[ idx - 1 ][ lane ] );
+                         }
+                    }
+                    else
+                    {
+                         for( size_t lane = 0; lane < lanes; lane++ )
+                         {
+                              w[ idx ][ lane ] = w[ idx - Nk ][ lane ] ^ w[ idx - 1 ][ lane ];
+                         }
+                    }
+               }
+               rcon = ( rcon << 1 ) ^ ( ( rcon & 0x80 ) != 0 ? 0x11b : 0 );
+          }
 
-     return matrix_4_4_to_vector( dataMatrix );
+          for( size_t lane = 0; lane < lanes; lane++ )
+          {
+               for( int idx = 0; idx < words; idx++ )
+               {
+                    storeColumn( roundKeys[ first + lane ].bytes + 4 * idx, w[ idx ][ lane ] );
+               }
+          }
+     }
 }
 
 
-std::vector< unsigned char > AESCryptography::decryptDataECB( const std::vector< unsigned char >& data, const std::vector< unsigned char >& key )
+void AESCryptography::expandDecryptionKeysWords( AesRoundKeys& roundKeys ) const
 {
-     if( data.size() % 16 != 0 )
+     // ключи эквивалентного обратного шифра: порядок раундов обращается, к промежуточным ключам применяется
+     // InvMixColumns(FIPS-197 п. 5.3.5)
+     for( int round = 0; round <= Nr; round++ )
      {
-          throw runtime_error( "data is not aligned" );
+          for( int column = 0; column < 4; column++ )
+          {
+               uint32_t word = loadColumn( roundKeys.bytes + 16 * ( Nr - round ) + 4 * column );
+               storeColumn( roundKeys.decryptionBytes + 16 * round + 4 * column, round != 0 && round != Nr ? invMixColumnWord( word ) : word );
+          }
      }
+}
 
-     Matrix roundKeyMatrix = KeyExpansion( key );
 
-     std::vector< unsigned char > result;
-     for( int block = 0; block < data.size(); block+= 16 )
+void AESCryptography::cryptBlocksECB( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys ) const
+{
+     if( backend() == ABAesNi )
+     {
+          cryptBlocksAesNi( src, dst, size / oneBlockSize, roundKeys );
+          return;
+     }
+     for( size_t block = 0; block < size; block += oneBlockSize )
      {
-          std::vector< unsigned char > tmp = decryptBlock( { data.begin() + block, data.begin() + block + 16 }, roundKeyMatrix );
-          result.insert( result.end(), std::make_move_iterator( tmp.begin() ), std::make_move_iterator( tmp.end() ) );
+          cryptBlock( src + block, dst + block, roundKeys );
      }
+}
 
-     return result;
+
+void AESCryptography::cryptBlocksCBC( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] ) const
+{
+     if( backend() == ABAesNi )
+     {
+          cryptBlocksCbcAesNi( src, dst, size / oneBlockSize, roundKeys, iv );
+          return;
+     }
+     for( size_t block = 0; block < size; block += oneBlockSize )
+     {
+          // выполняем операцию XOR над последним блоком шифртекста и текущим открытым текстом
+          unsigned char tmp[ 16 ];
+          for( int idx = 0; idx < 16; idx++ )
+          {
+               tmp[ idx ] = src[ block + idx ] ^ iv[ idx ];
+          }
+          cryptBlock( tmp, dst + block, roundKeys );
+
+          // записываем текущий блок шифртекста для использования при шифровании следующего блока
+          memcpy( iv, dst + block, 16 );
+     }
 }
 
-std::vector<unsigned char> AESCryptography::decryptDataCBC( const std::vector<unsigned char>& data, const std::vector<unsigned char>& key, const std::vector<unsigned char>& iv )
+
+void AESCryptography::decryptBlocksECB( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys ) const
 {
-     if( data.size() % 16 != 0 )
+     if( !roundKeys.decryption )
      {
-          throw runtime_error( "data is not aligned" );
+          throw runtime_error( "round keys are expanded for encryption only" );
+     }
+     if( backend() == ABAesNi )
+     {
+          decryptBlocksAesNi( src, dst, size / oneBlockSize, roundKeys );
+          return;
      }
+     for( size_t block = 0; block < size; block += oneBlockSize )
+     {
+          decryptBlock( src + block, dst + block, roundKeys );
+     }
+}
 
-     Matrix roundKeyMatrix = KeyExpansion( key );
 
-     std::vector< unsigned char > last_encrypted_data = iv;
+void AESCryptography::decryptBlocksCBC( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] ) const
+{
+     if( !roundKeys.decryption )
+     {
+          throw runtime_error( "round keys are expanded for encryption only" );
+     }
+     if( backend() == ABAesNi )
+     {
+          decryptBlocksCbcAesNi( src, dst, size / oneBlockSize, roundKeys, iv );
+          return;
+     }
+     for( size_t block = 0; block < size; block += oneBlockSize )
+     {
+          // сохраняем блок шифртекста до расшифрования, т.к. src и dst могут совпадать
+          unsigned char encrypted[ 16 ];
+          memcpy( encrypted, src + block, 16 );
+
+          decryptBlock( encrypted, dst + block, roundKeys );
+          for( int idx = 0; idx < 16; idx++ )
+          {
+               dst[ block + idx ] ^= iv[ idx ];
+          }
+          memcpy( iv, encrypted, 16 );
+     }
+}
+
 
-     std::vector< unsigned char > result;
-     for( int block = 0; block < data.size(); block+= 16 )
+void AESCryptography::cryptBlocksCTR( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys, unsigned char counter[ 16 ] ) const
+{
+     // значения счетчика шифруются пачками как независимые блоки ECB, что позволяет AES-NI обрабатывать их одновременно
+     unsigned char keystream[ ctrBatchBlocks * 16 ];
+     for( size_t offset = 0; offset < size; offset += sizeof( keystream ) )
      {
-          std::vector< unsigned char > src( data.begin() + block, data.begin() + block + 16 );
-          std::vector< unsigned char > tmp = decryptBlock( src, roundKeyMatrix );
-          tmp = vector_xor( tmp, last_encrypted_data );
-          last_encrypted_data = src;
-          result.insert( result.end(), std::make_move_iterator( tmp.begin() ), std::make_move_iterator( tmp.end() ) );
+          size_t count = std::min< size_t >( sizeof( keystream ), size - offset );
+          size_t blocks = ( count + oneBlockSize - 1 ) / oneBlockSize;
+          for( size_t block = 0; block < blocks; block++ )
+          {
+               memcpy( keystream + 16 * block, counter, 16 );
+               addCounter( counter, 1 );
+          }
+          cryptBlocksECB( keystream, keystream, 16 * blocks, roundKeys );
+
+          // складываем гамму с данными
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               dst[ offset + idx ] = src[ offset + idx ] ^ keystream[ idx ];
+          }
      }
+}
 
-     return result;
+
+void AESCryptography::addCounter( unsigned char counter[ 16 ], uint64_t blocks )
+{
+     unsigned carry = 0;
+     for( int idx = 15; idx >= 0 && ( blocks != 0 || carry != 0 ); idx-- )
+     {
+          unsigned sum = counter[ idx ] + static_cast< unsigned >( blocks & 0xff ) + carry;
+          counter[ idx ] = static_cast< unsigned char >( sum );
+          carry = sum >> 8;
+          blocks >>= 8;
+     }
 }
 
 
-std::vector< unsigned char > AESCryptography::decryptBlock( const std::vector<unsigned char>& data, const Matrix& roundKeysMatrix )
+void AESCryptography::cmac( const unsigned char* data, size_t size, const AesRoundKeys& roundKeys, unsigned char mac[ 16 ] ) const
 {
-     if( data.size() != 16 )
+     // подключи K1 и K2 получаются удвоением в GF(2^128) шифра нулевого блока
+     unsigned char subkey[ 16 ] = {};
+     cryptBlock( subkey, subkey, roundKeys );
+     int doublings = ( size != 0 && size % oneBlockSize == 0 ) ? 1 : 2;
+     for( int cnt = 0; cnt < doublings; cnt++ )
      {
-          throw runtime_error( "invalid block size" );
+          unsigned char carry = subkey[ 0 ] >> 7;
+          for( int idx = 0; idx < 15; idx++ )
+          {
+               subkey[ idx ] = ( subkey[ idx ] << 1 ) | ( subkey[ idx + 1 ] >> 7 );
+          }
+          subkey[ 15 ] = ( subkey[ 15 ] << 1 ) ^ ( carry ? 0x87 : 0x00 );
      }
 
-     Matrix dataMatrix = block_to_matrix_4x4( data );
+     // все блоки, кроме последнего, обрабатываются как в CBC с нулевым IV
+     size_t lastBlock = size == 0 ? 0 : ( size - 1 ) / oneBlockSize * oneBlockSize;
+     memset( mac, 0, 16 );
+     for( size_t block = 0; block < lastBlock; block += oneBlockSize )
+     {
+          for( int idx = 0; idx < 16; idx++ )
+          {
+               mac[ idx ] ^= data[ block + idx ];
+          }
+          cryptBlock( mac, mac, roundKeys );
+     }
+
+     // последний блок дополняется 10...0, если он неполный, и складывается с подключом
+     unsigned char last[ 16 ] = {};
+     size_t tail = size - lastBlock;
+     memcpy( last, data + lastBlock, tail );
+     if( tail < 16 )
+     {
+          last[ tail ] = 0x80;
+     }
+     for( int idx = 0; idx < 16; idx++ )
+     {
+          mac[ idx ] ^= last[ idx ] ^ subkey[ idx ];
+     }
+     cryptBlock( mac, mac, roundKeys );
+}
 
-     int roundKeyIdx = ( ( Nr + 1 ) ) * Nb - 4;
 
-     addRoundKey( dataMatrix, roundKeysMatrix, roundKeyIdx );
-     roundKeyIdx -= 4;
+void AESCryptography::cryptBlock( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const
+{
+     switch( backend() )
+     {
+          case ABAesNi:
+          {
+               cryptBlocksAesNi( src, dst, 1, roundKeys );
+               break;
+          }
+          case ABTable:
+          {
+               cryptBlockTable( src, dst, roundKeys );
+               break;
+          }
+          default:
+          {
+               cryptBlockPortable( src, dst, roundKeys );
+          }
+     }
+}
+
+
+void AESCryptography::decryptBlock( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const
+{
+     switch( backend() )
+     {
+          case ABAesNi:
+          {
+               decryptBlocksAesNi( src, dst, 1, roundKeys );
+               break;
+          }
+          case ABTable:
+          {
+               decryptBlockTable( src, dst, roundKeys );
+               break;
+          }
+          default:
+          {
+               decryptBlockPortable( src, dst, roundKeys );
+          }
+     }
+}
+
+
+void AESCryptography::cryptBlockPortable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const
+{
+     unsigned char state[ 16 ];
+     memcpy( state, src, 16 );
+
+     // выполняем операции для шифрования из стандарта(п. 5.1, стр 15)
+     const unsigned char* roundKey = roundKeys.bytes;
+     addRoundKey( state, roundKey );
+     roundKey += 16;
 
-     for( int round = Nr - 1; round > 0; round-- )
+     for( int round = 0; round < Nr - 1; round++ )
      {
-          invShiftRows( dataMatrix );
-          invSubBytes( dataMatrix );
-          addRoundKey( dataMatrix, roundKeysMatrix, roundKeyIdx );
-          roundKeyIdx -= 4;
-          invMixColumn( dataMatrix );
+          subBytes( state );
+          shiftRows( state );
+          mixColumn( state );
+          addRoundKey( state, roundKey );
+          roundKey += 16;
      }
 
-     invShiftRows( dataMatrix );
-     invSubBytes( dataMatrix );
-     addRoundKey( dataMatrix, roundKeysMatrix, roundKeyIdx );
+     subBytes( state );
+     shiftRows( state );
+     addRoundKey( state, roundKey );
+
+     memcpy( dst, state, 16 );
+}
+
 
+void AESCryptography::decryptBlockPortable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const
+{
+     unsigned char state[ 16 ];
+     memcpy( state, src, 16 );
+
+     // эквивалентный обратный шифр: порядок преобразований совпадает с шифрованием, InvMixColumns уже применен к ключам раундов
+     const unsigned char* roundKey = roundKeys.decryptionBytes;
+     addRoundKey( state, roundKey );
+     roundKey += 16;
 
-     return matrix_4_4_to_vector( dataMatrix );
+     for( int round = 0; round < Nr - 1; round++ )
+     {
+          invSubBytes( state );
+          invShiftRows( state );
+          invMixColumn( state );
+          addRoundKey( state, roundKey );
+          roundKey += 16;
+     }
+
+     invSubBytes( state );
+     invShiftRows( state );
+     addRoundKey( state, roundKey );
+
+     memcpy( dst, state, 16 );
 }
 
 
-Matrix AESCryptography::block_to_matrix_4x4( const vector< unsigned char >& data )
+void AESCryptography::cryptBlockTable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const
 {
-     Matrix result( 4, 4 );
+     const uint32_t ( &te )[ 4 ][ 256 ] = tables_.te;
+     const unsigned char* roundKey = roundKeys.bytes;
+
+     uint32_t s0 = loadColumn( src ) ^ loadColumn( roundKey );
+     uint32_t s1 = loadColumn( src + 4 ) ^ loadColumn( roundKey + 4 );
+     uint32_t s2 = loadColumn( src + 8 ) ^ loadColumn( roundKey + 8 );
+     uint32_t s3 = loadColumn( src + 12 ) ^ loadColumn( roundKey + 12 );
 
-     for( int idx = 0; idx < data.size(); idx++ )
+     // каждый раунд: ShiftRows выражается выбором байтов из соседних столбцов, SubBytes и MixColumns - поиском в таблицах
+     for( int round = 1; round < Nr; round++ )
      {
-          result[ idx % 4 ][ idx / 4 ] = data[ idx ];
+          roundKey += 16;
+          uint32_t t0 = te[ 0 ][ s0 >> 24 ] ^ te[ 1 ][ ( s1 >> 16 ) & 0xff ] ^ te[ 2 ][ ( s2 >> 8 ) & 0xff ] ^ te[ 3 ][ s3 & 0xff ] ^ loadColumn( roundKey );
+          uint32_t t1 = te[ 0 ][ s1 >> 24 ] ^ te[ 1 ][ ( s2 >> 16 ) & 0xff ] ^ te[ 2 ][ ( s3 >> 8 ) & 0xff ] ^ te[ 3 ][ s0 & 0xff ] ^ loadColumn( roundKey + 4 );
+          uint32_t t2 = te[ 0 ][ s2 >> 24 ] ^ te[ 1 ][ ( s3 >> 16 ) & 0xff ] ^ te[ 2 ][ ( s0 >> 8 ) & 0xff ] ^ te[ 3 ][ s1 & 0xff ] ^ loadColumn( roundKey + 8 );
+          uint32_t t3 = te[ 0 ][ s3 >> 24 ] ^ te[ 1 ][ ( s0 >> 16 ) & 0xff ] ^ te[ 2 ][ ( s1 >> 8 ) & 0xff ] ^ te[ 3 ][ s2 & 0xff ] ^ loadColumn( roundKey + 12 );
+          s0 = t0;
+          s1 = t1;
+          s2 = t2;
+          s3 = t3;
+     }
+
+     // последний раунд без MixColumns
+     roundKey += 16;
+     const uint32_t columns[ 4 ] = { s0, s1, s2, s3 };
+     for( int column = 0; column < 4; column++ )
+     {
+          for( int row = 0; row < 4; row++ )
+          {
+               unsigned char value = columns[ ( column + row ) % 4 ] >> ( 24 - 8 * row );
+               dst[ 4 * column + row ] = sboxValue( value, sbox ) ^ roundKey[ 4 * column + row ];
+          }
      }
-     return result;
 }
 
 
-void AESCryptography::subBytes( Matrix& matrix )
+void AESCryptography::decryptBlockTable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const
 {
-     for( int row = 0; row < matrix.rowCount(); row++ )
+     const uint32_t ( &td )[ 4 ][ 256 ] = tables_.td;
+     const unsigned char* roundKey = roundKeys.decryptionBytes;
+
+     uint32_t s0 = loadColumn( src ) ^ loadColumn( roundKey );
+     uint32_t s1 = loadColumn( src + 4 ) ^ loadColumn( roundKey + 4 );
+     uint32_t s2 = loadColumn( src + 8 ) ^ loadColumn( roundKey + 8 );
+     uint32_t s3 = loadColumn( src + 12 ) ^ loadColumn( roundKey + 12 );
+
+     // каждый раунд: InvShiftRows выражается выбором байтов из соседних столбцов, InvSubBytes и InvMixColumns - поиском в таблицах
+     for( int round = 1; round < Nr; round++ )
      {
-          for( int column = 0; column < matrix.columnCount(); column++ )
+          roundKey += 16;
+          uint32_t t0 = td[ 0 ][ s0 >> 24 ] ^ td[ 1 ][ ( s3 >> 16 ) & 0xff ] ^ td[ 2 ][ ( s2 >> 8 ) & 0xff ] ^ td[ 3 ][ s1 & 0xff ] ^ loadColumn( roundKey );
+          uint32_t t1 = td[ 0 ][ s1 >> 24 ] ^ td[ 1 ][ ( s0 >> 16 ) & 0xff ] ^ td[ 2 ][ ( s3 >> 8 ) & 0xff ] ^ td[ 3 ][ s2 & 0xff ] ^ loadColumn( roundKey + 4 );
+          uint32_t t2 = td[ 0 ][ s2 >> 24 ] ^ td[ 1 ][ ( s1 >> 16 ) & 0xff ] ^ td[ 2 ][ ( s0 >> 8 ) & 0xff ] ^ td[ 3 ][ s3 & 0xff ] ^ loadColumn( roundKey + 8 );
+          uint32_t t3 = td[ 0 ][ s3 >> 24 ] ^ td[ 1 ][ ( s2 >> 16 ) & 0xff ] ^ td[ 2 ][ ( s1 >> 8 ) & 0xff ] ^ td[ 3 ][ s0 & 0xff ] ^ loadColumn( roundKey + 12 );
+          s0 = t0;
+          s1 = t1;
+          s2 = t2;
+          s3 = t3;
+     }
+
+     // последний раунд без InvMixColumns
+     roundKey += 16;
+     const uint32_t columns[ 4 ] = { s0, s1, s2, s3 };
+     for( int column = 0; column < 4; column++ )
+     {
+          for( int row = 0; row < 4; row++ )
           {
-               matrix[ row ][ column ]= sboxValue( matrix[ row ][ column ], sbox );
+               unsigned char value = columns[ ( column - row + 4 ) % 4 ] >> ( 24 - 8 * row );
+               dst[ 4 * column + row ] = sboxValue( value, invSbox ) ^ roundKey[ 4 * column + row ];
           }
      }
 }
 
 
-void AESCryptography::shiftRows( Matrix& matrix )
+void AESCryptography::subBytes( unsigned char state[ 16 ] ) const
 {
+     for( int idx = 0; idx < 16; idx++ )
+     {
+          state[ idx ] = sboxValue( state[ idx ], sbox );
+     }
+}
+
+
+void AESCryptography::invSubBytes( unsigned char state[ 16 ] ) const
+{
+     for( int idx = 0; idx < 16; idx++ )
+     {
+          state[ idx ] = sboxValue( state[ idx ], invSbox );
+     }
+}
+
+
+void AESCryptography::shiftRows( unsigned char state[ 16 ] ) const
+{
+     // строка row сдвигается влево на row позиций
+     unsigned char tmp[ 16 ];
      for( int row = 0; row < 4; row++ )
      {
-          int shift_count = row;
-          while( shift_count != 0 )
+          for( int column = 0; column < 4; column++ )
           {
-               unsigned char first_byte = matrix[ row ][ 0 ];
-               for( int idx = 1; idx < 4; idx++ )
-               {
-                    matrix[ row ][ idx - 1 ] = matrix[ row ][ idx ];
-               }
-               matrix[ row ][ 3 ] = first_byte;
-               shift_count--;
+               tmp[ row + 4 * column ] = state[ row + 4 * ( ( column + row ) % 4 ) ];
           }
      }
+     memcpy( state, tmp, 16 );
 }
 
 
-void AESCryptography::mixColumn( Matrix& matrix )
+void AESCryptography::invShiftRows( unsigned char state[ 16 ] ) const
 {
-     for( int column = 0; column < 4; column++ )
+     // строка row сдвигается вправо на row позиций
+     unsigned char tmp[ 16 ];
+     for( int row = 0; row < 4; row++ )
      {
-          unsigned char tmp_column[4];
-          for( int row = 0; row < 4; row++ )
+          for( int column = 0; column < 4; column++ )
           {
-               tmp_column[ row ] = multiplyBytes( mixColumnsMatrix[ row ][ 0 ],  matrix[ 0 ][ column ] ) ^
-                                   multiplyBytes( mixColumnsMatrix[ row ][ 1 ],  matrix[ 1 ][ column ] ) ^
-                                   multiplyBytes( mixColumnsMatrix[ row ][ 2 ],  matrix[ 2 ][ column ] ) ^
-                                   multiplyBytes( mixColumnsMatrix[ row ][ 3 ],  matrix[ 3 ][ column ] );
+               tmp[ row + 4 * ( ( column + row ) % 4 ) ] = state[ row + 4 * column ];
           }
+     }
+     memcpy( state, tmp, 16 );
+}
 
+
+void AESCryptography::mixColumn( unsigned char state[ 16 ] ) const
+{
+     for( int column = 0; column < 4; column++ )
+     {
+          unsigned char* col = state + 4 * column;
+          unsigned char tmp_column[4];
           for( int row = 0; row < 4; row++ )
           {
-               matrix[ row ][ column ] = tmp_column[ row ];
+               tmp_column[ row ] = multiplyBytes( mixColumnsMatrix[ row ][ 0 ],  col[ 0 ] ) ^
+                                   multiplyBytes( mixColumnsMatrix[ row ][ 1 ],  col[ 1 ] ) ^
+                                   multiplyBytes( mixColumnsMatrix[ row ][ 2 ],  col[ 2 ] ) ^
+                                   multiplyBytes( mixColumnsMatrix[ row ][ 3 ],  col[ 3 ] );
           }
+          memcpy( col, tmp_column, 4 );
      }
 }
 
 
-unsigned char AESCryptography::multiplyBytes( unsigned char a, unsigned char b )
+unsigned char AESCryptography::multiplyBytes( unsigned char a, unsigned char b ) const
 {
      unsigned char result = 0;
      unsigned char high_bit_set;
@@ -267,206 +690,683 @@ unsigned char AESCryptography::multiplyBytes( unsigned char a, unsigned char b )
 }
 
 
-Matrix AESCryptography::KeyExpansion( const vector< unsigned char >& key )
+void AESCryptography::addRoundKey( unsigned char state[ 16 ], const unsigned char roundKey[ 16 ] ) const
 {
-     if( key.size() != Nk * 4 )
+     for( int idx = 0; idx < 16; idx++ )
      {
-          throw runtime_error( "invalid key size" );
+          state[ idx ] ^= roundKey[ idx ];
      }
+}
 
-     // сохдаем матрицу раундовых ключей с размеров столбца в зависимости от размеры ключа
-     Matrix result( 4, Nb * ( Nr + 1 ) );
 
-     // заполняем первый раундовый ключ переданным ключом
-     for( int row = 0; row < 4; row++ )
+void AESCryptography::invMixColumn( unsigned char state[ 16 ] ) const
+{
+     for( int column = 0; column < 4; column++ )
+     {
+          unsigned char* col = state + 4 * column;
+          unsigned char tmp_column[4];
+          for( int row = 0; row < 4; row++ )
+          {
+               tmp_column[ row ] = multiplyBytes( invMixColumnsMatrix[ row ][ 0 ],  col[ 0 ] ) ^
+                                   multiplyBytes( invMixColumnsMatrix[ row ][ 1 ],  col[ 1 ] ) ^
+                                   multiplyBytes( invMixColumnsMatrix[ row ][ 2 ],  col[ 2 ] ) ^
+                                   multiplyBytes( invMixColumnsMatrix[ row ][ 3 ],  col[ 3 ] );
+          }
+          memcpy( col, tmp_column, 4 );
+     }
+}
+
+
+const AESCryptography::Tables& AESCryptography::buildTables() const
+{
+     // таблицы не зависят от ключа, поэтому строятся один раз(инициализация локальной статической переменной потокобезопасна)
+     static const Tables tables = [ this ]()
+     {
+          Tables result{};
+          for( int value = 0; value < 256; value++ )
+          {
+               unsigned char substituted = sboxValue( value, sbox );
+               uint32_t forward = ( uint32_t( multiplyBytes( 0x02, substituted ) ) << 24 ) | ( uint32_t( substituted ) << 16 ) |
+                                  ( uint32_t( substituted ) << 8 ) | multiplyBytes( 0x03, substituted );
+               unsigned char inverted = sboxValue( value, invSbox );
+               uint32_t column = ( uint32_t( multiplyBytes( 0x0e, inverted ) ) << 24 ) | ( uint32_t( multiplyBytes( 0x09, inverted ) ) << 16 ) |
+                                 ( uint32_t( multiplyBytes( 0x0d, inverted ) ) << 8 ) | multiplyBytes( 0x0b, inverted );
+               for( int row = 0; row < 4; row++ )
+               {
+                    // вклад строки row - циклический сдвиг столбца для строки 0
+                    result.te[ row ][ value ] = row == 0 ? forward : ( forward >> ( 8 * row ) ) | ( forward << ( 32 - 8 * row ) );
+                    result.td[ row ][ value ] = row == 0 ? column : ( column >> ( 8 * row ) ) | ( column << ( 32 - 8 * row ) );
+               }
+          }
+          return result;
+     }();
+     return tables;
+}
+
+
+void AESCryptography::setBackend( AesBackend backend )
+{
+     if( !backendSupported( backend ) )
+     {
+          throw runtime_error( "AES backend is not supported by this CPU" );
+     }
+     backendSetting().store( backend, std::memory_order_relaxed );
+}
+
+
+AesBackend AESCryptography::backend()
+{
+     return static_cast< AesBackend >( backendSetting().load( std::memory_order_relaxed ) );
+}
+
+
+bool AESCryptography::backendSupported( AesBackend backend )
+{
+     return backend == ABPortable || backend == ABTable || ( backend == ABAesNi && hasAesNi() );
+}
+
+
+AesBackend AESCryptography::bestBackend()
+{
+     return hasAesNi() ? ABAesNi : ABTable;
+}
+
+
+const char* AESCryptography::backendName( AesBackend backend )
+{
+     switch( backend )
+     {
+          case ABPortable:
+          {
+               return "portable";
+          }
+          case ABTable:
+          {
+               return "ttable";
+          }
+          case ABAesNi:
+          {
+               return "aesni";
+          }
+     }
+     return "unknown";
+}
+
+
+#ifdef AES_X86
+
+namespace
+{
+     __attribute__(( target( "aes,sse2" ) ))
+     inline void loadRoundKeys( const unsigned char* bytes, int rounds, __m128i keys[ 15 ] )
      {
-          for( int column = 0; column < Nk; column++ )
+          for( int round = 0; round <= rounds; round++ )
           {
-               result[ row ][ column ] = key[ row + 4 * column ];
+               keys[ round ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( bytes + 16 * round ) );
           }
      }
 
-     // заполняем матрицу в соответствии со стандартом(п 5.2, стр.19)
-     for( int column = Nk; column < result.columnCount(); column++ )
+     __attribute__(( target( "aes,sse2" ) ))
+     inline __m128i encryptBlockNi( __m128i block, const __m128i keys[ 15 ], int rounds )
      {
-          if( column % Nk == 0 )
+          block = _mm_xor_si128( block, keys[ 0 ] );
+          for( int round = 1; round < rounds; round++ )
           {
-               unsigned char tmp_column[ 4 ];
-               shiftColumn( result, column - 1, 1, tmp_column );
+               block = _mm_aesenc_si128( block, keys[ round ] );
+          }
+          return _mm_aesenclast_si128( block, keys[ rounds ] );
+     }
 
-               for( int row = 0; row < 4; row++ )
+     __attribute__(( target( "aes,sse2" ) ))
+     inline __m128i decryptBlockNi( __m128i block, const __m128i keys[ 15 ], int rounds )
+     {
+          block = _mm_xor_si128( block, keys[ 0 ] );
+          for( int round = 1; round < rounds; round++ )
+          {
+               block = _mm_aesdec_si128( block, keys[ round ] );
+          }
+          return _mm_aesdeclast_si128( block, keys[ rounds ] );
+     }
+
+     // четыре независимых блока: инструкции раунда разных блоков выполняются конвейером одновременно
+     template< bool decrypt >
+     __attribute__(( target( "aes,sse2" ) ))
+     inline void cryptFour( __m128i blocks[ 4 ], const __m128i keys[ 15 ], int rounds )
+     {
+          for( int idx = 0; idx < 4; idx++ )
+          {
+               blocks[ idx ] = _mm_xor_si128( blocks[ idx ], keys[ 0 ] );
+          }
+          for( int round = 1; round < rounds; round++ )
+          {
+               for( int idx = 0; idx < 4; idx++ )
                {
-                    tmp_column[ row ] = sboxValue( tmp_column[ row ], sbox );
+                    blocks[ idx ] = decrypt ? _mm_aesdec_si128( blocks[ idx ], keys[ round ] ) : _mm_aesenc_si128( blocks[ idx ], keys[ round ] );
                }
-               for( int row = 0; row < 4; row++ )
+          }
+          for( int idx = 0; idx < 4; idx++ )
+          {
+               blocks[ idx ] = decrypt ? _mm_aesdeclast_si128( blocks[ idx ], keys[ rounds ] ) : _mm_aesenclast_si128( blocks[ idx ], keys[ rounds ] );
+          }
+     }
+
+     // шаг расписания: слова ключа раунда - префиксный XOR слов предыдущего ключа и слова assist, размноженного на все позиции
+     __attribute__(( target( "aes,sse2" ) ))
+     inline __m128i expandStep( __m128i key, __m128i assist )
+     {
+          key = _mm_xor_si128( key, _mm_slli_si128( key, 4 ) );
+          key = _mm_xor_si128( key, _mm_slli_si128( key, 8 ) );
+          return _mm_xor_si128( key, assist );
+     }
+
+     // SubWord(RotWord( word )) ^ rcon для слова word, размноженного на все позиции. В состоянии из одинаковых столбцов
+     // ShiftRows ничего не меняет, поэтому aesenclast дает SubBytes и XOR с rcon. В отличие от aeskeygenassist, которая
+     // на многих процессорах микрокодирована, aesenclast выполняется конвейером, а rcon не обязан быть константой
+     __attribute__(( target( "aes,sse2" ) ))
+     inline __m128i subRotWord( __m128i word, __m128i rcon )
+     {
+          word = _mm_or_si128( _mm_srli_epi32( word, 8 ), _mm_slli_epi32( word, 24 ) );
+          return _mm_aesenclast_si128( word, rcon );
+     }
+
+     // Расписания группы из lanes(не более niLanes) ключей строятся одновременно: шаги разных ключей независимы, поэтому
+     // задержки инструкций перекрываются. src - ключи группы, dst - AesRoundKeys::bytes для каждого из них. Состояние
+     // 256-битного ключа занимает два регистра xmm из 16, поэтому группа уже, чем у VAES
+     const size_t niLanes = 4;
+
+     __attribute__(( target( "aes,sse2" ) ))
+     void expandKeys128( const unsigned char* const src[ niLanes ], unsigned char* const dst[ niLanes ], size_t lanes )
+     {
+          __m128i keys[ niLanes ];
+          for( size_t lane = 0; lane < lanes; lane++ )
+          {
+               keys[ lane ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src[ lane ] ) );
+               _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] ), keys[ lane ] );
+          }
+          __m128i rcon = _mm_set1_epi32( 0x01 );
+          for( int round = 1; round <= 10; round++ )
+          {
+               for( size_t lane = 0; lane < lanes; lane++ )
                {
-                    result[ row ][ column ] = result[ row ][ column - Nk ] ^ tmp_column[ row ] ^
-                            rcon( row, column / Nk - 1 );
+                    keys[ lane ] = expandStep( keys[ lane ], subRotWord( _mm_shuffle_epi32( keys[ lane ], 0xff ), rcon ) );
+                    _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] + 16 * round ), keys[ lane ] );
                }
+               // rcon = xtime( rcon ): после 0x80 следует 0x1b
+               rcon = round == 8 ? _mm_set1_epi32( 0x1b ) : _mm_slli_epi32( rcon, 1 );
           }
-          else if( Nk > 6 && column % Nk == 4 )
+     }
+
+     // 192-битный ключ: шаг дает 6 слов. first - слова w[ i - 6, i - 3 ], second - w[ i - 2 ], w[ i - 1 ] в младшей
+     // половине. Вторая половина последнего шага выходит за расписание, но помещается в AesRoundKeys::bytes
+     __attribute__(( target( "aes,sse2" ) ))
+     void expandKeys192( const unsigned char* const src[ niLanes ], unsigned char* const dst[ niLanes ], size_t lanes )
+     {
+          __m128i first[ niLanes ];
+          __m128i second[ niLanes ];
+          for( size_t lane = 0; lane < lanes; lane++ )
           {
-               for( int row = 0; row < 4; row++ )
+               first[ lane ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src[ lane ] ) );
+               second[ lane ] = _mm_loadl_epi64( reinterpret_cast< const __m128i* >( src[ lane ] + 16 ) );
+               _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] ), first[ lane ] );
+               _mm_storel_epi64( reinterpret_cast< __m128i* >( dst[ lane ] + 16 ), second[ lane ] );
+          }
+          __m128i rcon = _mm_set1_epi32( 0x01 );
+          for( int word = 6; word < 52; word += 6 )
+          {
+               for( size_t lane = 0; lane < lanes; lane++ )
                {
-                    result[ row ][ column ] = result[ row ][ column - Nk ] ^ sboxValue( result[ row ][ column - 1 ], sbox );
+                    first[ lane ] = expandStep( first[ lane ], subRotWord( _mm_shuffle_epi32( second[ lane ], 0x55 ), rcon ) );
+                    __m128i last = _mm_shuffle_epi32( first[ lane ], 0xff );
+                    second[ lane ] = _mm_xor_si128( _mm_xor_si128( second[ lane ], _mm_slli_si128( second[ lane ], 4 ) ), last );
+                    _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] + 4 * word ), first[ lane ] );
+                    _mm_storel_epi64( reinterpret_cast< __m128i* >( dst[ lane ] + 4 * word + 16 ), second[ lane ] );
                }
+               rcon = _mm_slli_epi32( rcon, 1 );
           }
-          else
+     }
+
+     // 256-битный ключ: шаг дает два ключа раунда, второй - через SubWord без RotWord и rcon. Последний шаг дает один ключ
+     __attribute__(( target( "aes,sse2" ) ))
+     void expandKeys256( const unsigned char* const src[ niLanes ], unsigned char* const dst[ niLanes ], size_t lanes )
+     {
+          __m128i first[ niLanes ];
+          __m128i second[ niLanes ];
+          for( size_t lane = 0; lane < lanes; lane++ )
           {
-               for( int row = 0; row < 4; row++ )
+               first[ lane ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src[ lane ] ) );
+               second[ lane ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src[ lane ] + 16 ) );
+               _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] ), first[ lane ] );
+               _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] + 16 ), second[ lane ] );
+          }
+          __m128i rcon = _mm_set1_epi32( 0x01 );
+          for( int round = 2; round <= 14; round += 2 )
+          {
+               for( size_t lane = 0; lane < lanes; lane++ )
                {
-                    result[ row ][ column ] = result[ row ][ column - Nk ] ^ result[ row ][ column - 1 ];
+                    first[ lane ] = expandStep( first[ lane ], subRotWord( _mm_shuffle_epi32( second[ lane ], 0xff ), rcon ) );
+                    _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] + 16 * round ), first[ lane ] );
+               }
+               rcon = _mm_slli_epi32( rcon, 1 );
+               if( round == 14 )
+               {
+                    break;
+               }
+               for( size_t lane = 0; lane < lanes; lane++ )
+               {
+                    __m128i assist = _mm_aesenclast_si128( _mm_shuffle_epi32( first[ lane ], 0xff ), _mm_setzero_si128() );
+                    second[ lane ] = expandStep( second[ lane ], assist );
+                    _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ lane ] + 16 * ( round + 1 ) ), second[ lane ] );
                }
           }
      }
-     return result;
-}
 
+     // С VAES регистр ymm держит два ключа, по одному в 128-битной половине: vaesenclast, pshufb и байтовые сдвиги
+     // работают с половинами независимо, поэтому одна инструкция выполняет шаг расписания сразу для двух ключей.
+     // Группа - pairs пар ключей, идущих подряд с src, расписания записываются в dst[ 0, 2 * pairs ). Адреса считаются
+     // от начала массивов, а не берутся из массива указателей, который компилятор перечитывал бы после каждой записи
+     const size_t vaesPairs = AESCryptography::keyLanes / 2;
 
-void AESCryptography::shiftColumn( const Matrix& matrix, int column, int shift, unsigned char result[ 4 ] )
-{
-     for( int row = 0; row < 4; row++ )
+     bool hasVaes()
      {
-          result[ row ] = matrix[ row ][ column ];
+          static const bool supported = __builtin_cpu_supports( "vaes" ) && __builtin_cpu_supports( "avx2" );
+          return supported;
      }
-     while( shift != 0 )
+
+     __attribute__(( target( "avx2,vaes" ) ))
+     inline __m256i loadPair( const unsigned char* low, const unsigned char* high )
      {
-          int top_item = result[ 0 ];
-          for( int row = 0; row < 3; row++ )
-          {
-               result[ row ] = result[ row + 1 ];
-          }
-          result[ 3 ] = top_item;
-          shift--;
+          __m128i first = _mm_loadu_si128( reinterpret_cast< const __m128i* >( low ) );
+          return _mm256_inserti128_si256( _mm256_castsi128_si256( first ), _mm_loadu_si128( reinterpret_cast< const __m128i* >( high ) ), 1 );
      }
-}
 
+     // расписания пары pair группы dst, начиная с байта offset
+     __attribute__(( target( "avx2,vaes" ) ))
+     inline void storePair( __m256i keys, AesRoundKeys* dst, size_t pair, size_t offset )
+     {
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ 2 * pair ].bytes + offset ), _mm256_castsi256_si128( keys ) );
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst[ 2 * pair + 1 ].bytes + offset ), _mm256_extracti128_si256( keys, 1 ) );
+     }
 
-unsigned char AESCryptography::rcon( int row, int column )
-{
-     if( row != 0 )
+     // то же для младших 8 байт каждой половины
+     __attribute__(( target( "avx2,vaes" ) ))
+     inline void storeLowPair( __m256i keys, AesRoundKeys* dst, size_t pair, size_t offset )
      {
-          return 0;
+          _mm_storel_epi64( reinterpret_cast< __m128i* >( dst[ 2 * pair ].bytes + offset ), _mm256_castsi256_si128( keys ) );
+          _mm_storel_epi64( reinterpret_cast< __m128i* >( dst[ 2 * pair + 1 ].bytes + offset ), _mm256_extracti128_si256( keys, 1 ) );
      }
-     if( column == 8 )
+
+     __attribute__(( target( "avx2,vaes" ) ))
+     inline __m256i expandStepPair( __m256i key, __m256i assist )
      {
-          return 0x1b;
+          key = _mm256_xor_si256( key, _mm256_bslli_epi128( key, 4 ) );
+          key = _mm256_xor_si256( key, _mm256_bslli_epi128( key, 8 ) );
+          return _mm256_xor_si256( key, assist );
      }
-     if( column == 9 )
+
+     // pshufb с маской rotation размножает слово и выполняет RotWord одной инструкцией(см. subRotWord)
+     __attribute__(( target( "avx2,vaes" ) ))
+     inline __m256i subRotWordPair( __m256i key, __m256i rotation, __m256i rcon )
      {
-          return 0x36;
+          return _mm256_aesenclast_epi128( _mm256_shuffle_epi8( key, rotation ), rcon );
      }
-     return ( 1 << column );
-}
 
+     // маска pshufb: RotWord слова word, размноженный на все позиции обеих половин
+     __attribute__(( target( "avx2,vaes" ) ))
+     inline __m256i rotationMask( int word )
+     {
+          const int first = 4 * word;
+          return _mm256_set1_epi32( ( first + 1 ) | ( ( first + 2 ) << 8 ) | ( ( first + 3 ) << 16 ) | ( first << 24 ) );
+     }
 
-void AESCryptography::addRoundKey( Matrix& matrix, const Matrix& round_keys_matrix, int first_column )
-{
-     for( int row = 0; row < matrix.rowCount(); row++ )
+     template< size_t pairs >
+     __attribute__(( target( "avx2,vaes" ) ))
+     void expandKeys128Vaes( const unsigned char* src, AesRoundKeys* dst )
      {
-          for( int column = 0; column < matrix.columnCount(); column++ )
+          __m256i keys[ pairs ];
+          for( size_t pair = 0; pair < pairs; pair++ )
+          {
+               keys[ pair ] = loadPair( src + 32 * pair, src + 32 * pair + 16 );
+               storePair( keys[ pair ], dst, pair, 0 );
+          }
+          const __m256i rotation = rotationMask( 3 );
+          __m256i rcon = _mm256_set1_epi32( 0x01 );
+          for( int round = 1; round <= 10; round++ )
           {
-               matrix[ row ][ column ] ^= round_keys_matrix[ row ][ column + first_column ];
+#pragma GCC unroll 8
+               for( size_t pair = 0; pair < pairs; pair++ )
+               {
+                    keys[ pair ] = expandStepPair( keys[ pair ], subRotWordPair( keys[ pair ], rotation, rcon ) );
+                    storePair( keys[ pair ], dst, pair, 16 * round );
+               }
+               rcon = round == 8 ? _mm256_set1_epi32( 0x1b ) : _mm256_slli_epi32( rcon, 1 );
           }
      }
-}
 
+     template< size_t pairs >
+     __attribute__(( target( "avx2,vaes" ) ))
+     void expandKeys192Vaes( const unsigned char* src, AesRoundKeys* dst )
+     {
+          __m256i first[ pairs ];
+          __m256i second[ pairs ];
+          for( size_t pair = 0; pair < pairs; pair++ )
+          {
+               const unsigned char* low = src + 48 * pair;
+               first[ pair ] = loadPair( low, low + 24 );
+               second[ pair ] = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadl_epi64( reinterpret_cast< const __m128i* >( low + 16 ) ) ),
+                                                         _mm_loadl_epi64( reinterpret_cast< const __m128i* >( low + 40 ) ), 1 );
+               storePair( first[ pair ], dst, pair, 0 );
+               storeLowPair( second[ pair ], dst, pair, 16 );
+          }
+          const __m256i rotation = rotationMask( 1 );
+          __m256i rcon = _mm256_set1_epi32( 0x01 );
+          for( int word = 6; word < 52; word += 6 )
+          {
+#pragma GCC unroll 8
+               for( size_t pair = 0; pair < pairs; pair++ )
+               {
+                    first[ pair ] = expandStepPair( first[ pair ], subRotWordPair( second[ pair ], rotation, rcon ) );
+                    __m256i last = _mm256_shuffle_epi32( first[ pair ], 0xff );
+                    second[ pair ] = _mm256_xor_si256( _mm256_xor_si256( second[ pair ], _mm256_bslli_epi128( second[ pair ], 4 ) ), last );
+                    storePair( first[ pair ], dst, pair, 4 * word );
+                    storeLowPair( second[ pair ], dst, pair, 4 * word + 16 );
+               }
+               rcon = _mm256_slli_epi32( rcon, 1 );
+          }
+     }
 
-std::vector< unsigned char > AESCryptography::matrix_4_4_to_vector( const Matrix& matrix )
-{
-     std::vector< unsigned char > result;
-     result.resize( 4 * Nb );
-     for( int row = 0; row < 4; row++ )
+     template< size_t pairs >
+     __attribute__(( target( "avx2,vaes" ) ))
+     void expandKeys256Vaes( const unsigned char* src, AesRoundKeys* dst )
+     {
+          __m256i first[ pairs ];
+          __m256i second[ pairs ];
+          for( size_t pair = 0; pair < pairs; pair++ )
+          {
+               const unsigned char* low = src + 64 * pair;
+               first[ pair ] = loadPair( low, low + 32 );
+               second[ pair ] = loadPair( low + 16, low + 48 );
+               storePair( first[ pair ], dst, pair, 0 );
+               storePair( second[ pair ], dst, pair, 16 );
+          }
+          const __m256i rotation = rotationMask( 3 );
+          __m256i rcon = _mm256_set1_epi32( 0x01 );
+          for( int round = 2; round <= 14; round += 2 )
+          {
+#pragma GCC unroll 8
+               for( size_t pair = 0; pair < pairs; pair++ )
+               {
+                    first[ pair ] = expandStepPair( first[ pair ], subRotWordPair( second[ pair ], rotation, rcon ) );
+                    storePair( first[ pair ], dst, pair, 16 * round );
+               }
+               rcon = _mm256_slli_epi32( rcon, 1 );
+               if( round == 14 )
+               {
+                    break;
+               }
+#pragma GCC unroll 8
+               for( size_t pair = 0; pair < pairs; pair++ )
+               {
+                    __m256i assist = _mm256_aesenclast_epi128( _mm256_shuffle_epi32( first[ pair ], 0xff ), _mm256_setzero_si256() );
+                    second[ pair ] = expandStepPair( second[ pair ], assist );
+                    storePair( second[ pair ], dst, pair, 16 * ( round + 1 ) );
+               }
+          }
+     }
+
+     // разворачивает группу и возвращает число ключей в ней: у 192- и 256-битных ключей состояние пары занимает два
+     // регистра, поэтому пар в группе вдвое меньше, чтобы оно помещалось в 16 регистров ymm
+     template< size_t pairs >
+     size_t expandKeysVaes( const unsigned char* src, AesRoundKeys* dst, int keyWords )
      {
-          for( int column = 0; column < Nb; column++ )
+          const size_t widePairs = pairs > 1 ? pairs / 2 : 1;
+          switch( keyWords )
           {
-               result[ row + 4 * column ] = matrix[ row ][ column ];
+               case 4:
+               {
+                    expandKeys128Vaes< pairs >( src, dst );
+                    return 2 * pairs;
+               }
+               case 6:
+               {
+                    expandKeys192Vaes< widePairs >( src, dst );
+                    return 2 * widePairs;
+               }
+               default:
+               {
+                    expandKeys256Vaes< widePairs >( src, dst );
+                    return 2 * widePairs;
+               }
+          }
+     }
+
+     template< bool decrypt >
+     __attribute__(( target( "aes,sse2" ) ))
+     void cryptBlocksEcb( const unsigned char* src, unsigned char* dst, size_t blocks, const unsigned char* keyBytes, int rounds )
+     {
+          __m128i keys[ 15 ];
+          loadRoundKeys( keyBytes, rounds, keys );
+
+          size_t block = 0;
+          for( ; block + 4 <= blocks; block += 4 )
+          {
+               __m128i data[ 4 ];
+               for( int idx = 0; idx < 4; idx++ )
+               {
+                    data[ idx ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 16 * ( block + idx ) ) );
+               }
+               cryptFour< decrypt >( data, keys, rounds );
+               for( int idx = 0; idx < 4; idx++ )
+               {
+                    _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 16 * ( block + idx ) ), data[ idx ] );
+               }
+          }
+          for( ; block < blocks; block++ )
+          {
+               __m128i data = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 16 * block ) );
+               data = decrypt ? decryptBlockNi( data, keys, rounds ) : encryptBlockNi( data, keys, rounds );
+               _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 16 * block ), data );
           }
      }
-     return result;
 }
 
 
+__attribute__(( target( "aes,sse2" ) ))
+void AESCryptography::cryptBlocksAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys )
+{
+     cryptBlocksEcb< false >( src, dst, blocks, roundKeys.bytes, roundKeys.rounds );
+}
+
 
-void AESCryptography::invSubBytes( Matrix& matrix )
+__attribute__(( target( "aes,sse2" ) ))
+void AESCryptography::decryptBlocksAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys )
 {
-     for( int row = 0; row < matrix.rowCount(); row++ )
+     cryptBlocksEcb< true >( src, dst, blocks, roundKeys.decryptionBytes, roundKeys.rounds );
+}
+
+
+__attribute__(( target( "aes,sse2" ) ))
+void AESCryptography::cryptBlocksCbcAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] )
+{
+     // шифрование CBC последовательно по определению: каждый блок зависит от предыдущего
+     __m128i keys[ 15 ];
+     loadRoundKeys( roundKeys.bytes, roundKeys.rounds, keys );
+     __m128i chain = _mm_loadu_si128( reinterpret_cast< const __m128i* >( iv ) );
+     for( size_t block = 0; block < blocks; block++ )
      {
-          for( int column = 0; column < matrix.columnCount(); column++ )
-          {
-               matrix[ row ][ column ]= sboxValue( matrix[ row ][ column ], invSbox );
-          }
+          __m128i data = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 16 * block ) );
+          chain = encryptBlockNi( _mm_xor_si128( data, chain ), keys, roundKeys.rounds );
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 16 * block ), chain );
      }
+     _mm_storeu_si128( reinterpret_cast< __m128i* >( iv ), chain );
 }
 
 
-void AESCryptography::invShiftRows( Matrix& matrix )
+__attribute__(( target( "aes,sse2" ) ))
+void AESCryptography::decryptBlocksCbcAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] )
 {
-     for( int row = 0; row < 4; row++ )
+     __m128i keys[ 15 ];
+     loadRoundKeys( roundKeys.decryptionBytes, roundKeys.rounds, keys );
+     __m128i chain = _mm_loadu_si128( reinterpret_cast< const __m128i* >( iv ) );
+
+     // блоки шифртекста читаются до записи результата, поэтому src и dst могут совпадать
+     size_t block = 0;
+     for( ; block + 4 <= blocks; block += 4 )
      {
-          int shift_count = row;
-          while( shift_count != 0 )
+          __m128i encrypted[ 4 ];
+          __m128i data[ 4 ];
+          for( int idx = 0; idx < 4; idx++ )
           {
-               unsigned char first_byte = matrix[ row ][ 3 ];
-               for( int idx = 3; idx > 0; idx-- )
-               {
-                    matrix[ row ][ idx ] = matrix[ row ][ idx - 1 ];
-               }
-               matrix[ row ][ 0 ] = first_byte;
-               shift_count--;
+               encrypted[ idx ] = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 16 * ( block + idx ) ) );
+               data[ idx ] = encrypted[ idx ];
           }
+          cryptFour< true >( data, keys, roundKeys.rounds );
+          for( int idx = 0; idx < 4; idx++ )
+          {
+               data[ idx ] = _mm_xor_si128( data[ idx ], idx == 0 ? chain : encrypted[ idx - 1 ] );
+               _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 16 * ( block + idx ) ), data[ idx ] );
+          }
+          chain = encrypted[ 3 ];
+     }
+     for( ; block < blocks; block++ )
+     {
+          __m128i encrypted = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 16 * block ) );
+          __m128i data = _mm_xor_si128( decryptBlockNi( encrypted, keys, roundKeys.rounds ), chain );
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 16 * block ), data );
+          chain = encrypted;
      }
+     _mm_storeu_si128( reinterpret_cast< __m128i* >( iv ), chain );
 }
 
 
-void AESCryptography::invMixColumn( Matrix& matrix )
+__attribute__(( target( "aes,sse2" ) ))
+void AESCryptography::expandKeysAesNi( const unsigned char* keys, size_t count, int keyWords, AesRoundKeys* roundKeys )
 {
-     for( int column = 0; column < 4; column++ )
+     size_t first = 0;
+     if( hasVaes() )
      {
-          unsigned char tmp_column[4];
-          for( int row = 0; row < 4; row++ )
+          // полные группы, затем остаток парами. Нечетный последний ключ разворачивается через xmm
+          const size_t group = keyWords == 4 ? 2 * vaesPairs : vaesPairs;
+          while( first + 2 <= count )
           {
-               tmp_column[ row ] = multiplyBytes( invMixColumnsMatrix[ row ][ 0 ],  matrix[ 0 ][ column ] ) ^
-                                   multiplyBytes( invMixColumnsMatrix[ row ][ 1 ],  matrix[ 1 ][ column ] ) ^
-                                   multiplyBytes( invMixColumnsMatrix[ row ][ 2 ],  matrix[ 2 ][ column ] ) ^
-                                   multiplyBytes( invMixColumnsMatrix[ row ][ 3 ],  matrix[ 3 ][ column ] );
+               const unsigned char* src = keys + 4 * keyWords * first;
+               first += count - first >= group ? expandKeysVaes< vaesPairs >( src, roundKeys + first, keyWords )
+                                               : expandKeysVaes< 1 >( src, roundKeys + first, keyWords );
           }
-
-          for( int row = 0; row < 4; row++ )
+     }
+     for( ; first < count; first += niLanes )
+     {
+          const size_t lanes = std::min( niLanes, count - first );
+          const unsigned char* src[ niLanes ];
+          unsigned char* dst[ niLanes ];
+          for( size_t lane = 0; lane < lanes; lane++ )
           {
-               matrix[ row ][ column ] = tmp_column[ row ];
+               src[ lane ] = keys + 4 * keyWords * ( first + lane );
+               dst[ lane ] = roundKeys[ first + lane ].bytes;
+          }
+          switch( keyWords )
+          {
+               case 4:
+               {
+                    expandKeys128( src, dst, lanes );
+                    break;
+               }
+               case 6:
+               {
+                    expandKeys192( src, dst, lanes );
+                    break;
+               }
+               default:
+               {
+                    expandKeys256( src, dst, lanes );
+               }
           }
      }
 }
 
-std::vector< unsigned char > AESCryptography::vector_xor( const vector<unsigned char>& lhs, const vector<unsigned char>& rhs )
+
+__attribute__(( target( "aes,sse2" ) ))
+void AESCryptography::expandDecryptionKeysAesNi( AesRoundKeys& roundKeys )
 {
-     if( lhs.size() != rhs.size() )
+     // ключи эквивалентного обратного шифра: aesimc выполняет InvMixColumns
+     const int rounds = roundKeys.rounds;
+     for( int round = 0; round <= rounds; round++ )
      {
-          throw std::runtime_error( "could not xor vectors with different size" );
+          __m128i key = _mm_load_si128( reinterpret_cast< const __m128i* >( roundKeys.bytes + 16 * ( rounds - round ) ) );
+          if( round != 0 && round != rounds )
+          {
+               key = _mm_aesimc_si128( key );
+          }
+          _mm_store_si128( reinterpret_cast< __m128i* >( roundKeys.decryptionBytes + 16 * round ), key );
      }
+}
 
-     std::vector< unsigned char > result;
-     result.resize( lhs.size() );
-     for( int idx = 0; idx < lhs.size(); idx++ )
-     {
-          result[ idx ] = lhs[ idx ] ^ rhs[ idx ];
-     }
-     return result;
+
+bool AESCryptography::hasAesNi()
+{
+     static const bool supported = __builtin_cpu_supports( "aes" ) && __builtin_cpu_supports( "sse2" );
+     return supported;
 }
 
+#else
 
-std::vector<unsigned char> AESCryptography::create_iv()
+void AESCryptography::cryptBlocksAesNi( const unsigned char*, unsigned char*, size_t, const AesRoundKeys& )
 {
-     std::vector<unsigned char > result;
-     std::random_device dev;
-     std::mt19937 rng(dev());
-     std::uniform_int_distribution<std::mt19937::result_type> dist6( 0,255 );
+     throw runtime_error( "AES backend is not supported by this CPU" );
+}
 
-     for( int cnt = oneBlockSize; cnt > 0; cnt-- )
+
+void AESCryptography::decryptBlocksAesNi( const unsigned char*, unsigned char*, size_t, const AesRoundKeys& )
+{
+     throw runtime_error( "AES backend is not supported by this CPU" );
+}
+
+
+void AESCryptography::cryptBlocksCbcAesNi( const unsigned char*, unsigned char*, size_t, const AesRoundKeys&, unsigned char[ 16 ] )
+{
+     throw runtime_error( "AES backend is not supported by this CPU" );
+}
+
+
+void AESCryptography::decryptBlocksCbcAesNi( const unsigned char*, unsigned char*, size_t, const AesRoundKeys&, unsigned char[ 16 ] )
+{
+     throw runtime_error( "AES backend is not supported by this CPU" );
+}
+
+
+void AESCryptography::expandKeysAesNi( const unsigned char*, size_t, int, AesRoundKeys* )
+{
+     throw runtime_error( "AES backend is not supported by this CPU" );
+}
+
+
+void AESCryptography::expandDecryptionKeysAesNi( AesRoundKeys& )
+{
+     throw runtime_error( "AES backend is not supported by this CPU" );
+}
+
+
+bool AESCryptography::hasAesNi()
+{
+     return false;
+}
+
+#endif
+
+
+void AESCryptography::checkAligned( size_t size ) const
+{
+     if( size % oneBlockSize != 0 )
      {
-          result.push_back( dist6( rng ) );
+          throw runtime_error( "data is not aligned" );
      }
+}
+
+
+std::vector<unsigned char> AESCryptography::create_iv()
+{
+     // IV вырабатывается генератором CTR_DRBG текущего потока
+     std::vector<unsigned char > result( oneBlockSize );
+     CtrDrbg::threadLocal().generate( result.data(), result.size() );
      return result;
 }
 
@@ -513,9 +1413,7 @@ int AESCryptography::calculateNr( AesKeyLength len ) const
 }
 
 
-unsigned char AESCryptography::sboxValue( unsigned char src, const unsigned char sboxMatrix[16][16] )
+unsigned char AESCryptography::sboxValue( unsigned char src, const unsigned char sboxMatrix[16][16] ) const
 {
      return sboxMatrix[ src / 16 ][ src % 16 ];
-}
-
-
+}
\ No newline at end of file
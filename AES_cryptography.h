@@ -1,7 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
-#include "matrix.h"
 
 
 enum AesKeyLength
@@ -11,6 +12,31 @@ enum AesKeyLength
      AKL_256
 };
 
+
+// реализация блочного шифра. Выбирается для всего процесса: по умолчанию самая быстрая из поддерживаемых
+// процессором, при наличии профиля настройки(см. TuningProfile) - из профиля
+enum AesBackend
+{
+     ABPortable,        // побайтовые преобразования по тексту стандарта
+     ABTable,           // раундовые преобразования, объединенные в таблицы(T-таблицы)
+     ABAesNi            // инструкции AES-NI
+};
+
+
+// развернутый набор раундовых ключей. Ключ раунда r занимает байты [16 * r, 16 * r + 16) в порядке байт блока.
+// хранится без выделения памяти, поэтому может создаваться на стеке для каждого задания. Выровнен по 16 байтам:
+// ключи раундов загружаются в регистры AES-NI, не пересекая границ строк кэша
+struct alignas( 16 ) AesRoundKeys
+{
+     unsigned char bytes[ 240 ];
+     // ключи для эквивалентного обратного шифра(FIPS-197 п. 5.3.5): в обратном порядке, к ключам 1..Nr-1 применен InvMixColumns.
+     // Заполнены, только если decryption == true
+     unsigned char decryptionBytes[ 240 ];
+     int rounds;
+     // построены ли decryptionBytes(см. AESCryptography::expandKeys)
+     bool decryption;
+};
+
 class AESCryptography
 {
 public:
@@ -22,7 +48,7 @@ public:
      // выполняет шифрование в режиме CBC(режим сцепления блоков шифрованного текста)
      std::vector< unsigned char > cryptDataCBC( const std::vector< unsigned char >& data, const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
 
-     // создает случайный вектор инициализации
+     // создает случайный вектор инициализации. Для выработки большого числа IV за раз используется CtrDrbg::generate
      std::vector< unsigned char > create_iv();
 
      // выполняет расшифрование данных в режиме ECB
@@ -31,53 +57,116 @@ public:
      // выполняет расшифрование данных в режиме CBC
      std::vector< unsigned char > decryptDataCBC( const std::vector< unsigned char >& data, const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
 
-private:
-     // выполняет шифрование одного блока данных
-     std::vector< unsigned char > cryptBlock( const std::vector< unsigned char >& data, const Matrix& roundKeysMatrix );
+     // создает набор раундовых ключей для методов, работающих с участками памяти. При decryption == false ключи обратного
+     // шифра не строятся: такой набор годится только для шифрования ECB/CBC, CTR и CMAC
+     AesRoundKeys expandKey( const std::vector< unsigned char >& key, bool decryption = true );
+
+     // разворачивает count ключей длины, заданной при создании объекта, за один вызов: keys - ключи подряд, результат
+     // записывается в roundKeys[ 0, count ). Ключи обрабатываются группами до keyLanes, вычисления разных ключей группы
+     // независимы и перекрываются. Память не выделяется - для потоков, где ключ меняется почти с каждым сообщением
+     void expandKeys( const unsigned char* keys, size_t count, AesRoundKeys* roundKeys, bool decryption = true ) const;
+
+     // достраивает ключи обратного шифра для набора, развернутого только для шифрования
+     void expandDecryptionKeys( AesRoundKeys& roundKeys ) const;
+
+     // наибольшее число ключей, разворачиваемых одновременно: столько ведут portable, ttable и AES-128 с VAES. С VAES
+     // ключи AES-192/256 идут группами по 8, на AES-NI без VAES - по 4
+     static const size_t keyLanes = 16;
 
-     // выполняет расшифрование одного блока данных
-     std::vector< unsigned char > decryptBlock( const std::vector< unsigned char >& data, const Matrix& roundKeysMatrix );
+     // шифрование/расшифрование size байт(кратно размеру блока) из src в dst без выделения памяти. src и dst могут совпадать.
+     // в режиме CBC в iv после вызова записывается последний блок шифртекста, что позволяет обрабатывать данные частями
+     void cryptBlocksECB( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys ) const;
+     void cryptBlocksCBC( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] ) const;
+     void decryptBlocksECB( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys ) const;
+     void decryptBlocksCBC( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] ) const;
 
-     // функции для преобразования из массива байт(матрицы 4x4) в матрицу 4х4(массив байт)
-     Matrix block_to_matrix_4x4( const std::vector< unsigned char >& data );
-     std::vector< unsigned char > matrix_4_4_to_vector( const Matrix& matrix );
+     // шифрование/расшифрование в режиме CTR(NIST SP 800-38A п. 6.5) для произвольного size. counter - 128-битный счетчик
+     // в big-endian, после вызова содержит счетчик следующего блока. Неполным может быть только последний фрагмент данных
+     void cryptBlocksCTR( const unsigned char* src, unsigned char* dst, size_t size, const AesRoundKeys& roundKeys, unsigned char counter[ 16 ] ) const;
 
-     // выполняет замену каждого байта исходной матрицы на элемент таблицы sbox
-     void subBytes( Matrix& matrix );
+     // увеличивает 128-битный счетчик CTR на blocks
+     static void addCounter( unsigned char counter[ 16 ], uint64_t blocks );
+
+     // вычисляет имитовставку CMAC(NIST SP 800-38B) над size байт data
+     void cmac( const unsigned char* data, size_t size, const AesRoundKeys& roundKeys, unsigned char mac[ 16 ] ) const;
+
+     // выбирает реализацию для всех объектов процесса. Бросает исключение, если процессор ее не поддерживает
+     static void setBackend( AesBackend backend );
+     static AesBackend backend();
+     static bool backendSupported( AesBackend backend );
+     static AesBackend bestBackend();
+
+     // имя реализации в профиле настройки и журналах: portable, ttable, aesni
+     static const char* backendName( AesBackend backend );
+
+private:
+     // выполняет шифрование/расшифрование одного блока выбранной реализацией
+     void cryptBlock( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const;
+     void decryptBlock( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const;
+
+     // шифрование одного блока по тексту стандарта. Состояние хранится по столбцам: байт (row, column) находится в state[ row + 4 * column ]
+     void cryptBlockPortable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const;
+
+     // расшифрование одного блока по эквивалентному обратному шифру(FIPS-197 п. 5.3.5) по тексту стандарта
+     void decryptBlockPortable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const;
+
+     // шифрование/расшифрование одного блока с объединенными таблицами
+     void cryptBlockTable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const;
+     void decryptBlockTable( const unsigned char src[ 16 ], unsigned char dst[ 16 ], const AesRoundKeys& roundKeys ) const;
+
+     // реализации на AES-NI для blocks целых блоков. Независимые блоки обрабатываются по четыре, чтобы скрыть задержку инструкций
+     static void cryptBlocksAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys );
+     static void decryptBlocksAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys );
+     static void cryptBlocksCbcAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] );
+     static void decryptBlocksCbcAesNi( const unsigned char* src, unsigned char* dst, size_t blocks, const AesRoundKeys& roundKeys, unsigned char iv[ 16 ] );
+     static bool hasAesNi();
+
+     // развертывание ключей группами: по 32-битным словам(FIPS-197 п. 5.2) для portable и ttable, на AES-NI - через
+     // aesenclast(SubWord и rcon). Заполняют только bytes, ключи расшифрования строятся отдельно(на AES-NI - через aesimc)
+     void expandKeysWords( const unsigned char* keys, size_t count, AesRoundKeys* roundKeys ) const;
+     static void expandKeysAesNi( const unsigned char* keys, size_t count, int keyWords, AesRoundKeys* roundKeys );
+     void expandDecryptionKeysWords( AesRoundKeys& roundKeys ) const;
+     static void expandDecryptionKeysAesNi( AesRoundKeys& roundKeys );
+
+     // выполняет замену каждого байта состояния на элемент таблицы sbox
+     void subBytes( unsigned char state[ 16 ] ) const;
+     void invSubBytes( unsigned char state[ 16 ] ) const;
 
      // циклический сдвиг влево на n позиций(где n = 0 для 1 строки, 1 для 2, 2 для 3, и 3 для 4)
-     void shiftRows( Matrix& matrix );
+     void shiftRows( unsigned char state[ 16 ] ) const;
+     void invShiftRows( unsigned char state[ 16 ] ) const;
 
      // выполняет умножение каждой колонки в поле GF(2^8) по модулю x^4 + 1 с многочленом  3x^3 + x^2 + x + 2(из стандарта)
-     void mixColumn( Matrix& matrix );
-
-     // выполняет XOR между элементасм из data_matrix и round_keys_matrix. При этом за первый столбец матрицы round_keys_matrix принимается first_column
-     void addRoundKey( Matrix& matrix, const Matrix& round_keys_matrix, int first_column );
+     void mixColumn( unsigned char state[ 16 ] ) const;
 
-     // пробразования, обратные subBytes shiftRows mixColumn. используются при расшифровании
-     void invSubBytes( Matrix& matrix );
-     void invShiftRows( Matrix& matrix );
-     void invMixColumn( Matrix& matrix );
+     // выполняет XOR состояния с ключом раунда
+     void addRoundKey( unsigned char state[ 16 ], const unsigned char roundKey[ 16 ] ) const;
 
-     // метод для создания матрицы наборов раундовых ключей в соответствии с ключом
-     Matrix KeyExpansion( const std::vector< unsigned char >& key );
+     // пробразование, обратное mixColumn. используется при подготовке ключей расшифрования
+     void invMixColumn( unsigned char state[ 16 ] ) const;
 
-     // перемножает байты в поле  GF(2^8)
-     unsigned char multiplyBytes( unsigned char a, unsigned char b );
+     // таблицы, объединяющие SubBytes и MixColumns(te) и InvSubBytes и InvMixColumns(td): te[ row ][ x ] - вклад байта x
+     // из строки row в столбец результата. Столбец хранится как 32-битное слово, строка 0 в старшем байте
+     struct Tables
+     {
+          uint32_t te[ 4 ][ 256 ];
+          uint32_t td[ 4 ][ 256 ];
+     };
 
-     // выполняет циклический сдвиг влево столбца column на shift позиций матрицы matrix и возвращает результат в поле result
-     void shiftColumn( const Matrix& matrix, int column, int shift, unsigned char result[ 4 ] );
+     // строит таблицы при первом вызове, общие для всех объектов
+     const Tables& buildTables() const;
 
-     // возвращает значение из таблицы rcon(стандарт, A.1, стр 27)
-     unsigned char rcon( int row, int column );
+     // проверяет размеры данных для методов, работающих с векторами
+     void checkAligned( size_t size ) const;
 
-     std::vector< unsigned char > vector_xor( const std::vector< unsigned char >& lhs, const std::vector< unsigned char >& rhs );
+     // перемножает байты в поле  GF(2^8)
+     unsigned char multiplyBytes( unsigned char a, unsigned char b ) const;
 
      int calculateNk( AesKeyLength len ) const;
      int calculateNr( AesKeyLength len ) const;
 
      // преобразует байт src по таблице sbox или invSbox, в зависимости от того, что передано в параметре sboxMatrix
-     unsigned char sboxValue( unsigned char src, const unsigned char sboxMatrix[16][16] );
+     unsigned char sboxValue( unsigned char src, const unsigned char sboxMatrix[16][16] ) const;
 
 private:
      const unsigned char sbox[16][16] =
@@ -141,4 +230,6 @@ private:
 
      const int Nk;                  // длина ключа в 32-х битных словах 8
      const int Nr;                 // число раундов шифрования 14
+
+     const Tables& tables_;
 };
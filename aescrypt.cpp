@@ -0,0 +1,879 @@
+/// @file
+/// @brief Реализация C-интерфейса libaescrypt поверх AESCryptography и FileEncryptor
+
+#include "aescrypt.h"
+#include "AES_cryptography.h"
+#include "buffer_pool.h"
+#include "file_crypt.h"
+#include "thread_pool.h"
+#include "tuning_profile.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+struct aescrypt_key
+{
+     explicit aescrypt_key( const std::vector< unsigned char >& bytes, AesKeyLength length )
+     :key( bytes ), crypt( length ), roundKeys( crypt.expandKey( key ) )
+     {
+     }
+
+     aescrypt_key( const std::vector< unsigned char >& bytes, AesKeyLength length, const AesRoundKeys& expanded )
+     :key( bytes ), crypt( length ), roundKeys( expanded )
+     {
+     }
+
+     std::vector< unsigned char > key;       // исходный ключ нужен файловым функциям
+     AESCryptography crypt;
+     AesRoundKeys roundKeys;
+};
+
+
+struct aescrypt_stream
+{
+     const aescrypt_key* key = nullptr;
+     CryptMode mode = CMCbc;
+     bool decrypt = false;
+     bool finished = false;
+     unsigned char chain[ 16 ] = {};
+     unsigned char pending[ 16 ] = {};       // неполный блок или, при расшифровании с дополнением, последний блок
+     size_t pendingSize = 0;
+};
+
+
+namespace
+{
+     // ошибка с кодом, который получит вызывающий
+     class ApiError : public std::runtime_error
+     {
+     public:
+          ApiError( int status, const std::string& message ) : std::runtime_error( message ), status_( status ) {}
+          int status() const { return status_; }
+
+     private:
+          int status_;
+     };
+
+     thread_local std::string lastError;
+
+     // переводит обрабатываемое исключение в код ошибки и сохраняет его текст в message
+     int currentStatus( std::string& message )
+     {
+          try
+          {
+               throw;
+          }
+          catch( const ApiError& ex )
+          {
+               message = ex.what();
+               return ex.status();
+          }
+          catch( const std::bad_alloc& )
+          {
+               message = "Out of memory";
+               return AESCRYPT_ERROR_MEMORY;
+          }
+          catch( const std::exception& ex )
+          {
+               message = ex.what();
+               return AESCRYPT_ERROR_FAILED;
+          }
+          catch( ... )
+          {
+               message = "Unknown error";
+               return AESCRYPT_ERROR_FAILED;
+          }
+     }
+
+     // выполняет body, не выпуская исключения за границу C-интерфейса
+     template< typename Body >
+     int guarded( Body&& body )
+     {
+          try
+          {
+               body();
+               return AESCRYPT_OK;
+          }
+          catch( ... )
+          {
+               return currentStatus( lastError );
+          }
+     }
+
+     void require( bool condition, const char* message )
+     {
+          if( !condition )
+          {
+               throw ApiError( AESCRYPT_ERROR_ARGUMENT, message );
+          }
+     }
+
+     void wipe( void* data, size_t size )
+     {
+          volatile unsigned char* bytes = static_cast< volatile unsigned char* >( data );
+          for( size_t idx = 0; idx < size; idx++ )
+          {
+               bytes[ idx ] = 0;
+          }
+     }
+
+     AesKeyLength keyLength( size_t keySize )
+     {
+          switch( keySize )
+          {
+               case 16:
+               {
+                    return AKL_128;
+               }
+               case 24:
+               {
+                    return AKL_192;
+               }
+               case 32:
+               {
+                    return AKL_256;
+               }
+               default:
+               {
+                    throw ApiError( AESCRYPT_ERROR_ARGUMENT, "Incorrect key length" );
+               }
+          }
+     }
+
+     CryptMode cryptMode( aescrypt_mode mode )
+     {
+          switch( mode )
+          {
+               case AESCRYPT_MODE_CBC:
+               {
+                    return CMCbc;
+               }
+               case AESCRYPT_MODE_ECB:
+               {
+                    return CMEcb;
+               }
+               case AESCRYPT_MODE_CTR:
+               {
+                    return CMCtr;
+               }
+          }
+          throw ApiError( AESCRYPT_ERROR_ARGUMENT, "Incorrect mode" );
+     }
+
+     ChecksumType checksumType( aescrypt_checksum type )
+     {
+          switch( type )
+          {
+               case AESCRYPT_CHECKSUM_NONE:
+               {
+                    return CTNone;
+               }
+               case AESCRYPT_CHECKSUM_CRC32C:
+               {
+                    return CTCrc32c;
+               }
+               case AESCRYPT_CHECKSUM_XXH64:
+               {
+                    return CTXxh64;
+               }
+          }
+          throw ApiError( AESCRYPT_ERROR_ARGUMENT, "Incorrect checksum type" );
+     }
+
+     aescrypt_checksum apiChecksumType( ChecksumType type )
+     {
+          return type == CTCrc32c ? AESCRYPT_CHECKSUM_CRC32C : type == CTXxh64 ? AESCRYPT_CHECKSUM_XXH64 : AESCRYPT_CHECKSUM_NONE;
+     }
+
+     // проверяет ключ и IV и возвращает режим
+     CryptMode checkArguments( const aescrypt_key* key, aescrypt_mode apiMode, const uint8_t* iv )
+     {
+          require( key != nullptr, "Key is null" );
+          CryptMode mode = cryptMode( apiMode );
+          require( mode == CMEcb || iv != nullptr, "IV is required for CBC and CTR modes" );
+          return mode;
+     }
+
+     // шифрует/расшифровывает size байт на месте в вызывающем потоке
+     void cryptSpan( const aescrypt_key& key, CryptMode mode, bool decrypt, unsigned char* data, size_t size, unsigned char* chain )
+     {
+          if( mode != CMCtr && size % 16 != 0 )
+          {
+               throw ApiError( decrypt ? AESCRYPT_ERROR_DATA : AESCRYPT_ERROR_ARGUMENT, "data is not aligned" );
+          }
+          switch( mode )
+          {
+               case CMCbc:
+               {
+                    if( decrypt )
+                    {
+                         key.crypt.decryptBlocksCBC( data, data, size, key.roundKeys, chain );
+                    }
+                    else
+                    {
+                         key.crypt.cryptBlocksCBC( data, data, size, key.roundKeys, chain );
+                    }
+                    break;
+               }
+               case CMEcb:
+               {
+                    if( decrypt )
+                    {
+                         key.crypt.decryptBlocksECB( data, data, size, key.roundKeys );
+                    }
+                    else
+                    {
+                         key.crypt.cryptBlocksECB( data, data, size, key.roundKeys );
+                    }
+                    break;
+               }
+               case CMCtr:
+               {
+                    key.crypt.cryptBlocksCTR( data, data, size, key.roundKeys, chain );
+                    break;
+               }
+          }
+     }
+
+     size_t removePadding( const unsigned char* data, size_t size )
+     {
+          try
+          {
+               return FileEncryptor::removePadding( data, size );
+          }
+          catch( const std::runtime_error& )
+          {
+               throw ApiError( AESCRYPT_ERROR_DATA, "Input data corrupted" );
+          }
+     }
+
+     void checkCapacity( size_t capacity, size_t required, size_t* dstSize )
+     {
+          if( capacity < required )
+          {
+               *dstSize = required;
+               throw ApiError( AESCRYPT_ERROR_BUFFER, "Output buffer is too small" );
+          }
+     }
+
+     // шифрует/расшифровывает сообщение целиком. Результат пишется в dst, размер - в dstSize
+     void cryptMessage( const aescrypt_key& key, CryptMode mode, bool decrypt, const uint8_t* iv, const uint8_t* src, size_t srcSize,
+                        uint8_t* dst, size_t dstCapacity, size_t* dstSize )
+     {
+          require( ( src != nullptr || srcSize == 0 ) && dstSize != nullptr, "Data pointer is null" );
+          const bool padded = mode != CMCtr;
+          if( decrypt && padded && ( srcSize == 0 || srcSize % 16 != 0 ) )
+          {
+               throw ApiError( AESCRYPT_ERROR_DATA, "data is not aligned" );
+          }
+          const size_t required = decrypt || !padded ? srcSize : srcSize / 16 * 16 + 16;
+          checkCapacity( dstCapacity, required, dstSize );
+          require( dst != nullptr || required == 0, "Data pointer is null" );
+
+          unsigned char chain[ 16 ] = {};
+          if( mode != CMEcb )
+          {
+               memcpy( chain, iv, sizeof( chain ) );
+          }
+          if( srcSize != 0 )
+          {
+               memmove( dst, src, srcSize );
+          }
+          size_t size = srcSize;
+          if( !decrypt && padded )
+          {
+               size = FileEncryptor::addPadding( dst, size );
+          }
+          cryptSpan( key, mode, decrypt, dst, size, chain );
+          if( decrypt && padded )
+          {
+               size = removePadding( dst, size );
+          }
+          *dstSize = size;
+     }
+
+     // потоки пакетной обработки общие для всех вызовов библиотеки
+     ThreadPool& batchPool()
+     {
+          static ThreadPool pool;
+          return pool;
+     }
+
+     // пакет меньшего размера обрабатывается в вызывающем потоке: передача в пул дороже шифрования
+     const size_t batchParallelThreshold = 256 * 1024;
+
+     int cryptBatch( const aescrypt_key* key, aescrypt_mode apiMode, bool decrypt, aescrypt_message* messages, size_t count )
+     {
+          CryptMode mode = CMCbc;
+          int status = guarded( [ & ]()
+          {
+               require( key != nullptr, "Key is null" );
+               require( messages != nullptr || count == 0, "Messages pointer is null" );
+               mode = cryptMode( apiMode );
+          } );
+          if( status != AESCRYPT_OK )
+          {
+               return status;
+          }
+
+          // текст ошибки сообщения с наименьшим номером
+          std::mutex errorMutex;
+          size_t errorIndex = count;
+          std::string errorMessage;
+          auto process = [ & ]( size_t idx )
+          {
+               aescrypt_message& message = messages[ idx ];
+               try
+               {
+                    require( mode == CMEcb || message.iv != nullptr, "IV is required for CBC and CTR modes" );
+                    cryptMessage( *key, mode, decrypt, message.iv, message.src, message.srcSize, message.dst, message.dstCapacity, &message.dstSize );
+                    message.status = AESCRYPT_OK;
+               }
+               catch( ... )
+               {
+                    std::string text;
+                    message.status = currentStatus( text );
+                    std::lock_guard< std::mutex > lock( errorMutex );
+                    if( idx < errorIndex )
+                    {
+                         errorIndex = idx;
+                         errorMessage = text;
+                    }
+               }
+          };
+
+          size_t totalSize = 0;
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               totalSize += messages[ idx ].srcSize;
+          }
+          if( count > 1 && totalSize >= batchParallelThreshold )
+          {
+               // сообщения делятся на непрерывные группы, чтобы не ставить в пул задачу на каждое короткое сообщение
+               ThreadPool& pool = batchPool();
+               const size_t taskCount = std::min( count, 4 * pool.threadCount() );
+               pool.parallelFor( taskCount, [ & ]( size_t task )
+               {
+                    for( size_t idx = task * count / taskCount; idx < ( task + 1 ) * count / taskCount; idx++ )
+                    {
+                         process( idx );
+                    }
+               } );
+          }
+          else
+          {
+               for( size_t idx = 0; idx < count; idx++ )
+               {
+                    process( idx );
+               }
+          }
+
+          if( errorIndex != count )
+          {
+               lastError = errorMessage;
+               return messages[ errorIndex ].status;
+          }
+          return AESCRYPT_OK;
+     }
+
+     // параметры файловых функций. Структура более ранней версии(с меньшим size) дополняется значениями по умолчанию
+     aescrypt_file_options fileOptions( const aescrypt_file_options* options )
+     {
+          aescrypt_file_options result;
+          aescrypt_file_options_init( &result );
+          if( options != nullptr )
+          {
+               require( options->size >= sizeof( uint32_t ) && options->size <= sizeof( result ), "Incorrect options size" );
+               memcpy( &result, options, options->size );
+          }
+          return result;
+     }
+
+     enum FileOperation
+     {
+          FOEncrypt,
+          FODecrypt,
+          FOVerify            // расшифрование без записи открытого текста, dstPath не используется
+     };
+
+     thread_local std::string lastEvidence;
+
+     // создает FileEncryptor с флагами, числом потоков и пулом буферов из параметров. Пул с огромными страницами
+     // создается только по запросу в hugePagePool, иначе используется пул процесса по умолчанию
+     std::unique_ptr< FileEncryptor > fileEncryptor( const std::string& srcPath, const std::string& dstPath, const aescrypt_file_options& options,
+                                                     std::unique_ptr< BufferPool >& hugePagePool )
+     {
+          if( ( options.flags & AESCRYPT_FILE_HUGE_PAGES ) != 0 )
+          {
+               hugePagePool.reset( new BufferPool( TuningProfile::active().chunkSize, true ) );
+          }
+          std::unique_ptr< FileEncryptor > fileCrypt( new FileEncryptor( srcPath, dstPath, hugePagePool ? *hugePagePool : BufferPool::defaultPool() ) );
+          fileCrypt->setHexArmor( ( options.flags & AESCRYPT_FILE_HEX ) != 0 );
+          fileCrypt->setThreadCount( options.threads );
+          fileCrypt->setNumaPolicy( ( options.flags & AESCRYPT_FILE_NUMA_LOCAL ) != 0        ? NPLocal
+                                    : ( options.flags & AESCRYPT_FILE_NUMA_INTERLEAVE ) != 0 ? NPInterleave
+                                                                                              : NPOff );
+          return fileCrypt;
+     }
+
+     std::vector< unsigned char > fileIv( CryptMode mode, const aescrypt_file_options& options )
+     {
+          std::vector< unsigned char > iv;
+          if( mode != CMEcb && options.iv != nullptr )
+          {
+               iv.assign( options.iv, options.iv + 16 );
+          }
+          return iv;
+     }
+
+     void setResult( aescrypt_file_result* result, const FileEncryptor& fileCrypt )
+     {
+          if( result != nullptr )
+          {
+               result->checksumType = apiChecksumType( fileCrypt.lastChecksumType() );
+               result->checksum = fileCrypt.lastChecksum();
+          }
+     }
+
+     void cryptFile( FileOperation operation, const aescrypt_key* key, const char* srcPath, const char* dstPath,
+                     const aescrypt_file_options* apiOptions, aescrypt_file_result* result )
+     {
+          aescrypt_file_options options = fileOptions( apiOptions );
+          const bool inPlace = ( options.flags & AESCRYPT_FILE_IN_PLACE ) != 0;
+          require( srcPath != nullptr && ( dstPath != nullptr || operation == FOVerify || inPlace ), "File path is null" );
+          CryptMode mode = cryptMode( options.mode );
+          require( key != nullptr, "Key is null" );
+          require( operation != FOEncrypt || mode == CMEcb || options.iv != nullptr, "IV is required for CBC and CTR modes" );
+          require( options.format <= AESCRYPT_FORMAT_SPARSE, "Incorrect format" );
+
+          // сегментированный, инкрементальный и разреженный форматы и обработка на месте не сочетаются с суммой и сжатием
+          const bool container = options.format != AESCRYPT_FORMAT_STREAM || inPlace;
+          require( !container || ( options.checksum == AESCRYPT_CHECKSUM_NONE && ( options.flags & AESCRYPT_FILE_COMPRESS ) == 0 ),
+                   "Checksum and compression are supported only for stream format" );
+          require( ( options.format != AESCRYPT_FORMAT_SEGMENTED && options.format != AESCRYPT_FORMAT_INCREMENTAL ) || mode == CMCbc,
+                   "Segmented format is supported only in CBC mode" );
+          require( options.format != AESCRYPT_FORMAT_INCREMENTAL || operation == FOEncrypt, "Incremental format supports only encryption" );
+          require( options.format != AESCRYPT_FORMAT_SPARSE || ( mode == CMCtr && ( options.flags & AESCRYPT_FILE_HEX ) == 0 ),
+                   "Sparse format is supported only in CTR mode without HEX" );
+          require( !inPlace || ( mode == CMCtr && options.format == AESCRYPT_FORMAT_STREAM && options.iv != nullptr && operation != FOVerify ),
+                   "In-place processing is supported only for stream format in CTR mode with IV" );
+
+          std::vector< unsigned char > iv = fileIv( mode, options );
+          const std::string source( srcPath );
+          const std::string destination = inPlace ? source + ".journal" : dstPath != nullptr ? dstPath : "";
+          std::unique_ptr< BufferPool > hugePagePool;
+          std::unique_ptr< FileEncryptor > fileCrypt = fileEncryptor( source, destination, options, hugePagePool );
+          fileCrypt->setCompression( ( options.flags & AESCRYPT_FILE_COMPRESS ) != 0 );
+          fileCrypt->setChecksum( checksumType( options.checksum ) );
+
+          FileEncryptor::VerifyResult verified;
+          FileEncryptor::IncrementalStats incremental;
+          switch( options.format )
+          {
+               case AESCRYPT_FORMAT_SEGMENTED:
+               {
+                    if( operation == FOEncrypt )
+                    {
+                         fileCrypt->cryptFileSegmented( key->key, iv, options.segments != 0 ? options.segments : ThreadPool::hardwareThreads() );
+                    }
+                    else if( operation == FODecrypt )
+                    {
+                         fileCrypt->decryptFileSegmented( key->key, iv );
+                    }
+                    else
+                    {
+                         verified = fileCrypt->verifyFileSegmented( key->key, iv );
+                    }
+                    break;
+               }
+               case AESCRYPT_FORMAT_INCREMENTAL:
+               {
+                    incremental = fileCrypt->cryptFileIncremental( key->key, iv, options.segmentSize != 0 ? options.segmentSize : 4 * 1024 * 1024 );
+                    break;
+               }
+               case AESCRYPT_FORMAT_SPARSE:
+               {
+                    if( operation == FOEncrypt )
+                    {
+                         fileCrypt->cryptFileSparse( key->key, iv );
+                    }
+                    else if( operation == FODecrypt )
+                    {
+                         fileCrypt->decryptFileSparse( key->key, iv );
+                    }
+                    else
+                    {
+                         verified = fileCrypt->verifyFileSparse( key->key, iv );
+                    }
+                    break;
+               }
+               default:
+               {
+                    if( inPlace && operation == FOEncrypt )
+                    {
+                         fileCrypt->cryptFileInPlace( key->key, iv );
+                    }
+                    else if( inPlace )
+                    {
+                         fileCrypt->decryptFileInPlace( key->key, iv );
+                    }
+                    else if( operation == FOEncrypt )
+                    {
+                         fileCrypt->cryptFile( key->key, mode, iv );
+                    }
+                    else if( operation == FODecrypt )
+                    {
+                         fileCrypt->decryptFile( key->key, mode, iv );
+                    }
+                    else
+                    {
+                         verified = fileCrypt->verifyFile( key->key, mode, iv );
+                    }
+                    break;
+               }
+          }
+
+          setResult( result, *fileCrypt );
+          if( result != nullptr )
+          {
+               result->segments = incremental.segments;
+               result->segmentsEncrypted = incremental.encrypted;
+          }
+          if( operation == FOVerify )
+          {
+               lastEvidence = verified.evidence;
+               if( result != nullptr )
+               {
+                    result->verifyStrength = verified.strength == VSFull      ? AESCRYPT_VERIFY_FULL
+                                             : verified.strength == VSPadding ? AESCRYPT_VERIFY_PADDING
+                                                                              : AESCRYPT_VERIFY_NONE;
+                    result->verifiedSize = verified.size;
+                    result->decryptedSize = verified.decrypted;
+                    result->evidence = lastEvidence.c_str();
+               }
+               if( verified.strength == VSNone )
+               {
+                    throw ApiError( AESCRYPT_ERROR_UNVERIFIED, "CTR ciphertext without checksum cannot be verified" );
+               }
+          }
+     }
+
+     void reencryptFile( const aescrypt_key* oldKey, const aescrypt_file_options* oldApiOptions, const aescrypt_key* newKey,
+                         const aescrypt_file_options* newApiOptions, const char* srcPath, const char* dstPath, aescrypt_file_result* result )
+     {
+          require( srcPath != nullptr && dstPath != nullptr, "File path is null" );
+          require( oldKey != nullptr && newKey != nullptr, "Key is null" );
+          aescrypt_file_options oldOptions = fileOptions( oldApiOptions );
+          aescrypt_file_options newOptions = fileOptions( newApiOptions );
+          CryptMode oldMode = cryptMode( oldOptions.mode );
+          CryptMode newMode = cryptMode( newOptions.mode );
+          require( oldMode != CMCtr && newMode != CMCtr, "Reencryption supports only ECB and CBC modes" );
+          require( ( oldMode == CMEcb || oldOptions.iv != nullptr ) && ( newMode == CMEcb || newOptions.iv != nullptr ), "IV is required for CBC mode" );
+
+          std::unique_ptr< BufferPool > hugePagePool;
+          std::unique_ptr< FileEncryptor > fileCrypt = fileEncryptor( srcPath, dstPath, newOptions, hugePagePool );
+          fileCrypt->reencryptFile( oldKey->key, oldMode, fileIv( oldMode, oldOptions ), newKey->key, newMode, fileIv( newMode, newOptions ) );
+          setResult( result, *fileCrypt );
+     }
+}
+
+
+uint32_t aescrypt_abi_version( void )
+{
+     return AESCRYPT_ABI_VERSION;
+}
+
+
+const char* aescrypt_last_error( void )
+{
+     return lastError.c_str();
+}
+
+
+int aescrypt_load_profile( const char* path )
+{
+     return guarded( [ & ]()
+     {
+          require( path != nullptr, "Profile path is null" );
+          if( !TuningProfile::loadActive( path ) )
+          {
+               throw ApiError( AESCRYPT_ERROR_FAILED, "Tuning profile is missing or was made on another CPU" );
+          }
+     } );
+}
+
+
+int aescrypt_key_create( const uint8_t* key, size_t keySize, aescrypt_key** result )
+{
+     return guarded( [ & ]()
+     {
+          require( key != nullptr && result != nullptr, "Key pointer is null" );
+
+          // профиль по умолчанию выбирает реализацию шифра до первого шифрования
+          TuningProfile::active();
+          *result = new aescrypt_key( std::vector< unsigned char >( key, key + keySize ), keyLength( keySize ) );
+     } );
+}
+
+
+int aescrypt_key_create_batch( const uint8_t* keys, size_t keySize, size_t count, aescrypt_key** results )
+{
+     return guarded( [ & ]()
+     {
+          require( ( keys != nullptr && results != nullptr ) || count == 0, "Key pointer is null" );
+
+          TuningProfile::active();
+          AesKeyLength length = keyLength( keySize );
+          std::vector< AesRoundKeys > expanded( count );
+          AESCryptography( length ).expandKeys( keys, count, expanded.data() );
+
+          // при ошибке уже созданные ключи затираются и освобождаются
+          std::vector< std::unique_ptr< aescrypt_key, decltype( &aescrypt_key_destroy ) > > created;
+          created.reserve( count );
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               const uint8_t* key = keys + idx * keySize;
+               created.emplace_back( new aescrypt_key( std::vector< unsigned char >( key, key + keySize ), length, expanded[ idx ] ),
+                                     aescrypt_key_destroy );
+          }
+          wipe( expanded.data(), expanded.size() * sizeof( AesRoundKeys ) );
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               results[ idx ] = created[ idx ].release();
+          }
+     } );
+}
+
+
+void aescrypt_key_destroy( aescrypt_key* key )
+{
+     if( key == nullptr )
+     {
+          return;
+     }
+     wipe( key->key.data(), key->key.size() );
+     wipe( &key->roundKeys, sizeof( key->roundKeys ) );
+     delete key;
+}
+
+
+size_t aescrypt_encrypted_size( aescrypt_mode mode, size_t srcSize )
+{
+     return mode == AESCRYPT_MODE_CTR ? srcSize : srcSize / 16 * 16 + 16;
+}
+
+
+int aescrypt_encrypt( const aescrypt_key* key, aescrypt_mode mode, const uint8_t* iv, const uint8_t* src, size_t srcSize,
+                      uint8_t* dst, size_t dstCapacity, size_t* dstSize )
+{
+     return guarded( [ & ]()
+     {
+          CryptMode checkedMode = checkArguments( key, mode, iv );
+          cryptMessage( *key, checkedMode, false, iv, src, srcSize, dst, dstCapacity, dstSize );
+     } );
+}
+
+
+int aescrypt_decrypt( const aescrypt_key* key, aescrypt_mode mode, const uint8_t* iv, const uint8_t* src, size_t srcSize,
+                      uint8_t* dst, size_t dstCapacity, size_t* dstSize )
+{
+     return guarded( [ & ]()
+     {
+          CryptMode checkedMode = checkArguments( key, mode, iv );
+          cryptMessage( *key, checkedMode, true, iv, src, srcSize, dst, dstCapacity, dstSize );
+     } );
+}
+
+
+int aescrypt_encrypt_blocks( const aescrypt_key* key, aescrypt_mode mode, uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t size )
+{
+     return guarded( [ & ]()
+     {
+          CryptMode checkedMode = checkArguments( key, mode, chain );
+          require( ( src != nullptr && dst != nullptr ) || size == 0, "Data pointer is null" );
+          if( size != 0 )
+          {
+               memmove( dst, src, size );
+          }
+          cryptSpan( *key, checkedMode, false, dst, size, chain );
+     } );
+}
+
+
+int aescrypt_decrypt_blocks( const aescrypt_key* key, aescrypt_mode mode, uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t size )
+{
+     return guarded( [ & ]()
+     {
+          CryptMode checkedMode = checkArguments( key, mode, chain );
+          require( ( src != nullptr && dst != nullptr ) || size == 0, "Data pointer is null" );
+          if( size != 0 )
+          {
+               memmove( dst, src, size );
+          }
+          cryptSpan( *key, checkedMode, true, dst, size, chain );
+     } );
+}
+
+
+int aescrypt_encrypt_batch( const aescrypt_key* key, aescrypt_mode mode, aescrypt_message* messages, size_t count )
+{
+     return cryptBatch( key, mode, false, messages, count );
+}
+
+
+int aescrypt_decrypt_batch( const aescrypt_key* key, aescrypt_mode mode, aescrypt_message* messages, size_t count )
+{
+     return cryptBatch( key, mode, true, messages, count );
+}
+
+
+int aescrypt_stream_create( const aescrypt_key* key, aescrypt_mode mode, const uint8_t* iv, int decrypt, aescrypt_stream** result )
+{
+     return guarded( [ & ]()
+     {
+          require( result != nullptr, "Stream pointer is null" );
+          std::unique_ptr< aescrypt_stream > stream( new aescrypt_stream() );
+          stream->key = key;
+          stream->mode = checkArguments( key, mode, iv );
+          stream->decrypt = decrypt != 0;
+          if( stream->mode != CMEcb )
+          {
+               memcpy( stream->chain, iv, sizeof( stream->chain ) );
+          }
+          *result = stream.release();
+     } );
+}
+
+
+int aescrypt_stream_update( aescrypt_stream* stream, const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity, size_t* dstSize )
+{
+     return guarded( [ & ]()
+     {
+          require( stream != nullptr && dstSize != nullptr && ( src != nullptr || srcSize == 0 ), "Pointer is null" );
+          require( !stream->finished, "Stream already finished" );
+
+          // обрабатываются только целые блоки. При расшифровании с дополнением последний блок ждет finish
+          const bool padded = stream->mode != CMCtr;
+          const size_t total = stream->pendingSize + srcSize;
+          size_t take = total / 16 * 16;
+          if( stream->decrypt && padded && take == total && take != 0 )
+          {
+               take -= 16;
+          }
+          checkCapacity( dstCapacity, take, dstSize );
+          require( dst != nullptr || take == 0, "Data pointer is null" );
+
+          // остаток сохраняется до записи в dst, так как dst может совпадать с src
+          unsigned char tail[ 16 ];
+          const size_t tailSize = total - take;
+          for( size_t idx = take; idx < total; idx++ )
+          {
+               tail[ idx - take ] = idx < stream->pendingSize ? stream->pending[ idx ] : src[ idx - stream->pendingSize ];
+          }
+          if( take != 0 )
+          {
+               memmove( dst + stream->pendingSize, src, take - stream->pendingSize );
+               memcpy( dst, stream->pending, stream->pendingSize );
+               cryptSpan( *stream->key, stream->mode, stream->decrypt, dst, take, stream->chain );
+          }
+          memcpy( stream->pending, tail, tailSize );
+          stream->pendingSize = tailSize;
+          *dstSize = take;
+     } );
+}
+
+
+int aescrypt_stream_finish( aescrypt_stream* stream, uint8_t* dst, size_t dstCapacity, size_t* dstSize )
+{
+     return guarded( [ & ]()
+     {
+          require( stream != nullptr && dstSize != nullptr, "Pointer is null" );
+          require( !stream->finished, "Stream already finished" );
+
+          // последний блок обрабатывается в копии, чтобы при нехватке места поток можно было завершить повторно
+          const bool padded = stream->mode != CMCtr;
+          unsigned char block[ 32 ];
+          unsigned char chain[ 16 ];
+          memcpy( block, stream->pending, stream->pendingSize );
+          memcpy( chain, stream->chain, sizeof( chain ) );
+          size_t size = stream->pendingSize;
+          if( stream->decrypt && padded && size != 16 )
+          {
+               throw ApiError( AESCRYPT_ERROR_DATA, "Input data corrupted" );
+          }
+          if( !stream->decrypt && padded )
+          {
+               size = FileEncryptor::addPadding( block, size );
+          }
+          cryptSpan( *stream->key, stream->mode, stream->decrypt, block, size, chain );
+          if( stream->decrypt && padded )
+          {
+               size = removePadding( block, size );
+          }
+
+          checkCapacity( dstCapacity, size, dstSize );
+          require( dst != nullptr || size == 0, "Data pointer is null" );
+          memcpy( dst, block, size );
+          wipe( block, sizeof( block ) );
+          stream->finished = true;
+          *dstSize = size;
+     } );
+}
+
+
+void aescrypt_stream_destroy( aescrypt_stream* stream )
+{
+     if( stream == nullptr )
+     {
+          return;
+     }
+     wipe( stream->pending, sizeof( stream->pending ) );
+     delete stream;
+}
+
+
+void aescrypt_file_options_init( aescrypt_file_options* options )
+{
+     if( options == nullptr )
+     {
+          return;
+     }
+     memset( options, 0, sizeof( *options ) );
+     options->size = sizeof( *options );
+     options->mode = AESCRYPT_MODE_CBC;
+     options->checksum = AESCRYPT_CHECKSUM_NONE;
+}
+
+
+int aescrypt_encrypt_file( const aescrypt_key* key, const char* srcPath, const char* dstPath,
+                           const aescrypt_file_options* options, aescrypt_file_result* result )
+{
+     return guarded( [ & ]() { cryptFile( FOEncrypt, key, srcPath, dstPath, options, result ); } );
+}
+
+
+int aescrypt_decrypt_file( const aescrypt_key* key, const char* srcPath, const char* dstPath,
+                           const aescrypt_file_options* options, aescrypt_file_result* result )
+{
+     return guarded( [ & ]() { cryptFile( FODecrypt, key, srcPath, dstPath, options, result ); } );
+}
+
+
+int aescrypt_verify_file( const aescrypt_key* key, const char* srcPath, const aescrypt_file_options* options, aescrypt_file_result* result )
+{
+     return guarded( [ & ]() { cryptFile( FOVerify, key, srcPath, nullptr, options, result ); } );
+}
+
+
+int aescrypt_reencrypt_file( const aescrypt_key* oldKey, const aescrypt_file_options* oldOptions, const aescrypt_key* newKey,
+                             const aescrypt_file_options* newOptions, const char* srcPath, const char* dstPath, aescrypt_file_result* result )
+{
+     return guarded( [ & ]() { reencryptFile( oldKey, oldOptions, newKey, newOptions, srcPath, dstPath, result ); } );
+}
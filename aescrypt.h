@@ -0,0 +1,197 @@
+/// @file
+/// @brief C-интерфейс библиотеки libaescrypt: ключи, шифрование участков памяти, пакетная обработка, потоки и файлы
+/// всех форматов утилиты crypto_2(сплошной, сегментированный, инкрементальный, разреженный, на месте), перешифрование
+/// и проверка. Вне интерфейса остаются только обработка каталогов и счетчики по стадиям(--stats)
+///
+/// Интерфейс стабилен на уровне ABI: структуры передаются по указателю, объекты скрыты за непрозрачными
+/// дескрипторами, а структура параметров файловых функций начинается с поля size. Функции не бросают исключений
+/// и возвращают код aescrypt_status, текст последней ошибки потока доступен через aescrypt_last_error()
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined( __GNUC__ )
+#define AESCRYPT_API __attribute__( ( visibility( "default" ) ) )
+#else
+#define AESCRYPT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// версия ABI: увеличивается при несовместимых изменениях. 2 - поля форматов в aescrypt_file_result
+#define AESCRYPT_ABI_VERSION 2
+
+typedef enum aescrypt_status
+{
+     AESCRYPT_OK = 0,
+     AESCRYPT_ERROR_ARGUMENT = -1,      // неверный аргумент: длина ключа, IV, режим, нулевой указатель
+     AESCRYPT_ERROR_BUFFER = -2,        // мал выходной буфер, требуемый размер записан в *dstSize
+     AESCRYPT_ERROR_DATA = -3,          // шифртекст поврежден: не кратен блоку или неверное дополнение
+     AESCRYPT_ERROR_MEMORY = -4,
+     AESCRYPT_ERROR_FAILED = -5,        // прочие ошибки, в том числе ввода-вывода
+     AESCRYPT_ERROR_UNVERIFIED = -6     // aescrypt_verify_file: шифртекст CTR без суммы и сжатия проверить нечем
+} aescrypt_status;
+
+typedef enum aescrypt_mode
+{
+     AESCRYPT_MODE_CBC = 0,
+     AESCRYPT_MODE_ECB = 1,
+     AESCRYPT_MODE_CTR = 2               // без дополнения, шифртекст равен открытому тексту по размеру
+} aescrypt_mode;
+
+typedef enum aescrypt_checksum
+{
+     AESCRYPT_CHECKSUM_NONE = 0,
+     AESCRYPT_CHECKSUM_CRC32C = 1,
+     AESCRYPT_CHECKSUM_XXH64 = 2
+} aescrypt_checksum;
+
+// формат файла
+typedef enum aescrypt_format
+{
+     AESCRYPT_FORMAT_STREAM = 0,         // сплошной шифртекст с необязательными меткой сжатия и концевиком сумм
+     AESCRYPT_FORMAT_SEGMENTED = 1,      // CBC: независимые сегменты, таблица сегментов с имитовставкой
+     AESCRYPT_FORMAT_INCREMENTAL = 2,    // CBC, только шифрование: сегментированный формат и манифест {dstPath}.manifest
+     AESCRYPT_FORMAT_SPARSE = 3          // CTR: только участки данных разреженного файла, карта участков в концевике
+} aescrypt_format;
+
+// надежность проверки aescrypt_verify_file
+typedef enum aescrypt_verify_strength
+{
+     AESCRYPT_VERIFY_NONE = 0,
+     AESCRYPT_VERIFY_PADDING = 1,        // только дополнение PKCS#7: неверный ключ проходит примерно в одном случае из 256
+     AESCRYPT_VERIFY_FULL = 2            // контрольные суммы, записи сжатия или имитовставка
+} aescrypt_verify_strength;
+
+// флаги файловых функций
+#define AESCRYPT_FILE_HEX 0x1u              // шифртекст в шестнадцатеричном виде
+#define AESCRYPT_FILE_COMPRESS 0x2u         // сжатие открытого текста перед шифрованием
+#define AESCRYPT_FILE_HUGE_PAGES 0x4u       // рабочие буферы на огромных страницах
+#define AESCRYPT_FILE_NUMA_LOCAL 0x8u       // потоки закреплены за ядрами, части буферов на узлах NUMA своих потоков
+#define AESCRYPT_FILE_NUMA_INTERLEAVE 0x10u // потоки закреплены за ядрами, страницы буферов чередуются по узлам NUMA
+#define AESCRYPT_FILE_IN_PLACE 0x20u        // CTR: srcPath перезаписывается частями через журнал {srcPath}.journal,
+                                            // прерванный запуск продолжается тем же вызовом. dstPath не используется
+
+// развернутый ключ. Создается один раз и может одновременно использоваться из нескольких потоков
+typedef struct aescrypt_key aescrypt_key;
+
+// поток шифрования данных, поступающих частями
+typedef struct aescrypt_stream aescrypt_stream;
+
+// сообщение пакетной обработки
+typedef struct aescrypt_message
+{
+     const uint8_t* src;
+     size_t srcSize;
+     const uint8_t* iv;                 // 16 байт, для ECB может быть NULL
+     uint8_t* dst;
+     size_t dstCapacity;
+     size_t dstSize;                    // результат: размер данных в dst(или требуемый размер при AESCRYPT_ERROR_BUFFER)
+     int status;                        // результат обработки сообщения
+} aescrypt_message;
+
+typedef struct aescrypt_file_options
+{
+     uint32_t size;                     // sizeof( aescrypt_file_options ), заполняется aescrypt_file_options_init
+     aescrypt_mode mode;
+     const uint8_t* iv;                 // 16 байт, для ECB может быть NULL
+     aescrypt_checksum checksum;
+     uint32_t flags;                    // AESCRYPT_FILE_*
+     uint32_t threads;                  // 0 - по числу аппаратных потоков
+     aescrypt_format format;
+     uint32_t segments;                 // AESCRYPT_FORMAT_SEGMENTED: число сегментов, 0 - по числу аппаратных потоков
+     uint64_t segmentSize;              // AESCRYPT_FORMAT_INCREMENTAL: размер сегмента первого запуска, 0 - 4 МиБ
+} aescrypt_file_options;
+
+typedef struct aescrypt_file_result
+{
+     aescrypt_checksum checksumType;    // AESCRYPT_CHECKSUM_NONE - у файла нет контрольной суммы
+     uint64_t checksum;
+     uint64_t segments;                 // AESCRYPT_FORMAT_INCREMENTAL: число сегментов в новом шифртексте
+     uint64_t segmentsEncrypted;        // из них зашифровано заново, остальные скопированы из предыдущего шифртекста
+     aescrypt_verify_strength verifyStrength;
+     uint64_t verifiedSize;             // aescrypt_verify_file: размер проверенного файла
+     uint64_t decryptedSize;            // сколько байт шифртекста пришлось расшифровать
+     const char* evidence;              // чем подтверждена целостность. Действителен до следующего вызова в этом потоке
+} aescrypt_file_result;
+
+
+AESCRYPT_API uint32_t aescrypt_abi_version( void );
+
+// текст последней ошибки в вызывающем потоке. Действителен до следующего вызова библиотеки в этом потоке
+AESCRYPT_API const char* aescrypt_last_error( void );
+
+// загружает профиль настройки, записанный командой "crypto_2 tune", вместо профиля по умолчанию($AESCRYPT_PROFILE или
+// ~/.config/crypto_2/profile). Размер части данных применяется, только если файловые функции еще не вызывались
+AESCRYPT_API int aescrypt_load_profile( const char* path );
+
+// разворачивает ключ длиной 16, 24 или 32 байта
+AESCRYPT_API int aescrypt_key_create( const uint8_t* key, size_t keySize, aescrypt_key** result );
+
+// разворачивает count ключей длины keySize, лежащих в keys подряд, одним вызовом: ключи разворачиваются группами
+// одновременно. Результаты записываются в results[ 0, count ). При ошибке ни один ключ не создается
+AESCRYPT_API int aescrypt_key_create_batch( const uint8_t* keys, size_t keySize, size_t count, aescrypt_key** results );
+
+// затирает и освобождает ключ. Допускается NULL
+AESCRYPT_API void aescrypt_key_destroy( aescrypt_key* key );
+
+// размер шифртекста для srcSize байт открытого текста
+AESCRYPT_API size_t aescrypt_encrypted_size( aescrypt_mode mode, size_t srcSize );
+
+// шифрует/расшифровывает сообщение целиком с дополнением PKCS#7(кроме CTR). dst может совпадать с src
+AESCRYPT_API int aescrypt_encrypt( const aescrypt_key* key, aescrypt_mode mode, const uint8_t* iv, const uint8_t* src, size_t srcSize,
+                                   uint8_t* dst, size_t dstCapacity, size_t* dstSize );
+AESCRYPT_API int aescrypt_decrypt( const aescrypt_key* key, aescrypt_mode mode, const uint8_t* iv, const uint8_t* src, size_t srcSize,
+                                   uint8_t* dst, size_t dstCapacity, size_t* dstSize );
+
+// шифрует/расшифровывает size байт без дополнения(для CBC и ECB кратно 16). chain - IV для CBC или счетчик для CTR,
+// после вызова содержит значение для продолжения, что позволяет обрабатывать данные частями. Для ECB может быть NULL
+AESCRYPT_API int aescrypt_encrypt_blocks( const aescrypt_key* key, aescrypt_mode mode, uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t size );
+AESCRYPT_API int aescrypt_decrypt_blocks( const aescrypt_key* key, aescrypt_mode mode, uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t size );
+
+// обрабатывает count независимых сообщений одним вызовом. Сообщения распределяются между потоками библиотеки, если
+// их суммарный размер оправдывает это. Возвращает AESCRYPT_OK или код первого неуспешного сообщения
+AESCRYPT_API int aescrypt_encrypt_batch( const aescrypt_key* key, aescrypt_mode mode, aescrypt_message* messages, size_t count );
+AESCRYPT_API int aescrypt_decrypt_batch( const aescrypt_key* key, aescrypt_mode mode, aescrypt_message* messages, size_t count );
+
+// создает поток. key должен существовать до уничтожения потока
+AESCRYPT_API int aescrypt_stream_create( const aescrypt_key* key, aescrypt_mode mode, const uint8_t* iv, int decrypt, aescrypt_stream** result );
+
+// обрабатывает очередную часть любого размера. В dst записывается не больше srcSize + 16 байт
+AESCRYPT_API int aescrypt_stream_update( aescrypt_stream* stream, const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity, size_t* dstSize );
+
+// завершает поток: дополняет последний блок или проверяет и снимает дополнение. В dst записывается не больше 16 байт
+AESCRYPT_API int aescrypt_stream_finish( aescrypt_stream* stream, uint8_t* dst, size_t dstCapacity, size_t* dstSize );
+
+AESCRYPT_API void aescrypt_stream_destroy( aescrypt_stream* stream );
+
+// заполняет параметры значениями по умолчанию: CBC, без суммы и флагов
+AESCRYPT_API void aescrypt_file_options_init( aescrypt_file_options* options );
+
+// шифрует/расшифровывает файл в формате options->format, формат совпадает с утилитой crypto_2. result может быть NULL
+AESCRYPT_API int aescrypt_encrypt_file( const aescrypt_key* key, const char* srcPath, const char* dstPath,
+                                        const aescrypt_file_options* options, aescrypt_file_result* result );
+AESCRYPT_API int aescrypt_decrypt_file( const aescrypt_key* key, const char* srcPath, const char* dstPath,
+                                        const aescrypt_file_options* options, aescrypt_file_result* result );
+
+// проверяет зашифрованный файл без записи открытого текста: контрольные суммы(если есть), записи сжатия и дополнение
+// PKCS#7, для сегментированного и разреженного форматов - имитовставки таблицы или карты. Без суммы и сжатия
+// расшифровывается только последний блок, и неверный ключ проходит проверку дополнения примерно в одном случае из 256
+// (verifyStrength = AESCRYPT_VERIFY_PADDING). Повреждение или неверный ключ - AESCRYPT_ERROR_FAILED, шифртекст CTR без
+// суммы и сжатия - AESCRYPT_ERROR_UNVERIFIED
+AESCRYPT_API int aescrypt_verify_file( const aescrypt_key* key, const char* srcPath, const aescrypt_file_options* options,
+                                       aescrypt_file_result* result );
+
+// перешифровывает сплошной шифртекст ECB/CBC со старого ключа на новый за один проход. Из oldOptions берутся режим и IV,
+// из newOptions - режим, IV, флаги и число потоков. Концевик с суммами переносится после проверки каждой части
+// открытого текста, результат заменяет dstPath только при успехе
+AESCRYPT_API int aescrypt_reencrypt_file( const aescrypt_key* oldKey, const aescrypt_file_options* oldOptions, const aescrypt_key* newKey,
+                                          const aescrypt_file_options* newOptions, const char* srcPath, const char* dstPath,
+                                          aescrypt_file_result* result );
+
+#ifdef __cplusplus
+}
+#endif
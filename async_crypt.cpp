@@ -0,0 +1,314 @@
+/// @file
+/// @brief Асинхронное шифрование файлов и потоков данных на сопрограммах C++20
+
+#include "async_crypt.h"
+#include "file_io.h"
+
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+     AesKeyLength keyLengthFromSize( size_t size )
+     {
+          switch( size * 8 )
+          {
+               case 128:
+               {
+                    return AKL_128;
+               }
+               case 192:
+               {
+                    return AKL_192;
+               }
+               case 256:
+               {
+                    return AKL_256;
+               }
+          }
+          throw std::runtime_error( "Incorrect key length" );
+     }
+
+     void checkIv( CryptMode mode, const std::vector< unsigned char >& iv )
+     {
+          if( mode != CMEcb && iv.size() != 16 )
+          {
+               throw std::runtime_error( "iv has not valid size" );
+          }
+     }
+
+     struct Chunk
+     {
+          PoolBuffer buffer;
+          size_t size = 0;
+     };
+     using ChunkPtr = std::shared_ptr< Chunk >;
+     using FilePtr = std::shared_ptr< PosixFile >;
+}
+
+
+AsyncCryptEngine::AsyncCryptEngine( RunLoop& loop, size_t cpuThreads, size_t ioThreads, size_t maxCpuJobs, BufferPool& pool )
+:loop_( loop ), pool_( pool ), cpu_( cpuThreads ), io_( std::max< size_t >( ioThreads, 1 ) ),
+ cpuSlots_( loop, maxCpuJobs != 0 ? maxCpuJobs : 2 * cpu_.threadCount() )
+{
+}
+
+
+Task<> AsyncCryptEngine::encryptAsync( std::string srcPath, std::string dstPath, AsyncCryptParams params )
+{
+     return process( false, std::move( srcPath ), std::move( dstPath ), std::move( params ) );
+}
+
+
+Task<> AsyncCryptEngine::decryptAsync( std::string srcPath, std::string dstPath, AsyncCryptParams params )
+{
+     return process( true, std::move( srcPath ), std::move( dstPath ), std::move( params ) );
+}
+
+
+ThreadPool& AsyncCryptEngine::cpuPool()
+{
+     return cpu_;
+}
+
+
+Task<> AsyncCryptEngine::process( bool decrypt, std::string srcPath, std::string dstPath, AsyncCryptParams params )
+{
+     params.cancel.throwIfCancelled();
+     checkIv( params.mode, params.iv );
+     auto crypt = std::make_shared< AESCryptography >( keyLengthFromSize( params.key.size() ) );
+     auto roundKeys = std::make_shared< AesRoundKeys >( crypt->expandKey( params.key ) );
+
+     // последний блок шифртекста(CBC) или счетчик(CTR). Меняется только заданием шифрования, которое всегда ожидается
+     auto chain = std::make_shared< std::array< unsigned char, 16 > >();
+     std::copy( params.iv.begin(), params.iv.end(), chain->begin() );
+
+     // открытие файла может блокироваться(например, на сетевой ФС), поэтому тоже выполняется в пуле ввода-вывода.
+     // Операции создаются отдельными переменными, а не временными объектами в выражении co_await: GCC 12 может
+     // уничтожить такие временные объекты дважды
+     PoolOperation< FilePtr > openInput( loop_, io_, [ srcPath ]() { return std::make_shared< PosixFile >( PosixFile::openRead( srcPath ) ); } );
+     FilePtr inp = co_await openInput;
+     PoolOperation< FilePtr > openOutput( loop_, io_, [ dstPath ]() { return std::make_shared< PosixFile >( PosixFile::create( dstPath ) ); } );
+     FilePtr out = co_await openOutput;
+
+     // части кратны блоку, у последней части при шифровании остается место под дополнение
+     const uint64_t inputSize = inp->size();
+     const size_t chunkSize = pool_.blockSize() - 16;
+     const size_t chunkCount = inputSize == 0 ? 1 : ( inputSize + chunkSize - 1 ) / chunkSize;
+     const size_t depth = std::max< size_t >( params.pipelineDepth, 1 );
+     const CryptMode mode = params.mode;
+
+     std::deque< PoolOperation< ChunkPtr > > reads;
+     std::deque< PoolOperation< bool > > writes;
+     size_t nextRead = 0;
+     auto startReads = [ & ]()
+     {
+          for( ; nextRead < chunkCount && reads.size() < depth; nextRead++ )
+          {
+               const uint64_t offset = nextRead * chunkSize;
+               const size_t expected = static_cast< size_t >( std::min< uint64_t >( chunkSize, inputSize - offset ) );
+               BufferPool* pool = &pool_;
+               reads.emplace_back( loop_, io_, [ inp, pool, offset, expected ]()
+               {
+                    auto chunk = std::make_shared< Chunk >();
+                    chunk->buffer = pool->acquire();
+                    chunk->buffer.markSensitive( expected );
+                    chunk->size = inp->readAt( chunk->buffer.data(), expected, offset );
+                    if( chunk->size != expected )
+                    {
+                         throw std::runtime_error( "Input file changed during encryption" );
+                    }
+                    return chunk;
+               } );
+          }
+     };
+
+     std::exception_ptr error;
+     try
+     {
+          uint64_t outOffset = 0;
+          for( size_t idx = 0; idx < chunkCount; idx++ )
+          {
+               params.cancel.throwIfCancelled();
+
+               // чтение следующих частей идет, пока текущая шифруется
+               startReads();
+               ChunkPtr chunk = co_await reads.front();
+               reads.pop_front();
+               startReads();
+
+               const bool last = idx + 1 == chunkCount;
+               if( decrypt && mode != CMCtr && chunk->size % 16 != 0 )
+               {
+                    throw std::runtime_error( "data is not aligned" );
+               }
+               if( params.progress != nullptr )
+               {
+                    params.progress->fetch_add( chunk->size, std::memory_order_relaxed );
+               }
+
+               ThreadPool* workers = &cpu_;
+               std::function< ChunkPtr() > work = [ crypt, roundKeys, chain, chunk, workers, decrypt, last, mode ]()
+               {
+                    if( decrypt )
+                    {
+                         FileEncryptor::decryptBlocksParallel( *crypt, *roundKeys, mode, chunk->buffer.data(), chunk->size, chain->data(), *workers );
+                         if( last && mode != CMCtr )
+                         {
+                              chunk->size = FileEncryptor::removePadding( chunk->buffer.data(), chunk->size );
+                         }
+                    }
+                    else
+                    {
+                         if( last && mode != CMCtr )
+                         {
+                              chunk->size = FileEncryptor::addPadding( chunk->buffer.data(), chunk->size );
+                         }
+                         FileEncryptor::cryptBlocksParallel( *crypt, *roundKeys, mode, chunk->buffer.data(), chunk->size, chain->data(), *workers );
+                    }
+                    return chunk;
+               };
+               Task< ChunkPtr > cryptChunk = offload( std::move( work ) );
+               chunk = co_await std::move( cryptChunk );
+
+               // обратное давление: новая часть не читается, пока в очереди записи depth частей
+               while( writes.size() >= depth )
+               {
+                    co_await writes.front();
+                    writes.pop_front();
+               }
+               const uint64_t offset = outOffset;
+               outOffset += chunk->size;
+               writes.emplace_back( loop_, io_, [ out, chunk, offset ]()
+               {
+                    out->writeAt( chunk->buffer.data(), chunk->size, offset );
+                    return true;
+               } );
+          }
+
+          while( !writes.empty() )
+          {
+               co_await writes.front();
+               writes.pop_front();
+          }
+     }
+     catch( ... )
+     {
+          error = std::current_exception();
+     }
+
+     if( error )
+     {
+          // дожидаемся начатых операций, чтобы они не писали в файл после его удаления
+          for( PoolOperation< ChunkPtr >& read: reads )
+          {
+               try
+               {
+                    co_await read;
+               }
+               catch( ... )
+               {
+               }
+          }
+          for( PoolOperation< bool >& write: writes )
+          {
+               try
+               {
+                    co_await write;
+               }
+               catch( ... )
+               {
+               }
+          }
+          unlink( dstPath.c_str() );
+          std::rethrow_exception( error );
+     }
+}
+
+
+AsyncCryptStream::AsyncCryptStream( AsyncCryptEngine& engine, bool decrypt, const std::vector< unsigned char >& key, CryptMode mode,
+                                    const std::vector< unsigned char >& iv, CancellationToken cancel )
+:engine_( engine ), decrypt_( decrypt ), mode_( mode ), cancel_( cancel ), state_( std::make_shared< State >() )
+{
+     checkIv( mode, iv );
+     state_->crypt.reset( new AESCryptography( keyLengthFromSize( key.size() ) ) );
+     state_->roundKeys = state_->crypt->expandKey( key );
+     std::copy( iv.begin(), iv.end(), state_->chain.begin() );
+}
+
+
+Task< std::vector< unsigned char > > AsyncCryptStream::update( std::vector< unsigned char > data )
+{
+     return process( std::move( data ), false );
+}
+
+
+Task< std::vector< unsigned char > > AsyncCryptStream::finish()
+{
+     return process( {}, true );
+}
+
+
+Task< std::vector< unsigned char > > AsyncCryptStream::process( std::vector< unsigned char > data, bool final )
+{
+     if( finished_ )
+     {
+          throw std::runtime_error( "Stream already finished" );
+     }
+     cancel_.throwIfCancelled();
+     finished_ = final;
+
+     std::vector< unsigned char >& pending = state_->pending;
+     pending.insert( pending.end(), data.begin(), data.end() );
+
+     // обрабатываются только целые блоки. При расшифровании с дополнением последний блок ждет finish
+     const bool padded = mode_ != CMCtr;
+     size_t take = pending.size() / 16 * 16;
+     if( final )
+     {
+          take = pending.size();
+          if( decrypt_ && padded && take != 16 )
+          {
+               throw std::runtime_error( "Input data corrupted" );
+          }
+     }
+     else if( decrypt_ && padded && take == pending.size() && take != 0 )
+     {
+          take -= 16;
+     }
+
+     auto work = std::make_shared< std::vector< unsigned char > >( pending.begin(), pending.begin() + take );
+     pending.erase( pending.begin(), pending.begin() + take );
+
+     std::shared_ptr< State > state = state_;
+     ThreadPool* workers = &engine_.cpuPool();
+     const bool decrypt = decrypt_;
+     const CryptMode mode = mode_;
+     std::function< std::vector< unsigned char >() > job = [ state, work, workers, decrypt, final, padded, mode ]()
+     {
+          std::vector< unsigned char >& data = *work;
+          if( decrypt )
+          {
+               FileEncryptor::decryptBlocksParallel( *state->crypt, state->roundKeys, mode, data.data(), data.size(), state->chain.data(), *workers );
+               if( final && padded )
+               {
+                    data.resize( FileEncryptor::removePadding( data.data(), data.size() ) );
+               }
+          }
+          else
+          {
+               if( final && padded )
+               {
+                    size_t size = data.size();
+                    data.resize( size + 16 );
+                    data.resize( FileEncryptor::addPadding( data.data(), size ) );
+               }
+               FileEncryptor::cryptBlocksParallel( *state->crypt, state->roundKeys, mode, data.data(), data.size(), state->chain.data(), *workers );
+          }
+          return std::move( data );
+     };
+     Task< std::vector< unsigned char > > result = engine_.offload( std::move( job ) );
+     co_return co_await std::move( result );
+}
@@ -0,0 +1,114 @@
+/// @file
+/// @brief Асинхронное шифрование файлов и потоков данных на сопрограммах C++20
+#pragma once
+
+#include "async_task.h"
+#include "buffer_pool.h"
+#include "file_crypt.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+struct AsyncCryptParams
+{
+     std::vector< unsigned char > key;
+     CryptMode mode = CMCbc;
+     std::vector< unsigned char > iv;
+
+     // число частей, читаемых заранее, и частей, ожидающих записи. При заполнении очереди записи операция
+     // приостанавливается, поэтому медленный диск не приводит к накоплению данных в памяти
+     size_t pipelineDepth = 2;
+
+     CancellationToken cancel;
+     std::atomic< uint64_t >* progress = nullptr;      // счетчик обработанных байтов исходного файла
+};
+
+
+// Движок асинхронного шифрования. Сопрограммы выполняются в цикле loop, вычисления выгружаются в ограниченный
+// пул потоков, а чтение и запись файлов - в отдельный пул ввода-вывода, поэтому ни один поток цикла не блокируется
+// и одновременно могут выполняться операции над многими файлами. Формат результата совпадает с FileEncryptor::cryptFile
+class AsyncCryptEngine
+{
+public:
+     // cpuThreads == 0 - по числу аппаратных потоков. maxCpuJobs ограничивает число частей, одновременно находящихся
+     // в пуле вычислений по всем операциям движка(0 - удвоенное число потоков): остальные операции ждут в цикле
+     AsyncCryptEngine( RunLoop& loop, size_t cpuThreads = 0, size_t ioThreads = 2, size_t maxCpuJobs = 0,
+                       BufferPool& pool = BufferPool::defaultPool() );
+
+     // параметры передаются по значению: задача ленивая и выполняется после возврата из вызова.
+     // При ошибке или отмене частично записанный результат удаляется
+     Task<> encryptAsync( std::string srcPath, std::string dstPath, AsyncCryptParams params );
+     Task<> decryptAsync( std::string srcPath, std::string dstPath, AsyncCryptParams params );
+
+     // выполняет work в пуле вычислений и возвращает результат в цикл. Work должна владеть своими данными
+     template< typename T >
+     Task< T > offload( std::function< T() > work )
+     {
+          co_await cpuSlots_.acquire();
+          PoolOperation< T > operation( loop_, cpu_, std::move( work ) );
+          try
+          {
+               T result = co_await operation;
+               cpuSlots_.release();
+               co_return result;
+          }
+          catch( ... )
+          {
+               cpuSlots_.release();
+               throw;
+          }
+     }
+
+     ThreadPool& cpuPool();
+
+private:
+     Task<> process( bool decrypt, std::string srcPath, std::string dstPath, AsyncCryptParams params );
+
+private:
+     RunLoop& loop_;
+     BufferPool& pool_;
+     ThreadPool cpu_;
+     ThreadPool io_;
+     AsyncSemaphore cpuSlots_;
+};
+
+
+// Шифрование потока данных, поступающего частями(например, из сети). Части могут иметь любой размер:
+// неполный блок(а при расшифровании - последний блок с дополнением) накапливается до следующего вызова.
+// Вызовы update/finish одного потока не должны перекрываться
+class AsyncCryptStream
+{
+public:
+     AsyncCryptStream( AsyncCryptEngine& engine, bool decrypt, const std::vector< unsigned char >& key, CryptMode mode,
+                       const std::vector< unsigned char >& iv = {}, CancellationToken cancel = CancellationToken() );
+
+     // обрабатывает очередную часть и возвращает готовый результат
+     Task< std::vector< unsigned char > > update( std::vector< unsigned char > data );
+
+     // завершает поток: дополняет последний блок при шифровании, проверяет и удаляет дополнение при расшифровании
+     Task< std::vector< unsigned char > > finish();
+
+private:
+     struct State
+     {
+          std::unique_ptr< AESCryptography > crypt;
+          AesRoundKeys roundKeys;
+          std::array< unsigned char, 16 > chain{};
+          std::vector< unsigned char > pending;          // байты, еще не переданные в шифрование
+     };
+
+     Task< std::vector< unsigned char > > process( std::vector< unsigned char > data, bool final );
+
+private:
+     AsyncCryptEngine& engine_;
+     const bool decrypt_;
+     const CryptMode mode_;
+     CancellationToken cancel_;
+     std::shared_ptr< State > state_;
+     bool finished_ = false;
+};
@@ -0,0 +1,127 @@
+/// @file
+/// @brief Сопрограммы C++20 для асинхронного шифрования: задача, цикл выполнения, семафор и отмена
+
+#include "async_task.h"
+
+
+OperationCancelled::OperationCancelled()
+:std::runtime_error( "Operation cancelled" )
+{
+}
+
+
+CancellationToken::CancellationToken()
+:flag_( std::make_shared< std::atomic< bool > >( false ) )
+{
+}
+
+
+void CancellationToken::cancel()
+{
+     flag_->store( true );
+}
+
+
+bool CancellationToken::cancelled() const
+{
+     return flag_->load();
+}
+
+
+void CancellationToken::throwIfCancelled() const
+{
+     if( cancelled() )
+     {
+          throw OperationCancelled();
+     }
+}
+
+
+void RunLoop::post( std::coroutine_handle<> handle )
+{
+     {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          ready_.push_back( handle );
+     }
+     wake_.notify_one();
+}
+
+
+void RunLoop::run()
+{
+     std::unique_lock< std::mutex > lock( mutex_ );
+     while( true )
+     {
+          wake_.wait( lock, [ this ]() { return !ready_.empty() || running_ == 0; } );
+          if( ready_.empty() )
+          {
+               return;
+          }
+          std::coroutine_handle<> handle = ready_.front();
+          ready_.pop_front();
+          lock.unlock();
+          handle.resume();
+          lock.lock();
+     }
+}
+
+
+void RunLoop::taskStarted()
+{
+     std::lock_guard< std::mutex > lock( mutex_ );
+     running_++;
+}
+
+
+void RunLoop::taskFinished()
+{
+     {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          running_--;
+     }
+     wake_.notify_all();
+}
+
+
+void SpawnedTask::spawn( RunLoop& loop, Task<> task, std::function< void( std::exception_ptr ) > onDone )
+{
+     loop.taskStarted();
+     run( loop, std::move( task ), std::move( onDone ) );
+}
+
+
+SpawnedTask SpawnedTask::run( RunLoop& loop, Task<> task, std::function< void( std::exception_ptr ) > onDone )
+{
+     // задача начинает выполняться уже в потоке цикла
+     co_await loop.schedule();
+     std::exception_ptr error;
+     try
+     {
+          co_await std::move( task );
+     }
+     catch( ... )
+     {
+          error = std::current_exception();
+     }
+     onDone( error );
+     loop.taskFinished();
+}
+
+
+AsyncSemaphore::AsyncSemaphore( RunLoop& loop, size_t count )
+:loop_( loop ), count_( count )
+{
+}
+
+
+void AsyncSemaphore::release()
+{
+     if( waiters_.empty() )
+     {
+          count_++;
+          return;
+     }
+     std::coroutine_handle<> waiter = waiters_.front();
+     waiters_.pop_front();
+     loop_.post( waiter );
+}
@@ -0,0 +1,344 @@
+/// @file
+/// @brief Сопрограммы C++20 для асинхронного шифрования: задача, цикл выполнения, семафор и отмена
+#pragma once
+
+#include "thread_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+
+// исключение, которым завершается операция после запроса отмены
+class OperationCancelled : public std::runtime_error
+{
+public:
+     OperationCancelled();
+};
+
+
+// флаг отмены, разделяемый между копиями. Отмена кооперативная: операция проверяет флаг между частями данных
+class CancellationToken
+{
+public:
+     CancellationToken();
+
+     void cancel();
+     bool cancelled() const;
+
+     // бросает OperationCancelled, если отмена запрошена
+     void throwIfCancelled() const;
+
+private:
+     std::shared_ptr< std::atomic< bool > > flag_;
+};
+
+
+// Минимальный однопоточный исполнитель: все сопрограммы выполняются в потоке, вызвавшем run(), а завершение
+// работы в пулах потоков возвращает их в этот поток через post(). Пригоден для тестов и как образец
+// интеграции с циклом событий сервиса
+class RunLoop
+{
+public:
+     RunLoop() = default;
+     RunLoop( const RunLoop& ) = delete;
+     RunLoop& operator=( const RunLoop& ) = delete;
+
+     // ставит сопрограмму в очередь на продолжение. Может вызываться из любого потока
+     void post( std::coroutine_handle<> handle );
+
+     // выполняет очередь, пока не завершатся все запущенные через spawn задачи
+     void run();
+
+     // ожидание, продолжающее сопрограмму в потоке цикла
+     auto schedule()
+     {
+          struct Awaiter
+          {
+               RunLoop& loop;
+               bool await_ready() const noexcept { return false; }
+               void await_suspend( std::coroutine_handle<> handle ) { loop.post( handle ); }
+               void await_resume() const noexcept {}
+          };
+          return Awaiter{ *this };
+     }
+
+private:
+     friend struct SpawnedTask;
+
+     void taskStarted();
+     void taskFinished();
+
+private:
+     std::mutex mutex_;
+     std::condition_variable wake_;
+     std::deque< std::coroutine_handle<> > ready_;
+     size_t running_ = 0;
+};
+
+
+namespace async_detail
+{
+     template< typename T >
+     struct Result
+     {
+          std::optional< T > value;
+          std::exception_ptr error;
+
+          template< typename U >
+          void return_value( U&& result ) { value.emplace( std::forward< U >( result ) ); }
+          T take()
+          {
+               if( error )
+               {
+                    std::rethrow_exception( error );
+               }
+               return std::move( *value );
+          }
+     };
+
+     template<>
+     struct Result< void >
+     {
+          std::exception_ptr error;
+
+          void return_void() {}
+          void take()
+          {
+               if( error )
+               {
+                    std::rethrow_exception( error );
+               }
+          }
+     };
+}
+
+
+// Ленивая задача: начинает выполняться при co_await и по завершении сразу продолжает ожидающую сопрограмму
+template< typename T = void >
+class Task
+{
+public:
+     struct promise_type : async_detail::Result< T >
+     {
+          std::coroutine_handle<> continuation = std::noop_coroutine();
+
+          Task get_return_object() { return Task( std::coroutine_handle< promise_type >::from_promise( *this ) ); }
+          std::suspend_always initial_suspend() noexcept { return {}; }
+          auto final_suspend() noexcept
+          {
+               struct FinalAwaiter
+               {
+                    bool await_ready() const noexcept { return false; }
+                    std::coroutine_handle<> await_suspend( std::coroutine_handle< promise_type > handle ) noexcept
+                    {
+                         return handle.promise().continuation;
+                    }
+                    void await_resume() const noexcept {}
+               };
+               return FinalAwaiter{};
+          }
+          void unhandled_exception() { this->error = std::current_exception(); }
+     };
+
+     Task( Task&& rhs ) noexcept : handle_( std::exchange( rhs.handle_, nullptr ) ) {}
+     Task& operator=( Task&& rhs ) noexcept
+     {
+          if( this != &rhs )
+          {
+               reset();
+               handle_ = std::exchange( rhs.handle_, nullptr );
+          }
+          return *this;
+     }
+     ~Task() { reset(); }
+
+     auto operator co_await() && noexcept
+     {
+          struct Awaiter
+          {
+               std::coroutine_handle< promise_type > handle;
+               bool await_ready() const noexcept { return false; }
+               std::coroutine_handle<> await_suspend( std::coroutine_handle<> continuation ) noexcept
+               {
+                    handle.promise().continuation = continuation;
+                    return handle;
+               }
+               T await_resume() { return handle.promise().take(); }
+          };
+          return Awaiter{ handle_ };
+     }
+
+private:
+     explicit Task( std::coroutine_handle< promise_type > handle ) : handle_( handle ) {}
+
+     void reset()
+     {
+          if( handle_ )
+          {
+               handle_.destroy();
+               handle_ = nullptr;
+          }
+     }
+
+private:
+     std::coroutine_handle< promise_type > handle_;
+};
+
+
+// задача, запущенная в цикле без ожидания результата. Сама уничтожается по завершении
+struct SpawnedTask
+{
+     struct promise_type
+     {
+          SpawnedTask get_return_object() { return {}; }
+          std::suspend_never initial_suspend() noexcept { return {}; }
+          std::suspend_never final_suspend() noexcept { return {}; }
+          void return_void() {}
+          void unhandled_exception() { std::terminate(); }
+     };
+
+     // запускает task в потоке цикла. onDone получает исключение задачи(или nullptr) и не должен бросать исключений
+     static void spawn( RunLoop& loop, Task<> task, std::function< void( std::exception_ptr ) > onDone );
+
+private:
+     static SpawnedTask run( RunLoop& loop, Task<> task, std::function< void( std::exception_ptr ) > onDone );
+};
+
+
+// запускает задачу в цикле и выполняет цикл до ее завершения(и завершения других запущенных задач)
+template< typename T >
+T syncWait( RunLoop& loop, Task< T > task )
+{
+     async_detail::Result< T > result;
+     auto wrapper = [ & ]( Task< T > inner ) -> Task<>
+     {
+          if constexpr( std::is_void_v< T > )
+          {
+               co_await std::move( inner );
+          }
+          else
+          {
+               result.return_value( co_await std::move( inner ) );
+          }
+     };
+     SpawnedTask::spawn( loop, wrapper( std::move( task ) ), [ & ]( std::exception_ptr error ) { result.error = error; } );
+     loop.run();
+     return result.take();
+}
+
+
+// Выполняемая в пуле потоков операция, которая запускается сразу при создании, а ожидается позже: так чтение
+// следующей части перекрывается с шифрованием текущей. Функция должна владеть всеми используемыми данными,
+// потому что может завершиться после уничтожения ожидающей сопрограммы
+template< typename T >
+class PoolOperation
+{
+     static_assert( !std::is_void_v< T >, "operation must return a value" );
+
+public:
+     PoolOperation( RunLoop& loop, ThreadPool& pool, std::function< T() > work )
+     :state_( std::make_shared< State >() )
+     {
+          std::shared_ptr< State > state = state_;
+          state->loop = &loop;
+          pool.submit( [ state, work ]()
+          {
+               try
+               {
+                    state->result.return_value( work() );
+               }
+               catch( ... )
+               {
+                    state->result.error = std::current_exception();
+               }
+               std::coroutine_handle<> waiter;
+               {
+                    std::lock_guard< std::mutex > lock( state->mutex );
+                    state->done = true;
+                    waiter = state->waiter;
+               }
+               if( waiter )
+               {
+                    state->loop->post( waiter );
+               }
+          } );
+     }
+
+     bool await_ready() const
+     {
+          std::lock_guard< std::mutex > lock( state_->mutex );
+          return state_->done;
+     }
+
+     bool await_suspend( std::coroutine_handle<> handle )
+     {
+          std::lock_guard< std::mutex > lock( state_->mutex );
+          if( state_->done )
+          {
+               return false;
+          }
+          state_->waiter = handle;
+          return true;
+     }
+
+     T await_resume() { return state_->result.take(); }
+
+private:
+     struct State
+     {
+          std::mutex mutex;
+          bool done = false;
+          std::coroutine_handle<> waiter;
+          RunLoop* loop = nullptr;
+          async_detail::Result< T > result;
+     };
+
+     std::shared_ptr< State > state_;
+};
+
+
+// Семафор для сопрограмм одного цикла: ограничивает число одновременно занятых ресурсов(например, частей
+// в пуле вычислений). Сопрограмма, не получившая разрешения, приостанавливается - так возникает обратное давление
+class AsyncSemaphore
+{
+public:
+     AsyncSemaphore( RunLoop& loop, size_t count );
+
+     auto acquire()
+     {
+          struct Awaiter
+          {
+               AsyncSemaphore& semaphore;
+               bool await_ready() const noexcept
+               {
+                    if( semaphore.count_ == 0 )
+                    {
+                         return false;
+                    }
+                    semaphore.count_--;
+                    return true;
+               }
+               void await_suspend( std::coroutine_handle<> handle ) { semaphore.waiters_.push_back( handle ); }
+               void await_resume() const noexcept {}
+          };
+          return Awaiter{ *this };
+     }
+
+     // возвращает разрешение: его сразу получает первая ожидающая сопрограмма
+     void release();
+
+private:
+     RunLoop& loop_;
+     size_t count_;
+     std::deque< std::coroutine_handle<> > waiters_;
+};
@@ -0,0 +1,66 @@
+/// @file
+/// @brief Очередь ограниченного размера для передачи данных между стадиями обработки
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+
+// push блокируется, пока очередь заполнена, pop - пока она пуста. После close новые элементы не принимаются,
+// а pop возвращает оставшиеся элементы и затем false
+template< typename T >
+class BoundedQueue
+{
+public:
+     explicit BoundedQueue( size_t capacity )
+     :capacity_( capacity )
+     {
+     }
+
+     // возвращает false, если очередь закрыта
+     bool push( T&& item )
+     {
+          std::unique_lock< std::mutex > lock( mutex_ );
+          notFull_.wait( lock, [ this ]() { return closed_ || items_.size() < capacity_; } );
+          if( closed_ )
+          {
+               return false;
+          }
+          items_.push_back( std::move( item ) );
+          notEmpty_.notify_one();
+          return true;
+     }
+
+     // возвращает false, если очередь закрыта и пуста
+     bool pop( T& item )
+     {
+          std::unique_lock< std::mutex > lock( mutex_ );
+          notEmpty_.wait( lock, [ this ]() { return closed_ || !items_.empty(); } );
+          if( items_.empty() )
+          {
+               return false;
+          }
+          item = std::move( items_.front() );
+          items_.pop_front();
+          notFull_.notify_one();
+          return true;
+     }
+
+     void close()
+     {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          closed_ = true;
+          notFull_.notify_all();
+          notEmpty_.notify_all();
+     }
+
+private:
+     const size_t capacity_;
+     std::deque< T > items_;
+     std::mutex mutex_;
+     std::condition_variable notFull_;
+     std::condition_variable notEmpty_;
+     bool closed_ = false;
+};
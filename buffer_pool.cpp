@@ -0,0 +1,188 @@
+/// @file
+/// @brief Пул переиспользуемых буферов, выровненных по границе страницы
+
+#include "buffer_pool.h"
+#include "tuning_profile.h"
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+     const size_t hugePageSize = 2 << 20;
+
+     size_t roundUp( size_t value, size_t alignment )
+     {
+          return ( value + alignment - 1 ) / alignment * alignment;
+     }
+}
+
+
+PoolBuffer::PoolBuffer( BufferPool* pool, unsigned char* data, size_t size )
+:pool_( pool ), data_( data ), size_( size )
+{
+}
+
+
+PoolBuffer::PoolBuffer( PoolBuffer&& rhs ) noexcept
+{
+     *this = std::move( rhs );
+}
+
+
+PoolBuffer& PoolBuffer::operator=( PoolBuffer&& rhs ) noexcept
+{
+     if( this != &rhs )
+     {
+          release();
+          pool_ = rhs.pool_;
+          data_ = rhs.data_;
+          size_ = rhs.size_;
+          sensitive_ = rhs.sensitive_;
+          rhs.pool_ = nullptr;
+          rhs.data_ = nullptr;
+          rhs.size_ = 0;
+          rhs.sensitive_ = 0;
+     }
+     return *this;
+}
+
+
+PoolBuffer::~PoolBuffer()
+{
+     release();
+}
+
+
+unsigned char* PoolBuffer::data() const
+{
+     return data_;
+}
+
+
+size_t PoolBuffer::size() const
+{
+     return size_;
+}
+
+
+void PoolBuffer::markSensitive( size_t size )
+{
+     sensitive_ = std::max( sensitive_, std::min( size, size_ ) );
+}
+
+
+void PoolBuffer::release()
+{
+     if( pool_ != nullptr )
+     {
+          pool_->release( data_, sensitive_ );
+     }
+     pool_ = nullptr;
+     data_ = nullptr;
+     size_ = 0;
+     sensitive_ = 0;
+}
+
+
+BufferPool::BufferPool( size_t blockSize, bool hugePages, size_t maxCached )
+:blockSize_( roundUp( blockSize, hugePages ? hugePageSize : static_cast< size_t >( sysconf( _SC_PAGESIZE ) ) ) ),
+ hugePages_( hugePages ), maxCached_( maxCached )
+{
+}
+
+
+BufferPool::~BufferPool()
+{
+     for( unsigned char* block: freeBlocks_ )
+     {
+          freeBlock( block );
+     }
+}
+
+
+PoolBuffer BufferPool::acquire()
+{
+     {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          if( !freeBlocks_.empty() )
+          {
+               unsigned char* block = freeBlocks_.back();
+               freeBlocks_.pop_back();
+               return PoolBuffer( this, block, blockSize_ );
+          }
+     }
+     return PoolBuffer( this, allocateBlock(), blockSize_ );
+}
+
+
+size_t BufferPool::blockSize() const
+{
+     return blockSize_;
+}
+
+
+BufferPool& BufferPool::defaultPool()
+{
+     // размер блока берется из профиля настройки(crypto_2 tune), если он есть
+     static BufferPool pool( TuningProfile::active().chunkSize );
+     return pool;
+}
+
+
+void BufferPool::release( unsigned char* data, size_t wipeSize )
+{
+     // блок стирается до того, как станет доступен другим потокам. explicit_bzero не удаляется компилятором
+     // как запись в память, которая больше не читается
+     if( wipeSize != 0 )
+     {
+          explicit_bzero( data, wipeSize );
+     }
+     {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          if( freeBlocks_.size() < maxCached_ )
+          {
+               freeBlocks_.push_back( data );
+               return;
+          }
+     }
+     freeBlock( data );
+}
+
+
+unsigned char* BufferPool::allocateBlock()
+{
+     void* block = MAP_FAILED;
+#ifdef MAP_HUGETLB
+     // сначала пробуем явно выделенные огромные страницы. Если они не настроены в системе - обычные страницы с подсказкой ядру
+     if( hugePages_ )
+     {
+          block = mmap( nullptr, blockSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+     }
+#endif
+     if( block == MAP_FAILED )
+     {
+          block = mmap( nullptr, blockSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+          if( block == MAP_FAILED )
+          {
+               throw std::bad_alloc();
+          }
+#ifdef MADV_HUGEPAGE
+          if( hugePages_ )
+          {
+               madvise( block, blockSize_, MADV_HUGEPAGE );
+          }
+#endif
+     }
+     return static_cast< unsigned char* >( block );
+}
+
+
+void BufferPool::freeBlock( unsigned char* data )
+{
+     munmap( data, blockSize_ );
+}
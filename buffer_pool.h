@@ -0,0 +1,80 @@
+/// @file
+/// @brief Пул переиспользуемых буферов, выровненных по границе страницы
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+class BufferPool;
+
+
+// буфер, выданный пулом. При уничтожении возвращается в пул, а не освобождается. Блок, возвращенный в пул,
+// достается следующему файлу или задаче, поэтому часть, отмеченная markSensitive, перед этим стирается
+class PoolBuffer
+{
+public:
+     PoolBuffer() = default;
+     PoolBuffer( PoolBuffer&& rhs ) noexcept;
+     PoolBuffer& operator=( PoolBuffer&& rhs ) noexcept;
+     PoolBuffer( const PoolBuffer& ) = delete;
+     PoolBuffer& operator=( const PoolBuffer& ) = delete;
+     ~PoolBuffer();
+
+     unsigned char* data() const;
+     size_t size() const;
+
+     // отмечает, что первые size байт блока содержат открытый текст: они стираются при возврате блока в пул
+     void markSensitive( size_t size );
+
+private:
+     friend class BufferPool;
+     PoolBuffer( BufferPool* pool, unsigned char* data, size_t size );
+     void release();
+
+private:
+     BufferPool* pool_ = nullptr;
+     unsigned char* data_ = nullptr;
+     size_t size_ = 0;
+     size_t sensitive_ = 0;
+};
+
+
+class BufferPool
+{
+public:
+     // blockSize округляется вверх до размера страницы(или огромной страницы при hugePages).
+     // maxCached - сколько свободных блоков пул держит у себя, остальные возвращаются системе
+     explicit BufferPool( size_t blockSize, bool hugePages = false, size_t maxCached = 16 );
+     ~BufferPool();
+
+     BufferPool( const BufferPool& ) = delete;
+     BufferPool& operator=( const BufferPool& ) = delete;
+
+     // выдает блок размером blockSize(). Сначала используются ранее возвращенные блоки
+     PoolBuffer acquire();
+
+     size_t blockSize() const;
+
+     // пул процесса, используемый по умолчанию. Позволяет переиспользовать буферы между файлами в пакетных запусках
+     static BufferPool& defaultPool();
+
+     // размер блока пула процесса по умолчанию
+     static const size_t defaultBlockSize = 1 << 20;
+
+private:
+     friend class PoolBuffer;
+     // перед возвратом блока стираются его первые wipeSize байт
+     void release( unsigned char* data, size_t wipeSize );
+
+     unsigned char* allocateBlock();
+     void freeBlock( unsigned char* data );
+
+private:
+     size_t blockSize_;
+     bool hugePages_;
+     size_t maxCached_;
+
+     std::mutex mutex_;
+     std::vector< unsigned char* > freeBlocks_;
+};
@@ -0,0 +1,420 @@
+/// @file
+/// @brief Быстрые некриптографические контрольные суммы открытого текста
+
+#include "checksum.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#if ( defined( __x86_64__ ) || defined( __i386__ ) ) && defined( __GNUC__ )
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+     const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+     const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+     const uint64_t prime3 = 0x165667B19E3779F9ULL;
+     const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+     const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+     uint64_t rotl( uint64_t value, int shift )
+     {
+          return ( value << shift ) | ( value >> ( 64 - shift ) );
+     }
+
+     // чтение little-endian независимо от выравнивания
+     uint64_t read64( const unsigned char* src )
+     {
+          uint64_t value;
+          memcpy( &value, src, 8 );
+          return value;
+     }
+
+     uint32_t read32( const unsigned char* src )
+     {
+          uint32_t value;
+          memcpy( &value, src, 4 );
+          return value;
+     }
+
+     uint64_t round( uint64_t accumulator, uint64_t input )
+     {
+          accumulator += input * prime2;
+          return rotl( accumulator, 31 ) * prime1;
+     }
+
+     uint64_t mergeRound( uint64_t hash, uint64_t accumulator )
+     {
+          hash ^= round( 0, accumulator );
+          return hash * prime1 + prime4;
+     }
+
+     // таблица CRC32C для отраженного полинома 0x82F63B78
+     constexpr std::array< uint32_t, 256 > makeCrcTable()
+     {
+          std::array< uint32_t, 256 > result{};
+          for( uint32_t idx = 0; idx < 256; idx++ )
+          {
+               uint32_t crc = idx;
+               for( int bit = 0; bit < 8; bit++ )
+               {
+                    crc = ( crc >> 1 ) ^ ( ( crc & 1 ) != 0 ? 0x82F63B78u : 0 );
+               }
+               result[ idx ] = crc;
+          }
+          return result;
+     }
+
+     constexpr std::array< uint32_t, 256 > crcTable = makeCrcTable();
+
+     const char trailerMagic[ 8 ] = { 'A', 'E', 'S', 'S', 'U', 'M', '0', '1' };
+
+     void putUint64( unsigned char* dst, uint64_t value )
+     {
+          for( int idx = 0; idx < 8; idx++ )
+          {
+               dst[ idx ] = static_cast< unsigned char >( value >> ( 8 * idx ) );
+          }
+     }
+
+     uint64_t getUint64( const unsigned char* src )
+     {
+          uint64_t value = 0;
+          for( int idx = 7; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | src[ idx ];
+          }
+          return value;
+     }
+}
+
+
+Xxh64::Xxh64( uint64_t seed )
+:seed_( seed )
+{
+     accumulators_[ 0 ] = seed + prime1 + prime2;
+     accumulators_[ 1 ] = seed + prime2;
+     accumulators_[ 2 ] = seed;
+     accumulators_[ 3 ] = seed - prime1;
+}
+
+
+void Xxh64::update( const unsigned char* data, size_t size )
+{
+     totalSize_ += size;
+
+     // дополняем накопленный неполный блок из 32 байт
+     if( buffered_ != 0 )
+     {
+          size_t count = 32 - buffered_ < size ? 32 - buffered_ : size;
+          memcpy( buffer_ + buffered_, data, count );
+          buffered_ += count;
+          data += count;
+          size -= count;
+          if( buffered_ < 32 )
+          {
+               return;
+          }
+          for( int lane = 0; lane < 4; lane++ )
+          {
+               accumulators_[ lane ] = round( accumulators_[ lane ], read64( buffer_ + 8 * lane ) );
+          }
+          buffered_ = 0;
+     }
+
+     // основной цикл: четыре независимые полосы по 8 байт
+     uint64_t v1 = accumulators_[ 0 ], v2 = accumulators_[ 1 ], v3 = accumulators_[ 2 ], v4 = accumulators_[ 3 ];
+     for( ; size >= 32; data += 32, size -= 32 )
+     {
+          v1 = round( v1, read64( data ) );
+          v2 = round( v2, read64( data + 8 ) );
+          v3 = round( v3, read64( data + 16 ) );
+          v4 = round( v4, read64( data + 24 ) );
+     }
+     accumulators_[ 0 ] = v1;
+     accumulators_[ 1 ] = v2;
+     accumulators_[ 2 ] = v3;
+     accumulators_[ 3 ] = v4;
+
+     memcpy( buffer_, data, size );
+     buffered_ = size;
+}
+
+
+uint64_t Xxh64::digest() const
+{
+     uint64_t hash;
+     if( totalSize_ >= 32 )
+     {
+          hash = rotl( accumulators_[ 0 ], 1 ) + rotl( accumulators_[ 1 ], 7 ) + rotl( accumulators_[ 2 ], 12 ) + rotl( accumulators_[ 3 ], 18 );
+          for( int lane = 0; lane < 4; lane++ )
+          {
+               hash = mergeRound( hash, accumulators_[ lane ] );
+          }
+     }
+     else
+     {
+          hash = seed_ + prime5;
+     }
+     hash += totalSize_;
+
+     // хвост длиной меньше 32 байт
+     const unsigned char* tail = buffer_;
+     size_t size = buffered_;
+     for( ; size >= 8; tail += 8, size -= 8 )
+     {
+          hash ^= round( 0, read64( tail ) );
+          hash = rotl( hash, 27 ) * prime1 + prime4;
+     }
+     if( size >= 4 )
+     {
+          hash ^= static_cast< uint64_t >( read32( tail ) ) * prime1;
+          hash = rotl( hash, 23 ) * prime2 + prime3;
+          tail += 4;
+          size -= 4;
+     }
+     for( ; size != 0; tail++, size-- )
+     {
+          hash ^= *tail * prime5;
+          hash = rotl( hash, 11 ) * prime1;
+     }
+
+     hash ^= hash >> 33;
+     hash *= prime2;
+     hash ^= hash >> 29;
+     hash *= prime3;
+     hash ^= hash >> 32;
+     return hash;
+}
+
+
+uint64_t Xxh64::hash( const unsigned char* data, size_t size, uint64_t seed )
+{
+     Xxh64 state( seed );
+     state.update( data, size );
+     return state.digest();
+}
+
+
+void Crc32c::update( const unsigned char* data, size_t size )
+{
+     crc_ = hasSse42() ? updateSse42( crc_, data, size ) : updateScalar( crc_, data, size );
+}
+
+
+uint32_t Crc32c::digest() const
+{
+     return ~crc_;
+}
+
+
+uint32_t Crc32c::hash( const unsigned char* data, size_t size )
+{
+     Crc32c state;
+     state.update( data, size );
+     return state.digest();
+}
+
+
+uint32_t Crc32c::updateScalar( uint32_t crc, const unsigned char* data, size_t size )
+{
+     for( size_t idx = 0; idx < size; idx++ )
+     {
+          crc = ( crc >> 8 ) ^ crcTable[ ( crc ^ data[ idx ] ) & 0xff ];
+     }
+     return crc;
+}
+
+
+#ifdef CHECKSUM_X86
+
+__attribute__(( target( "sse4.2" ) ))
+uint32_t Crc32c::updateSse42( uint32_t crc, const unsigned char* data, size_t size )
+{
+#ifdef __x86_64__
+     uint64_t wide = crc;
+     for( ; size >= 8; data += 8, size -= 8 )
+     {
+          uint64_t value;
+          memcpy( &value, data, 8 );
+          wide = _mm_crc32_u64( wide, value );
+     }
+     crc = static_cast< uint32_t >( wide );
+#else
+     for( ; size >= 4; data += 4, size -= 4 )
+     {
+          crc = _mm_crc32_u32( crc, read32( data ) );
+     }
+#endif
+     for( ; size != 0; data++, size-- )
+     {
+          crc = _mm_crc32_u8( crc, *data );
+     }
+     return crc;
+}
+
+
+bool Crc32c::hasSse42()
+{
+     static const bool supported = __builtin_cpu_supports( "sse4.2" );
+     return supported;
+}
+
+#else
+
+uint32_t Crc32c::updateSse42( uint32_t crc, const unsigned char* data, size_t size )
+{
+     return updateScalar( crc, data, size );
+}
+
+
+bool Crc32c::hasSse42()
+{
+     return false;
+}
+
+#endif
+
+
+ChunkedChecksum::ChunkedChecksum( ChecksumType type, uint64_t chunkSize )
+:type_( type ), chunkSize_( chunkSize )
+{
+}
+
+
+void ChunkedChecksum::update( const unsigned char* data, size_t size )
+{
+     totalSize_ += size;
+     if( type_ == CTCrc32c )
+     {
+          totalCrc_.update( data, size );
+     }
+     else
+     {
+          totalXxh_.update( data, size );
+     }
+
+     while( size != 0 )
+     {
+          size_t count = static_cast< size_t >( std::min< uint64_t >( chunkSize_ - chunkFilled_, size ) );
+          if( type_ == CTCrc32c )
+          {
+               chunkCrc_.update( data, count );
+          }
+          else
+          {
+               chunkXxh_.update( data, count );
+          }
+          chunkFilled_ += count;
+          data += count;
+          size -= count;
+
+          if( chunkFilled_ == chunkSize_ )
+          {
+               chunkDigests_.push_back( chunkDigest() );
+               chunkCrc_ = Crc32c();
+               chunkXxh_ = Xxh64();
+               chunkFilled_ = 0;
+          }
+     }
+}
+
+
+void ChunkedChecksum::finish()
+{
+     if( chunkFilled_ != 0 )
+     {
+          chunkDigests_.push_back( chunkDigest() );
+          chunkFilled_ = 0;
+     }
+}
+
+
+const std::vector< uint64_t >& ChunkedChecksum::chunkDigests() const
+{
+     return chunkDigests_;
+}
+
+
+uint64_t ChunkedChecksum::totalDigest() const
+{
+     return type_ == CTCrc32c ? totalCrc_.digest() : totalXxh_.digest();
+}
+
+
+uint64_t ChunkedChecksum::totalSize() const
+{
+     return totalSize_;
+}
+
+
+uint64_t ChunkedChecksum::chunkDigest() const
+{
+     return type_ == CTCrc32c ? chunkCrc_.digest() : chunkXxh_.digest();
+}
+
+
+std::vector< unsigned char > ChecksumTrailer::serialize() const
+{
+     std::vector< unsigned char > result( size() );
+     unsigned char* dst = result.data();
+     for( uint64_t digest: digests )
+     {
+          putUint64( dst, digest );
+          dst += 8;
+     }
+     putUint64( dst, digests.size() );
+     putUint64( dst + 8, chunkSize );
+     putUint64( dst + 16, plainSize );
+     putUint64( dst + 24, total );
+     putUint64( dst + 32, static_cast< uint32_t >( type ) );
+     memcpy( dst + 40, trailerMagic, sizeof( trailerMagic ) );
+     return result;
+}
+
+
+bool ChecksumTrailer::parseFooter( const unsigned char* footer, uint64_t available )
+{
+     if( memcmp( footer + 40, trailerMagic, sizeof( trailerMagic ) ) != 0 )
+     {
+          return false;
+     }
+
+     uint64_t count = getUint64( footer );
+     chunkSize = getUint64( footer + 8 );
+     plainSize = getUint64( footer + 16 );
+     total = getUint64( footer + 24 );
+     uint64_t typeValue = getUint64( footer + 32 );
+     if( typeValue != CTCrc32c && typeValue != CTXxh64 )
+     {
+          throw std::runtime_error( "Unknown checksum type" );
+     }
+     type = static_cast< ChecksumType >( typeValue );
+
+     // число частей однозначно определяется размером открытого текста, поэтому размер концевика не может быть произвольным
+     if( chunkSize == 0 || count != ( plainSize + chunkSize - 1 ) / chunkSize || count > available / 8 )
+     {
+          throw std::runtime_error( "Checksum trailer corrupted" );
+     }
+     digests.assign( count, 0 );
+     return true;
+}
+
+
+void ChecksumTrailer::parseDigests( const unsigned char* data )
+{
+     for( size_t idx = 0; idx < digests.size(); idx++ )
+     {
+          digests[ idx ] = getUint64( data + 8 * idx );
+     }
+}
+
+
+uint64_t ChecksumTrailer::size() const
+{
+     return digests.size() * 8 + footerSize;
+}
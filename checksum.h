@@ -0,0 +1,117 @@
+/// @file
+/// @brief Быстрые некриптографические контрольные суммы открытого текста
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// xxHash64: 64-битная хеш-функция, вычисляемая по частям. Не является криптографической,
+// поэтому используется только для обнаружения изменений и повреждений, но не подделки
+class Xxh64
+{
+public:
+     explicit Xxh64( uint64_t seed = 0 );
+
+     void update( const unsigned char* data, size_t size );
+     uint64_t digest() const;
+
+     // хеш данных за один вызов
+     static uint64_t hash( const unsigned char* data, size_t size, uint64_t seed = 0 );
+
+private:
+     uint64_t seed_;
+     uint64_t accumulators_[ 4 ];
+     unsigned char buffer_[ 32 ];
+     size_t buffered_ = 0;
+     uint64_t totalSize_ = 0;
+};
+
+
+// CRC32C(полином Кастаньоли). При наличии SSE4.2 вычисляется инструкцией crc32 по 8 байт за такт,
+// иначе - табличным методом
+class Crc32c
+{
+public:
+     void update( const unsigned char* data, size_t size );
+     uint32_t digest() const;
+
+     static uint32_t hash( const unsigned char* data, size_t size );
+
+private:
+     static uint32_t updateScalar( uint32_t crc, const unsigned char* data, size_t size );
+     static uint32_t updateSse42( uint32_t crc, const unsigned char* data, size_t size );
+     static bool hasSse42();
+
+private:
+     uint32_t crc_ = 0xffffffff;
+};
+
+
+enum ChecksumType
+{
+     CTNone = 0,
+     CTCrc32c = 1,
+     CTXxh64 = 2
+};
+
+
+// контрольная сумма потока данных, вычисляемая одновременно целиком и по частям фиксированного размера.
+// Суммы частей позволяют обнаружить повреждение, не дожидаясь конца потока
+class ChunkedChecksum
+{
+public:
+     ChunkedChecksum( ChecksumType type, uint64_t chunkSize );
+
+     void update( const unsigned char* data, size_t size );
+
+     // завершает последнюю неполную часть. После вызова update не допускается
+     void finish();
+
+     // суммы завершенных частей
+     const std::vector< uint64_t >& chunkDigests() const;
+
+     // сумма всего потока(CRC32C или xxHash64 с нулевым зерном, совпадает со стандартными утилитами)
+     uint64_t totalDigest() const;
+     uint64_t totalSize() const;
+
+private:
+     uint64_t chunkDigest() const;
+
+private:
+     const ChecksumType type_;
+     const uint64_t chunkSize_;
+     Crc32c totalCrc_;
+     Xxh64 totalXxh_;
+     Crc32c chunkCrc_;
+     Xxh64 chunkXxh_;
+     uint64_t chunkFilled_ = 0;
+     uint64_t totalSize_ = 0;
+     std::vector< uint64_t > chunkDigests_;
+};
+
+
+// Концевик файла с контрольными суммами(все числа в little-endian):
+//   суммы частей по 8 байт | число частей(8) | размер части(8) | размер открытого текста(8) | сумма файла(8) |
+//   тип суммы(4) | резерв(4) | "AESSUM01"
+struct ChecksumTrailer
+{
+     ChecksumType type = CTNone;
+     uint64_t chunkSize = 0;
+     uint64_t plainSize = 0;
+     uint64_t total = 0;
+     std::vector< uint64_t > digests;
+
+     std::vector< unsigned char > serialize() const;
+
+     // разбирает последние footerSize байт концевика, перед которыми в файле есть available байт.
+     // Возвращает false, если концевика нет. digests получает размер по числу частей, сами суммы читаются parseDigests
+     bool parseFooter( const unsigned char* footer, uint64_t available );
+     void parseDigests( const unsigned char* data );
+
+     // полный размер концевика
+     uint64_t size() const;
+
+     static const size_t footerSize = 48;
+};
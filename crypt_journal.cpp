@@ -0,0 +1,183 @@
+/// @file
+/// @brief Журнал шифрования файла на месте, позволяющий продолжить прерванную операцию
+
+#include "crypt_journal.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <unistd.h>
+
+namespace
+{
+     const char magic[ 8 ] = { 'A', 'E', 'S', 'J', 'R', 'N', '0', '1' };
+     const size_t headerSize = 48;
+     const size_t recordHeaderSize = 32;
+
+     void putUint64( unsigned char* dst, uint64_t value )
+     {
+          for( int idx = 0; idx < 8; idx++ )
+          {
+               dst[ idx ] = static_cast< unsigned char >( value >> ( 8 * idx ) );
+          }
+     }
+
+     uint64_t getUint64( const unsigned char* src )
+     {
+          uint64_t value = 0;
+          for( int idx = 7; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | src[ idx ];
+          }
+          return value;
+     }
+
+     // FNV-1a: контрольная сумма нужна только для обнаружения записи, прерванной сбоем
+     uint64_t checksum( const unsigned char* recordHeader, const unsigned char* data, size_t size )
+     {
+          uint64_t hash = 0xcbf29ce484222325ULL;
+          for( size_t idx = 0; idx < 24; idx++ )
+          {
+               hash = ( hash ^ recordHeader[ idx ] ) * 0x100000001b3ULL;
+          }
+          for( size_t idx = 0; idx < size; idx++ )
+          {
+               hash = ( hash ^ data[ idx ] ) * 0x100000001b3ULL;
+          }
+          return hash;
+     }
+}
+
+
+CryptJournal::CryptJournal( PosixFile&& file, const Header& header )
+:file_( std::move( file ) ), header_( header )
+{
+}
+
+
+bool CryptJournal::exists( const std::string& path )
+{
+     return access( path.c_str(), F_OK ) == 0;
+}
+
+
+CryptJournal CryptJournal::create( const std::string& path, const Header& header )
+{
+     unsigned char buffer[ headerSize ] = {};
+     memcpy( buffer, magic, sizeof( magic ) );
+     buffer[ 8 ] = static_cast< unsigned char >( header.operation );
+     putUint64( buffer + 16, header.fileSize );
+     putUint64( buffer + 24, header.chunkSize );
+     memcpy( buffer + 32, header.id, 16 );
+
+     PosixFile file = PosixFile::create( path );
+     file.writeAt( buffer, headerSize, 0 );
+     file.sync();
+     PosixFile::syncDirectory( path );
+     return CryptJournal( std::move( file ), header );
+}
+
+
+CryptJournal CryptJournal::open( const std::string& path )
+{
+     PosixFile file = PosixFile::openReadWrite( path );
+     unsigned char buffer[ headerSize ];
+     if( file.readAt( buffer, headerSize, 0 ) != headerSize || memcmp( buffer, magic, sizeof( magic ) ) != 0 )
+     {
+          throw std::runtime_error( "Journal file corrupted" );
+     }
+
+     Header header;
+     header.operation = buffer[ 8 ];
+     header.fileSize = getUint64( buffer + 16 );
+     header.chunkSize = getUint64( buffer + 24 );
+     memcpy( header.id, buffer + 32, 16 );
+     if( header.chunkSize == 0 || header.chunkSize % 16 != 0 )
+     {
+          throw std::runtime_error( "Journal file corrupted" );
+     }
+     return CryptJournal( std::move( file ), header );
+}
+
+
+void CryptJournal::remove( const std::string& path )
+{
+     if( unlink( path.c_str() ) != 0 )
+     {
+          throw std::runtime_error( "Could not remove journal: " + path );
+     }
+     PosixFile::syncDirectory( path );
+}
+
+
+const CryptJournal::Header& CryptJournal::header() const
+{
+     return header_;
+}
+
+
+bool CryptJournal::lastRecord( uint64_t& chunkIndex, unsigned char* data, size_t& size )
+{
+     // ищем целую запись с наибольшим порядковым номером
+     uint64_t bestSequence = 0;
+     for( uint64_t slot = 0; slot < 2; slot++ )
+     {
+          unsigned char recordHeader[ recordHeaderSize ];
+          uint64_t offset = headerSize + slot * ( recordHeaderSize + header_.chunkSize );
+          if( file_.readAt( recordHeader, recordHeaderSize, offset ) != recordHeaderSize )
+          {
+               continue;
+          }
+
+          uint64_t sequence = getUint64( recordHeader );
+          uint64_t recordSize = getUint64( recordHeader + 16 );
+          if( sequence <= bestSequence || sequence % 2 != slot || recordSize > header_.chunkSize )
+          {
+               continue;
+          }
+          if( file_.readAt( data, recordSize, offset + recordHeaderSize ) != recordSize ||
+              checksum( recordHeader, data, recordSize ) != getUint64( recordHeader + 24 ) )
+          {
+               continue;
+          }
+          bestSequence = sequence;
+          chunkIndex = getUint64( recordHeader + 8 );
+          size = recordSize;
+     }
+
+     // данные лучшей записи могли быть перезаписаны чтением второй ячейки, перечитываем их
+     if( bestSequence != 0 )
+     {
+          file_.readAt( data, size, slotOffset( bestSequence ) + recordHeaderSize );
+     }
+     sequence_ = bestSequence;
+     return bestSequence != 0;
+}
+
+
+void CryptJournal::append( uint64_t chunkIndex, const unsigned char* data, size_t size )
+{
+     if( size > header_.chunkSize )
+     {
+          throw std::runtime_error( "Journal record is too large" );
+     }
+
+     uint64_t sequence = sequence_ + 1;
+     unsigned char recordHeader[ recordHeaderSize ];
+     putUint64( recordHeader, sequence );
+     putUint64( recordHeader + 8, chunkIndex );
+     putUint64( recordHeader + 16, size );
+     putUint64( recordHeader + 24, checksum( recordHeader, data, size ) );
+
+     uint64_t offset = slotOffset( sequence );
+     file_.writeAt( data, size, offset + recordHeaderSize );
+     file_.writeAt( recordHeader, recordHeaderSize, offset );
+     file_.sync();
+     sequence_ = sequence;
+}
+
+
+uint64_t CryptJournal::slotOffset( uint64_t sequence ) const
+{
+     return headerSize + ( sequence % 2 ) * ( recordHeaderSize + header_.chunkSize );
+}
@@ -0,0 +1,59 @@
+/// @file
+/// @brief Журнал шифрования файла на месте, позволяющий продолжить прерванную операцию
+#pragma once
+
+#include "file_io.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// Формат журнала(все числа в little-endian):
+//   "AESJRN01" | операция(4) | резерв(4) | размер файла(8) | размер части(8) | идентификатор операции(16) | 2 ячейки записей
+//   запись: порядковый номер(8) | номер части(8) | размер данных(8) | контрольная сумма(8) | данные(размер части)
+// запись с порядковым номером k пишется в ячейку k % 2 и сбрасывается на диск до перезаписи части в файле.
+// Прерванная запись в журнал портит только свою ячейку, в другой остается предыдущая целая запись
+class CryptJournal
+{
+public:
+     struct Header
+     {
+          uint32_t operation = 0;
+          uint64_t fileSize = 0;
+          uint64_t chunkSize = 0;
+          unsigned char id[ 16 ] = {};       // идентифицирует ключ, IV и операцию, для которых создан журнал
+     };
+
+     CryptJournal() = default;
+
+     static bool exists( const std::string& path );
+
+     // создает пустой журнал и дожидается его записи на диск
+     static CryptJournal create( const std::string& path, const Header& header );
+
+     // открывает существующий журнал
+     static CryptJournal open( const std::string& path );
+
+     // удаляет журнал завершенной операции
+     static void remove( const std::string& path );
+
+     const Header& header() const;
+
+     // читает последнюю целую запись в data(не менее chunkSize байт). false - целых записей нет.
+     // при продолжении операции вызывается до append: следующая запись займет ячейку поврежденной или более старой записи
+     bool lastRecord( uint64_t& chunkIndex, unsigned char* data, size_t& size );
+
+     // сохраняет новое содержимое части и дожидается его записи на диск
+     void append( uint64_t chunkIndex, const unsigned char* data, size_t size );
+
+private:
+     CryptJournal( PosixFile&& file, const Header& header );
+
+     uint64_t slotOffset( uint64_t sequence ) const;
+
+private:
+     PosixFile file_;
+     Header header_;
+     uint64_t sequence_ = 0;
+};
@@ -0,0 +1,70 @@
+/// @file
+/// @brief Тесты libaescrypt: известные ответы, дифференциальное тестирование и контроль производительности
+
+#include "self_test.h"
+#include "AES_cryptography.h"
+
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <iostream>
+#include <string>
+
+
+// crypto_tests {OPTIONAL: --iterations N} {OPTIONAL: --seed N} {OPTIONAL: --min-mbps-{portable/ttable/aesni} N} {OPTIONAL: --stats}.
+// Нижняя граница производительности задается для каждой реализации шифра отдельно. Код возврата ненулевой,
+// если хотя бы одна проверка не пройдена
+int main( int argc, char* argv[] )
+{
+     SelfTest::Options options;
+     try
+     {
+          for( int idx = 1; idx < argc; idx++ )
+          {
+               std::string name = argv[ idx ];
+               int floorBackend = -1;
+               for( AesBackend backend: { ABPortable, ABTable, ABAesNi } )
+               {
+                    if( name == std::string( "--min-mbps-" ) + AESCryptography::backendName( backend ) )
+                    {
+                         floorBackend = backend;
+                    }
+               }
+               if( name == "--stats" )
+               {
+                    options.perfStats = true;
+                    continue;
+               }
+               if( idx + 1 >= argc )
+               {
+                    throw std::runtime_error( "missing value for option: " + name );
+               }
+               std::string value = argv[ ++idx ];
+               if( name == "--iterations" )
+               {
+                    options.iterations = std::stoul( value );
+               }
+               else if( name == "--seed" )
+               {
+                    options.seed = std::stoul( value );
+               }
+               else if( floorBackend >= 0 )
+               {
+                    options.minMbps[ floorBackend ] = std::stod( value );
+               }
+               else
+               {
+                    throw std::runtime_error( "unknown option: " + name );
+               }
+          }
+     }
+     catch( const std::exception& ex )
+     {
+          std::cout << ex.what() << std::endl;
+          std::cout << "Usage: crypto_tests {OPTIONAL: --iterations N} {OPTIONAL: --seed N} {OPTIONAL: --min-mbps-{portable/ttable/aesni} N} "
+                       "{OPTIONAL: --stats}" << std::endl;
+          return 2;
+     }
+
+     return SelfTest( std::cout ).run( options ) ? 0 : 1;
+}
@@ -0,0 +1,335 @@
+/// @file
+/// @brief Параллельное рекурсивное шифрование и расшифрование каталогов
+
+#include "directory_crypt.h"
+#include "tuning_profile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+     AesKeyLength keyLengthFromSize( size_t size )
+     {
+          switch( size * 8 )
+          {
+               case 128:
+               {
+                    return AKL_128;
+               }
+               case 192:
+               {
+                    return AKL_192;
+               }
+               case 256:
+               {
+                    return AKL_256;
+               }
+          }
+          throw std::runtime_error( "Incorrect key length" );
+     }
+
+     // true, если path совпадает с root или находится внутри него
+     bool isInside( const fs::path& path, const fs::path& root )
+     {
+          auto mismatch = std::mismatch( root.begin(), root.end(), path.begin(), path.end() );
+          return mismatch.first == root.end();
+     }
+}
+
+
+DirectoryEncryptor::DirectoryEncryptor( const std::string& srcDir, const std::string& dstDir, std::ostream& log )
+:srcDir_( srcDir ), dstDir_( dstDir ), log_( log ), pool_( &BufferPool::defaultPool() )
+{
+}
+
+
+void DirectoryEncryptor::cryptDirectory( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv )
+{
+     process( false, key, mode, iv );
+}
+
+
+void DirectoryEncryptor::decryptDirectory( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv )
+{
+     process( true, key, mode, iv );
+}
+
+
+void DirectoryEncryptor::setThreadCount( size_t threadCount )
+{
+     threadCount_ = threadCount;
+}
+
+
+void DirectoryEncryptor::setNumaPolicy( NumaPolicy policy )
+{
+     numaPolicy_ = policy;
+}
+
+
+void DirectoryEncryptor::setHexArmor( bool enabled )
+{
+     hexArmor_ = enabled;
+}
+
+
+void DirectoryEncryptor::setSegmented( bool enabled, size_t segmentCount )
+{
+     segmented_ = enabled;
+     segmentCount_ = segmentCount;
+}
+
+
+void DirectoryEncryptor::setBufferPool( BufferPool& pool )
+{
+     pool_ = &pool;
+}
+
+
+void DirectoryEncryptor::setChecksum( ChecksumType type )
+{
+     checksum_ = type;
+}
+
+
+void DirectoryEncryptor::setCompression( bool enabled )
+{
+     compression_ = enabled;
+}
+
+
+void DirectoryEncryptor::process( bool decrypt, const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv )
+{
+     if( segmented_ && mode != CMCbc )
+     {
+          throw std::runtime_error( "segmented format is supported only in CBC mode" );
+     }
+     if( mode != CMEcb && iv.size() != 16 )
+     {
+          throw std::runtime_error( "iv has not valid size" );
+     }
+
+     // ключ выработки IV файлов: E_K( "DIR" || счетчик ), усеченный до длины основного ключа
+     AESCryptography crypt( keyLengthFromSize( key.size() ) );
+     AesRoundKeys ivKeys{};
+     if( mode != CMEcb )
+     {
+          AesRoundKeys roundKeys = crypt.expandKey( key );
+          std::vector< unsigned char > ivKey( 32 );
+          for( unsigned char counter = 0; counter < 2; counter++ )
+          {
+               unsigned char block[ 16 ] = { 'D', 'I', 'R' };
+               block[ 15 ] = counter;
+               crypt.cryptBlocksECB( block, ivKey.data() + 16 * counter, 16, roundKeys );
+          }
+          ivKey.resize( key.size() );
+          ivKeys = crypt.expandKey( ivKey, false );
+     }
+
+     std::vector< FileTask > files = collectFiles();
+     std::vector< size_t > batches = makeBatches( files );
+     uint64_t totalBytes = 0;
+     for( const FileTask& file: files )
+     {
+          totalBytes += file.size;
+     }
+
+     ThreadPool workers( threadCount_ != 0 ? threadCount_ : TuningProfile::active().threadCount, numaPolicy_ );
+     std::atomic< uint64_t > doneBytes( 0 );
+     std::atomic< size_t > doneFiles( 0 );
+     std::mutex failuresMutex;
+     std::vector< std::string > failures;
+
+     // ход выполнения выводится раз в секунду отдельным потоком
+     const auto start = std::chrono::steady_clock::now();
+     auto elapsed = [ & ]() { return std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count(); };
+     std::mutex reporterMutex;
+     std::condition_variable reporterWake;
+     bool finished = false;
+     std::thread reporter( [ & ]()
+     {
+          std::unique_lock< std::mutex > lock( reporterMutex );
+          while( !reporterWake.wait_for( lock, std::chrono::seconds( 1 ), [ & ]() { return finished; } ) )
+          {
+               reportProgress( std::min( doneBytes.load(), totalBytes ), totalBytes, doneFiles, files.size(), elapsed(), false );
+          }
+     } );
+
+     workers.parallelFor( batches.size() - 1, [ & ]( size_t batch )
+     {
+          for( size_t idx = batches[ batch ]; idx < batches[ batch + 1 ]; idx++ )
+          {
+               const FileTask& file = files[ idx ];
+               try
+               {
+                    fs::path relative( file.relativePath );
+                    FileEncryptor fileCrypt( ( fs::path( srcDir_ ) / relative ).string(), ( fs::path( dstDir_ ) / relative ).string(), *pool_ );
+                    fileCrypt.setHexArmor( hexArmor_ );
+                    fileCrypt.setChecksum( checksum_ );
+                    fileCrypt.setCompression( compression_ );
+                    fileCrypt.setThreadPool( &workers );
+                    fileCrypt.setProgressCounter( &doneBytes );
+
+                    std::vector< unsigned char > ivFile;
+                    if( mode != CMEcb )
+                    {
+                         ivFile = fileIv( crypt, ivKeys, iv, file.relativePath );
+                    }
+
+                    if( segmented_ && decrypt )
+                    {
+                         fileCrypt.decryptFileSegmented( key, ivFile );
+                    }
+                    else if( segmented_ )
+                    {
+                         size_t segmentCount = segmentCount_ != 0 ? segmentCount_ : ( file.size + autoSegmentSize - 1 ) / autoSegmentSize;
+                         fileCrypt.cryptFileSegmented( key, ivFile, segmentCount );
+                    }
+                    else if( decrypt )
+                    {
+                         fileCrypt.decryptFile( key, mode, ivFile );
+                    }
+                    else
+                    {
+                         fileCrypt.cryptFile( key, mode, ivFile );
+                    }
+               }
+               catch( const std::exception& ex )
+               {
+                    std::lock_guard< std::mutex > lock( failuresMutex );
+                    failures.push_back( file.relativePath + ": " + ex.what() );
+               }
+               doneFiles++;
+          }
+     } );
+
+     {
+          std::lock_guard< std::mutex > lock( reporterMutex );
+          finished = true;
+     }
+     reporterWake.notify_all();
+     reporter.join();
+     reportProgress( totalBytes, totalBytes, files.size(), files.size(), elapsed(), true );
+
+     for( const std::string& failure: failures )
+     {
+          log_ << "Failed: " << failure << std::endl;
+     }
+     if( !failures.empty() )
+     {
+          throw std::runtime_error( std::to_string( failures.size() ) + " of " + std::to_string( files.size() ) + " files failed" );
+     }
+}
+
+
+std::vector< DirectoryEncryptor::FileTask > DirectoryEncryptor::collectFiles()
+{
+     const fs::path src( srcDir_ );
+     const fs::path dst( dstDir_ );
+     if( !fs::is_directory( src ) )
+     {
+          throw std::runtime_error( "Input directory does not not exist or unavailable" );
+     }
+     if( isInside( fs::weakly_canonical( dst ), fs::canonical( src ) ) )
+     {
+          throw std::runtime_error( "Output directory must not be inside input directory" );
+     }
+     fs::create_directories( dst );
+
+     std::vector< FileTask > files;
+     skipped_ = 0;
+     for( const fs::directory_entry& entry: fs::recursive_directory_iterator( src ) )
+     {
+          fs::path relative = entry.path().lexically_relative( src );
+          if( entry.is_symlink() )
+          {
+               skipped_++;
+          }
+          else if( entry.is_directory() )
+          {
+               fs::create_directories( dst / relative );
+          }
+          else if( entry.is_regular_file() )
+          {
+               files.push_back( { relative.generic_string(), entry.file_size() } );
+          }
+          else
+          {
+               skipped_++;
+          }
+     }
+
+     // большие файлы запускаются первыми, чтобы в конце не остался один долгий файл на фоне простаивающих потоков
+     std::stable_sort( files.begin(), files.end(), []( const FileTask& left, const FileTask& right )
+     {
+          return left.size > right.size;
+     } );
+     return files;
+}
+
+
+std::vector< size_t > DirectoryEncryptor::makeBatches( const std::vector< FileTask >& files ) const
+{
+     std::vector< size_t > bounds( 1, 0 );
+     uint64_t bytes = 0;
+     for( size_t idx = 0; idx < files.size(); idx++ )
+     {
+          bytes += files[ idx ].size;
+          size_t count = idx + 1 - bounds.back();
+          if( files[ idx ].size >= smallFileSize || bytes >= batchBytes || count >= batchFiles )
+          {
+               bounds.push_back( idx + 1 );
+               bytes = 0;
+          }
+     }
+     if( bounds.back() != files.size() )
+     {
+          bounds.push_back( files.size() );
+     }
+     return bounds;
+}
+
+
+std::vector< unsigned char > DirectoryEncryptor::fileIv( const AESCryptography& crypt, const AesRoundKeys& ivKeys,
+                                                         const std::vector< unsigned char >& masterIv, const std::string& relativePath ) const
+{
+     std::vector< unsigned char > data( masterIv );
+     data.insert( data.end(), relativePath.begin(), relativePath.end() );
+
+     std::vector< unsigned char > result( 16 );
+     crypt.cmac( data.data(), data.size(), ivKeys, result.data() );
+     return result;
+}
+
+
+void DirectoryEncryptor::reportProgress( uint64_t doneBytes, uint64_t totalBytes, size_t doneFiles, size_t totalFiles, double seconds, bool final )
+{
+     const double mib = 1024.0 * 1024.0;
+     double speed = seconds > 0 ? doneBytes / mib / seconds : 0;
+
+     std::ostringstream line;
+     line << std::fixed << std::setprecision( 1 );
+     if( final )
+     {
+          line << "\rProcessed " << totalFiles << " files, " << totalBytes / mib << " MiB in " << seconds << " s, " << speed << " MiB/s";
+          if( skipped_ != 0 )
+          {
+               line << ", skipped " << skipped_ << " special files";
+          }
+          log_ << line.str() << std::endl;
+          return;
+     }
+     line << "\rFiles " << doneFiles << "/" << totalFiles << ", " << doneBytes / mib << "/" << totalBytes / mib << " MiB, " << speed << " MiB/s";
+     log_ << line.str() << std::flush;
+}
@@ -0,0 +1,89 @@
+/// @file
+/// @brief Параллельное рекурсивное шифрование и расшифрование каталогов
+#pragma once
+
+#include "file_crypt.h"
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+
+// обходит дерево srcDir и воспроизводит его в dstDir: каталоги создаются заранее, а файлы обрабатываются
+// FileEncryptor в общем пуле потоков с перехватом задач. Большие файлы обрабатываются по одному на задачу,
+// а их части распределяются между свободными потоками; мелкие файлы объединяются в пакеты.
+// В режимах CBC и CTR IV каждого файла вырабатывается из IV каталога и относительного пути файла, поэтому
+// одинаковые файлы в разных местах дерева дают разный шифртекст. Символические ссылки пропускаются
+class DirectoryEncryptor
+{
+public:
+     // ход выполнения и итоговая производительность выводятся в log
+     DirectoryEncryptor( const std::string& srcDir, const std::string& dstDir, std::ostream& log );
+
+     void cryptDirectory( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv = {} );
+     void decryptDirectory( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv = {} );
+
+     // число потоков. 0 - по числу аппаратных потоков
+     void setThreadCount( size_t threadCount );
+
+     // закрепление потоков за ядрами узлов NUMA(см. ThreadPool). Буферы файла размещаются на узле обрабатывающего его потока
+     void setNumaPolicy( NumaPolicy policy );
+
+     void setHexArmor( bool enabled );
+
+     // включает сегментированный формат(только CBC). segmentCount == 0 - число сегментов выбирается по размеру файла
+     void setSegmented( bool enabled, size_t segmentCount = 0 );
+
+     void setBufferPool( BufferPool& pool );
+
+     // контрольная сумма открытого текста каждого файла(см. FileEncryptor::setChecksum)
+     void setChecksum( ChecksumType type );
+
+     // сжатие открытого текста каждого файла(см. FileEncryptor::setCompression)
+     void setCompression( bool enabled );
+
+private:
+     struct FileTask
+     {
+          std::string relativePath;
+          uint64_t size = 0;
+     };
+
+     void process( bool decrypt, const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv );
+
+     // создает каталоги назначения и возвращает список обычных файлов, большие файлы - в начале
+     std::vector< FileTask > collectFiles();
+
+     // делит файлы на пакеты: большой файл - отдельный пакет, мелкие объединяются. Возвращает границы пакетов
+     std::vector< size_t > makeBatches( const std::vector< FileTask >& files ) const;
+
+     // IV файла: CMAC( masterIv || относительный путь ) на ключе, выработанном из основного
+     std::vector< unsigned char > fileIv( const AESCryptography& crypt, const AesRoundKeys& ivKeys,
+                                          const std::vector< unsigned char >& masterIv, const std::string& relativePath ) const;
+
+     void reportProgress( uint64_t doneBytes, uint64_t totalBytes, size_t doneFiles, size_t totalFiles, double seconds, bool final );
+
+private:
+     // файлы меньше этого размера объединяются в пакеты до batchBytes байт
+     static const uint64_t smallFileSize = 64 * 1024;
+     static const uint64_t batchBytes = 4 * 1024 * 1024;
+     static const size_t batchFiles = 256;
+
+     // размер сегмента при автоматическом выборе числа сегментов
+     static const uint64_t autoSegmentSize = 64 * 1024 * 1024;
+
+     const std::string srcDir_;
+     const std::string dstDir_;
+     std::ostream& log_;
+     BufferPool* pool_;
+     size_t threadCount_ = 0;
+     NumaPolicy numaPolicy_ = NPOff;
+     bool hexArmor_ = false;
+     bool segmented_ = false;
+     ChecksumType checksum_ = CTNone;
+     bool compression_ = false;
+     size_t segmentCount_ = 0;
+     size_t skipped_ = 0;
+};
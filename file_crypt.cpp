@@ -1,141 +1,1689 @@
 #include "file_crypt.h"
+#include "hex_codec.h"
+#include "lz_codec.h"
+#include "bounded_queue.h"
+#include "checksum.h"
+#include "crypt_journal.h"
+#include "perf_counters.h"
+#include "random_generator.h"
+#include "sparse_format.h"
+#include "tuning_profile.h"
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <filesystem>
 #include <fstream>
+#include <thread>
+#include <stdexcept>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+namespace
+{
+     const char compressMagic[ 8 ] = { 'A', 'E', 'S', 'L', 'Z', 'B', '0', '1' };
+}
+
+
+FileEncryptor::FileEncryptor( const std::string& srcPath, const std::string& dstPath, BufferPool& pool )
+:srcPath_( srcPath ), dstPath_( dstPath ), pool_( pool )
+{
+}
+
+
+void FileEncryptor::cryptFile( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv  )
+{
+     AesKeyLength keyLength = keyLengthFromKey( key );
+     checkIv( mode, iv );
+
+     std::ifstream inp( srcPath_, std::ios_base::binary | std::ios_base::in );
+     if( !inp.is_open() )
+     {
+          throw std::runtime_error( "Input file does not not exist or unavailable" );
+     }
+
+     std::ofstream out( dstPath_, std::ios_base::binary | std::ios_base::out );
+     if( !out.is_open() )
+     {
+          throw std::runtime_error( "Create output file error" );
+     }
+
+     AESCryptography crypt( keyLength );
+     AesRoundKeys roundKeys = crypt.expandKey( key );
+
+     // последний блок шифртекста, используется для сцепления частей в режиме CBC, или счетчик режима CTR
+     unsigned char chain[ 16 ] = {};
+     std::copy( iv.begin(), iv.end(), chain );
+
+     // файл обрабатывается частями размером с блок пула. Последние 16 байт блока оставляем под дополнение
+     PoolBuffer buffer = pool_.acquire();
+     PoolBuffer armorBuffer = hexArmor_ ? pool_.acquire() : PoolBuffer();
+     size_t chunkSize = buffer.size() - 16;
+     buffer.markSensitive( buffer.size() );
+
+     // при сжатии открытый текст читается в отдельный буфер, а в buffer помещаются записи сжатых блоков.
+     // Запись не длиннее блока с заголовком, поэтому часть уменьшается так, чтобы записи всегда помещались.
+     // Размер записей произволен, а шифруется только целое число блоков AES: остаток меньше блока(tail)
+     // переносится в начало следующей части, поэтому в buffer резервируется еще 16 байт
+     PoolBuffer plainBuffer = compression_ ? pool_.acquire() : PoolBuffer();
+     plainBuffer.markSensitive( plainBuffer.size() );
+     const size_t blockSize = std::min( ( buffer.size() - 32 ) / 2 - compressRecordHeader, static_cast< size_t >( compressBlockSize ) );
+     if( compression_ )
+     {
+          chunkSize = ( buffer.size() - 32 ) / ( blockSize + compressRecordHeader ) * blockSize;
+     }
+     unsigned char* plain = compression_ ? plainBuffer.data() : buffer.data();
+     unsigned char tail[ 16 ];
+     size_t tailSize = 0;
+
+     // шифрование CBC последовательное, пул потоков создается только для ECB
+     std::unique_ptr< ThreadPool > localWorkers;
+     if( mode != CMCbc || compression_ )
+     {
+          placeBuffers( workers( localWorkers ), { &buffer, &armorBuffer, &plainBuffer } );
+     }
+
+     // сумма считается по только что прочитанной части, пока она в кэше, до шифрования на месте
+     std::unique_ptr< ChunkedChecksum > checksum;
+     if( checksum_ != CTNone )
+     {
+          checksum.reset( new ChunkedChecksum( checksum_, checksumChunkSize ) );
+     }
+     lastChecksumType_ = CTNone;
+
+     const char* cipherPhase = mode == CMCbc ? "CBC encrypt" : mode == CMCtr ? "CTR" : "ECB encrypt";
+     bool last = false;
+     while( !last )
+     {
+          PerfPhase readPhase( perfStats_, "read" );
+          size_t readBytes = inp.read( ( char* ) plain, chunkSize ).gcount();
+          last = readBytes < chunkSize || inp.peek() == std::char_traits< char >::eof();
+          readPhase.finish( readBytes );
+          addProgress( readBytes );
+          if( checksum )
+          {
+               PerfPhase checksumPhase( perfStats_, "checksum" );
+               checksum->update( plain, readBytes );
+               checksumPhase.finish( readBytes );
+          }
+          if( compression_ )
+          {
+               PerfPhase compressPhase( perfStats_, "compress" );
+               const size_t plainBytes = readBytes;
+               std::copy( tail, tail + tailSize, buffer.data() );
+               readBytes = tailSize + compressChunk( plain, readBytes, buffer.data() + tailSize, blockSize, workers( localWorkers ) );
+               tailSize = last ? 0 : readBytes % 16;
+               readBytes -= tailSize;
+               std::copy( buffer.data() + readBytes, buffer.data() + readBytes + tailSize, tail );
+               compressPhase.finish( plainBytes );
+          }
+
+          // выполняем дополнение последней части. В режиме CTR дополнение не нужно
+          if( last && mode != CMCtr )
+          {
+               readBytes = addPadding( buffer.data(), readBytes );
+          }
+
+          // выполняем шифрование на месте
+          PerfPhase cipher( perfStats_, cipherPhase );
+          if( mode == CMCbc )
+          {
+               crypt.cryptBlocksCBC( buffer.data(), buffer.data(), readBytes, roundKeys, chain );
+          }
+          else
+          {
+               cryptBlocksParallel( crypt, roundKeys, mode, buffer.data(), readBytes, chain, workers( localWorkers ) );
+          }
+          cipher.finish( readBytes );
+
+          PerfPhase writePhase( perfStats_, "write" );
+          writeData( out, buffer.data(), readBytes, armorBuffer );
+          writePhase.finish( readBytes );
+     }
+
+     if( compression_ )
+     {
+          writeCompressionMarker( out, armorBuffer );
+     }
+     if( checksum )
+     {
+          checksum->finish();
+          ChecksumTrailer trailer;
+          trailer.type = checksum_;
+          trailer.chunkSize = checksumChunkSize;
+          trailer.plainSize = checksum->totalSize();
+          trailer.total = checksum->totalDigest();
+          trailer.digests = checksum->chunkDigests();
+          maskChecksums( crypt, roundKeys, trailer );
+
+          std::vector< unsigned char > data = trailer.serialize();
+          writeData( out, data.data(), data.size(), armorBuffer );
+          lastChecksumType_ = checksum_;
+          lastChecksum_ = checksum->totalDigest();
+     }
+}
+
+
+void FileEncryptor::decryptFile( const std::vector<unsigned char>& key, CryptMode mode, const std::vector< unsigned char >& iv )
+{
+     decryptStream( key, mode, iv, true );
+}
+
+
+FileEncryptor::VerifyResult FileEncryptor::verifyFile( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv )
+{
+     AesKeyLength keyLength = keyLengthFromKey( key );
+     checkIv( mode, iv );
+
+     std::ifstream inp( srcPath_, std::ios_base::binary | std::ios_base::in );
+     if( !inp.is_open() )
+     {
+          throw std::runtime_error( "Input file does not not exist or unavailable" );
+     }
+
+     AESCryptography crypt( keyLength );
+     AesRoundKeys roundKeys = crypt.expandKey( key );
+     ChecksumTrailer trailer;
+     bool compressed = false;
+     const uint64_t cipherSize = readCompressionMarker( inp, readChecksumTrailer( inp, crypt, roundKeys, trailer ), compressed );
+
+     VerifyResult result;
+     result.size = std::filesystem::file_size( srcPath_ );
+
+     // открытый текст нужен целиком, только чтобы сверить его с суммами концевика или разобрать записи сжатия
+     if( trailer.type != CTNone || checksum_ != CTNone || compressed || compression_ )
+     {
+          result.decrypted = decryptStream( key, mode, iv, false );
+          result.evidence = trailer.type != CTNone ? ( mode == CMCtr ? "checksum" : "checksum and padding" )
+                                                   : ( mode == CMCtr ? "compressed records" : "compressed records and padding" );
+          return result;
+     }
+
+     // шестнадцатеричный текст проверяется целиком: decryptFile отвергает файл с любым недопустимым символом
+     PoolBuffer buffer = pool_.acquire();
+     if( hexArmor_ )
+     {
+          for( uint64_t done = 0; done < cipherSize; )
+          {
+               size_t expected = static_cast< size_t >( std::min< uint64_t >( buffer.size() / 2, cipherSize - done ) );
+               if( readData( inp, buffer.data(), expected ) != expected )
+               {
+                    throw std::runtime_error( "Input file corrupted" );
+               }
+               addProgress( 2 * expected );
+               done += expected;
+          }
+     }
+     else
+     {
+          addProgress( cipherSize );
+     }
+     if( mode == CMCtr )
+     {
+          result.evidence = "none, CTR without checksum";
+          result.strength = VSNone;
+          return result;
+     }
+
+     // размер кратен блоку, а дополнение зависит только от последнего блока и предшествующего ему блока шифртекста(или IV)
+     if( cipherSize == 0 )
+     {
+          throw std::runtime_error( "Input file corrupted" );
+     }
+     if( cipherSize % 16 != 0 )
+     {
+          throw std::runtime_error( "data is not aligned" );
+     }
+     const size_t tailSize = mode == CMCbc && cipherSize >= 32 ? 32 : 16;
+     inp.clear();
+     inp.seekg( ( cipherSize - tailSize ) * ( hexArmor_ ? 2 : 1 ) );
+     if( readData( inp, buffer.data(), tailSize ) != tailSize )
+     {
+          throw std::runtime_error( "Input file corrupted" );
+     }
+
+     unsigned char* last = buffer.data() + tailSize - 16;
+     buffer.markSensitive( tailSize );
+     if( mode == CMCbc )
+     {
+          unsigned char chain[ 16 ];
+          std::copy( tailSize == 32 ? buffer.data() : iv.data(), tailSize == 32 ? buffer.data() + 16 : iv.data() + 16, chain );
+          crypt.decryptBlocksCBC( last, last, 16, roundKeys, chain );
+     }
+     else
+     {
+          crypt.decryptBlocksECB( last, last, 16, roundKeys );
+     }
+     removePadding( last, 16 );
+     result.decrypted = 16;
+     result.evidence = "padding";
+     result.strength = VSPadding;
+     return result;
+}
+
+
+uint64_t FileEncryptor::decryptStream( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv,
+                                       bool writeOutput )
+{
+     AesKeyLength keyLength = keyLengthFromKey( key );
+     checkIv( mode, iv );
+
+     std::ifstream inp( srcPath_, std::ios_base::binary | std::ios_base::in );
+     if( !inp.is_open() )
+     {
+          throw std::runtime_error( "Input file does not not exist or unavailable" );
+     }
+
+     // при проверке выходной файл не создается
+     std::ofstream out;
+     if( writeOutput )
+     {
+          out.open( dstPath_, std::ios_base::binary | std::ios_base::out );
+          if( !out.is_open() )
+          {
+               throw std::runtime_error( "Create output file error" );
+          }
+     }
+
+     AESCryptography crypt( keyLength );
+     AesRoundKeys roundKeys = crypt.expandKey( key );
+
+     unsigned char chain[ 16 ] = {};
+     std::copy( iv.begin(), iv.end(), chain );
+
+     // концевик с контрольными суммами не является шифртекстом, поэтому читается до конца файла
+     ChecksumTrailer trailer;
+     bool compressed = false;
+     uint64_t remaining = readCompressionMarker( inp, readChecksumTrailer( inp, crypt, roundKeys, trailer ), compressed );
+     const uint64_t cipherSize = remaining;
+     if( checksum_ != CTNone && trailer.type != checksum_ )
+     {
+          throw std::runtime_error( trailer.type == CTNone ? "Checksum not found: input file corrupted" : "Checksum type mismatch" );
+     }
+     if( compression_ && !compressed )
+     {
+          throw std::runtime_error( "Compression marker not found: file was encrypted without compression" );
+     }
+     std::unique_ptr< ChunkedChecksum > checksum;
+     if( trailer.type != CTNone )
+     {
+          checksum.reset( new ChunkedChecksum( trailer.type, trailer.chunkSize ) );
+     }
+     lastChecksumType_ = CTNone;
+     size_t verified = 0;
+
+     // части открытого текста, завершенные в очередном фрагменте, проверяются до записи: поврежденный файл
+     // обнаруживается сразу. Размер открытого текста известен из концевика, поэтому последняя неполная часть
+     // тоже проверяется до записи
+     auto emit = [ & ]( const unsigned char* data, size_t size )
+     {
+          if( checksum )
+          {
+               checkPlainPart( *checksum, trailer, verified, data, size );
+          }
+
+          // выполняем запись открытого текста в указанный файл
+          if( writeOutput )
+          {
+               out.write( ( const char* ) data, size );
+          }
+     };
+     std::vector< unsigned char > carry;
+     std::vector< unsigned char > unpacked;
+
+     // шифртекст в шестнадцатеричном виде занимает вдвое больше места, поэтому за раз читаем половину блока
+     PoolBuffer buffer = pool_.acquire();
+     const size_t chunkSize = hexArmor_ ? buffer.size() / 2 : buffer.size();
+     buffer.markSensitive( chunkSize );
+     std::unique_ptr< ThreadPool > localWorkers;
+     placeBuffers( workers( localWorkers ), { &buffer } );
+
+     const char* cipherPhase = mode == CMCbc ? "CBC decrypt" : mode == CMCtr ? "CTR" : "ECB decrypt";
+     bool last = false;
+     while( !last )
+     {
+          size_t expected = static_cast< size_t >( std::min< uint64_t >( chunkSize, remaining ) );
+          PerfPhase readPhase( perfStats_, "read" );
+          size_t readBytes = readData( inp, buffer.data(), expected );
+          readPhase.finish( readBytes );
+          if( readBytes != expected )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+          remaining -= readBytes;
+          last = remaining == 0;
+          if( readBytes % 16 != 0 && mode != CMCtr )
+          {
+               throw std::runtime_error( "data is not aligned" );
+          }
+          addProgress( hexArmor_ ? 2 * readBytes : readBytes );
+
+          // выполняем расшифрование на месте, части блока расшифровываются параллельно
+          PerfPhase cipher( perfStats_, cipherPhase );
+          decryptBlocksParallel( crypt, roundKeys, mode, buffer.data(), readBytes, chain, workers( localWorkers ) );
+          cipher.finish( readBytes );
+
+          // удаляем дополнение из последней части
+          if( last && mode != CMCtr )
+          {
+               readBytes = removePadding( buffer.data(), readBytes );
+          }
+
+          // распаковка выполняется сразу после расшифрования, пока данные в кэше. Запись включает проверку суммы
+          PerfPhase writePhase( perfStats_, compressed ? "decompress and write" : "write" );
+          if( compressed )
+          {
+               decompressChunk( buffer.data(), readBytes, last, carry, unpacked, workers( localWorkers ), emit );
+          }
+          else
+          {
+               emit( buffer.data(), readBytes );
+          }
+          writePhase.finish( readBytes );
+     }
+
+     if( checksum )
+     {
+          checkPlainTotal( *checksum, trailer, verified );
+          lastChecksumType_ = trailer.type;
+          lastChecksum_ = trailer.total;
+     }
+     return cipherSize;
+}
+
+
+void FileEncryptor::cryptFileSegmented( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv, size_t segmentCount )
+{
+     SegmentedFormat format( keyLengthFromKey( key ), key, iv );
+
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     PosixFile out = PosixFile::create( dstPath_ );
+
+     // размер сегмента кратен размеру блока, поэтому дополнение появляется только в конце сегмента.
+     // Сегментов не больше, чем принимает SegmentedFormat::read: иначе получился бы шифртекст, который нельзя расшифровать
+     const uint64_t plainSize = inp.size();
+     segmentCount = std::max< size_t >( segmentCount, 1 );
+     uint64_t segmentSize = ( ( plainSize + segmentCount - 1 ) / segmentCount + 15 ) / 16 * 16;
+     segmentSize = std::max( segmentSize, static_cast< uint64_t >( SegmentedFormat::minSegmentSize ) );
+     while( ( plainSize + segmentSize - 1 ) / segmentSize > SegmentedFormat::maxSegments )
+     {
+          segmentSize *= 2;
+     }
+     segmentCount = plainSize == 0 ? 1 : ( plainSize + segmentSize - 1 ) / segmentSize;
+
+     SegmentTable table;
+     table.segmentSize = segmentSize;
+     table.entries.resize( segmentCount );
+     for( size_t idx = 0; idx < segmentCount; idx++ )
+     {
+          uint64_t segmentPlainSize = std::min( segmentSize, plainSize - idx * segmentSize );
+          table.entries[ idx ].cipherSize = segmentPlainSize - segmentPlainSize % 16 + 16;
+     }
+
+     std::vector< unsigned char > header = format.serialize( table );
+     out.writeAt( header.data(), header.size(), 0 );
+
+     std::vector< uint64_t > offsets = table.cipherOffsets();
+     std::unique_ptr< ThreadPool > localWorkers;
+     workers( localWorkers, segmentCount ).parallelFor( segmentCount, [ & ]( size_t idx )
+     {
+          cryptSegment( format, inp, out, table, idx, plainSize, offsets[ idx ] );
+     } );
+}
+
+
+void FileEncryptor::decryptFileSegmented( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     SegmentedFormat format( keyLengthFromKey( key ), key, iv );
+
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     SegmentTable table = format.read( inp );
+     PosixFile out = PosixFile::create( dstPath_ );
+
+     std::vector< uint64_t > offsets = table.cipherOffsets();
+     std::vector< uint64_t > plainSizes( table.entries.size() );
+     std::unique_ptr< ThreadPool > localWorkers;
+     workers( localWorkers, table.entries.size() ).parallelFor( table.entries.size(), [ & ]( size_t idx )
+     {
+          plainSizes[ idx ] = decryptSegment( format, inp, out, table, idx, offsets[ idx ] );
+     } );
+
+     // все сегменты, кроме последнего, должны содержать ровно segmentSize байт открытого текста
+     for( size_t idx = 0; idx + 1 < plainSizes.size(); idx++ )
+     {
+          if( plainSizes[ idx ] != table.segmentSize )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+     }
+     out.truncate( ( plainSizes.size() - 1 ) * table.segmentSize + plainSizes.back() );
+}
+
+
+FileEncryptor::VerifyResult FileEncryptor::verifyFileSegmented( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     SegmentedFormat format( keyLengthFromKey( key ), key, iv );
+
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     SegmentTable table = format.read( inp );
+
+     // дополнение есть только в конце каждого сегмента: расшифровывается последний блок сегмента на предыдущем блоке
+     // шифртекста(или IV сегмента), из него же получается размер открытого текста сегмента
+     std::vector< uint64_t > offsets = table.cipherOffsets();
+     std::vector< uint64_t > plainSizes( table.entries.size() );
+     std::unique_ptr< ThreadPool > localWorkers;
+     workers( localWorkers, table.entries.size() ).parallelFor( table.entries.size(), [ & ]( size_t idx )
+     {
+          const uint64_t cipherSize = table.entries[ idx ].cipherSize;
+          unsigned char tail[ 32 ];
+          unsigned char chain[ 16 ];
+          const size_t tailSize = cipherSize >= 32 ? 32 : 16;
+          if( inp.readAt( tail, tailSize, offsets[ idx ] + cipherSize - tailSize ) != tailSize )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+          if( tailSize == 32 )
+          {
+               std::copy( tail, tail + 16, chain );
+          }
+          else
+          {
+               format.segmentIv( idx, table.entries[ idx ].generation, chain );
+          }
+          unsigned char* last = tail + tailSize - 16;
+          format.crypt().decryptBlocksCBC( last, last, 16, format.roundKeys(), chain );
+          plainSizes[ idx ] = cipherSize - 16 + removePadding( last, 16 );
+          addProgress( cipherSize );
+     } );
+
+     for( size_t idx = 0; idx < plainSizes.size(); idx++ )
+     {
+          if( idx + 1 < plainSizes.size() ? plainSizes[ idx ] != table.segmentSize : plainSizes[ idx ] > table.segmentSize )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+     }
+
+     VerifyResult result;
+     result.size = inp.size();
+     result.decrypted = 16 * table.entries.size();
+     result.evidence = "segment table MAC and padding";
+     return result;
+}
+
+
+void FileEncryptor::reencryptFile( const std::vector< unsigned char >& oldKey, CryptMode oldMode, const std::vector< unsigned char >& oldIv,
+                                   const std::vector< unsigned char >& newKey, CryptMode newMode, const std::vector< unsigned char >& newIv )
+{
+     if( oldMode == CMCtr || newMode == CMCtr )
+     {
+          throw std::runtime_error( "reencrypt supports only ECB and CBC modes" );
+     }
+     AESCryptography oldCrypt( keyLengthFromKey( oldKey ) );
+     AESCryptography newCrypt( keyLengthFromKey( newKey ) );
+     checkIv( oldMode, oldIv );
+     checkIv( newMode, newIv );
+
+     // контейнеры с заголовком или картой нельзя перешифровать как сплошной шифртекст CBC/ECB
+     if( !hexArmor_ )
+     {
+          PosixFile source = PosixFile::openRead( srcPath_ );
+          if( SegmentedFormat::detect( source ) || SparseFormat::detect( source ) )
+          {
+               throw std::runtime_error( "reencrypt does not support segmented, incremental and sparse files" );
+          }
+     }
+
+     std::ifstream inp( srcPath_, std::ios_base::binary | std::ios_base::in );
+     if( !inp.is_open() )
+     {
+          throw std::runtime_error( "Input file does not not exist or unavailable" );
+     }
+
+     // шифртекст пишется во временный файл и заменяет результат только после успешной проверки всего открытого текста:
+     // прерванный или отвергнутый запуск не оставляет частичного файла
+     const std::string tempPath = dstPath_ + ".tmp";
+     std::ofstream out( tempPath, std::ios_base::binary | std::ios_base::out );
+     if( !out.is_open() )
+     {
+          throw std::runtime_error( "Create output file error" );
+     }
+
+     AesRoundKeys oldRoundKeys = oldCrypt.expandKey( oldKey );
+     AesRoundKeys newRoundKeys = newCrypt.expandKey( newKey );
+     unsigned char oldChain[ 16 ] = {};
+     unsigned char newChain[ 16 ] = {};
+     std::copy( oldIv.begin(), oldIv.end(), oldChain );
+     std::copy( newIv.begin(), newIv.end(), newChain );
+
+     // концевик не является шифртекстом: перешифровывается только то, что перед ним
+     ChecksumTrailer trailer;
+     bool compressed = false;
+     uint64_t remaining = 0;
+     try
+     {
+          remaining = readCompressionMarker( inp, readChecksumTrailer( inp, oldCrypt, oldRoundKeys, trailer ), compressed );
+     }
+     catch( ... )
+     {
+          out.close();
+          unlink( tempPath.c_str() );
+          throw;
+     }
+     lastChecksumType_ = CTNone;
+
+     struct Chunk
+     {
+          PoolBuffer buffer;
+          size_t size = 0;
+     };
+
+     // дополнение PKCS одинаково для ECB и CBC, поэтому дополненный открытый текст шифруется на новом ключе как есть.
+     // Неверный старый ключ проходит проверку дополнения последней части примерно в одном случае из 256, поэтому
+     // при наличии концевика каждая часть открытого текста(после распаковки записей сжатия) сверяется с его суммами
+     // до перешифрования, и суммы переносятся без пересчета. Без концевика остается только проверка дополнения
+     std::unique_ptr< ThreadPool > localWorkers;
+     ThreadPool& pool = workers( localWorkers );
+     BoundedQueue< Chunk > queue( 2 );
+     std::exception_ptr decryptError;
+     std::thread decryptStage( [ & ]()
+     {
+          try
+          {
+               std::unique_ptr< ChunkedChecksum > checksum;
+               if( trailer.type != CTNone )
+               {
+                    checksum.reset( new ChunkedChecksum( trailer.type, trailer.chunkSize ) );
+               }
+               size_t verified = 0;
+               std::vector< unsigned char > carry;
+               std::vector< unsigned char > unpacked;
+               auto check = [ & ]( const unsigned char* data, size_t size )
+               {
+                    checkPlainPart( *checksum, trailer, verified, data, size );
+               };
+
+               bool last = false;
+               while( !last )
+               {
+                    Chunk chunk;
+                    chunk.buffer = pool_.acquire();
+                    placeBuffers( pool, { &chunk.buffer } );
+                    size_t capacity = std::min( hexArmor_ ? chunk.buffer.size() / 2 : chunk.buffer.size(), reencryptChunkSize );
+                    capacity = static_cast< size_t >( std::min< uint64_t >( capacity, remaining ) );
+                    chunk.buffer.markSensitive( capacity );
+                    chunk.size = readData( inp, chunk.buffer.data(), capacity );
+                    last = chunk.size < capacity || chunk.size == remaining;
+                    remaining -= chunk.size;
+                    if( chunk.size % 16 != 0 )
+                    {
+                         throw std::runtime_error( "data is not aligned" );
+                    }
+
+                    addProgress( hexArmor_ ? 2 * chunk.size : chunk.size );
+                    decryptBlocksParallel( oldCrypt, oldRoundKeys, oldMode, chunk.buffer.data(), chunk.size, oldChain, pool );
+                    size_t plainSize = chunk.size;
+                    if( last )
+                    {
+                         plainSize = removePadding( chunk.buffer.data(), chunk.size );
+                    }
+                    if( checksum && compressed )
+                    {
+                         decompressChunk( chunk.buffer.data(), plainSize, last, carry, unpacked, pool, check );
+                    }
+                    else if( checksum )
+                    {
+                         check( chunk.buffer.data(), plainSize );
+                    }
+                    if( checksum && last )
+                    {
+                         checkPlainTotal( *checksum, trailer, verified );
+                    }
+                    if( !queue.push( std::move( chunk ) ) )
+                    {
+                         break;
+                    }
+               }
+          }
+          catch( ... )
+          {
+               decryptError = std::current_exception();
+          }
+          queue.close();
+     } );
+
+     try
+     {
+          PoolBuffer armorBuffer = hexArmor_ ? pool_.acquire() : PoolBuffer();
+          Chunk chunk;
+          while( queue.pop( chunk ) )
+          {
+               cryptBlocksParallel( newCrypt, newRoundKeys, newMode, chunk.buffer.data(), chunk.size, newChain, pool );
+               writeData( out, chunk.buffer.data(), chunk.size, armorBuffer );
+          }
+
+          // записи сжатия перешифрованы как есть, поэтому метка переносится без изменений, а у проверенных сумм
+          // открытого текста меняются только маски
+          if( !decryptError && compressed )
+          {
+               writeCompressionMarker( out, armorBuffer );
+          }
+          if( !decryptError && trailer.type != CTNone )
+          {
+               const uint64_t total = trailer.total;
+               maskChecksums( newCrypt, newRoundKeys, trailer );
+               std::vector< unsigned char > data = trailer.serialize();
+               writeData( out, data.data(), data.size(), armorBuffer );
+               lastChecksumType_ = trailer.type;
+               lastChecksum_ = total;
+          }
+     }
+     catch( ... )
+     {
+          queue.close();
+          decryptStage.join();
+          out.close();
+          unlink( tempPath.c_str() );
+          throw;
+     }
+
+     decryptStage.join();
+     out.close();
+     if( decryptError || !out || rename( tempPath.c_str(), dstPath_.c_str() ) != 0 )
+     {
+          unlink( tempPath.c_str() );
+          lastChecksumType_ = CTNone;
+          if( decryptError )
+          {
+               std::rethrow_exception( decryptError );
+          }
+          throw std::runtime_error( "Create output file error" );
+     }
+}
+
+
+FileEncryptor::IncrementalStats FileEncryptor::cryptFileIncremental( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv,
+                                                                    uint64_t segmentSize )
+{
+     SegmentedFormat format( keyLengthFromKey( key ), key, iv );
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     const uint64_t plainSize = inp.size();
+     const std::string manifestPath = dstPath_ + ".manifest";
+     const std::string tempPath = dstPath_ + ".tmp";
+
+     // предыдущий шифртекст используется, только если он и манифест подлинны и описывают друг друга
+     PosixFile previous;
+     SegmentTable oldTable;
+     SegmentManifest oldManifest;
+     bool incremental = false;
+     try
+     {
+          previous = PosixFile::openRead( dstPath_ );
+          oldTable = format.read( previous );
+          oldManifest = format.readManifest( PosixFile::openRead( manifestPath ) );
+          unsigned char mac[ 16 ];
+          SegmentedFormat::headerMac( previous, oldTable, mac );
+          incremental = oldManifest.segmentSize == oldTable.segmentSize && oldManifest.digests.size() == oldTable.entries.size() &&
+                        std::equal( mac, mac + 16, oldManifest.cipherMac );
+     }
+     catch( const std::exception& )
+     {
+          incremental = false;
+     }
+
+     // при инкрементальном шифровании сетка сегментов сохраняется, иначе размер сегмента увеличивается до допустимого числа сегментов
+     if( incremental && ( plainSize + oldTable.segmentSize - 1 ) / oldTable.segmentSize > SegmentedFormat::maxSegments )
+     {
+          incremental = false;
+     }
+     if( incremental )
+     {
+          segmentSize = oldTable.segmentSize;
+     }
+     else
+     {
+          segmentSize = std::max< uint64_t >( ( segmentSize + 15 ) / 16 * 16, 16 );
+          while( ( plainSize + segmentSize - 1 ) / segmentSize > SegmentedFormat::maxSegments )
+          {
+               segmentSize *= 2;
+          }
+     }
+     const size_t segmentCount = plainSize == 0 ? 1 : ( plainSize + segmentSize - 1 ) / segmentSize;
+
+     // измененные сегменты получают новое поколение, чтобы их IV не совпадал с IV прежнего содержимого.
+     // без манифеста история поколений неизвестна, поэтому начальное поколение выбирается случайно
+     uint32_t generation = oldManifest.nextGeneration;
+     if( !incremental )
+     {
+          CtrDrbg::threadLocal().generate( reinterpret_cast< unsigned char* >( &generation ), sizeof( generation ) );
+     }
+
+     std::unique_ptr< ThreadPool > localWorkers;
+     ThreadPool& pool = workers( localWorkers, segmentCount );
+
+     SegmentManifest manifest;
+     manifest.segmentSize = segmentSize;
+     manifest.nextGeneration = generation + 1;
+     manifest.digests = segmentDigests( inp, segmentSize, segmentCount, format.digestSeed(), pool );
+
+     SegmentTable table;
+     table.segmentSize = segmentSize;
+     table.entries.resize( segmentCount );
+     std::vector< bool > reuse( segmentCount, false );
+     IncrementalStats stats;
+     stats.segments = segmentCount;
+     for( size_t idx = 0; idx < segmentCount; idx++ )
+     {
+          uint64_t segmentPlainSize = std::min( segmentSize, plainSize - idx * segmentSize );
+          table.entries[ idx ].cipherSize = segmentPlainSize - segmentPlainSize % 16 + 16;
+          table.entries[ idx ].generation = generation;
+          if( incremental && idx < oldTable.entries.size() && manifest.digests[ idx ] == oldManifest.digests[ idx ] &&
+              table.entries[ idx ].cipherSize == oldTable.entries[ idx ].cipherSize )
+          {
+               table.entries[ idx ].generation = oldTable.entries[ idx ].generation;
+               reuse[ idx ] = true;
+          }
+          else
+          {
+               stats.encrypted++;
+          }
+     }
+
+     std::vector< unsigned char > header = format.serialize( table );
+     std::copy( header.end() - 16, header.end(), manifest.cipherMac );
+
+     PosixFile out = PosixFile::create( tempPath );
+     out.writeAt( header.data(), header.size(), 0 );
+     std::vector< uint64_t > offsets = table.cipherOffsets();
+     std::vector< uint64_t > oldOffsets = incremental ? oldTable.cipherOffsets() : std::vector< uint64_t >();
+     pool.parallelFor( segmentCount, [ & ]( size_t idx )
+     {
+          if( reuse[ idx ] )
+          {
+               previous.copyTo( out, oldOffsets[ idx ], offsets[ idx ], table.entries[ idx ].cipherSize );
+          }
+          else
+          {
+               cryptSegment( format, inp, out, table, idx, plainSize, offsets[ idx ] );
+          }
+     } );
+     out.sync();
+
+     // шифртекст заменяется раньше манифеста: после сбоя между ними манифест не совпадет с шифртекстом
+     // и следующий запуск просто зашифрует файл целиком
+     if( rename( tempPath.c_str(), dstPath_.c_str() ) != 0 )
+     {
+          throw std::runtime_error( "Create output file error" );
+     }
+     std::vector< unsigned char > manifestData = format.serializeManifest( manifest );
+     const std::string manifestTemp = manifestPath + ".tmp";
+     PosixFile manifestFile = PosixFile::create( manifestTemp );
+     manifestFile.writeAt( manifestData.data(), manifestData.size(), 0 );
+     manifestFile.sync();
+     if( rename( manifestTemp.c_str(), manifestPath.c_str() ) != 0 )
+     {
+          throw std::runtime_error( "Create output file error" );
+     }
+     PosixFile::syncDirectory( dstPath_ );
+     return stats;
+}
+
+
+void FileEncryptor::cryptFileInPlace( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     processInPlace( false, key, iv );
+}
+
+
+void FileEncryptor::decryptFileInPlace( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     processInPlace( true, key, iv );
+}
+
+
+void FileEncryptor::cryptFileSparse( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     checkIv( CMCtr, iv );
+     if( hexArmor_ )
+     {
+          throw std::runtime_error( "HEX format is not supported for sparse files" );
+     }
+     SparseFormat format( keyLengthFromKey( key ), key, iv );
+
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     PosixFile out = PosixFile::create( dstPath_ );
+
+     // границы участков выравниваются по блоку AES: счетчик участка вычисляется из его смещения
+     SparseMap map;
+     map.plainSize = inp.size();
+     for( const FileExtent& extent: inp.dataExtents() )
+     {
+          uint64_t begin = extent.offset / 16 * 16;
+          uint64_t end = std::min( ( extent.offset + extent.size + 15 ) / 16 * 16, map.plainSize );
+          if( !map.extents.empty() && begin <= map.extents.back().offset + map.extents.back().size )
+          {
+               map.extents.back().size = end - map.extents.back().offset;
+               continue;
+          }
+          map.extents.push_back( { begin, end - begin } );
+     }
+
+     cryptExtents( format.crypt(), format.roundKeys(), iv, inp, out, map.extents );
+     std::vector< unsigned char > trailer = format.serialize( map );
+     out.writeAt( trailer.data(), trailer.size(), map.plainSize );
+}
+
+
+void FileEncryptor::decryptFileSparse( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     checkIv( CMCtr, iv );
+     if( hexArmor_ )
+     {
+          throw std::runtime_error( "HEX format is not supported for sparse files" );
+     }
+     SparseFormat format( keyLengthFromKey( key ), key, iv );
+
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     SparseMap map = format.read( inp );
+
+     // файл нужного размера без данных целиком состоит из дыры, участки записываются на свои места
+     PosixFile out = PosixFile::create( dstPath_ );
+     out.truncate( map.plainSize );
+     cryptExtents( format.crypt(), format.roundKeys(), iv, inp, out, map.extents );
+}
+
+
+FileEncryptor::VerifyResult FileEncryptor::verifyFileSparse( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     checkIv( CMCtr, iv );
+     if( hexArmor_ )
+     {
+          throw std::runtime_error( "HEX format is not supported for sparse files" );
+     }
+     SparseFormat format( keyLengthFromKey( key ), key, iv );
+
+     PosixFile inp = PosixFile::openRead( srcPath_ );
+     format.read( inp );
+
+     VerifyResult result;
+     result.size = inp.size();
+     result.evidence = "extent map MAC";
+     return result;
+}
+
+
+void FileEncryptor::cryptExtents( const AESCryptography& crypt, const AesRoundKeys& roundKeys, const std::vector< unsigned char >& iv,
+                                  const PosixFile& inp, const PosixFile& out, const std::vector< FileExtent >& extents )
+{
+     PoolBuffer buffer = pool_.acquire();
+     buffer.markSensitive( buffer.size() );
+     std::unique_ptr< ThreadPool > localWorkers;
+     placeBuffers( workers( localWorkers ), { &buffer } );
+
+     for( const FileExtent& extent: extents )
+     {
+          for( uint64_t offset = extent.offset; offset < extent.offset + extent.size; )
+          {
+               size_t size = static_cast< size_t >( std::min< uint64_t >( buffer.size(), extent.offset + extent.size - offset ) );
+               if( inp.readAt( buffer.data(), size, offset ) != size )
+               {
+                    throw std::runtime_error( "Input file corrupted" );
+               }
+
+               unsigned char counter[ 16 ];
+               std::copy( iv.begin(), iv.end(), counter );
+               AESCryptography::addCounter( counter, offset / 16 );
+               cryptBlocksParallel( crypt, roundKeys, CMCtr, buffer.data(), size, counter, workers( localWorkers ) );
+
+               out.writeAt( buffer.data(), size, offset );
+               addProgress( size );
+               offset += size;
+          }
+     }
+}
+
+
+void FileEncryptor::setThreadCount( size_t threadCount )
+{
+     threadCount_ = threadCount;
+}
+
+
+void FileEncryptor::setThreadPool( ThreadPool* workers )
+{
+     sharedWorkers_ = workers;
+}
+
+
+void FileEncryptor::setNumaPolicy( NumaPolicy policy )
+{
+     numaPolicy_ = policy;
+}
+
+
+void FileEncryptor::setPerfStats( PerfStats* stats )
+{
+     perfStats_ = stats;
+}
+
+
+void FileEncryptor::setProgressCounter( std::atomic< uint64_t >* counter )
+{
+     progress_ = counter;
+}
+
+
+void FileEncryptor::processInPlace( bool decrypt, const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+{
+     AESCryptography crypt( keyLengthFromKey( key ) );
+     checkIv( CMCtr, iv );
+     if( hexArmor_ )
+     {
+          throw std::runtime_error( "HEX format changes file size and is not supported in place" );
+     }
+
+     PosixFile file = PosixFile::openReadWrite( srcPath_ );
+     AesRoundKeys roundKeys = crypt.expandKey( key );
+
+     // идентификатор операции: CMAC( IV || операция || размер файла ). Журнал другого ключа, IV или файла не принимается
+     CryptJournal::Header header;
+     header.operation = decrypt ? 2 : 1;
+     header.fileSize = file.size();
+     unsigned char idData[ 25 ] = {};
+     std::copy( iv.begin(), iv.end(), idData );
+     idData[ 16 ] = static_cast< unsigned char >( header.operation );
+     for( int idx = 0; idx < 8; idx++ )
+     {
+          idData[ 17 + idx ] = static_cast< unsigned char >( header.fileSize >> ( 8 * idx ) );
+     }
+     crypt.cmac( idData, sizeof( idData ), roundKeys, header.id );
+
+     CryptJournal journal;
+     const bool resume = CryptJournal::exists( dstPath_ );
+     if( resume )
+     {
+          journal = CryptJournal::open( dstPath_ );
+          const CryptJournal::Header& saved = journal.header();
+          if( saved.operation != header.operation || saved.fileSize != header.fileSize || !std::equal( saved.id, saved.id + 16, header.id ) )
+          {
+               throw std::runtime_error( "Journal belongs to another operation or wrong key/iv" );
+          }
+          header.chunkSize = saved.chunkSize;
+     }
+
+     // размер части при продолжении берется из журнала: профиль настройки или огромные страницы могли измениться
+     // между запусками. Если часть не помещается в блок пула, буфер берется из отдельного пула нужного размера
+     std::unique_ptr< BufferPool > journalPool;
+     if( resume && header.chunkSize > pool_.blockSize() )
+     {
+          journalPool.reset( new BufferPool( header.chunkSize ) );
+     }
+     PoolBuffer buffer = ( journalPool ? *journalPool : pool_ ).acquire();
+     buffer.markSensitive( buffer.size() );
+
+     uint64_t nextChunk = 0;
+     if( resume )
+     {
+          // последняя целая запись могла не дойти до файла: повторяем ее и продолжаем со следующей части
+          uint64_t chunkIndex = 0;
+          size_t size = 0;
+          if( journal.lastRecord( chunkIndex, buffer.data(), size ) )
+          {
+               file.writeAt( buffer.data(), size, chunkIndex * header.chunkSize );
+               file.sync();
+               nextChunk = chunkIndex + 1;
+          }
+     }
+     else
+     {
+          header.chunkSize = buffer.size();
+          journal = CryptJournal::create( dstPath_, header );
+     }
+
+     std::unique_ptr< ThreadPool > localWorkers;
+     placeBuffers( workers( localWorkers ), { &buffer } );
+     const uint64_t chunkCount = ( header.fileSize + header.chunkSize - 1 ) / header.chunkSize;
+     for( uint64_t chunk = nextChunk; chunk < chunkCount; chunk++ )
+     {
+          const uint64_t offset = chunk * header.chunkSize;
+          size_t size = static_cast< size_t >( std::min< uint64_t >( header.chunkSize, header.fileSize - offset ) );
+          if( file.readAt( buffer.data(), size, offset ) != size )
+          {
+               throw std::runtime_error( "Input file changed during encryption" );
+          }
+
+          unsigned char counter[ 16 ];
+          std::copy( iv.begin(), iv.end(), counter );
+          AESCryptography::addCounter( counter, offset / 16 );
+          cryptBlocksParallel( crypt, roundKeys, CMCtr, buffer.data(), size, counter, workers( localWorkers ) );
+
+          // часть перезаписывается только после того, как ее новое содержимое сохранено в журнале
+          journal.append( chunk, buffer.data(), size );
+          file.writeAt( buffer.data(), size, offset );
+          file.sync();
+          addProgress( size );
+     }
+
+     journal = CryptJournal();
+     CryptJournal::remove( dstPath_ );
+}
 
 
-FileEncryptor::FileEncryptor( const std::string& srcPath, const std::string& dstPath )
-:srcPath_( srcPath ), dstPath_( dstPath )
+void FileEncryptor::cryptSegment( const SegmentedFormat& format, const PosixFile& inp, const PosixFile& out, const SegmentTable& table,
+                                  size_t index, uint64_t plainSize, uint64_t cipherOffset )
 {
+     const uint64_t plainOffset = index * table.segmentSize;
+     const uint64_t segmentPlainSize = std::min( table.segmentSize, plainSize - plainOffset );
+
+     unsigned char chain[ 16 ];
+     format.segmentIv( index, table.entries[ index ].generation, chain );
+
+     PoolBuffer buffer = pool_.acquire();
+     buffer.markSensitive( buffer.size() );
+     const size_t chunkSize = buffer.size() - 16;
+
+     uint64_t done = 0;
+     bool last = false;
+     while( !last )
+     {
+          size_t size = static_cast< size_t >( std::min< uint64_t >( chunkSize, segmentPlainSize - done ) );
+          if( inp.readAt( buffer.data(), size, plainOffset + done ) != size )
+          {
+               throw std::runtime_error( "Input file changed during encryption" );
+          }
+          last = done + size == segmentPlainSize;
+          addProgress( size );
+
+          size_t cipherSize = last ? addPadding( buffer.data(), size ) : size;
+          format.crypt().cryptBlocksCBC( buffer.data(), buffer.data(), cipherSize, format.roundKeys(), chain );
+          out.writeAt( buffer.data(), cipherSize, cipherOffset + done );
+          done += size;
+     }
 }
 
 
-void FileEncryptor::cryptFile( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv  )
+uint64_t FileEncryptor::decryptSegment( const SegmentedFormat& format, const PosixFile& inp, const PosixFile& out, const SegmentTable& table,
+                                        size_t index, uint64_t cipherOffset )
 {
-     AesKeyLength keyLength = keyLengthFromKey( key );
+     const uint64_t plainOffset = index * table.segmentSize;
+     const uint64_t cipherSize = table.entries[ index ].cipherSize;
 
-     std::ifstream inp( srcPath_, std::ios_base::binary | std::ios_base::in );
-     if( !inp.is_open() )
+     unsigned char chain[ 16 ];
+     format.segmentIv( index, table.entries[ index ].generation, chain );
+
+     PoolBuffer buffer = pool_.acquire();
+     buffer.markSensitive( buffer.size() );
+
+     uint64_t done = 0;
+     uint64_t written = 0;
+     while( done < cipherSize )
      {
-          throw std::runtime_error( "Input file does not not exist or unavailable" );
+          size_t size = static_cast< size_t >( std::min< uint64_t >( buffer.size(), cipherSize - done ) );
+          if( inp.readAt( buffer.data(), size, cipherOffset + done ) != size )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+          format.crypt().decryptBlocksCBC( buffer.data(), buffer.data(), size, format.roundKeys(), chain );
+          addProgress( size );
+          done += size;
+
+          size_t plainChunk = done == cipherSize ? removePadding( buffer.data(), size ) : size;
+          if( written + plainChunk > table.segmentSize )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+          out.writeAt( buffer.data(), plainChunk, plainOffset + written );
+          written += plainChunk;
      }
+     return written;
+}
 
-     std::ofstream out( dstPath_, std::ios_base::binary | std::ios_base::out );
-     if( !out.is_open() )
+
+std::vector< uint64_t > FileEncryptor::segmentDigests( const PosixFile& inp, uint64_t segmentSize, size_t segmentCount, uint64_t seed,
+                                                       ThreadPool& workers )
+{
+     const uint64_t plainSize = inp.size();
+     std::vector< uint64_t > digests( segmentCount );
+     workers.parallelFor( segmentCount, [ & ]( size_t idx )
      {
-          throw std::runtime_error( "Create output file error" );
+          const uint64_t offset = idx * segmentSize;
+          const uint64_t size = std::min( segmentSize, plainSize - offset );
+          PoolBuffer buffer = pool_.acquire();
+          buffer.markSensitive( static_cast< size_t >( std::min< uint64_t >( buffer.size(), size ) ) );
+          Xxh64 digest( seed );
+          for( uint64_t done = 0; done < size; )
+          {
+               size_t count = static_cast< size_t >( std::min< uint64_t >( buffer.size(), size - done ) );
+               if( inp.readAt( buffer.data(), count, offset + done ) != count )
+               {
+                    throw std::runtime_error( "Input file changed during encryption" );
+               }
+               digest.update( buffer.data(), count );
+               done += count;
+          }
+          digests[ idx ] = digest.digest();
+     } );
+     return digests;
+}
+
+
+size_t FileEncryptor::compressChunk( const unsigned char* src, size_t size, unsigned char* dst, size_t blockSize, ThreadPool& workers )
+{
+     // блоки сжимаются параллельно, каждый в свою область dst, затем записи сдвигаются вплотную друг к другу
+     const size_t slotSize = blockSize + compressRecordHeader;
+     const size_t blockCount = ( size + blockSize - 1 ) / blockSize;
+     std::vector< size_t > recordSizes( blockCount );
+     workers.parallelFor( blockCount, [ & ]( size_t idx )
+     {
+          const unsigned char* block = src + idx * blockSize;
+          const size_t plainSize = std::min( blockSize, size - idx * blockSize );
+          unsigned char* record = dst + idx * slotSize;
+
+          // сжатие имеет смысл, только если результат короче исходного блока
+          uint32_t storedSize = static_cast< uint32_t >( LzCodec::compress( block, plainSize, record + compressRecordHeader, plainSize - 1 ) );
+          uint32_t flags = 0;
+          if( storedSize == 0 )
+          {
+               memcpy( record + compressRecordHeader, block, plainSize );
+               storedSize = static_cast< uint32_t >( plainSize );
+               flags = 0x80000000;
+          }
+          for( int byte = 0; byte < 4; byte++ )
+          {
+               record[ byte ] = static_cast< unsigned char >( ( storedSize | flags ) >> ( 8 * byte ) );
+               record[ 4 + byte ] = static_cast< unsigned char >( plainSize >> ( 8 * byte ) );
+          }
+          recordSizes[ idx ] = compressRecordHeader + storedSize;
+     } );
+
+     size_t packedSize = 0;
+     for( size_t idx = 0; idx < blockCount; idx++ )
+     {
+          memmove( dst + packedSize, dst + idx * slotSize, recordSizes[ idx ] );
+          packedSize += recordSizes[ idx ];
      }
+     return packedSize;
+}
+
+
+void FileEncryptor::decompressChunk( const unsigned char* data, size_t size, bool last, std::vector< unsigned char >& carry,
+                                     std::vector< unsigned char >& unpacked, ThreadPool& workers,
+                                     const std::function< void( const unsigned char*, size_t ) >& emit )
+{
+     struct Record
+     {
+          const unsigned char* data = nullptr;
+          size_t storedSize = 0;
+          size_t plainSize = 0;
+          bool raw = false;
+     };
+
+     // разбирает заголовок записи и проверяет его согласованность
+     auto parseHeader = [ & ]( const unsigned char* header )
+     {
+          Record record;
+          uint32_t stored = 0;
+          uint32_t plain = 0;
+          for( int byte = 3; byte >= 0; byte-- )
+          {
+               stored = ( stored << 8 ) | header[ byte ];
+               plain = ( plain << 8 ) | header[ 4 + byte ];
+          }
+          record.raw = ( stored & 0x80000000 ) != 0;
+          record.storedSize = stored & 0x7fffffff;
+          record.plainSize = plain;
+          if( plain == 0 || plain > compressBlockSize || ( record.raw ? record.storedSize != plain : record.storedSize >= plain ) )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+          return record;
+     };
 
-     std::vector< unsigned char > data;
+     auto unpack = [ & ]( const Record& record, unsigned char* dst )
+     {
+          if( record.raw )
+          {
+               memcpy( dst, record.data, record.plainSize );
+          }
+          else if( !LzCodec::decompress( record.data, record.storedSize, dst, record.plainSize ) )
+          {
+               throw std::runtime_error( "Input file corrupted" );
+          }
+     };
 
-     // выполняем чтение из файла
-     const int tmpSize = 1024;
-     std::vector< unsigned char > tmpArr( tmpSize );
-     while( inp.good() )
+     // дописываем запись, начатую в предыдущей части
+     size_t offset = 0;
+     if( !carry.empty() )
      {
-          std::streamsize readBytes = inp.read( ( char* ) tmpArr.data(), tmpSize ).gcount();
-          if( readBytes != 0 )
+          size_t headerBytes = carry.size() < compressRecordHeader ? std::min( compressRecordHeader - carry.size(), size ) : 0;
+          carry.insert( carry.end(), data, data + headerBytes );
+          offset = headerBytes;
+          if( carry.size() >= compressRecordHeader )
           {
-               data.insert( data.end(), tmpArr.begin(), tmpArr.begin() + readBytes );
+               Record record = parseHeader( carry.data() );
+               size_t bodyBytes = std::min( compressRecordHeader + record.storedSize - carry.size(), size - offset );
+               carry.insert( carry.end(), data + offset, data + offset + bodyBytes );
+               offset += bodyBytes;
+               if( carry.size() == compressRecordHeader + record.storedSize )
+               {
+                    record.data = carry.data() + compressRecordHeader;
+                    unpacked.resize( record.plainSize );
+                    unpack( record, unpacked.data() );
+                    emit( unpacked.data(), record.plainSize );
+                    carry.clear();
+               }
           }
      }
 
-     // выполняем дополнение
-     addPadding( data );
+     // целые записи части
+     std::vector< Record > records;
+     if( carry.empty() )
+     {
+          while( size - offset >= compressRecordHeader )
+          {
+               Record record = parseHeader( data + offset );
+               if( size - offset - compressRecordHeader < record.storedSize )
+               {
+                    break;
+               }
+               record.data = data + offset + compressRecordHeader;
+               records.push_back( record );
+               offset += compressRecordHeader + record.storedSize;
+          }
+          carry.assign( data + offset, data + size );
+     }
+     if( last && !carry.empty() )
+     {
+          throw std::runtime_error( "Input file corrupted" );
+     }
 
-     // выполняем шифрование
-     std::vector< unsigned char > encryptedData;
-     AESCryptography crypt( keyLength );
-     if( mode == CMCbc )
+     // записи распаковываются параллельно группами, открытый текст группы не превышает groupSize
+     const size_t groupSize = std::max( pool_.blockSize(), static_cast< size_t >( compressBlockSize ) );
+     for( size_t begin = 0; begin < records.size(); )
      {
-          encryptedData = crypt.cryptDataCBC( data, key, iv );
+          std::vector< size_t > offsets( 1, 0 );
+          size_t end = begin;
+          for( ; end < records.size() && offsets.back() + records[ end ].plainSize <= groupSize; end++ )
+          {
+               offsets.push_back( offsets.back() + records[ end ].plainSize );
+          }
+          unpacked.resize( offsets.back() );
+          workers.parallelFor( end - begin, [ & ]( size_t idx )
+          {
+               unpack( records[ begin + idx ], unpacked.data() + offsets[ idx ] );
+          } );
+          emit( unpacked.data(), offsets.back() );
+          begin = end;
      }
-     else
+}
+
+
+uint64_t FileEncryptor::readChecksumTrailer( std::istream& inp, const AESCryptography& crypt, const AesRoundKeys& roundKeys,
+                                            ChecksumTrailer& trailer )
+{
+     // в шестнадцатеричном виде каждый байт занимает два символа
+     const uint64_t scale = hexArmor_ ? 2 : 1;
+     inp.seekg( 0, std::ios_base::end );
+     const uint64_t fileSize = static_cast< uint64_t >( inp.tellg() );
+     if( fileSize % scale != 0 )
+     {
+          throw std::runtime_error( "Input file corrupted" );
+     }
+
+     // readData декодирует шестнадцатеричный текст на месте, поэтому буферы рассчитаны на scale * размер
+     uint64_t cipherSize = fileSize / scale;
+     const size_t footerSize = ChecksumTrailer::footerSize;
+     if( cipherSize >= footerSize )
      {
-          encryptedData = crypt.cryptDataECB( data, key );
+          std::vector< unsigned char > footer( footerSize * scale );
+          inp.seekg( ( cipherSize - footerSize ) * scale );
+          if( readData( inp, footer.data(), footerSize ) == footerSize && trailer.parseFooter( footer.data(), cipherSize - footerSize ) )
+          {
+               const size_t digestsSize = trailer.digests.size() * 8;
+               std::vector< unsigned char > digests( digestsSize * scale );
+               cipherSize -= trailer.size();
+               inp.seekg( cipherSize * scale );
+               if( readData( inp, digests.data(), digestsSize ) != digestsSize )
+               {
+                    throw std::runtime_error( "Input file corrupted" );
+               }
+               trailer.parseDigests( digests.data() );
+               maskChecksums( crypt, roundKeys, trailer );
+          }
      }
 
-     out.write( ( char* ) encryptedData.data(), encryptedData.size() );
+     inp.clear();
+     inp.seekg( 0 );
+     return cipherSize;
 }
 
 
-void FileEncryptor::decryptFile( const std::vector<unsigned char>& key, CryptMode mode, const std::vector< unsigned char >& iv )
+uint64_t FileEncryptor::readCompressionMarker( std::istream& inp, uint64_t cipherSize, bool& compressed )
 {
-     AesKeyLength keyLength = keyLengthFromKey( key );
+     const uint64_t scale = hexArmor_ ? 2 : 1;
+     compressed = false;
+     if( cipherSize >= compressMarkerSize )
+     {
+          unsigned char marker[ 2 * compressMarkerSize ];
+          inp.clear();
+          inp.seekg( ( cipherSize - compressMarkerSize ) * scale );
+          if( readData( inp, marker, compressMarkerSize ) == compressMarkerSize &&
+              memcmp( marker + 8, compressMagic, sizeof( compressMagic ) ) == 0 )
+          {
+               uint64_t blockSize = 0;
+               for( int idx = 7; idx >= 0; idx-- )
+               {
+                    blockSize = ( blockSize << 8 ) | marker[ idx ];
+               }
+               if( blockSize == 0 || blockSize > compressBlockSize )
+               {
+                    throw std::runtime_error( "Input file corrupted" );
+               }
+               compressed = true;
+               cipherSize -= compressMarkerSize;
+          }
+     }
 
-     std::ifstream inp( srcPath_, std::ios_base::binary | std::ios_base::in );
-     if( !inp.is_open() )
+     inp.clear();
+     inp.seekg( 0 );
+     return cipherSize;
+}
+
+
+void FileEncryptor::writeCompressionMarker( std::ostream& out, const PoolBuffer& armorBuffer )
+{
+     unsigned char marker[ compressMarkerSize ] = {};
+     for( int idx = 0; idx < 8; idx++ )
      {
-          throw std::runtime_error( "Input file does not not exist or unavailable" );
+          marker[ idx ] = static_cast< unsigned char >( static_cast< uint64_t >( compressBlockSize ) >> ( 8 * idx ) );
      }
+     memcpy( marker + 8, compressMagic, sizeof( compressMagic ) );
+     writeData( out, marker, sizeof( marker ), armorBuffer );
+}
 
-     std::ofstream out( dstPath_, std::ios_base::binary | std::ios_base::out );
-     if( !out.is_open() )
+
+void FileEncryptor::checkPlainPart( ChunkedChecksum& checksum, const ChecksumTrailer& trailer, size_t& verified,
+                                    const unsigned char* data, size_t size )
+{
+     if( checksum.totalSize() + size > trailer.plainSize )
      {
-          throw std::runtime_error( "Create output file error" );
+          throw std::runtime_error( "Checksum mismatch: input file corrupted" );
+     }
+     checksum.update( data, size );
+     if( checksum.totalSize() == trailer.plainSize )
+     {
+          checksum.finish();
+     }
+     const std::vector< uint64_t >& digests = checksum.chunkDigests();
+     for( ; verified < digests.size(); verified++ )
+     {
+          if( verified >= trailer.digests.size() || digests[ verified ] != trailer.digests[ verified ] )
+          {
+               throw std::runtime_error( "Checksum mismatch: input file corrupted" );
+          }
      }
+}
+
+
+void FileEncryptor::checkPlainTotal( const ChunkedChecksum& checksum, const ChecksumTrailer& trailer, size_t verified )
+{
+     if( checksum.totalSize() != trailer.plainSize || verified != trailer.digests.size() || checksum.totalDigest() != trailer.total )
+     {
+          throw std::runtime_error( "Checksum mismatch: input file corrupted" );
+     }
+}
 
-     std::vector< unsigned char > data;
 
-     // выполняем чтение шифртекста из файла
-     const int tmpSize = 1024;
-     std::vector< unsigned char > tmpArr( tmpSize );
-     while( inp.good() )
+void FileEncryptor::maskChecksums( const AESCryptography& crypt, const AesRoundKeys& roundKeys, ChecksumTrailer& trailer )
+{
+     auto mask = [ & ]( uint64_t index )
      {
-          std::streamsize readBytes = inp.read( ( char* ) tmpArr.data(), tmpSize ).gcount();
-          if( readBytes != 0 )
+          unsigned char block[ 16 ] = { 'S', 'U', 'M' };
+          for( int idx = 0; idx < 8; idx++ )
           {
-               data.insert( data.end(), tmpArr.begin(), tmpArr.begin() + readBytes );
+               block[ 8 + idx ] = static_cast< unsigned char >( index >> ( 8 * idx ) );
           }
+          crypt.cryptBlocksECB( block, block, 16, roundKeys );
+          uint64_t value = 0;
+          for( int idx = 7; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | block[ idx ];
+          }
+          return value;
+     };
+
+     for( size_t idx = 0; idx < trailer.digests.size(); idx++ )
+     {
+          trailer.digests[ idx ] ^= mask( idx );
      }
+     trailer.total ^= mask( UINT64_MAX );
+}
 
-     // выполняем расшифрование
-     std::vector< unsigned char > decryptedData;
-     AESCryptography crypt( keyLength );
+
+void FileEncryptor::cryptBlocksParallel( const AESCryptography& crypt, const AesRoundKeys& roundKeys, CryptMode mode,
+                                         unsigned char* data, size_t size, unsigned char chain[ 16 ], ThreadPool& workers )
+{
+     // каждый блок CBC зависит от предыдущего блока шифртекста, поэтому шифрование CBC не распараллеливается
      if( mode == CMCbc )
      {
-          decryptedData = crypt.decryptDataCBC( data, key, iv );
+          crypt.cryptBlocksCBC( data, data, size, roundKeys, chain );
+          return;
      }
-     else
+
+     // в режиме CTR счетчик части вычисляется по ее смещению
+     const size_t partSize = std::max< size_t >( ( size / workers.threadCount() + 15 ) / 16 * 16, 4096 );
+     workers.parallelFor( ( size + partSize - 1 ) / partSize, [ & ]( size_t part )
+     {
+          size_t offset = part * partSize;
+          size_t partBytes = std::min( partSize, size - offset );
+          if( mode == CMCtr )
+          {
+               unsigned char counter[ 16 ];
+               std::copy( chain, chain + 16, counter );
+               AESCryptography::addCounter( counter, offset / 16 );
+               crypt.cryptBlocksCTR( data + offset, data + offset, partBytes, roundKeys, counter );
+          }
+          else
+          {
+               crypt.cryptBlocksECB( data + offset, data + offset, partBytes, roundKeys );
+          }
+     } );
+     if( mode == CMCtr )
+     {
+          AESCryptography::addCounter( chain, ( size + 15 ) / 16 );
+     }
+}
+
+
+void FileEncryptor::decryptBlocksParallel( const AESCryptography& crypt, const AesRoundKeys& roundKeys, CryptMode mode,
+                                           unsigned char* data, size_t size, unsigned char chain[ 16 ], ThreadPool& workers )
+{
+     if( size == 0 )
+     {
+          return;
+     }
+     if( mode == CMCtr )
+     {
+          cryptBlocksParallel( crypt, roundKeys, mode, data, size, chain, workers );
+          return;
+     }
+
+     const size_t partSize = std::max< size_t >( ( size / workers.threadCount() + 15 ) / 16 * 16, 4096 );
+     const size_t partCount = ( size + partSize - 1 ) / partSize;
+
+     // при расшифровании CBC каждой части нужен только последний блок шифртекста предыдущей части.
+     // запоминаем эти блоки до расшифрования на месте
+     std::vector< unsigned char > partIvs;
+     if( mode == CMCbc )
+     {
+          partIvs.resize( 16 * partCount );
+          std::copy( chain, chain + 16, partIvs.begin() );
+          for( size_t part = 1; part < partCount; part++ )
+          {
+               std::copy( data + part * partSize - 16, data + part * partSize, partIvs.begin() + 16 * part );
+          }
+          std::copy( data + size - 16, data + size, chain );
+     }
+
+     workers.parallelFor( partCount, [ & ]( size_t part )
+     {
+          size_t offset = part * partSize;
+          size_t partBytes = std::min( partSize, size - offset );
+          if( mode == CMCbc )
+          {
+               crypt.decryptBlocksCBC( data + offset, data + offset, partBytes, roundKeys, partIvs.data() + 16 * part );
+          }
+          else
+          {
+               crypt.decryptBlocksECB( data + offset, data + offset, partBytes, roundKeys );
+          }
+     } );
+}
+
+
+ThreadPool& FileEncryptor::workers( std::unique_ptr< ThreadPool >& localWorkers, size_t maxThreads )
+{
+     if( sharedWorkers_ != nullptr )
+     {
+          return *sharedWorkers_;
+     }
+     if( !localWorkers )
+     {
+          size_t threadCount = threadCount_ != 0 ? threadCount_ : TuningProfile::active().threadCount;
+          if( threadCount == 0 )
+          {
+               threadCount = ThreadPool::hardwareThreads();
+          }
+          localWorkers.reset( new ThreadPool( maxThreads == 0 ? threadCount : std::min( threadCount, maxThreads ), numaPolicy_ ) );
+     }
+     return *localWorkers;
+}
+
+
+void FileEncryptor::placeBuffers( const ThreadPool& workers, std::initializer_list< const PoolBuffer* > buffers )
+{
+     for( const PoolBuffer* buffer: buffers )
+     {
+          if( buffer->data() != nullptr )
+          {
+               workers.placeMemory( buffer->data(), buffer->size() );
+          }
+     }
+}
+
+
+void FileEncryptor::addProgress( uint64_t bytes )
+{
+     if( progress_ != nullptr )
+     {
+          progress_->fetch_add( bytes, std::memory_order_relaxed );
+     }
+}
+
+
+void FileEncryptor::checkIv( CryptMode mode, const std::vector< unsigned char >& iv )
+{
+     if( mode != CMEcb && iv.size() != 16 )
+     {
+          throw std::runtime_error( "iv has not valid size" );
+     }
+}
+
+
+void FileEncryptor::setHexArmor( bool enabled )
+{
+     hexArmor_ = enabled;
+}
+
+
+void FileEncryptor::setCompression( bool enabled )
+{
+     compression_ = enabled;
+}
+
+
+void FileEncryptor::setChecksum( ChecksumType type )
+{
+     checksum_ = type;
+}
+
+
+ChecksumType FileEncryptor::lastChecksumType() const
+{
+     return lastChecksumType_;
+}
+
+
+uint64_t FileEncryptor::lastChecksum() const
+{
+     return lastChecksum_;
+}
+
+
+size_t FileEncryptor::readData( std::istream& inp, unsigned char* data, size_t size )
+{
+     if( !hexArmor_ )
      {
-          decryptedData = crypt.decryptDataECB( data, key );
+          return inp.read( ( char* ) data, size ).gcount();
+     }
+
+     // декодируем на месте: результат всегда короче исходных данных
+     size_t readChars = inp.read( ( char* ) data, 2 * size ).gcount();
+     if( !HexCodec::decode( ( const char* ) data, readChars, data ) )
+     {
+          throw std::runtime_error( "Input file corrupted" );
      }
+     return readChars / 2;
+}
+
 
-     // удаляем дополнение
-     removePadding( decryptedData );
+void FileEncryptor::writeData( std::ostream& out, const unsigned char* data, size_t size, const PoolBuffer& armorBuffer )
+{
+     if( !hexArmor_ )
+     {
+          out.write( ( const char* ) data, size );
+          return;
+     }
 
-     // выполняем запись открытого текста в указанный файл
-     out.write( ( char* ) decryptedData.data(), decryptedData.size() );
+     const size_t step = armorBuffer.size() / 2;
+     for( size_t offset = 0; offset < size; offset += step )
+     {
+          size_t count = std::min( step, size - offset );
+          HexCodec::encode( data + offset, count, ( char* ) armorBuffer.data() );
+          out.write( ( const char* ) armorBuffer.data(), 2 * count );
+     }
 }
 
 
-void FileEncryptor::addPadding( std::vector<unsigned char>& data )
+size_t FileEncryptor::addPadding( unsigned char* data, size_t size )
 {
-     int paddingSize = 16 - ( data.size() % 16 );
+     int paddingSize = 16 - ( size % 16 );
 
-     std::vector< unsigned char > padding( paddingSize, paddingSize );
-     data.insert( data.end(), padding.begin(), padding.end() );
+     std::fill( data + size, data + size + paddingSize, paddingSize );
+     return size + paddingSize;
 }
 
 
-void FileEncryptor::removePadding( std::vector<unsigned char>& data )
+size_t FileEncryptor::removePadding( const unsigned char* data, size_t size )
 {
-     if( data.empty() )
+     if( size == 0 )
      {
           throw std::runtime_error( "Input file corrupted" );
      }
-     int paddingSize = *data.rbegin();
-     if( data.size() < paddingSize )
+     size_t paddingSize = data[ size - 1 ];
+     if( paddingSize == 0 || paddingSize > 16 || size < paddingSize )
      {
           throw std::runtime_error( "Input file corrupted" );
      }
-     for( int cnt = paddingSize; cnt > 0; cnt-- )
+     for( size_t idx = size - paddingSize; idx < size; idx++ )
      {
-          if( *data.rbegin() != paddingSize )
+          if( data[ idx ] != paddingSize )
           {
                throw std::runtime_error( "Input file corrupted" );
           }
-          data.pop_back();
      }
+     return size - paddingSize;
 }
 
 
@@ -162,16 +1710,38 @@ AesKeyLength FileEncryptor::keyLengthFromKey( const std::vector< unsigned char >
 
 std::vector< unsigned char > FileEncryptor::hexToArray( const std::string& str )
 {
-     if( str.size() % 2 != 0 )
+     std::vector< unsigned char > result( str.size() / 2 );
+     if( !HexCodec::decode( str.data(), str.size(), result.data() ) )
      {
           throw std::runtime_error( "Incorrect HEX value" );
      }
-     std::vector< unsigned char > result;
+     return result;
+}
+
+
+std::vector< unsigned char > FileEncryptor::readBinaryFile( const std::string& path, size_t maxSize )
+{
+     int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+     if( fd < 0 )
+     {
+          throw std::runtime_error( "Could not open file: " + path );
+     }
 
-     for(int idx = 0; idx < str.size(); idx += 2)
+     struct stat info{};
+     if( fstat( fd, &info ) != 0 || !S_ISREG( info.st_mode ) || static_cast< size_t >( info.st_size ) > maxSize )
      {
-          result.push_back(static_cast<unsigned char>(std::stoi(str.substr(idx, 2), nullptr, 16)));
+          close( fd );
+          throw std::runtime_error( "Incorrect file: " + path );
      }
 
+     // читаем на один байт больше, чтобы обнаружить файл, выросший после fstat
+     std::vector< unsigned char > result( info.st_size + 1 );
+     ssize_t readBytes = read( fd, result.data(), result.size() );
+     close( fd );
+     if( readBytes != info.st_size )
+     {
+          throw std::runtime_error( "Could not read file: " + path );
+     }
+     result.resize( readBytes );
      return result;
 }
@@ -1,33 +1,254 @@
+#pragma once
+
 #include "AES_cryptography.h"
+#include "buffer_pool.h"
+#include "checksum.h"
+#include "file_io.h"
+#include "segmented_format.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <iosfwd>
+#include <memory>
 #include <vector>
 #include <string>
 
+class PerfStats;
+
 
 enum CryptMode
 {
      CMCbc,
-     CMEcb
+     CMEcb,
+     CMCtr          // режим счетчика: шифртекст равен открытому тексту по размеру, дополнение не используется
+};
+
+// надежность проверки шифртекста без записи открытого текста
+enum VerifyStrength
+{
+     VSNone,        // проверять нечего: шифртекст CTR без контрольной суммы и сжатия расшифровывается любым ключом
+     VSPadding,     // только дополнение PKCS#7 последнего блока: неверный ключ проходит примерно в одном случае из 256
+     VSFull         // контрольные суммы, записи сжатия или имитовставка
 };
 
 class FileEncryptor
 {
 public:
-     FileEncryptor( const std::string& srcPath, const std::string& dstPath );
+     // результат инкрементального шифрования
+     struct IncrementalStats
+     {
+          size_t segments = 0;          // число сегментов в новом шифртексте
+          size_t encrypted = 0;         // из них зашифровано заново, остальные скопированы из предыдущего шифртекста
+     };
+
+     // результат проверки шифртекста без записи открытого текста
+     struct VerifyResult
+     {
+          uint64_t size = 0;            // размер проверенного файла
+          uint64_t decrypted = 0;       // сколько байт шифртекста пришлось расшифровать
+          std::string evidence;         // чем подтверждена целостность: дополнение, контрольная сумма, имитовставка
+          VerifyStrength strength = VSFull;
+     };
+
+     // все рабочие буферы берутся из pool. Для пакетной обработки файлов следует передавать общий пул
+     FileEncryptor( const std::string& srcPath, const std::string& dstPath, BufferPool& pool = BufferPool::defaultPool() );
      void cryptFile( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv = {} );
      void decryptFile( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv = {} );
 
+     // проверяет, что srcPath расшифровывается без ошибок, не создавая dstPath: ошибки те же, что у decryptFile.
+     // Без контрольной суммы и сжатия в CBC и ECB достаточно проверить размер и дополнение последнего блока, остальной
+     // шифртекст не расшифровывается. С концевиком или сжатием шифртекст расшифровывается параллельно, как в decryptFile,
+     // и сверяется с суммами концевика. CTR без суммы проверить нечем, проверяется только чтение файла
+     VerifyResult verifyFile( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv = {} );
+
+     // шифрует файл в сегментированном формате(см. SegmentedFormat): открытый текст делится на segmentCount сегментов,
+     // каждый из которых шифруется в режиме CBC со своим IV. Сегменты шифруются и расшифровываются параллельно
+     void cryptFileSegmented( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv, size_t segmentCount );
+     void decryptFileSegmented( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     // проверяет имитовставку заголовка и дополнение последнего блока каждого сегмента(сегменты проверяются параллельно)
+     VerifyResult verifyFileSegmented( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     // инкрементальное шифрование в сегментированном формате. Рядом с шифртекстом хранится манифест dstPath.manifest
+     // с хешами открытого текста сегментов. Если шифртекст и манифест от предыдущего запуска на том же ключе и IV
+     // согласованы, заново шифруются только сегменты с изменившимся хешем(с новым поколением IV), а остальные
+     // копируются из старого шифртекста. Иначе файл шифруется целиком сегментами по segmentSize байт.
+     // Результат пишется во временный файл и атомарно заменяет предыдущий
+     IncrementalStats cryptFileIncremental( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv, uint64_t segmentSize );
+
+     // шифрует/расшифровывает файл srcPath на месте в режиме CTR без второй копии на диске. dstPath - путь журнала:
+     // новое содержимое каждой части сначала сохраняется в журнал и только затем перезаписывается в файле.
+     // Если журнал уже существует, прерванная операция продолжается с части, на которой она остановилась
+     void cryptFileInPlace( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+     void decryptFileInPlace( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     // шифрует разреженный файл в режиме CTR(см. SparseFormat): шифруются только участки с данными, дыры остаются
+     // дырами и в шифртексте, а карта участков записывается в концевик. Время и занятое место зависят от объема данных,
+     // а не от размера файла. Расшифрование восстанавливает те же дыры
+     void cryptFileSparse( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+     void decryptFileSparse( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     // проверяет имитовставку карты участков: шифртекст CTR сверх нее проверить нечем
+     VerifyResult verifyFileSparse( const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     // перешифровывает файл за один проход: шифртекст на старом ключе/режиме/IV расшифровывается частями и сразу шифруется
+     // на новом. Открытый текст существует только в небольшом буфере. Стадии расшифрования и шифрования выполняются
+     // одновременно, а внутри стадии блоки распределяются между потоками, если режим это позволяет.
+     // Концевик с контрольными суммами переносится: каждая часть открытого текста сверяется с его суммами до перешифрования,
+     // суммы не меняются, маски вычисляются на новом ключе. Результат пишется во временный файл и заменяет dstPath только
+     // после успешного завершения. Сегментированный и разреженный форматы не перешифровываются
+     void reencryptFile( const std::vector< unsigned char >& oldKey, CryptMode oldMode, const std::vector< unsigned char >& oldIv,
+                         const std::vector< unsigned char >& newKey, CryptMode newMode, const std::vector< unsigned char >& newIv );
+
+     // число потоков для параллельных режимов. 0 - по числу аппаратных потоков
+     void setThreadCount( size_t threadCount );
+
+     // общий пул потоков для параллельных режимов(например, при обработке каталога). Если пул не задан,
+     // он создается на время операции из setThreadCount потоков
+     void setThreadPool( ThreadPool* workers );
+
+     // размещение потоков и буферов на узлах NUMA для собственного пула потоков(см. ThreadPool)
+     void setNumaPolicy( NumaPolicy policy );
+
+     // накопитель аппаратных счетчиков по стадиям cryptFile/decryptFile(чтение, шифрование, запись ...). nullptr - без замеров
+     void setPerfStats( PerfStats* stats );
+
+     // счетчик обработанных байтов исходного файла для отображения прогресса
+     void setProgressCounter( std::atomic< uint64_t >* counter );
+
+     // включает запись шифртекста в шестнадцатеричном виде(и его чтение при расшифровании)
+     void setHexArmor( bool enabled );
+
+     // cryptFile вычисляет контрольную сумму открытого текста в том же проходе, что и шифрование, и дописывает
+     // ее в концевик шифртекста(см. ChecksumTrailer) вместе с суммами частей по checksumChunkSize байт.
+     // decryptFile находит концевик сам и проверяет каждую часть до записи ее открытого текста. Если сумма задана
+     // при расшифровании, файл без концевика или с суммой другого типа считается поврежденным
+     void setChecksum( ChecksumType type );
+
+     // включает сжатие открытого текста перед шифрованием в cryptFile(и распаковку в decryptFile). Открытый текст
+     // делится на блоки по compressBlockSize байт, которые сжимаются LzCodec параллельно; несжимаемый блок
+     // сохраняется как есть. Шифруется поток записей: размер сжатых данных(4, старший бит - блок без сжатия) |
+     // размер открытого текста блока(4) | данные. После шифртекста(перед концевиком с суммами) пишется метка
+     // сжатого потока: размер блока сжатия(8) | "AESLZB01". decryptFile находит метку сам и распаковывает записи.
+     // Если сжатие задано при расшифровании, файл без метки отвергается как зашифрованный без сжатия
+     void setCompression( bool enabled );
+
+     // тип и значение контрольной суммы открытого текста после последнего cryptFile/decryptFile(CTNone - суммы нет)
+     ChecksumType lastChecksumType() const;
+     uint64_t lastChecksum() const;
+
      static std::vector< unsigned char > hexToArray( const std::string& str );
+
+     // шифрует/расшифровывает size байт на месте. ECB, CTR и расшифрование CBC выполняются параллельно в workers,
+     // шифрование CBC - последовательно. chain - последний блок шифртекста для режима CBC или счетчик для CTR
+     static void cryptBlocksParallel( const AESCryptography& crypt, const AesRoundKeys& roundKeys, CryptMode mode,
+                                      unsigned char* data, size_t size, unsigned char chain[ 16 ], ThreadPool& workers );
+     static void decryptBlocksParallel( const AESCryptography& crypt, const AesRoundKeys& roundKeys, CryptMode mode,
+                                        unsigned char* data, size_t size, unsigned char chain[ 16 ], ThreadPool& workers );
+
+     // читает файл с ключом или вектором инициализации в бинарном виде одним системным вызовом.
+     // файл большего, чем maxSize, размера считается некорректным
+     static std::vector< unsigned char > readBinaryFile( const std::string& path, size_t maxSize );
+
+     // методы создания и удаления дополнения по методу PKCS. Возвращают новый размер данных.
+     // addPadding требует 16 свободных байт после data + size
+     static size_t addPadding( unsigned char* data, size_t size );
+     static size_t removePadding( const unsigned char* data, size_t size );
 private:
-     // методы создания и удаления дополнения по методу PKCS
-     void addPadding( std::vector< unsigned char >& data );
-     void removePadding( std::vector< unsigned char >& data );
+
+     // расшифровывает файл потоково. Без writeOutput открытый текст только проверяется и никуда не записывается.
+     // Возвращает размер расшифрованного шифртекста
+     uint64_t decryptStream( const std::vector< unsigned char >& key, CryptMode mode, const std::vector< unsigned char >& iv, bool writeOutput );
+
+     // чтение/запись данных с учетом шестнадцатеричного представления шифртекста
+     size_t readData( std::istream& inp, unsigned char* data, size_t size );
+     void writeData( std::ostream& out, const unsigned char* data, size_t size, const PoolBuffer& armorBuffer );
+
+     // читает концевик с контрольными суммами, если он есть, и снимает с сумм маски. Возвращает размер шифртекста без концевика
+     uint64_t readChecksumTrailer( std::istream& inp, const AESCryptography& crypt, const AesRoundKeys& roundKeys, ChecksumTrailer& trailer );
+
+     // проверяет, заканчивается ли шифртекст размером cipherSize меткой сжатого потока. Возвращает размер шифртекста
+     // без метки. Поток остается в начале файла
+     uint64_t readCompressionMarker( std::istream& inp, uint64_t cipherSize, bool& compressed );
+
+     // дописывает метку сжатого потока
+     void writeCompressionMarker( std::ostream& out, const PoolBuffer& armorBuffer );
+
+     // передает очередной фрагмент открытого текста в checksum и сверяет завершенные части с суммами концевика,
+     // verified - число уже сверенных частей. checkPlainTotal сверяет размер и сумму всего открытого текста
+     static void checkPlainPart( ChunkedChecksum& checksum, const ChecksumTrailer& trailer, size_t& verified,
+                                 const unsigned char* data, size_t size );
+     static void checkPlainTotal( const ChunkedChecksum& checksum, const ChecksumTrailer& trailer, size_t verified );
+
+     // накладывает(снимает) на суммы концевика маски E_K( "SUM" || номер части ): без ключа по суммам нельзя проверять догадки об открытом тексте
+     void maskChecksums( const AESCryptography& crypt, const AesRoundKeys& roundKeys, ChecksumTrailer& trailer );
+
+     // сжимает size байт src блоками по blockSize байт в поток записей в dst. Возвращает размер записей.
+     // dst должен вмещать ( blockSize + compressRecordHeader ) байт на каждый блок
+     size_t compressChunk( const unsigned char* src, size_t size, unsigned char* dst, size_t blockSize, ThreadPool& workers );
+
+     // распаковывает записи из очередной части расшифрованного потока и передает открытый текст в emit. Запись,
+     // прерванная на границе части, накапливается в carry. Записи распаковываются параллельно группами в unpacked
+     void decompressChunk( const unsigned char* data, size_t size, bool last, std::vector< unsigned char >& carry,
+                           std::vector< unsigned char >& unpacked, ThreadPool& workers,
+                           const std::function< void( const unsigned char*, size_t ) >& emit );
+
+     void processInPlace( bool decrypt, const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     // шифрует/расшифровывает один сегмент сегментированного файла
+     void cryptSegment( const SegmentedFormat& format, const PosixFile& inp, const PosixFile& out, const SegmentTable& table,
+                        size_t index, uint64_t plainSize, uint64_t cipherOffset );
+     uint64_t decryptSegment( const SegmentedFormat& format, const PosixFile& inp, const PosixFile& out, const SegmentTable& table,
+                              size_t index, uint64_t cipherOffset );
+
+     // вычисляет xxHash64 открытого текста сегментов файла
+     std::vector< uint64_t > segmentDigests( const PosixFile& inp, uint64_t segmentSize, size_t segmentCount, uint64_t seed, ThreadPool& workers );
+
+
+     // шифрует в режиме CTR участки extents из inp и записывает их на те же смещения в out
+     void cryptExtents( const AESCryptography& crypt, const AesRoundKeys& roundKeys, const std::vector< unsigned char >& iv,
+                        const PosixFile& inp, const PosixFile& out, const std::vector< FileExtent >& extents );
+
+     // возвращает общий пул потоков или создает локальный не более чем из maxThreads потоков(0 - без ограничения)
+     ThreadPool& workers( std::unique_ptr< ThreadPool >& localWorkers, size_t maxThreads = 0 );
+
+     // размещает страницы буферов на узлах потоков workers, которые будут обрабатывать их части
+     static void placeBuffers( const ThreadPool& workers, std::initializer_list< const PoolBuffer* > buffers );
+
+     void addProgress( uint64_t bytes );
+
+     // проверяет размер IV для режима
+     void checkIv( CryptMode mode, const std::vector< unsigned char >& iv );
 
      // расчитывает длину ключа шифрования/расшифрования из ключа
      AesKeyLength keyLengthFromKey( const std::vector< unsigned char >& key );
 
 private:
+     // размер части данных при перешифровании: открытый текст должен оставаться в кэше процессора
+     static constexpr size_t reencryptChunkSize = 256 * 1024;
+
+     // размер части открытого текста, для которой в концевике хранится отдельная контрольная сумма
+     static const uint64_t checksumChunkSize = 1024 * 1024;
+
+     // размер блока сжатия(не больше окна LzCodec) и заголовка записи сжатого блока
+     static const size_t compressBlockSize = 64 * 1024;
+     static const size_t compressRecordHeader = 8;
+     static const size_t compressMarkerSize = 16;
+
      const std::string srcPath_;
      const std::string dstPath_;
+     BufferPool& pool_;
+     bool hexArmor_ = false;
+     size_t threadCount_ = 0;
+     ThreadPool* sharedWorkers_ = nullptr;
+     NumaPolicy numaPolicy_ = NPOff;
+     PerfStats* perfStats_ = nullptr;
+     std::atomic< uint64_t >* progress_ = nullptr;
+     bool compression_ = false;
+     ChecksumType checksum_ = CTNone;
+     ChecksumType lastChecksumType_ = CTNone;
+     uint64_t lastChecksum_ = 0;
 };
 
 
@@ -0,0 +1,257 @@
+/// @file
+/// @brief Обертка над файловым дескриптором для позиционного чтения и записи из нескольких потоков
+
+#include "file_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+PosixFile::PosixFile( int fd )
+:fd_( fd )
+{
+}
+
+
+PosixFile::PosixFile( PosixFile&& rhs ) noexcept
+{
+     *this = std::move( rhs );
+}
+
+
+PosixFile& PosixFile::operator=( PosixFile&& rhs ) noexcept
+{
+     if( this != &rhs )
+     {
+          close();
+          fd_ = rhs.fd_;
+          rhs.fd_ = -1;
+     }
+     return *this;
+}
+
+
+PosixFile::~PosixFile()
+{
+     close();
+}
+
+
+PosixFile PosixFile::openRead( const std::string& path )
+{
+     int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+     if( fd < 0 )
+     {
+          throw std::runtime_error( "Input file does not not exist or unavailable" );
+     }
+     return PosixFile( fd );
+}
+
+
+PosixFile PosixFile::create( const std::string& path )
+{
+     int fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+     if( fd < 0 )
+     {
+          throw std::runtime_error( "Create output file error" );
+     }
+     return PosixFile( fd );
+}
+
+
+PosixFile PosixFile::openReadWrite( const std::string& path )
+{
+     int fd = open( path.c_str(), O_RDWR | O_CLOEXEC );
+     if( fd < 0 )
+     {
+          throw std::runtime_error( "Input file does not not exist or unavailable" );
+     }
+     return PosixFile( fd );
+}
+
+
+int PosixFile::fd() const
+{
+     return fd_;
+}
+
+
+uint64_t PosixFile::size() const
+{
+     struct stat info{};
+     if( fstat( fd_, &info ) != 0 )
+     {
+          throw std::runtime_error( "Could not get file size" );
+     }
+     return info.st_size;
+}
+
+
+size_t PosixFile::readAt( unsigned char* data, size_t size, uint64_t offset ) const
+{
+     size_t total = 0;
+     while( total < size )
+     {
+          ssize_t readBytes = pread( fd_, data + total, size - total, offset + total );
+          if( readBytes < 0 && errno == EINTR )
+          {
+               continue;
+          }
+          if( readBytes < 0 )
+          {
+               throw std::runtime_error( "File read error" );
+          }
+          if( readBytes == 0 )
+          {
+               break;
+          }
+          total += readBytes;
+     }
+     return total;
+}
+
+
+void PosixFile::writeAt( const unsigned char* data, size_t size, uint64_t offset ) const
+{
+     size_t total = 0;
+     while( total < size )
+     {
+          ssize_t written = pwrite( fd_, data + total, size - total, offset + total );
+          if( written < 0 && errno == EINTR )
+          {
+               continue;
+          }
+          if( written <= 0 )
+          {
+               throw std::runtime_error( "File write error" );
+          }
+          total += written;
+     }
+}
+
+
+void PosixFile::truncate( uint64_t size ) const
+{
+     if( ftruncate( fd_, size ) != 0 )
+     {
+          throw std::runtime_error( "File truncate error" );
+     }
+}
+
+
+std::vector< FileExtent > PosixFile::dataExtents() const
+{
+     const uint64_t fileSize = size();
+     std::vector< FileExtent > extents;
+     uint64_t offset = 0;
+     while( offset < fileSize )
+     {
+          off_t data = lseek( fd_, static_cast< off_t >( offset ), SEEK_DATA );
+          if( data < 0 && errno == ENXIO )
+          {
+               // до конца файла только дыра
+               break;
+          }
+          if( data < 0 && offset == 0 && ( errno == EINVAL || errno == EOPNOTSUPP ) )
+          {
+               extents.push_back( { 0, fileSize } );
+               break;
+          }
+          if( data < 0 )
+          {
+               throw std::runtime_error( "Could not find data extents of file" );
+          }
+
+          off_t hole = lseek( fd_, data, SEEK_HOLE );
+          uint64_t end = hole < 0 ? fileSize : std::min< uint64_t >( hole, fileSize );
+          if( end > static_cast< uint64_t >( data ) )
+          {
+               extents.push_back( { static_cast< uint64_t >( data ), end - data } );
+          }
+          offset = std::max< uint64_t >( end, data + 1 );
+     }
+     return extents;
+}
+
+
+void PosixFile::copyTo( const PosixFile& dst, uint64_t offset, uint64_t dstOffset, uint64_t size ) const
+{
+     while( size != 0 )
+     {
+          loff_t from = offset;
+          loff_t to = dstOffset;
+          ssize_t copied = copy_file_range( fd_, &from, dst.fd_, &to, size, 0 );
+          if( copied < 0 && errno == EINTR )
+          {
+               continue;
+          }
+          if( copied < 0 && ( errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP ) )
+          {
+               break;
+          }
+          if( copied <= 0 )
+          {
+               throw std::runtime_error( "File copy error" );
+          }
+          offset += copied;
+          dstOffset += copied;
+          size -= copied;
+     }
+
+     std::vector< unsigned char > buffer( size < ( 1 << 20 ) ? size : ( 1 << 20 ) );
+     while( size != 0 )
+     {
+          size_t count = size < buffer.size() ? size : buffer.size();
+          if( readAt( buffer.data(), count, offset ) != count )
+          {
+               throw std::runtime_error( "File copy error" );
+          }
+          dst.writeAt( buffer.data(), count, dstOffset );
+          offset += count;
+          dstOffset += count;
+          size -= count;
+     }
+}
+
+
+void PosixFile::sync() const
+{
+     if( fdatasync( fd_ ) != 0 )
+     {
+          throw std::runtime_error( "File sync error" );
+     }
+}
+
+
+void PosixFile::syncDirectory( const std::string& path )
+{
+     std::string::size_type slash = path.rfind( '/' );
+     std::string directory = slash == std::string::npos ? "." : ( slash == 0 ? "/" : path.substr( 0, slash ) );
+     int fd = open( directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+     if( fd < 0 )
+     {
+          throw std::runtime_error( "Could not open directory: " + directory );
+     }
+     int result = fsync( fd );
+     ::close( fd );
+     if( result != 0 )
+     {
+          throw std::runtime_error( "Directory sync error" );
+     }
+}
+
+
+void PosixFile::close()
+{
+     if( fd_ >= 0 )
+     {
+          ::close( fd_ );
+          fd_ = -1;
+     }
+}
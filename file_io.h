@@ -0,0 +1,69 @@
+/// @file
+/// @brief Обертка над файловым дескриптором для позиционного чтения и записи из нескольких потоков
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// участок файла с данными
+struct FileExtent
+{
+     uint64_t offset = 0;
+     uint64_t size = 0;
+};
+
+
+class PosixFile
+{
+public:
+     PosixFile() = default;
+     PosixFile( PosixFile&& rhs ) noexcept;
+     PosixFile& operator=( PosixFile&& rhs ) noexcept;
+     PosixFile( const PosixFile& ) = delete;
+     PosixFile& operator=( const PosixFile& ) = delete;
+     ~PosixFile();
+
+     // открывает существующий файл на чтение
+     static PosixFile openRead( const std::string& path );
+
+     // создает(или обрезает) файл для записи
+     static PosixFile create( const std::string& path );
+
+     // открывает существующий файл на чтение и запись без обрезки
+     static PosixFile openReadWrite( const std::string& path );
+
+     int fd() const;
+     uint64_t size() const;
+
+     // читает до size байт с позиции offset. Меньше size возвращается только при достижении конца файла
+     size_t readAt( unsigned char* data, size_t size, uint64_t offset ) const;
+
+     // записывает ровно size байт с позиции offset
+     void writeAt( const unsigned char* data, size_t size, uint64_t offset ) const;
+
+     void truncate( uint64_t size ) const;
+
+     // участки с данными по возрастанию смещений(SEEK_DATA/SEEK_HOLE), между ними - дыры разреженного файла.
+     // Если файловая система не сообщает о дырах, весь файл считается одним участком
+     std::vector< FileExtent > dataExtents() const;
+
+     // копирует size байт с позиции offset в файл dst с позиции dstOffset. Данные копируются ядром(copy_file_range),
+     // а если файловая система этого не поддерживает - через буфер
+     void copyTo( const PosixFile& dst, uint64_t offset, uint64_t dstOffset, uint64_t size ) const;
+
+     // дожидается записи данных файла на устройство
+     void sync() const;
+
+     // дожидается записи на устройство записи о файле path в его каталоге(после создания или удаления файла)
+     static void syncDirectory( const std::string& path );
+
+private:
+     explicit PosixFile( int fd );
+     void close();
+
+private:
+     int fd_ = -1;
+};
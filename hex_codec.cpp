@@ -0,0 +1,199 @@
+/// @file
+/// @brief Кодирование/декодирование массивов байт в шестнадцатеричное представление
+
+#include "hex_codec.h"
+
+#include <array>
+
+#if ( defined( __x86_64__ ) || defined( __i386__ ) ) && defined( __GNUC__ )
+#define HEX_CODEC_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace
+{
+     // таблица значений символов: -1 для символов, не являющихся шестнадцатеричными цифрами
+     constexpr std::array< signed char, 256 > makeHexValues()
+     {
+          std::array< signed char, 256 > result{};
+          for( int idx = 0; idx < 256; idx++ )
+          {
+               result[ idx ] = -1;
+          }
+          for( int idx = 0; idx < 10; idx++ )
+          {
+               result[ '0' + idx ] = static_cast< signed char >( idx );
+          }
+          for( int idx = 0; idx < 6; idx++ )
+          {
+               result[ 'a' + idx ] = static_cast< signed char >( 10 + idx );
+               result[ 'A' + idx ] = static_cast< signed char >( 10 + idx );
+          }
+          return result;
+     }
+
+     constexpr std::array< signed char, 256 > hexValues = makeHexValues();
+
+     const char hexDigits[] = "0123456789ABCDEF";
+}
+
+
+bool HexCodec::decode( const char* src, size_t size, unsigned char* dst )
+{
+     if( size % 2 != 0 )
+     {
+          return false;
+     }
+
+     bool valid = true;
+     size_t processed = 0;
+     if( hasSsse3() )
+     {
+          processed = decodeSsse3( src, size, dst, valid );
+          if( !valid )
+          {
+               return false;
+          }
+     }
+
+     return decodeScalar( src + 2 * processed, size - 2 * processed, dst + processed );
+}
+
+
+void HexCodec::encode( const unsigned char* src, size_t size, char* dst )
+{
+     size_t processed = 0;
+     if( hasSsse3() )
+     {
+          processed = encodeSsse3( src, size, dst );
+     }
+     encodeScalar( src + processed, size - processed, dst + 2 * processed );
+}
+
+
+bool HexCodec::decodeScalar( const char* src, size_t size, unsigned char* dst )
+{
+     // накапливаем признак ошибки без ветвлений, чтобы не замедлять основной цикл
+     int invalid = 0;
+     for( size_t idx = 0; idx < size; idx += 2 )
+     {
+          int high = hexValues[ static_cast< unsigned char >( src[ idx ] ) ];
+          int low = hexValues[ static_cast< unsigned char >( src[ idx + 1 ] ) ];
+          invalid |= high | low;
+          dst[ idx / 2 ] = static_cast< unsigned char >( ( static_cast< unsigned >( high ) << 4 ) | ( low & 0x0f ) );
+     }
+     return invalid >= 0;
+}
+
+
+void HexCodec::encodeScalar( const unsigned char* src, size_t size, char* dst )
+{
+     for( size_t idx = 0; idx < size; idx++ )
+     {
+          dst[ 2 * idx ] = hexDigits[ src[ idx ] >> 4 ];
+          dst[ 2 * idx + 1 ] = hexDigits[ src[ idx ] & 0x0f ];
+     }
+}
+
+
+#ifdef HEX_CODEC_X86
+
+namespace
+{
+     // переводит 16 символов в значения полубайтов. В valid выставляются 0xff для корректных символов
+     __attribute__(( target( "ssse3" ) ))
+     inline __m128i nibblesFromChars( __m128i chars, __m128i& valid )
+     {
+          // символы >= 0x80 при знаковом сравнении отрицательны и не попадают ни в один из диапазонов
+          __m128i isDigit = _mm_and_si128( _mm_cmpgt_epi8( chars, _mm_set1_epi8( '0' - 1 ) ),
+                                           _mm_cmplt_epi8( chars, _mm_set1_epi8( '9' + 1 ) ) );
+          __m128i lower = _mm_or_si128( chars, _mm_set1_epi8( 0x20 ) );
+          __m128i isAlpha = _mm_and_si128( _mm_cmpgt_epi8( lower, _mm_set1_epi8( 'a' - 1 ) ),
+                                           _mm_cmplt_epi8( lower, _mm_set1_epi8( 'f' + 1 ) ) );
+
+          __m128i digits = _mm_and_si128( isDigit, _mm_sub_epi8( chars, _mm_set1_epi8( '0' ) ) );
+          __m128i letters = _mm_and_si128( isAlpha, _mm_sub_epi8( lower, _mm_set1_epi8( 'a' - 10 ) ) );
+
+          valid = _mm_or_si128( isDigit, isAlpha );
+          return _mm_or_si128( digits, letters );
+     }
+}
+
+
+__attribute__(( target( "ssse3" ) ))
+size_t HexCodec::decodeSsse3( const char* src, size_t size, unsigned char* dst, bool& valid )
+{
+     // за одну итерацию 32 символа превращаются в 16 байт: пары полубайтов складываются через maddubs(high * 16 + low)
+     const __m128i weights = _mm_set1_epi16( 0x0110 );
+     __m128i allValid = _mm_set1_epi8( -1 );
+
+     size_t processed = 0;
+     for( ; processed + 16 <= size / 2; processed += 16 )
+     {
+          __m128i first = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 2 * processed ) );
+          __m128i second = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + 2 * processed + 16 ) );
+
+          __m128i firstValid;
+          __m128i secondValid;
+          __m128i firstNibbles = nibblesFromChars( first, firstValid );
+          __m128i secondNibbles = nibblesFromChars( second, secondValid );
+          allValid = _mm_and_si128( allValid, _mm_and_si128( firstValid, secondValid ) );
+
+          __m128i bytes = _mm_packus_epi16( _mm_maddubs_epi16( firstNibbles, weights ),
+                                            _mm_maddubs_epi16( secondNibbles, weights ) );
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + processed ), bytes );
+     }
+
+     valid = _mm_movemask_epi8( allValid ) == 0xffff;
+     return processed;
+}
+
+
+__attribute__(( target( "ssse3" ) ))
+size_t HexCodec::encodeSsse3( const unsigned char* src, size_t size, char* dst )
+{
+     const __m128i digits = _mm_loadu_si128( reinterpret_cast< const __m128i* >( hexDigits ) );
+     const __m128i lowMask = _mm_set1_epi8( 0x0f );
+
+     size_t processed = 0;
+     for( ; processed + 16 <= size; processed += 16 )
+     {
+          __m128i bytes = _mm_loadu_si128( reinterpret_cast< const __m128i* >( src + processed ) );
+          __m128i high = _mm_shuffle_epi8( digits, _mm_and_si128( _mm_srli_epi16( bytes, 4 ), lowMask ) );
+          __m128i low = _mm_shuffle_epi8( digits, _mm_and_si128( bytes, lowMask ) );
+
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 2 * processed ), _mm_unpacklo_epi8( high, low ) );
+          _mm_storeu_si128( reinterpret_cast< __m128i* >( dst + 2 * processed + 16 ), _mm_unpackhi_epi8( high, low ) );
+     }
+     return processed;
+}
+
+
+bool HexCodec::hasSsse3()
+{
+     static const bool supported = __builtin_cpu_supports( "ssse3" );
+     return supported;
+}
+
+#else
+
+size_t HexCodec::decodeSsse3( const char*, size_t, unsigned char*, bool& valid )
+{
+     valid = true;
+     return 0;
+}
+
+
+size_t HexCodec::encodeSsse3( const unsigned char*, size_t, char* )
+{
+     return 0;
+}
+
+
+bool HexCodec::hasSsse3()
+{
+     return false;
+}
+
+#endif
@@ -0,0 +1,28 @@
+/// @file
+/// @brief Кодирование/декодирование массивов байт в шестнадцатеричное представление
+#pragma once
+
+#include <cstddef>
+
+
+class HexCodec
+{
+public:
+     // декодирует size символов из src в size / 2 байт в dst. Не выделяет память.
+     // возвращает false, если size нечетный или встретился символ, отличный от [0-9a-fA-F]
+     static bool decode( const char* src, size_t size, unsigned char* dst );
+
+     // кодирует size байт из src в 2 * size символов в dst(без завершающего нуля)
+     static void encode( const unsigned char* src, size_t size, char* dst );
+
+private:
+     // скалярные реализации, обрабатывают хвосты и используются при отсутствии SSSE3
+     static bool decodeScalar( const char* src, size_t size, unsigned char* dst );
+     static void encodeScalar( const unsigned char* src, size_t size, char* dst );
+
+     // векторные реализации, обрабатывают только целые блоки по 32 символа / 16 байт. Возвращают число обработанных байт
+     static size_t decodeSsse3( const char* src, size_t size, unsigned char* dst, bool& valid );
+     static size_t encodeSsse3( const unsigned char* src, size_t size, char* dst );
+
+     static bool hasSsse3();
+};
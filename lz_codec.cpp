@@ -0,0 +1,217 @@
+/// @file
+/// @brief Быстрое сжатие блоков данных семейства LZ77
+
+#include "lz_codec.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace
+{
+     const size_t minMatch = 4;
+     const size_t maxOffset = 65535;
+
+     // как в LZ4: последние 5 байт блока всегда литералы, совпадение не начинается ближе 12 байт к концу
+     const size_t lastLiterals = 5;
+     const size_t matchLimit = 12;
+
+     const int hashBits = 12;
+
+     uint32_t read32( const unsigned char* src )
+     {
+          uint32_t value;
+          memcpy( &value, src, 4 );
+          return value;
+     }
+
+     uint32_t hashOf( uint32_t sequence )
+     {
+          return ( sequence * 2654435761u ) >> ( 32 - hashBits );
+     }
+
+     // записывает длину, не поместившуюся в полубайт маркера, байтами по 255
+     bool putLength( size_t length, unsigned char*& dst, const unsigned char* dstEnd )
+     {
+          for( ; length >= 255; length -= 255 )
+          {
+               if( dst == dstEnd )
+               {
+                    return false;
+               }
+               *dst++ = 255;
+          }
+          if( dst == dstEnd )
+          {
+               return false;
+          }
+          *dst++ = static_cast< unsigned char >( length );
+          return true;
+     }
+
+     // читает продолжение длины. Возвращает false при выходе за конец данных
+     bool getLength( const unsigned char*& src, const unsigned char* srcEnd, size_t& length )
+     {
+          unsigned char value;
+          do
+          {
+               if( src == srcEnd )
+               {
+                    return false;
+               }
+               value = *src++;
+               length += value;
+          }
+          while( value == 255 );
+          return true;
+     }
+}
+
+
+size_t LzCodec::compress( const unsigned char* src, size_t size, unsigned char* dst, size_t capacity )
+{
+     unsigned char* out = dst;
+     const unsigned char* outEnd = dst + capacity;
+     size_t anchor = 0;
+
+     if( size > matchLimit )
+     {
+          // позиции последних вхождений 4-байтовых префиксов
+          uint32_t table[ 1 << hashBits ] = {};
+
+          size_t pos = 0;
+          const size_t limit = size - matchLimit;
+          while( pos < limit )
+          {
+               uint32_t sequence = read32( src + pos );
+               uint32_t& slot = table[ hashOf( sequence ) ];
+               size_t candidate = slot;
+               slot = static_cast< uint32_t >( pos );
+
+               if( candidate >= pos || pos - candidate > maxOffset || read32( src + candidate ) != sequence )
+               {
+                    // на несжимаемых участках шаг поиска растет, чтобы не тратить время впустую
+                    pos += 1 + ( ( pos - anchor ) >> 6 );
+                    continue;
+               }
+
+               size_t length = minMatch;
+               while( pos + length < size - lastLiterals && src[ candidate + length ] == src[ pos + length ] )
+               {
+                    length++;
+               }
+               if( !putSequence( src + anchor, pos - anchor, pos - candidate, length, out, outEnd ) )
+               {
+                    return 0;
+               }
+               pos += length;
+               anchor = pos;
+          }
+     }
+
+     if( !putSequence( src + anchor, size - anchor, 0, 0, out, outEnd ) )
+     {
+          return 0;
+     }
+     return out - dst;
+}
+
+
+bool LzCodec::decompress( const unsigned char* src, size_t size, unsigned char* dst, size_t dstSize )
+{
+     const unsigned char* srcEnd = src + size;
+     size_t written = 0;
+     while( src != srcEnd )
+     {
+          unsigned char token = *src++;
+
+          size_t literalCount = token >> 4;
+          if( literalCount == 15 && !getLength( src, srcEnd, literalCount ) )
+          {
+               return false;
+          }
+          if( literalCount > static_cast< size_t >( srcEnd - src ) || literalCount > dstSize - written )
+          {
+               return false;
+          }
+          memcpy( dst + written, src, literalCount );
+          src += literalCount;
+          written += literalCount;
+
+          // последняя последовательность содержит только литералы
+          if( src == srcEnd )
+          {
+               break;
+          }
+          if( srcEnd - src < 2 )
+          {
+               return false;
+          }
+          size_t offset = src[ 0 ] | ( src[ 1 ] << 8 );
+          src += 2;
+
+          size_t matchLength = token & 0x0f;
+          if( matchLength == 15 && !getLength( src, srcEnd, matchLength ) )
+          {
+               return false;
+          }
+          matchLength += minMatch;
+          if( offset == 0 || offset > written || matchLength > dstSize - written )
+          {
+               return false;
+          }
+
+          // совпадение может перекрываться с копируемыми данными(повтор короткого фрагмента), тогда копируем побайтно
+          unsigned char* out = dst + written;
+          const unsigned char* match = out - offset;
+          if( offset >= matchLength )
+          {
+               memcpy( out, match, matchLength );
+          }
+          else
+          {
+               for( size_t idx = 0; idx < matchLength; idx++ )
+               {
+                    out[ idx ] = match[ idx ];
+               }
+          }
+          written += matchLength;
+     }
+     return written == dstSize;
+}
+
+
+bool LzCodec::putSequence( const unsigned char* literals, size_t literalCount, size_t offset, size_t matchLength,
+                           unsigned char*& dst, const unsigned char* dstEnd )
+{
+     if( dst == dstEnd )
+     {
+          return false;
+     }
+     unsigned char* token = dst++;
+     *token = static_cast< unsigned char >( ( literalCount < 15 ? literalCount : 15 ) << 4 );
+     if( literalCount >= 15 && !putLength( literalCount - 15, dst, dstEnd ) )
+     {
+          return false;
+     }
+     if( literalCount > static_cast< size_t >( dstEnd - dst ) )
+     {
+          return false;
+     }
+     memcpy( dst, literals, literalCount );
+     dst += literalCount;
+
+     if( offset == 0 )
+     {
+          return true;
+     }
+     if( dstEnd - dst < 2 )
+     {
+          return false;
+     }
+     *dst++ = static_cast< unsigned char >( offset );
+     *dst++ = static_cast< unsigned char >( offset >> 8 );
+
+     size_t extra = matchLength - minMatch;
+     *token |= static_cast< unsigned char >( extra < 15 ? extra : 15 );
+     return extra < 15 || putLength( extra - 15, dst, dstEnd );
+}
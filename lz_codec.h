@@ -0,0 +1,27 @@
+/// @file
+/// @brief Быстрое сжатие блоков данных семейства LZ77
+#pragma once
+
+#include <cstddef>
+
+
+// Сжатие независимых блоков в формате блока LZ4: последовательности из литералов и ссылки на совпадение
+// не дальше 64 КиБ назад. Поиск совпадений жадный, по хеш-таблице 4-байтовых префиксов, поэтому сжатие
+// работает со скоростью, сопоставимой с копированием памяти, и хорошо подходит для журналов и текста
+class LzCodec
+{
+public:
+     // сжимает size байт из src в dst емкостью capacity байт. Возвращает размер сжатых данных
+     // или 0, если они не помещаются в capacity(данные несжимаемы)
+     static size_t compress( const unsigned char* src, size_t size, unsigned char* dst, size_t capacity );
+
+     // распаковывает size байт из src ровно в dstSize байт в dst.
+     // возвращает false, если данные повреждены: чтение и запись никогда не выходят за границы буферов
+     static bool decompress( const unsigned char* src, size_t size, unsigned char* dst, size_t dstSize );
+
+private:
+     // записывает последовательность: литералы и совпадение длиной matchLength со смещением offset(0 - только литералы).
+     // возвращает false при нехватке места
+     static bool putSequence( const unsigned char* literals, size_t literalCount, size_t offset, size_t matchLength,
+                              unsigned char*& dst, const unsigned char* dstEnd );
+};
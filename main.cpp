@@ -1,64 +1,625 @@
 #include <iostream>
+#include <chrono>
 #include <cstring>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <set>
+#include "aescrypt.h"
+#include "directory_crypt.h"
 #include "file_crypt.h"
+#include "hex_codec.h"
+#include "perf_counters.h"
+#include "thread_pool.h"
+#include "tuner.h"
+#include "tuning_profile.h"
 
 
 void printHelp()
 {
-     std::cout << "Usage: {encrypt/decrypt} {CBC/ECB} {KEY in HEX format} {Source file path} {Destination file path} {OPTIONAL: IV in HEX format}" << std::endl;
+     std::cout << "Usage: {encrypt/decrypt} {CBC/ECB/CTR} {KEY in HEX format} {Source file path} {Destination file path} {OPTIONAL: IV in HEX format}" << std::endl;
+     std::cout << "       {encrypt/decrypt} -r {CBC/ECB/CTR} {KEY in HEX format} {Source directory} {Destination directory} {OPTIONAL: IV in HEX format}" << std::endl;
+     std::cout << "       {encrypt/decrypt} CTR --in-place {KEY in HEX format} {File path} {IV in HEX format}" << std::endl;
+     std::cout << "       reencrypt {old CBC/ECB} {old KEY} {new CBC/ECB} {new KEY} {Source file path} {Destination file path} {CBC: old IV} {CBC: new IV}" << std::endl;
+     std::cout << "       verify {CBC/ECB/CTR} {KEY in HEX format} {Encrypted file path} {OPTIONAL: IV in HEX format}" << std::endl;
+     std::cout << "       tune {OPTIONAL: --output path}" << std::endl;
+     std::cout << "Options:\n"
+                    "\t--key-file {path}\tread binary key from file instead of HEX argument\n"
+                    "\t--iv-file {path}\tread binary IV from file instead of HEX argument\n"
+                    "\t-r\t\t\tprocess directory tree recursively, each file gets its own IV derived from the given one\n"
+                    "\t--hex\t\t\twrite(read) ciphertext in HEX format\n"
+                    "\t--huge-pages\t\tuse huge pages for work buffers\n"
+                    "\t--segments {N}\t\tCBC only: encrypt up to N independent segments of at least 4 KiB\n"
+                    "\t\t\t\tin parallel(segmented format)\n"
+                    "\t--segmented\t\tCBC only: decrypt file in segmented format\n"
+                    "\t--in-place\t\tCTR only: overwrite file chunk by chunk through journal {File path}.journal,\n"
+                    "\t\t\t\tIV is required, interrupted run is resumed by the same command\n"
+                    "\t--incremental\t\tCBC only: encrypt in segmented format and keep {Destination}.manifest with segment\n"
+                    "\t\t\t\thashes, next run with the same key and IV rewrites only changed segments\n"
+                    "\t--sparse\t\tCTR only: encrypt only data extents of sparse file, keep holes and store extent map\n"
+                    "\t\t\t\tin ciphertext trailer, decryption restores the same holes\n"
+                    "\t--segment-size {N}\tincremental: segment size in bytes for the first run(default 4 MiB)\n"
+                    "\t--checksum {type}\tcrc32c or xxh64: store plaintext checksum in ciphertext trailer while encrypting,\n"
+                    "\t\t\t\tdecryption verifies trailer if present, with this option it is required\n"
+                    "\t--compress\t\tcompress plaintext in parallel blocks before encryption, decryption detects compressed\n"
+                    "\t\t\t\tstream by its marker, with this option it is required\n"
+                    "\t--threads {N}\t\tnumber of worker threads for parallel modes\n"
+                    "\t--numa {policy}\t\toff, local or interleave: pin workers to cores of NUMA nodes and place each part\n"
+                    "\t\t\t\tof work buffers on the node of its worker(local) or interleave pages over nodes\n"
+                    "\t--stats\t\t\tsingle file: report time and hardware counters(cycles, instructions,\n"
+                    "\t\t\t\tL1D/LLC misses, branch misses) per byte for each phase, timing only if unavailable\n"
+                    "\t--profile {path}\ttuning profile written by tune(default $AESCRYPT_PROFILE or ~/.config/crypto_2/profile)\n"
+                    "\t--new-key-file {path}\treencrypt: read new binary key from file\n"
+                    "\t--new-iv-file {path}\treencrypt: read new binary IV from file\n"
+                    "verify checks the ciphertext without writing plaintext: checksum trailer and compressed records if present,\n"
+                    "PKCS#7 padding of the last block, segment table or extent map MAC with --segmented and --sparse.\n"
+                    "Padding alone is a weak check(reported as WEAK), CTR needs --checksum(or --compress) when encrypting\n"
+                    "to be verifiable, otherwise verify reports UNVERIFIED and fails" << std::endl;
      std::cout << "Examples:\n"
                     "\tencrypt CBC 88CF1B7478A797F03F54527B50EF6D427B8F8C9C4EFB7FC20AA06B0DCD94FD35 file_to_crypt.txt encrypted_file.txt 88CF1B7478A797F03F54527B50EF6D41\n"
-                    "\tdecrypt CBC 88CF1B7478A797F03F54527B50EF6D427B8F8C9C4EFB7FC20AA06B0DCD94FD35 encrypted_file.txt decrypted_file.txt 88CF1B7478A797F03F54527B50EF6D41" << std::endl;
+                    "\tdecrypt CBC 88CF1B7478A797F03F54527B50EF6D427B8F8C9C4EFB7FC20AA06B0DCD94FD35 encrypted_file.txt decrypted_file.txt 88CF1B7478A797F03F54527B50EF6D41\n"
+                    "\tencrypt CBC --key-file key.bin --iv-file iv.bin file_to_crypt.txt encrypted_file.txt\n"
+                    "\tencrypt -r ECB --key-file key.bin --threads 8 documents documents_encrypted\n"
+                    "\tverify CBC --key-file key.bin --iv-file iv.bin --checksum xxh64 encrypted_file.txt\n"
+                    "\treencrypt CBC --key-file old.key ECB --new-key-file new.key encrypted_file.txt reencrypted_file.txt 88CF1B7478A797F03F54527B50EF6D41" << std::endl;
 }
 
 
-void exec( const std::vector< std::string >& args )
+// разбирает аргументы на позиционные и опции вида --name [value] или -r
+void parseArgs( const std::vector< std::string >& args, std::vector< std::string >& positional, std::map< std::string, std::string >& options )
 {
+     // опции, которые требуют значения
+     const std::set< std::string > valueOptions = { "--key-file", "--iv-file", "--segments", "--threads",
+                                                    "--new-key-file", "--new-iv-file", "--segment-size", "--checksum",
+                                                    "--output", "--profile", "--numa" };
+     // опции-флаги без значения. Любая другая опция - ошибка: опечатка не должна молча менять результат
+     const std::set< std::string > flagOptions = { "--hex", "--huge-pages", "--segmented", "--in-place", "--incremental",
+                                                   "--sparse", "--compress", "--stats" };
+
+     for( size_t idx = 0; idx < args.size(); idx++ )
+     {
+          if( args[ idx ] == "-r" )
+          {
+               options[ args[ idx ] ] = "";
+               continue;
+          }
+          if( args[ idx ].compare( 0, 2, "--" ) != 0 )
+          {
+               positional.push_back( args[ idx ] );
+               continue;
+          }
+          if( flagOptions.count( args[ idx ] ) != 0 )
+          {
+               options[ args[ idx ] ] = "";
+               continue;
+          }
+          if( valueOptions.count( args[ idx ] ) == 0 )
+          {
+               throw std::runtime_error( "unknown option: " + args[ idx ] );
+          }
+          if( idx + 1 >= args.size() )
+          {
+               throw std::runtime_error( "missing value for option: " + args[ idx ] );
+          }
+          options[ args[ idx ] ] = args[ idx + 1 ];
+          idx++;
+     }
+}
+
+
+// разбирает режим шифрования
+CryptMode parseMode( const std::string& mode )
+{
+     if( mode == "CBC" )
+     {
+          return CMCbc;
+     }
+     if( mode == "CTR" )
+     {
+          return CMCtr;
+     }
+     if( mode != "ECB" )
+     {
+          throw std::runtime_error( "incorrect encrypt mode: " + mode );
+     }
+     return CMEcb;
+}
+
+
+// разбирает тип контрольной суммы открытого текста
+ChecksumType parseChecksum( const std::string& type )
+{
+     if( type == "crc32c" )
+     {
+          return CTCrc32c;
+     }
+     if( type != "xxh64" )
+     {
+          throw std::runtime_error( "incorrect checksum type: " + type );
+     }
+     return CTXxh64;
+}
+
+
+// выводит контрольную сумму открытого текста, вычисленную при шифровании или проверенную при расшифровании
+void printChecksum( const aescrypt_file_result& result )
+{
+     if( result.checksumType == AESCRYPT_CHECKSUM_NONE )
+     {
+          return;
+     }
+     unsigned char bytes[ 8 ];
+     size_t size = result.checksumType == AESCRYPT_CHECKSUM_CRC32C ? 4 : 8;
+     for( size_t idx = 0; idx < size; idx++ )
+     {
+          bytes[ idx ] = static_cast< unsigned char >( result.checksum >> ( 8 * ( size - 1 - idx ) ) );
+     }
+     std::string hex( 2 * size, '\0' );
+     HexCodec::encode( bytes, size, &hex[ 0 ] );
+     std::cout << ( result.checksumType == AESCRYPT_CHECKSUM_CRC32C ? "CRC32C: " : "XXH64: " ) << hex << std::endl;
+}
+
+
+// бросает исключение с текстом ошибки библиотеки, если ее вызов завершился неуспешно
+void checkStatus( int status )
+{
+     if( status != AESCRYPT_OK )
+     {
+          throw std::runtime_error( aescrypt_last_error() );
+     }
+}
+
+
+// параметры файловых функций C-интерфейса из опций командной строки
+aescrypt_file_options apiFileOptions( CryptMode mode, const std::vector< unsigned char >& iv, std::map< std::string, std::string >& options )
+{
+     if( mode != CMEcb && !iv.empty() && iv.size() != 16 )
+     {
+          throw std::runtime_error( "iv has not valid size" );
+     }
+
+     aescrypt_file_options fileOptions;
+     aescrypt_file_options_init( &fileOptions );
+     fileOptions.mode = mode == CMCbc ? AESCRYPT_MODE_CBC : mode == CMCtr ? AESCRYPT_MODE_CTR : AESCRYPT_MODE_ECB;
+     fileOptions.iv = mode != CMEcb && !iv.empty() ? iv.data() : nullptr;
+     ChecksumType checksum = options.count( "--checksum" ) != 0 ? parseChecksum( options[ "--checksum" ] ) : CTNone;
+     fileOptions.checksum = checksum == CTCrc32c ? AESCRYPT_CHECKSUM_CRC32C : checksum == CTXxh64 ? AESCRYPT_CHECKSUM_XXH64 : AESCRYPT_CHECKSUM_NONE;
+     fileOptions.flags = ( options.count( "--hex" ) != 0 ? AESCRYPT_FILE_HEX : 0 ) | ( options.count( "--compress" ) != 0 ? AESCRYPT_FILE_COMPRESS : 0 ) |
+                         ( options.count( "--huge-pages" ) != 0 ? AESCRYPT_FILE_HUGE_PAGES : 0 ) |
+                         ( options.count( "--in-place" ) != 0 ? AESCRYPT_FILE_IN_PLACE : 0 );
+     NumaPolicy numaPolicy = options.count( "--numa" ) != 0 ? NumaTopology::parsePolicy( options[ "--numa" ] ) : NPOff;
+     fileOptions.flags |= numaPolicy == NPLocal ? AESCRYPT_FILE_NUMA_LOCAL : numaPolicy == NPInterleave ? AESCRYPT_FILE_NUMA_INTERLEAVE : 0;
+     fileOptions.threads = options.count( "--threads" ) != 0 ? std::stoul( options[ "--threads" ] ) : 0;
+     fileOptions.format = options.count( "--incremental" ) != 0                                        ? AESCRYPT_FORMAT_INCREMENTAL
+                          : options.count( "--segments" ) != 0 || options.count( "--segmented" ) != 0 ? AESCRYPT_FORMAT_SEGMENTED
+                          : options.count( "--sparse" ) != 0                                          ? AESCRYPT_FORMAT_SPARSE
+                                                                                                      : AESCRYPT_FORMAT_STREAM;
+     fileOptions.segments = options.count( "--segments" ) != 0 ? std::stoul( options[ "--segments" ] ) : 0;
+     fileOptions.segmentSize = options.count( "--segment-size" ) != 0 ? std::stoull( options[ "--segment-size" ] ) : 0;
+     return fileOptions;
+}
+
+
+// разворачивает ключ через C-интерфейс
+std::unique_ptr< aescrypt_key, void( * )( aescrypt_key* ) > apiKey( const std::vector< unsigned char >& key )
+{
+     aescrypt_key* handle = nullptr;
+     checkStatus( aescrypt_key_create( key.data(), key.size(), &handle ) );
+     return std::unique_ptr< aescrypt_key, void( * )( aescrypt_key* ) >( handle, aescrypt_key_destroy );
+}
+
+
+// шифрует/расшифровывает один файл любого формата через C-интерфейс libaescrypt
+void processSingleFile( bool decrypt, const std::string& inputFile, const std::string& outputFile, const std::vector< unsigned char >& key,
+                        CryptMode mode, const std::vector< unsigned char >& iv, std::map< std::string, std::string >& options )
+{
+     aescrypt_file_options fileOptions = apiFileOptions( mode, iv, options );
+     auto keyHandle = apiKey( key );
+     aescrypt_file_result result{};
+     if( decrypt )
+     {
+          checkStatus( aescrypt_decrypt_file( keyHandle.get(), inputFile.c_str(), outputFile.c_str(), &fileOptions, &result ) );
+     }
+     else
+     {
+          checkStatus( aescrypt_encrypt_file( keyHandle.get(), inputFile.c_str(), outputFile.c_str(), &fileOptions, &result ) );
+     }
+     if( fileOptions.format == AESCRYPT_FORMAT_INCREMENTAL )
+     {
+          std::cout << "Segments encrypted: " << result.segmentsEncrypted << " of " << result.segments << std::endl;
+     }
+     printChecksum( result );
+}
+
+
+// выполняет шифрование/расшифрование одного файла или, с опцией -r, дерева каталогов
+void processFile( const std::vector< std::string >& positional, std::map< std::string, std::string >& options )
+{
+     bool keyFromFile = options.count( "--key-file" ) != 0;
+     bool ivFromFile = options.count( "--iv-file" ) != 0;
+     bool inPlace = options.count( "--in-place" ) != 0;
+
+     // при чтении ключа из файла позиционный аргумент с ключом отсутствует, при обработке на месте - путь результата
+     size_t argIdx = keyFromFile ? 2 : 3;
+     size_t pathCount = inPlace ? 1 : 2;
+     if( positional.size() < argIdx + pathCount )
+     {
+          throw std::runtime_error( "not enough arguments" );
+     }
+
      bool decrypt = false;
-     bool cbc = false;
-     std::vector< unsigned char > key = FileEncryptor::hexToArray( args[ 2 ] );
-     std::string inputFile = args[ 3 ];
-     std::string outputFile = args[ 4 ];
+     std::vector< unsigned char > key = keyFromFile ? FileEncryptor::readBinaryFile( options[ "--key-file" ], 32 )
+                                                    : FileEncryptor::hexToArray( positional[ 2 ] );
+     std::string inputFile = positional[ argIdx ];
+     std::string outputFile = inPlace ? inputFile + ".journal" : positional[ argIdx + 1 ];
      std::vector< unsigned char > iv;
-     if( args[ 0 ] == "decrypt" )
+     if( positional[ 0 ] == "decrypt" )
      {
           decrypt = true;
      }
-     else if( args[ 0 ] != "encrypt" )
+     else if( positional[ 0 ] != "encrypt" )
      {
-          throw std::runtime_error( "incorrect action: " + args[ 0 ] );
+          throw std::runtime_error( "incorrect action: " + positional[ 0 ] );
      }
 
-     if( args[ 1 ] == "CBC" )
+     CryptMode mode = parseMode( positional[ 1 ] );
+
+     if( ivFromFile )
      {
-          cbc = true;
+          iv = FileEncryptor::readBinaryFile( options[ "--iv-file" ], 16 );
      }
-     else if( args[ 1 ] != "ECB" )
+     else if( positional.size() > argIdx + pathCount )
      {
-          throw std::runtime_error( "incorrect encrypt mode: " + args[ 1 ] );
+          iv = FileEncryptor::hexToArray( positional[ argIdx + pathCount ] );
      }
 
-     if( args.size() >= 6 )
+     // пул с огромными страницами создается только по запросу, иначе используется пул процесса по умолчанию
+     std::unique_ptr< BufferPool > hugePagePool;
+     if( options.count( "--huge-pages" ) != 0 )
      {
-          iv = FileEncryptor::hexToArray( args[ 5 ] );
+          hugePagePool.reset( new BufferPool( TuningProfile::active().chunkSize, true ) );
      }
 
-     FileEncryptor fileCrypt( inputFile, outputFile );
+     // прерванное шифрование на месте продолжается только с тем же IV: журнал привязан к ключу и IV,
+     // поэтому случайный IV здесь не вырабатывается
+     if( inPlace && iv.empty() )
+     {
+          throw std::runtime_error( "in-place encryption requires IV(argument or --iv-file) to resume an interrupted run" );
+     }
 
-     if( decrypt )
+     // при шифровании в режимах CBC и CTR без заданного IV вырабатываем случайный и сообщаем его пользователю
+     if( mode != CMEcb && !decrypt && iv.empty() )
+     {
+          iv = AESCryptography( AKL_128 ).create_iv();
+          std::string hexIv( 2 * iv.size(), '\0' );
+          HexCodec::encode( iv.data(), iv.size(), &hexIv[ 0 ] );
+          std::cout << "IV: " << hexIv << std::endl;
+     }
+
+     bool segmented = options.count( "--segments" ) != 0 || options.count( "--segmented" ) != 0;
+     if( segmented && mode != CMCbc )
+     {
+          throw std::runtime_error( "segmented format is supported only in CBC mode" );
+     }
+     if( inPlace && ( mode != CMCtr || options.count( "-r" ) != 0 ) )
+     {
+          throw std::runtime_error( "in-place encryption is supported only for single file in CTR mode" );
+     }
+     bool incremental = options.count( "--incremental" ) != 0;
+     if( incremental && ( mode != CMCbc || decrypt || options.count( "-r" ) != 0 ) )
+     {
+          throw std::runtime_error( "incremental encryption is supported only for single file encryption in CBC mode" );
+     }
+     ChecksumType checksum = options.count( "--checksum" ) != 0 ? parseChecksum( options[ "--checksum" ] ) : CTNone;
+     if( checksum != CTNone && ( segmented || inPlace || incremental ) )
+     {
+          throw std::runtime_error( "checksum is not supported for segmented, incremental and in-place encryption" );
+     }
+     bool compression = options.count( "--compress" ) != 0;
+     if( compression && ( segmented || inPlace || incremental ) )
+     {
+          throw std::runtime_error( "compression is not supported for segmented, incremental and in-place encryption" );
+     }
+     bool sparse = options.count( "--sparse" ) != 0;
+     if( sparse && ( mode != CMCtr || options.count( "-r" ) != 0 || inPlace || checksum != CTNone || compression || options.count( "--hex" ) != 0 ) )
+     {
+          throw std::runtime_error( "sparse format is supported only for single file in CTR mode without HEX, checksum and compression" );
+     }
+
+     if( options.count( "-r" ) != 0 )
+     {
+          DirectoryEncryptor directoryCrypt( inputFile, outputFile, std::cout );
+          directoryCrypt.setHexArmor( options.count( "--hex" ) != 0 );
+          directoryCrypt.setSegmented( segmented, options.count( "--segments" ) != 0 ? std::stoul( options[ "--segments" ] ) : 0 );
+          directoryCrypt.setChecksum( checksum );
+          directoryCrypt.setCompression( compression );
+          if( hugePagePool )
+          {
+               directoryCrypt.setBufferPool( *hugePagePool );
+          }
+          if( options.count( "--threads" ) != 0 )
+          {
+               directoryCrypt.setThreadCount( std::stoul( options[ "--threads" ] ) );
+          }
+          if( options.count( "--numa" ) != 0 )
+          {
+               directoryCrypt.setNumaPolicy( NumaTopology::parsePolicy( options[ "--numa" ] ) );
+          }
+
+          if( decrypt )
+          {
+               directoryCrypt.decryptDirectory( key, mode, iv );
+          }
+          else
+          {
+               directoryCrypt.cryptDirectory( key, mode, iv );
+          }
+          return;
+     }
+
+     // файл любого формата обрабатывается через C-интерфейс библиотеки, как в сервисах, встраивающих ее.
+     // Для --stats файл обрабатывается FileEncryptor напрямую, чтобы снять счетчики по стадиям
+     bool stats = options.count( "--stats" ) != 0;
+     if( !stats )
      {
-          fileCrypt.decryptFile( key, cbc ? CMCbc : CMEcb, iv );
+          processSingleFile( decrypt, inputFile, outputFile, key, mode, iv, options );
+          return;
+     }
+
+     // счетчики открываются до создания пула потоков, чтобы рабочие потоки их унаследовали
+     std::unique_ptr< PerfCounters > counters( stats ? new PerfCounters() : nullptr );
+     std::unique_ptr< PerfStats > perfStats( stats ? new PerfStats( *counters ) : nullptr );
+     PerfReading startReading = counters ? counters->read() : PerfReading();
+
+     FileEncryptor fileCrypt( inputFile, outputFile, hugePagePool ? *hugePagePool : BufferPool::defaultPool() );
+     fileCrypt.setPerfStats( perfStats.get() );
+     fileCrypt.setHexArmor( options.count( "--hex" ) != 0 );
+     if( options.count( "--threads" ) != 0 )
+     {
+          fileCrypt.setThreadCount( std::stoul( options[ "--threads" ] ) );
+     }
+     if( options.count( "--numa" ) != 0 )
+     {
+          fileCrypt.setNumaPolicy( NumaTopology::parsePolicy( options[ "--numa" ] ) );
+     }
+
+     if( incremental )
+     {
+          uint64_t segmentSize = options.count( "--segment-size" ) != 0 ? std::stoull( options[ "--segment-size" ] ) : 4 * 1024 * 1024;
+          FileEncryptor::IncrementalStats stats = fileCrypt.cryptFileIncremental( key, iv, segmentSize );
+          std::cout << "Segments encrypted: " << stats.encrypted << " of " << stats.segments << std::endl;
+     }
+     else if( inPlace && decrypt )
+     {
+          fileCrypt.decryptFileInPlace( key, iv );
+     }
+     else if( sparse && decrypt )
+     {
+          fileCrypt.decryptFileSparse( key, iv );
+     }
+     else if( sparse )
+     {
+          fileCrypt.cryptFileSparse( key, iv );
+     }
+     else if( inPlace )
+     {
+          fileCrypt.cryptFileInPlace( key, iv );
+     }
+     else if( segmented && decrypt )
+     {
+          fileCrypt.decryptFileSegmented( key, iv );
+     }
+     else if( segmented )
+     {
+          size_t segmentCount = options.count( "--segments" ) != 0 ? std::stoul( options[ "--segments" ] ) : ThreadPool::hardwareThreads();
+          fileCrypt.cryptFileSegmented( key, iv, segmentCount );
      }
      else
      {
-          fileCrypt.cryptFile( key, cbc ? CMCbc : CMEcb, iv );
+          fileCrypt.setChecksum( checksum );
+          fileCrypt.setCompression( compression );
+          if( decrypt )
+          {
+               fileCrypt.decryptFile( key, mode, iv );
+          }
+          else
+          {
+               fileCrypt.cryptFile( key, mode, iv );
+          }
+          aescrypt_file_result result{};
+          result.checksumType = fileCrypt.lastChecksumType() == CTCrc32c  ? AESCRYPT_CHECKSUM_CRC32C
+                                : fileCrypt.lastChecksumType() == CTXxh64 ? AESCRYPT_CHECKSUM_XXH64
+                                                                          : AESCRYPT_CHECKSUM_NONE;
+          result.checksum = fileCrypt.lastChecksum();
+          printChecksum( result );
      }
+
+     // итог считается по размеру исходного файла и включает работу рабочих потоков, которые к этому моменту завершены
+     if( perfStats )
+     {
+          perfStats->report( std::cout );
+          PerfStats::reportLine( std::cout, *counters, "total, all threads", counters->read() - startReading, std::filesystem::file_size( inputFile ) );
+     }
+}
+
+
+// возвращает следующий позиционный аргумент
+const std::string& nextArg( const std::vector< std::string >& positional, size_t& argIdx )
+{
+     if( argIdx >= positional.size() )
+     {
+          throw std::runtime_error( "not enough arguments" );
+     }
+     return positional[ argIdx++ ];
+}
+
+
+// перешифровывает файл со старых ключа/режима/IV на новые за один проход
+void processReencrypt( const std::vector< std::string >& positional, std::map< std::string, std::string >& options )
+{
+     size_t argIdx = 1;
+     CryptMode oldMode = parseMode( nextArg( positional, argIdx ) );
+     std::vector< unsigned char > oldKey = options.count( "--key-file" ) != 0 ? FileEncryptor::readBinaryFile( options[ "--key-file" ], 32 )
+                                                                             : FileEncryptor::hexToArray( nextArg( positional, argIdx ) );
+     CryptMode newMode = parseMode( nextArg( positional, argIdx ) );
+     std::vector< unsigned char > newKey = options.count( "--new-key-file" ) != 0 ? FileEncryptor::readBinaryFile( options[ "--new-key-file" ], 32 )
+                                                                                 : FileEncryptor::hexToArray( nextArg( positional, argIdx ) );
+     std::string inputFile = nextArg( positional, argIdx );
+     std::string outputFile = nextArg( positional, argIdx );
+
+     // IV указываются только для режима CBC: сначала старый, затем новый
+     std::vector< unsigned char > oldIv;
+     if( oldMode == CMCbc )
+     {
+          oldIv = options.count( "--iv-file" ) != 0 ? FileEncryptor::readBinaryFile( options[ "--iv-file" ], 16 )
+                                                    : FileEncryptor::hexToArray( nextArg( positional, argIdx ) );
+     }
+     std::vector< unsigned char > newIv;
+     if( newMode == CMCbc && options.count( "--new-iv-file" ) != 0 )
+     {
+          newIv = FileEncryptor::readBinaryFile( options[ "--new-iv-file" ], 16 );
+     }
+     else if( newMode == CMCbc && argIdx < positional.size() )
+     {
+          newIv = FileEncryptor::hexToArray( nextArg( positional, argIdx ) );
+     }
+     else if( newMode == CMCbc )
+     {
+          newIv = AESCryptography( AKL_128 ).create_iv();
+          std::string hexIv( 2 * newIv.size(), '\0' );
+          HexCodec::encode( newIv.data(), newIv.size(), &hexIv[ 0 ] );
+          std::cout << "IV: " << hexIv << std::endl;
+     }
+
+     // флаги и число потоков относятся к новому шифртексту, старый берет из них только --hex
+     aescrypt_file_options oldOptions = apiFileOptions( oldMode, oldIv, options );
+     aescrypt_file_options newOptions = apiFileOptions( newMode, newIv, options );
+     auto oldHandle = apiKey( oldKey );
+     auto newHandle = apiKey( newKey );
+
+     // контрольная сумма переносится из концевика исходного файла
+     aescrypt_file_result result{};
+     checkStatus( aescrypt_reencrypt_file( oldHandle.get(), &oldOptions, newHandle.get(), &newOptions, inputFile.c_str(), outputFile.c_str(), &result ) );
+     printChecksum( result );
+}
+
+
+// проверяет зашифрованный файл без записи открытого текста. Возвращает false, если файл поврежден или ключ неверен
+bool processVerify( const std::vector< std::string >& positional, std::map< std::string, std::string >& options )
+{
+     size_t argIdx = 1;
+     CryptMode mode = parseMode( nextArg( positional, argIdx ) );
+     std::vector< unsigned char > key = options.count( "--key-file" ) != 0 ? FileEncryptor::readBinaryFile( options[ "--key-file" ], 32 )
+                                                                          : FileEncryptor::hexToArray( nextArg( positional, argIdx ) );
+     std::string inputFile = nextArg( positional, argIdx );
+     std::vector< unsigned char > iv;
+     if( options.count( "--iv-file" ) != 0 )
+     {
+          iv = FileEncryptor::readBinaryFile( options[ "--iv-file" ], 16 );
+     }
+     else if( argIdx < positional.size() )
+     {
+          iv = FileEncryptor::hexToArray( nextArg( positional, argIdx ) );
+     }
+
+     bool segmented = options.count( "--segmented" ) != 0;
+     bool sparse = options.count( "--sparse" ) != 0;
+     if( ( segmented && mode != CMCbc ) || ( sparse && mode != CMCtr ) )
+     {
+          throw std::runtime_error( "segmented format is supported only in CBC mode, sparse format only in CTR mode" );
+     }
+
+     aescrypt_file_options fileOptions = apiFileOptions( mode, iv, options );
+     auto keyHandle = apiKey( key );
+
+     // ошибки аргументов выше - исключения, а ошибки проверки сообщаются как результат. Проверка, которая ничего
+     // не проверяет, не может завершиться успешно, а проверка одного дополнения помечается как слабая
+     auto start = std::chrono::steady_clock::now();
+     aescrypt_file_result result{};
+     int status = aescrypt_verify_file( keyHandle.get(), inputFile.c_str(), &fileOptions, &result );
+     if( status == AESCRYPT_ERROR_UNVERIFIED )
+     {
+          std::cout << "UNVERIFIED: CTR ciphertext without checksum trailer cannot be checked, encrypt with --checksum" << std::endl;
+          return false;
+     }
+     if( status != AESCRYPT_OK )
+     {
+          std::cout << "FAILED: " << aescrypt_last_error() << std::endl;
+          return false;
+     }
+     double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+     std::cout << ( result.verifyStrength == AESCRYPT_VERIFY_PADDING ? "WEAK(padding only, wrong key passes about 1 in 256): verified by "
+                                                                     : "OK: verified by " )
+               << result.evidence << ", " << result.verifiedSize << " bytes(decrypted " << result.decryptedSize << ") in "
+               << std::fixed << std::setprecision( 3 ) << seconds << " s";
+     if( seconds > 0 )
+     {
+          std::cout << ", " << std::setprecision( 1 ) << result.verifiedSize / seconds / ( 1 << 20 ) << " MB/s";
+     }
+     std::cout << std::endl;
+     printChecksum( result );
+     return true;
+}
+
+
+// подбирает реализацию шифра, число потоков и размер части данных и записывает профиль
+void runTune( std::map< std::string, std::string >& options )
+{
+     const char* tmpDir = getenv( "TMPDIR" );
+     TuningProfile profile = Tuner( std::cout, tmpDir != nullptr ? tmpDir : "/tmp" ).run();
+     std::string path = options.count( "--output" ) != 0 ? options[ "--output" ] : TuningProfile::defaultPath();
+     profile.save( path );
+     std::cout << "Profile written to " << path << ": backend " << AESCryptography::backendName( profile.backend )
+               << ", chunk " << profile.chunkSize << " bytes, threads " << profile.threadCount << std::endl;
+}
+
+
+bool exec( const std::vector< std::string >& args )
+{
+     std::vector< std::string > positional;
+     std::map< std::string, std::string > options;
+     parseArgs( args, positional, options );
+
+     if( !positional.empty() && positional[ 0 ] == "tune" )
+     {
+          runTune( options );
+          return true;
+     }
+
+     // профиль применяется до создания пулов буферов и потоков
+     if( options.count( "--profile" ) != 0 )
+     {
+          if( !TuningProfile::loadActive( options[ "--profile" ] ) )
+          {
+               throw std::runtime_error( "Tuning profile is missing or was made on another CPU: " + options[ "--profile" ] );
+          }
+     }
+     else
+     {
+          TuningProfile::active();
+     }
+
+     if( !positional.empty() && positional[ 0 ] == "reencrypt" )
+     {
+          processReencrypt( positional, options );
+          return true;
+     }
+     if( !positional.empty() && positional[ 0 ] == "verify" )
+     {
+          return processVerify( positional, options );
+     }
+
+     processFile( positional, options );
+     return true;
 }
 
 
 int main( int argc, char* argv[] )
 {
-     if( argc < 6 || ( strlen( argv[ 1 ] ) == 0 && argv[ 1 ][ 0 ] == 'h' ) )
+     if( argc < 2 || ( strlen( argv[ 1 ] ) == 0 && argv[ 1 ][ 0 ] == 'h' ) )
      {
           printHelp();
           return 0;
@@ -72,7 +633,10 @@ int main( int argc, char* argv[] )
 
      try
      {
-          exec( args );
+          if( !exec( args ) )
+          {
+               return -1;
+          }
      }
      catch ( const std::exception& ex )
      {
@@ -0,0 +1,207 @@
+/// @file
+/// @brief Топология узлов NUMA: процессоры узлов, привязка потоков к ядрам и размещение памяти на узлах
+
+#include "numa_topology.h"
+
+#include <algorithm>
+#include <climits>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+     // разбирает список процессоров вида "0-3,8-11"
+     std::vector< int > parseCpuList( const std::string& list )
+     {
+          std::vector< int > cpus;
+          std::stringstream stream( list );
+          std::string range;
+          while( std::getline( stream, range, ',' ) )
+          {
+               if( range.empty() || range == "\n" )
+               {
+                    continue;
+               }
+               size_t dash = range.find( '-' );
+               int first = std::stoi( range.substr( 0, dash ) );
+               int last = dash == std::string::npos ? first : std::stoi( range.substr( dash + 1 ) );
+               for( int cpu = first; cpu <= last; cpu++ )
+               {
+                    cpus.push_back( cpu );
+               }
+          }
+          return cpus;
+     }
+}
+
+
+NumaTopology::NumaTopology()
+{
+     cpu_set_t allowed;
+     CPU_ZERO( &allowed );
+     bool maskKnown = sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0;
+
+     namespace fs = std::filesystem;
+     std::map< int, std::vector< int > > nodes;
+     std::error_code error;
+     for( const fs::directory_entry& entry: fs::directory_iterator( "/sys/devices/system/node", error ) )
+     {
+          std::string name = entry.path().filename().string();
+          if( name.compare( 0, 4, "node" ) != 0 || name.size() == 4 || name.find_first_not_of( "0123456789", 4 ) != std::string::npos )
+          {
+               continue;
+          }
+
+          std::ifstream inp( entry.path() / "cpulist" );
+          std::string list;
+          std::getline( inp, list );
+          std::vector< int > cpus;
+          try
+          {
+               cpus = parseCpuList( list );
+          }
+          catch( const std::exception& )
+          {
+               continue;
+          }
+          if( maskKnown )
+          {
+               cpus.erase( std::remove_if( cpus.begin(), cpus.end(), [ & ]( int cpu )
+               {
+                    return cpu >= CPU_SETSIZE || !CPU_ISSET( cpu, &allowed );
+               } ), cpus.end() );
+          }
+
+          // узлы только с памятью не нужны: потоки на них не размещаются
+          if( !cpus.empty() )
+          {
+               nodes[ std::stoi( name.substr( 4 ) ) ] = cpus;
+          }
+     }
+
+     // узлы по возрастанию номеров, чтобы соседние рабочие потоки попадали на один узел
+     for( const auto& [ id, cpus ]: nodes )
+     {
+          nodeIds_.push_back( id );
+          nodeCpus_.push_back( cpus );
+     }
+
+     if( nodeIds_.empty() )
+     {
+          std::vector< int > all;
+          for( int cpu = 0; cpu < CPU_SETSIZE && all.size() < std::thread::hardware_concurrency(); cpu++ )
+          {
+               if( !maskKnown || CPU_ISSET( cpu, &allowed ) )
+               {
+                    all.push_back( cpu );
+               }
+          }
+          if( all.empty() )
+          {
+               all.push_back( 0 );
+          }
+          nodeIds_.push_back( 0 );
+          nodeCpus_.push_back( all );
+     }
+}
+
+
+const NumaTopology& NumaTopology::host()
+{
+     static const NumaTopology topology;
+     return topology;
+}
+
+
+size_t NumaTopology::nodeCount() const
+{
+     return nodeCpus_.size();
+}
+
+
+const std::vector< int >& NumaTopology::nodeCpus( size_t node ) const
+{
+     return nodeCpus_[ node ];
+}
+
+
+int NumaTopology::nodeId( size_t node ) const
+{
+     return nodeIds_[ node ];
+}
+
+
+bool NumaTopology::pinCurrentThread( int cpu )
+{
+     cpu_set_t set;
+     CPU_ZERO( &set );
+     CPU_SET( cpu, &set );
+     return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+}
+
+
+bool NumaTopology::bindMemory( void* data, size_t size, const std::vector< size_t >& nodes, bool interleave ) const
+{
+     // на машине с одним узлом размещать нечего
+     if( nodeCount() < 2 || nodes.empty() || size == 0 )
+     {
+          return true;
+     }
+
+     const size_t bitsPerWord = sizeof( unsigned long ) * CHAR_BIT;
+     int maxId = *std::max_element( nodeIds_.begin(), nodeIds_.end() );
+     std::vector< unsigned long > mask( maxId / bitsPerWord + 1, 0 );
+     for( size_t node: nodes )
+     {
+          int id = nodeIds_[ node ];
+          mask[ id / bitsPerWord ] |= 1ul << ( id % bitsPerWord );
+     }
+
+     // libnuma не используется, чтобы не добавлять зависимость: mbind вызывается напрямую.
+     // Один узел только предпочитается: при нехватке на нем памяти страницы выделяются на других узлах
+     long result = syscall( SYS_mbind, data, size, interleave ? MPOL_INTERLEAVE : MPOL_PREFERRED, mask.data(), mask.size() * bitsPerWord + 1,
+                            MPOL_MF_MOVE );
+     return result == 0;
+}
+
+
+NumaPolicy NumaTopology::parsePolicy( const std::string& name )
+{
+     for( NumaPolicy policy: { NPOff, NPLocal, NPInterleave } )
+     {
+          if( name == policyName( policy ) )
+          {
+               return policy;
+          }
+     }
+     throw std::runtime_error( "Unknown NUMA policy: " + name );
+}
+
+
+const char* NumaTopology::policyName( NumaPolicy policy )
+{
+     switch( policy )
+     {
+          case NPLocal:
+          {
+               return "local";
+          }
+          case NPInterleave:
+          {
+               return "interleave";
+          }
+          default:
+          {
+               return "off";
+          }
+     }
+}
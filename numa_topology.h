@@ -0,0 +1,52 @@
+/// @file
+/// @brief Топология узлов NUMA: процессоры узлов, привязка потоков к ядрам и размещение памяти на узлах
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+// политика размещения рабочих потоков и буферов на многопроцессорных машинах
+enum NumaPolicy
+{
+     NPOff,              // потоки и память размещает система
+     NPLocal,            // потоки закреплены за ядрами, часть буфера лежит на узле потока, который ее обрабатывает
+     NPInterleave        // потоки закреплены за ядрами, страницы буферов чередуются по узлам
+};
+
+
+// Топология читается из /sys/devices/system/node с учетом маски процессоров, доступных процессу.
+// Без NUMA(или без sysfs) вся машина считается одним узлом, а размещение памяти ничего не делает
+class NumaTopology
+{
+public:
+     // топология машины, читается один раз
+     static const NumaTopology& host();
+
+     // число узлов с доступными процессу процессорами
+     size_t nodeCount() const;
+
+     // доступные процессу процессоры узла
+     const std::vector< int >& nodeCpus( size_t node ) const;
+
+     // номер узла в системе(для mbind) по порядковому номеру узла топологии
+     int nodeId( size_t node ) const;
+
+     // закрепляет вызывающий поток за процессором. false - система не позволила
+     static bool pinCurrentThread( int cpu );
+
+     // размещает страницы [data, data + size) на узлах nodes(порядковые номера топологии): на одном(первом) узле или,
+     // при interleave, по очереди на всех. Уже выделенные страницы переносятся. Адрес должен быть выровнен по странице
+     bool bindMemory( void* data, size_t size, const std::vector< size_t >& nodes, bool interleave ) const;
+
+     static NumaPolicy parsePolicy( const std::string& name );
+     static const char* policyName( NumaPolicy policy );
+
+private:
+     NumaTopology();
+
+private:
+     std::vector< int > nodeIds_;
+     std::vector< std::vector< int > > nodeCpus_;
+};
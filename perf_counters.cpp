@@ -0,0 +1,235 @@
+/// @file
+/// @brief Аппаратные счетчики производительности(perf_event_open) и их накопление по стадиям обработки
+
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+     uint64_t cacheMissConfig( uint64_t cache )
+     {
+          return cache | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+     }
+
+     int openCounter( uint32_t type, uint64_t config )
+     {
+          perf_event_attr attr;
+          memset( &attr, 0, sizeof( attr ) );
+          attr.size = sizeof( attr );
+          attr.type = type;
+          attr.config = config;
+          attr.inherit = 1;
+          // только пользовательский режим: так счетчики доступны и при perf_event_paranoid = 2
+          attr.exclude_kernel = 1;
+          attr.exclude_hv = 1;
+          attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+          return static_cast< int >( syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 ) );
+     }
+}
+
+
+PerfReading PerfReading::operator-( const PerfReading& rhs ) const
+{
+     PerfReading result;
+     result.seconds = seconds - rhs.seconds;
+     for( int counter = 0; counter < PCCount; counter++ )
+     {
+          result.values[ counter ] = values[ counter ] - rhs.values[ counter ];
+     }
+     return result;
+}
+
+
+PerfReading& PerfReading::operator+=( const PerfReading& rhs )
+{
+     seconds += rhs.seconds;
+     for( int counter = 0; counter < PCCount; counter++ )
+     {
+          values[ counter ] += rhs.values[ counter ];
+     }
+     return *this;
+}
+
+
+PerfCounters::PerfCounters()
+:start_( std::chrono::steady_clock::now() )
+{
+     const std::pair< uint32_t, uint64_t > events[ PCCount ] =
+     {
+          { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+          { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+          { PERF_TYPE_HW_CACHE, cacheMissConfig( PERF_COUNT_HW_CACHE_L1D ) },
+          { PERF_TYPE_HW_CACHE, cacheMissConfig( PERF_COUNT_HW_CACHE_LL ) },
+          { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+     };
+     for( int counter = 0; counter < PCCount; counter++ )
+     {
+          fds_[ counter ] = openCounter( events[ counter ].first, events[ counter ].second );
+          if( fds_[ counter ] < 0 && unavailableReason_.empty() )
+          {
+               unavailableReason_ = std::string( counterName( static_cast< PerfCounter >( counter ) ) ) + ": " + strerror( errno );
+          }
+     }
+}
+
+
+PerfCounters::~PerfCounters()
+{
+     for( int fd: fds_ )
+     {
+          if( fd >= 0 )
+          {
+               close( fd );
+          }
+     }
+}
+
+
+PerfReading PerfCounters::read() const
+{
+     PerfReading reading;
+     reading.seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start_ ).count();
+     for( int counter = 0; counter < PCCount; counter++ )
+     {
+          // value, time_enabled, time_running. Если счетчиков больше, чем регистров, система их чередует,
+          // и значение пересчитывается на все время работы
+          uint64_t data[ 3 ] = {};
+          if( fds_[ counter ] < 0 || ::read( fds_[ counter ], data, sizeof( data ) ) != sizeof( data ) )
+          {
+               continue;
+          }
+          reading.values[ counter ] = data[ 2 ] == 0 ? 0 : static_cast< double >( data[ 0 ] ) * data[ 1 ] / data[ 2 ];
+     }
+     return reading;
+}
+
+
+bool PerfCounters::available( PerfCounter counter ) const
+{
+     return fds_[ counter ] >= 0;
+}
+
+
+const std::string& PerfCounters::unavailableReason() const
+{
+     return unavailableReason_;
+}
+
+
+const char* PerfCounters::counterName( PerfCounter counter )
+{
+     switch( counter )
+     {
+          case PCCycles:
+          {
+               return "cycles";
+          }
+          case PCInstructions:
+          {
+               return "instructions";
+          }
+          case PCL1dMisses:
+          {
+               return "L1D misses";
+          }
+          case PCLlcMisses:
+          {
+               return "LLC misses";
+          }
+          default:
+          {
+               return "branch misses";
+          }
+     }
+}
+
+
+PerfStats::PerfStats( const PerfCounters& counters )
+:counters_( counters )
+{
+}
+
+
+const PerfCounters& PerfStats::counters() const
+{
+     return counters_;
+}
+
+
+void PerfStats::add( const std::string& phase, const PerfReading& delta, uint64_t bytes )
+{
+     for( auto& [ name, value ]: phases_ )
+     {
+          if( name == phase )
+          {
+               value.total += delta;
+               value.bytes += bytes;
+               return;
+          }
+     }
+     phases_.emplace_back( phase, Phase{ delta, bytes } );
+}
+
+
+void PerfStats::report( std::ostream& log ) const
+{
+     if( !counters_.unavailableReason().empty() )
+     {
+          log << "hardware counters unavailable(" << counters_.unavailableReason() << "), partial or timing only" << std::endl;
+     }
+     for( const auto& [ name, value ]: phases_ )
+     {
+          reportLine( log, counters_, name, value.total, value.bytes );
+     }
+}
+
+
+void PerfStats::reportLine( std::ostream& log, const PerfCounters& counters, const std::string& name, const PerfReading& delta,
+                            uint64_t bytes )
+{
+     const double perByte = bytes == 0 ? 0 : 1.0 / bytes;
+     log << std::fixed << std::setprecision( 3 ) << name << ": " << delta.seconds << " s";
+     if( delta.seconds > 0 )
+     {
+          log << ", " << std::setprecision( 1 ) << bytes / delta.seconds / ( 1 << 20 ) << " MB/s";
+     }
+     log << std::setprecision( 4 );
+     for( int counter = 0; counter < PCCount; counter++ )
+     {
+          if( counters.available( static_cast< PerfCounter >( counter ) ) )
+          {
+               log << ", " << PerfCounters::counterName( static_cast< PerfCounter >( counter ) ) << "/B " << delta.values[ counter ] * perByte;
+          }
+     }
+     if( counters.available( PCCycles ) && counters.available( PCInstructions ) && delta.values[ PCCycles ] > 0 )
+     {
+          log << ", IPC " << std::setprecision( 2 ) << delta.values[ PCInstructions ] / delta.values[ PCCycles ];
+     }
+     log << std::endl;
+}
+
+
+PerfPhase::PerfPhase( PerfStats* stats, const char* name )
+:stats_( stats ), name_( name )
+{
+     if( stats_ != nullptr )
+     {
+          start_ = stats_->counters().read();
+     }
+}
+
+
+void PerfPhase::finish( uint64_t bytes )
+{
+     if( stats_ != nullptr )
+     {
+          stats_->add( name_, stats_->counters().read() - start_, bytes );
+     }
+}
@@ -0,0 +1,107 @@
+/// @file
+/// @brief Аппаратные счетчики производительности(perf_event_open) и их накопление по стадиям обработки
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+enum PerfCounter
+{
+     PCCycles,
+     PCInstructions,
+     PCL1dMisses,        // промахи чтения L1 данных
+     PCLlcMisses,        // промахи чтения кэша последнего уровня
+     PCBranchMisses,     // неверно предсказанные переходы
+     PCCount
+};
+
+
+// показания счетчиков на момент чтения. Разность двух показаний - затраты на участок кода
+struct PerfReading
+{
+     double seconds = 0;
+     double values[ PCCount ] = {};
+
+     PerfReading operator-( const PerfReading& rhs ) const;
+     PerfReading& operator+=( const PerfReading& rhs );
+};
+
+
+// Счетчики открываются для вызывающего потока и наследуются потоками, созданными после этого. Показания
+// унаследованных счетчиков добавляются только после завершения потоков, поэтому работа пула потоков видна в итоге
+// операции, а по стадиям - только работа вызывающего потока. Счетчики, недоступные в системе(виртуальная машина,
+// perf_event_paranoid), пропускаются: без них остается только время
+class PerfCounters
+{
+public:
+     PerfCounters();
+     ~PerfCounters();
+
+     PerfCounters( const PerfCounters& ) = delete;
+     PerfCounters& operator=( const PerfCounters& ) = delete;
+
+     PerfReading read() const;
+
+     bool available( PerfCounter counter ) const;
+
+     // причина, по которой не открылся первый недоступный счетчик. Пусто, если доступны все
+     const std::string& unavailableReason() const;
+
+     static const char* counterName( PerfCounter counter );
+
+private:
+     int fds_[ PCCount ];
+     std::string unavailableReason_;
+     std::chrono::steady_clock::time_point start_;
+};
+
+
+// затраты по стадиям обработки(чтение, шифрование, запись ...) в порядке первого появления стадии
+class PerfStats
+{
+public:
+     explicit PerfStats( const PerfCounters& counters );
+
+     const PerfCounters& counters() const;
+
+     // добавляет к стадии phase затраты delta на обработку bytes байт
+     void add( const std::string& phase, const PerfReading& delta, uint64_t bytes );
+
+     // выводит по строке на стадию: время, скорость и показания счетчиков в пересчете на байт
+     void report( std::ostream& log ) const;
+
+     // строка отчета для одного замера
+     static void reportLine( std::ostream& log, const PerfCounters& counters, const std::string& name, const PerfReading& delta,
+                             uint64_t bytes );
+
+private:
+     struct Phase
+     {
+          PerfReading total;
+          uint64_t bytes = 0;
+     };
+
+     const PerfCounters& counters_;
+     std::vector< std::pair< std::string, Phase > > phases_;
+};
+
+
+// замер одной стадии: показания снимаются при создании и при finish. При stats == nullptr ничего не делает
+class PerfPhase
+{
+public:
+     PerfPhase( PerfStats* stats, const char* name );
+
+     void finish( uint64_t bytes );
+
+private:
+     PerfStats* stats_;
+     const char* name_;
+     PerfReading start_;
+};
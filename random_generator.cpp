@@ -0,0 +1,184 @@
+/// @file
+/// @brief Криптографический генератор случайных чисел CTR_DRBG(NIST SP 800-90A) на основе AES-256
+
+#include "random_generator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <pthread.h>
+#include <sys/random.h>
+
+namespace
+{
+     // увеличивается в дочернем процессе после fork, чтобы генераторы не повторяли выход родителя
+     std::atomic< uint64_t > forkGeneration( 0 );
+
+     void onFork()
+     {
+          forkGeneration++;
+     }
+
+     void incrementCounter( unsigned char counter[ 16 ] )
+     {
+          for( int idx = 15; idx >= 0; idx-- )
+          {
+               if( ++counter[ idx ] != 0 )
+               {
+                    break;
+               }
+          }
+     }
+
+     void wipe( void* data, size_t size )
+     {
+          volatile unsigned char* bytes = static_cast< volatile unsigned char* >( data );
+          for( size_t idx = 0; idx < size; idx++ )
+          {
+               bytes[ idx ] = 0;
+          }
+     }
+}
+
+
+CtrDrbg::CtrDrbg()
+:crypt_( AKL_256 )
+{
+     static std::once_flag atforkRegistered;
+     std::call_once( atforkRegistered, []() { pthread_atfork( nullptr, nullptr, onFork ); } );
+     reseed();
+}
+
+
+CtrDrbg::~CtrDrbg()
+{
+     wipe( key_, sizeof( key_ ) );
+     wipe( counter_, sizeof( counter_ ) );
+     wipe( buffer_, sizeof( buffer_ ) );
+     wipe( &roundKeys_, sizeof( roundKeys_ ) );
+}
+
+
+void CtrDrbg::generate( unsigned char* dst, size_t size )
+{
+     if( forkGeneration_ != forkGeneration.load( std::memory_order_relaxed ) )
+     {
+          reseed();
+     }
+
+     while( size != 0 )
+     {
+          if( available_ == 0 )
+          {
+               refill();
+          }
+
+          // выдаем байты с конца буфера и сразу стираем их, чтобы выданные значения не оставались в памяти
+          size_t count = std::min( size, available_ );
+          unsigned char* src = buffer_ + available_ - count;
+          memcpy( dst, src, count );
+          wipe( src, count );
+
+          available_ -= count;
+          dst += count;
+          size -= count;
+     }
+}
+
+
+void CtrDrbg::reseed()
+{
+     unsigned char entropy[ seedSize ];
+     systemEntropy( entropy, seedSize );
+
+     // при первой инициализации(CTR_DRBG_Instantiate) ключ и счетчик нулевые, при перезарядке сохраняются
+     if( reseedCounter_ == 0 )
+     {
+          memset( key_, 0, sizeof( key_ ) );
+          memset( counter_, 0, sizeof( counter_ ) );
+          roundKeys_ = crypt_.expandKey( std::vector< unsigned char >( key_, key_ + sizeof( key_ ) ), false );
+     }
+     update( entropy );
+     wipe( entropy, sizeof( entropy ) );
+
+     wipe( buffer_, sizeof( buffer_ ) );
+     available_ = 0;
+     reseedCounter_ = 1;
+     forkGeneration_ = forkGeneration.load( std::memory_order_relaxed );
+}
+
+
+CtrDrbg& CtrDrbg::threadLocal()
+{
+     thread_local CtrDrbg generator;
+     return generator;
+}
+
+
+void CtrDrbg::update( const unsigned char provided[ 48 ] )
+{
+     unsigned char temp[ seedSize ];
+     for( size_t block = 0; block < seedSize; block += 16 )
+     {
+          incrementCounter( counter_ );
+          memcpy( temp + block, counter_, 16 );
+     }
+     crypt_.cryptBlocksECB( temp, temp, seedSize, roundKeys_ );
+
+     for( size_t idx = 0; idx < seedSize; idx++ )
+     {
+          temp[ idx ] ^= provided[ idx ];
+     }
+
+     memcpy( key_, temp, sizeof( key_ ) );
+     memcpy( counter_, temp + sizeof( key_ ), sizeof( counter_ ) );
+     std::vector< unsigned char > key( key_, key_ + sizeof( key_ ) );
+     roundKeys_ = crypt_.expandKey( key, false );
+     wipe( key.data(), key.size() );
+     wipe( temp, sizeof( temp ) );
+}
+
+
+void CtrDrbg::refill()
+{
+     if( reseedCounter_ > reseedInterval )
+     {
+          reseed();
+     }
+
+     // CTR_DRBG_Generate(п. 10.2.1.5.1): счетчики шифруются одним вызовом, затем состояние обновляется
+     for( size_t block = 0; block < bufferSize; block += 16 )
+     {
+          incrementCounter( counter_ );
+          memcpy( buffer_ + block, counter_, 16 );
+     }
+     crypt_.cryptBlocksECB( buffer_, buffer_, bufferSize, roundKeys_ );
+
+     const unsigned char noInput[ seedSize ] = {};
+     update( noInput );
+     reseedCounter_++;
+     available_ = bufferSize;
+}
+
+
+void CtrDrbg::systemEntropy( unsigned char* dst, size_t size )
+{
+     while( size != 0 )
+     {
+          ssize_t received = getrandom( dst, size, 0 );
+          if( received < 0 && errno == EINTR )
+          {
+               continue;
+          }
+          if( received <= 0 )
+          {
+               throw std::runtime_error( "Could not get system entropy" );
+          }
+          dst += received;
+          size -= received;
+     }
+}
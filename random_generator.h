@@ -0,0 +1,55 @@
+/// @file
+/// @brief Криптографический генератор случайных чисел CTR_DRBG(NIST SP 800-90A) на основе AES-256
+#pragma once
+
+#include "AES_cryptography.h"
+
+#include <cstddef>
+#include <cstdint>
+
+
+// CTR_DRBG без функции формирования(derivation function), энтропия берется из getrandom.
+// объект не потокобезопасен, для каждого потока используется свой экземпляр(threadLocal)
+class CtrDrbg
+{
+public:
+     CtrDrbg();
+     ~CtrDrbg();
+
+     CtrDrbg( const CtrDrbg& ) = delete;
+     CtrDrbg& operator=( const CtrDrbg& ) = delete;
+
+     // заполняет dst случайными байтами. Байты выдаются из заранее выработанного блока, поэтому
+     // выработка IV для небольших записей сводится к копированию
+     void generate( unsigned char* dst, size_t size );
+
+     // получает новую энтропию из системы
+     void reseed();
+
+     // генератор текущего потока. После fork в дочернем процессе генератор перезаряжается автоматически
+     static CtrDrbg& threadLocal();
+
+private:
+     // функция CTR_DRBG_Update(SP 800-90A, п. 10.2.1.2)
+     void update( const unsigned char provided[ 48 ] );
+
+     // вырабатывает следующий блок выходных данных(один запрос Generate)
+     void refill();
+
+     static void systemEntropy( unsigned char* dst, size_t size );
+
+private:
+     static const size_t seedSize = 48;                 // длина ключа(32) + длина блока(16)
+     static const size_t bufferSize = 4096;             // объем одного запроса Generate
+     static const uint64_t reseedInterval = 1 << 16;    // число запросов Generate до перезарядки
+
+     AESCryptography crypt_;
+     AesRoundKeys roundKeys_;
+     unsigned char key_[ 32 ];
+     unsigned char counter_[ 16 ];
+     uint64_t reseedCounter_ = 0;
+     uint64_t forkGeneration_ = 0;
+
+     unsigned char buffer_[ bufferSize ];
+     size_t available_ = 0;
+};
@@ -0,0 +1,319 @@
+/// @file
+/// @brief Формат файла, разбитого на независимо зашифрованные в режиме CBC сегменты
+
+#include "segmented_format.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+     const char magic[ 8 ] = { 'A', 'E', 'S', 'S', 'E', 'G', '0', '1' };
+     const char manifestMagic[ 8 ] = { 'A', 'E', 'S', 'M', 'A', 'N', '0', '2' };
+     const size_t manifestHeaderSize = 40;
+     const size_t fixedHeaderSize = 24;
+     const size_t entrySize = 16;
+     const size_t macSize = 16;
+
+     void putUint32( unsigned char* dst, uint32_t value )
+     {
+          for( int idx = 0; idx < 4; idx++ )
+          {
+               dst[ idx ] = static_cast< unsigned char >( value >> ( 8 * idx ) );
+          }
+     }
+
+     void putUint64( unsigned char* dst, uint64_t value )
+     {
+          for( int idx = 0; idx < 8; idx++ )
+          {
+               dst[ idx ] = static_cast< unsigned char >( value >> ( 8 * idx ) );
+          }
+     }
+
+     uint32_t getUint32( const unsigned char* src )
+     {
+          uint32_t value = 0;
+          for( int idx = 3; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | src[ idx ];
+          }
+          return value;
+     }
+
+     uint64_t getUint64( const unsigned char* src )
+     {
+          uint64_t value = 0;
+          for( int idx = 7; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | src[ idx ];
+          }
+          return value;
+     }
+
+     // сравнение имитовставок без раннего выхода
+     bool macEqual( const unsigned char* left, const unsigned char* right )
+     {
+          unsigned char difference = 0;
+          for( size_t idx = 0; idx < macSize; idx++ )
+          {
+               difference |= left[ idx ] ^ right[ idx ];
+          }
+          return difference == 0;
+     }
+}
+
+
+size_t SegmentTable::headerSize() const
+{
+     return fixedHeaderSize + entries.size() * entrySize + macSize;
+}
+
+
+std::vector< uint64_t > SegmentTable::cipherOffsets() const
+{
+     std::vector< uint64_t > result( entries.size() );
+     uint64_t offset = headerSize();
+     for( size_t idx = 0; idx < entries.size(); idx++ )
+     {
+          result[ idx ] = offset;
+          offset += entries[ idx ].cipherSize;
+     }
+     return result;
+}
+
+
+SegmentedFormat::SegmentedFormat( AesKeyLength keyLength, const std::vector< unsigned char >& key, const std::vector< unsigned char >& masterIv )
+:crypt_( keyLength )
+{
+     if( masterIv.size() != 16 )
+     {
+          throw std::runtime_error( "iv has not valid size" );
+     }
+     memcpy( masterIv_, masterIv.data(), 16 );
+     roundKeys_ = crypt_.expandKey( key );
+
+     // ключи имитовставки и шифрования хешей манифеста: E_K( метка || счетчик ), усеченные до длины основного ключа
+     auto deriveKeys = [ & ]( const char label[ 3 ] )
+     {
+          std::vector< unsigned char > derived( 32 );
+          for( unsigned char counter = 0; counter < 2; counter++ )
+          {
+               unsigned char block[ 16 ] = {};
+               memcpy( block, label, 3 );
+               block[ 15 ] = counter;
+               crypt_.cryptBlocksECB( block, derived.data() + 16 * counter, 16, roundKeys_ );
+          }
+          derived.resize( key.size() );
+          return crypt_.expandKey( derived, false );
+     };
+     macKeys_ = deriveKeys( "MAC" );
+     digestKeys_ = deriveKeys( "DIG" );
+
+     unsigned char seed[ 16 ] = { 'S', 'E', 'E', 'D' };
+     crypt_.cryptBlocksECB( seed, seed, 16, roundKeys_ );
+     digestSeed_ = getUint64( seed );
+}
+
+
+const AESCryptography& SegmentedFormat::crypt() const
+{
+     return crypt_;
+}
+
+
+const AesRoundKeys& SegmentedFormat::roundKeys() const
+{
+     return roundKeys_;
+}
+
+
+void SegmentedFormat::segmentIv( size_t index, uint32_t generation, unsigned char iv[ 16 ] ) const
+{
+     // IV получается шифрованием уникального для сегмента блока тем же ключом(NIST SP 800-38A, приложение C)
+     unsigned char block[ 16 ] = {};
+     putUint64( block, index );
+     putUint32( block + 8, generation );
+     for( int idx = 0; idx < 16; idx++ )
+     {
+          block[ idx ] ^= masterIv_[ idx ];
+     }
+     crypt_.cryptBlocksECB( block, iv, 16, roundKeys_ );
+}
+
+
+std::vector< unsigned char > SegmentedFormat::serialize( const SegmentTable& table ) const
+{
+     std::vector< unsigned char > result( table.headerSize() );
+     memcpy( result.data(), magic, sizeof( magic ) );
+     putUint32( result.data() + 8, static_cast< uint32_t >( table.entries.size() ) );
+     putUint32( result.data() + 12, 0 );
+     putUint64( result.data() + 16, table.segmentSize );
+
+     unsigned char* entry = result.data() + fixedHeaderSize;
+     for( const SegmentEntry& item: table.entries )
+     {
+          putUint64( entry, item.cipherSize );
+          putUint32( entry + 8, item.generation );
+          putUint32( entry + 12, item.flags );
+          entry += entrySize;
+     }
+
+     // имитовставка вычисляется над заголовком и masterIv
+     std::vector< unsigned char > authenticated( result.begin(), result.end() - macSize );
+     authenticated.insert( authenticated.end(), masterIv_, masterIv_ + 16 );
+     crypt_.cmac( authenticated.data(), authenticated.size(), macKeys_, result.data() + result.size() - macSize );
+     return result;
+}
+
+
+SegmentTable SegmentedFormat::read( const PosixFile& file ) const
+{
+     const uint64_t fileSize = file.size();
+
+     unsigned char fixed[ fixedHeaderSize ];
+     if( file.readAt( fixed, fixedHeaderSize, 0 ) != fixedHeaderSize || memcmp( fixed, magic, sizeof( magic ) ) != 0 )
+     {
+          throw std::runtime_error( "Input file is not a segmented file" );
+     }
+
+     uint32_t count = getUint32( fixed + 8 );
+     if( count == 0 || count > maxSegments )
+     {
+          throw std::runtime_error( "Segment table corrupted" );
+     }
+
+     SegmentTable table;
+     table.segmentSize = getUint64( fixed + 16 );
+     table.entries.resize( count );
+
+     std::vector< unsigned char > header( table.headerSize() );
+     if( fileSize < header.size() || file.readAt( header.data(), header.size(), 0 ) != header.size() )
+     {
+          throw std::runtime_error( "Segment table corrupted" );
+     }
+
+     // проверяем имитовставку до разбора таблицы. Сравнение без раннего выхода
+     std::vector< unsigned char > authenticated( header.begin(), header.end() - macSize );
+     authenticated.insert( authenticated.end(), masterIv_, masterIv_ + 16 );
+     unsigned char mac[ macSize ];
+     crypt_.cmac( authenticated.data(), authenticated.size(), macKeys_, mac );
+     if( !macEqual( mac, header.data() + header.size() - macSize ) )
+     {
+          throw std::runtime_error( "Segment table corrupted or wrong key/iv" );
+     }
+
+     // таблица подлинная, но все равно проверяем, что она описывает файл целиком
+     uint64_t totalSize = header.size();
+     const unsigned char* entry = header.data() + fixedHeaderSize;
+     for( SegmentEntry& item: table.entries )
+     {
+          item.cipherSize = getUint64( entry );
+          item.generation = getUint32( entry + 8 );
+          item.flags = getUint32( entry + 12 );
+          entry += entrySize;
+
+          if( item.cipherSize == 0 || item.cipherSize % 16 != 0 || item.cipherSize > fileSize )
+          {
+               throw std::runtime_error( "Segment table corrupted" );
+          }
+          totalSize += item.cipherSize;
+     }
+     if( totalSize != fileSize || table.segmentSize % 16 != 0 )
+     {
+          throw std::runtime_error( "Segment table corrupted" );
+     }
+     return table;
+}
+
+
+bool SegmentedFormat::detect( const PosixFile& file )
+{
+     unsigned char signature[ sizeof( magic ) ];
+     return file.readAt( signature, sizeof( signature ), 0 ) == sizeof( signature ) && memcmp( signature, magic, sizeof( magic ) ) == 0;
+}
+
+
+void SegmentedFormat::headerMac( const PosixFile& file, const SegmentTable& table, unsigned char mac[ 16 ] )
+{
+     if( file.readAt( mac, macSize, table.headerSize() - macSize ) != macSize )
+     {
+          throw std::runtime_error( "Segment table corrupted" );
+     }
+}
+
+
+uint64_t SegmentedFormat::digestSeed() const
+{
+     return digestSeed_;
+}
+
+
+std::vector< unsigned char > SegmentedFormat::serializeManifest( const SegmentManifest& manifest ) const
+{
+     std::vector< unsigned char > result( manifestHeaderSize + 8 * manifest.digests.size() + macSize );
+     memcpy( result.data(), manifestMagic, sizeof( manifestMagic ) );
+     putUint32( result.data() + 8, static_cast< uint32_t >( manifest.digests.size() ) );
+     putUint32( result.data() + 12, manifest.nextGeneration );
+     putUint64( result.data() + 16, manifest.segmentSize );
+     memcpy( result.data() + 24, manifest.cipherMac, 16 );
+     for( size_t idx = 0; idx < manifest.digests.size(); idx++ )
+     {
+          putUint64( result.data() + manifestHeaderSize + 8 * idx, manifest.digests[ idx ] );
+     }
+     cryptDigests( result.data() + manifestHeaderSize, 8 * manifest.digests.size() );
+
+     // отличается от заголовка сегментированного файла сигнатурой, поэтому используется тот же ключ имитовставки
+     crypt_.cmac( result.data(), result.size() - macSize, macKeys_, result.data() + result.size() - macSize );
+     return result;
+}
+
+
+SegmentManifest SegmentedFormat::readManifest( const PosixFile& file ) const
+{
+     const uint64_t fileSize = file.size();
+     if( fileSize < manifestHeaderSize + macSize || fileSize > manifestHeaderSize + 8ULL * maxSegments + macSize )
+     {
+          throw std::runtime_error( "Manifest corrupted" );
+     }
+
+     std::vector< unsigned char > data( fileSize );
+     if( file.readAt( data.data(), data.size(), 0 ) != data.size() || memcmp( data.data(), manifestMagic, sizeof( manifestMagic ) ) != 0 )
+     {
+          throw std::runtime_error( "Manifest corrupted" );
+     }
+
+     unsigned char mac[ macSize ];
+     crypt_.cmac( data.data(), data.size() - macSize, macKeys_, mac );
+     if( !macEqual( mac, data.data() + data.size() - macSize ) )
+     {
+          throw std::runtime_error( "Manifest corrupted or wrong key/iv" );
+     }
+
+     SegmentManifest manifest;
+     uint32_t count = getUint32( data.data() + 8 );
+     if( data.size() != manifestHeaderSize + 8ULL * count + macSize )
+     {
+          throw std::runtime_error( "Manifest corrupted" );
+     }
+     manifest.nextGeneration = getUint32( data.data() + 12 );
+     manifest.segmentSize = getUint64( data.data() + 16 );
+     memcpy( manifest.cipherMac, data.data() + 24, 16 );
+     manifest.digests.resize( count );
+     cryptDigests( data.data() + manifestHeaderSize, 8 * count );
+     for( size_t idx = 0; idx < count; idx++ )
+     {
+          manifest.digests[ idx ] = getUint64( data.data() + manifestHeaderSize + 8 * idx );
+     }
+     return manifest;
+}
+
+
+void SegmentedFormat::cryptDigests( unsigned char* data, size_t size ) const
+{
+     // xxHash64 не является ключевой функцией, поэтому хеши открытого текста хранятся зашифрованными в режиме CTR
+     // на отдельном ключе. Гамма зависит только от номера сегмента: по манифестам видно лишь, какие сегменты
+     // не менялись между запусками, что и так видно по совпадающему шифртексту
+     unsigned char counter[ 16 ] = {};
+     crypt_.cryptBlocksCTR( data, data, size, digestKeys_, counter );
+}
@@ -0,0 +1,100 @@
+/// @file
+/// @brief Формат файла, разбитого на независимо зашифрованные в режиме CBC сегменты
+#pragma once
+
+#include "AES_cryptography.h"
+#include "file_io.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// запись таблицы сегментов
+struct SegmentEntry
+{
+     uint64_t cipherSize = 0;      // размер шифртекста сегмента вместе с дополнением
+     uint32_t generation = 0;      // поколение сегмента, участвует в выработке его IV
+     uint32_t flags = 0;           // зарезервировано
+};
+
+
+struct SegmentTable
+{
+     uint64_t segmentSize = 0;                 // размер открытого текста каждого сегмента, кроме последнего
+     std::vector< SegmentEntry > entries;
+
+     // размер заголовка файла(вместе с таблицей и имитовставкой)
+     size_t headerSize() const;
+
+     // смещения шифртекста сегментов от начала файла
+     std::vector< uint64_t > cipherOffsets() const;
+};
+
+
+// манифест инкрементального шифрования: хеши открытого текста сегментов, по которым находятся измененные сегменты
+struct SegmentManifest
+{
+     uint64_t segmentSize = 0;
+     uint32_t nextGeneration = 0;                 // поколение сегментов, которые будут перешифрованы при следующем запуске
+     unsigned char cipherMac[ 16 ] = {};          // имитовставка заголовка шифртекста, для которого составлен манифест
+     std::vector< uint64_t > digests;             // xxHash64 открытого текста каждого сегмента(в файле зашифрованы)
+};
+
+
+// Формат файла(все числа в little-endian):
+//   "AESSEG01" | число сегментов(4) | резерв(4) | размер сегмента(8) | записи таблицы по 16 байт | CMAC(16) | сегменты
+// каждый сегмент - обычный CBC с дополнением PKCS и IV = E_K( masterIv ^ ( index || generation ) ).
+// CMAC вычисляется на отдельном ключе, выработанном из основного, над заголовком и masterIv, поэтому
+// измененная таблица, неверный ключ или IV обнаруживаются до расшифрования
+class SegmentedFormat
+{
+public:
+     SegmentedFormat( AesKeyLength keyLength, const std::vector< unsigned char >& key, const std::vector< unsigned char >& masterIv );
+
+     const AESCryptography& crypt() const;
+     const AesRoundKeys& roundKeys() const;
+
+     // вырабатывает IV сегмента
+     void segmentIv( size_t index, uint32_t generation, unsigned char iv[ 16 ] ) const;
+
+     // формирует заголовок файла с имитовставкой
+     std::vector< unsigned char > serialize( const SegmentTable& table ) const;
+
+     // читает заголовок файла, проверяет имитовставку и согласованность таблицы с размером файла
+     SegmentTable read( const PosixFile& file ) const;
+
+     // true, если файл начинается с сигнатуры сегментированного формата. Ключ не нужен
+     static bool detect( const PosixFile& file );
+
+     // читает имитовставку заголовка файла(последние 16 байт заголовка, описанного table)
+     static void headerMac( const PosixFile& file, const SegmentTable& table, unsigned char mac[ 16 ] );
+
+     // зерно xxHash64 для хешей открытого текста, выработанное из ключа
+     uint64_t digestSeed() const;
+
+     // Формат манифеста: "AESMAN02" | число сегментов(4) | следующее поколение(4) | размер сегмента(8) |
+     //   имитовставка заголовка шифртекста(16) | хеши сегментов по 8 байт, зашифрованные CTR | CMAC(16)
+     std::vector< unsigned char > serializeManifest( const SegmentManifest& manifest ) const;
+
+     // читает манифест и проверяет его имитовставку
+     SegmentManifest readManifest( const PosixFile& file ) const;
+
+     // максимальное число сегментов, которое принимается при чтении
+     static const uint32_t maxSegments = 1 << 20;
+
+     // минимальный размер сегмента при шифровании: каждый сегмент дополняется отдельно, поэтому на мелких сегментах
+     // дополнение раздувает шифртекст. При чтении не проверяется
+     static const uint64_t minSegmentSize = 4096;
+
+private:
+     // зашифровывает/расшифровывает хеши манифеста на месте
+     void cryptDigests( unsigned char* data, size_t size ) const;
+
+private:
+     AESCryptography crypt_;
+     AesRoundKeys roundKeys_;
+     AesRoundKeys macKeys_;
+     AesRoundKeys digestKeys_;
+     unsigned char masterIv_[ 16 ];
+     uint64_t digestSeed_ = 0;
+};
@@ -0,0 +1,1664 @@
+/// @file
+/// @brief Самопроверка реализации: известные ответы, дифференциальное тестирование и контроль производительности
+
+#include "self_test.h"
+#include "aescrypt.h"
+#include "AES_cryptography.h"
+#include "async_crypt.h"
+#include "buffer_pool.h"
+#include "checksum.h"
+#include "crypt_journal.h"
+#include "directory_crypt.h"
+#include "file_crypt.h"
+#include "file_io.h"
+#include "lz_codec.h"
+#include "perf_counters.h"
+#include "random_generator.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+     unsigned char xtime( unsigned char value )
+     {
+          return static_cast< unsigned char >( ( value << 1 ) ^ ( ( value & 0x80 ) ? 0x1b : 0x00 ) );
+     }
+
+     unsigned char gmul( unsigned char a, unsigned char b )
+     {
+          unsigned char result = 0;
+          for( ; b != 0; b >>= 1 )
+          {
+               if( b & 1 )
+               {
+                    result ^= a;
+               }
+               a = xtime( a );
+          }
+          return result;
+     }
+
+     // эталонная реализация AES напрямую по тексту FIPS-197. Не использует таблицы AESCryptography:
+     // S-блок вычисляется как обратный элемент поля GF(2^8) с аффинным преобразованием
+     class ReferenceAes
+     {
+     public:
+          explicit ReferenceAes( const std::vector< unsigned char >& key )
+          {
+               for( int value = 0; value < 256; value++ )
+               {
+                    unsigned char inverse = 0;
+                    for( int candidate = 1; candidate < 256 && value != 0; candidate++ )
+                    {
+                         if( gmul( value, candidate ) == 1 )
+                         {
+                              inverse = candidate;
+                              break;
+                         }
+                    }
+                    unsigned char result = 0x63;
+                    for( int shift = 0; shift < 5; shift++ )
+                    {
+                         result ^= static_cast< unsigned char >( ( inverse << shift ) | ( inverse >> ( 8 - shift ) ) );
+                    }
+                    sbox_[ value ] = result;
+                    invSbox_[ result ] = value;
+               }
+
+               const int nk = key.size() / 4;
+               rounds_ = nk + 6;
+               roundKeys_.assign( key.begin(), key.end() );
+               unsigned char rcon = 1;
+               for( int word = nk; word < 4 * ( rounds_ + 1 ); word++ )
+               {
+                    unsigned char temp[ 4 ];
+                    std::copy( roundKeys_.end() - 4, roundKeys_.end(), temp );
+                    if( word % nk == 0 )
+                    {
+                         unsigned char first = temp[ 0 ];
+                         temp[ 0 ] = sbox_[ temp[ 1 ] ] ^ rcon;
+                         temp[ 1 ] = sbox_[ temp[ 2 ] ];
+                         temp[ 2 ] = sbox_[ temp[ 3 ] ];
+                         temp[ 3 ] = sbox_[ first ];
+                         rcon = xtime( rcon );
+                    }
+                    else if( nk > 6 && word % nk == 4 )
+                    {
+                         for( unsigned char& value: temp )
+                         {
+                              value = sbox_[ value ];
+                         }
+                    }
+                    for( int idx = 0; idx < 4; idx++ )
+                    {
+                         roundKeys_.push_back( roundKeys_[ 4 * ( word - nk ) + idx ] ^ temp[ idx ] );
+                    }
+               }
+          }
+
+          void encrypt( const unsigned char* src, unsigned char* dst ) const
+          {
+               unsigned char state[ 16 ];
+               addRoundKey( src, state, 0 );
+               for( int round = 1; round <= rounds_; round++ )
+               {
+                    unsigned char shifted[ 16 ];
+                    for( int idx = 0; idx < 16; idx++ )
+                    {
+                         int row = idx % 4;
+                         int column = idx / 4;
+                         shifted[ idx ] = sbox_[ state[ row + 4 * ( ( column + row ) % 4 ) ] ];
+                    }
+                    if( round != rounds_ )
+                    {
+                         for( int column = 0; column < 4; column++ )
+                         {
+                              unsigned char* c = shifted + 4 * column;
+                              unsigned char a0 = c[ 0 ], a1 = c[ 1 ], a2 = c[ 2 ], a3 = c[ 3 ];
+                              c[ 0 ] = gmul( a0, 2 ) ^ gmul( a1, 3 ) ^ a2 ^ a3;
+                              c[ 1 ] = a0 ^ gmul( a1, 2 ) ^ gmul( a2, 3 ) ^ a3;
+                              c[ 2 ] = a0 ^ a1 ^ gmul( a2, 2 ) ^ gmul( a3, 3 );
+                              c[ 3 ] = gmul( a0, 3 ) ^ a1 ^ a2 ^ gmul( a3, 2 );
+                         }
+                    }
+                    addRoundKey( shifted, state, round );
+               }
+               memcpy( dst, state, 16 );
+          }
+
+          void decrypt( const unsigned char* src, unsigned char* dst ) const
+          {
+               unsigned char state[ 16 ];
+               addRoundKey( src, state, rounds_ );
+               for( int round = rounds_ - 1; round >= 0; round-- )
+               {
+                    unsigned char shifted[ 16 ];
+                    for( int idx = 0; idx < 16; idx++ )
+                    {
+                         int row = idx % 4;
+                         int column = idx / 4;
+                         shifted[ row + 4 * ( ( column + row ) % 4 ) ] = invSbox_[ state[ idx ] ];
+                    }
+                    addRoundKey( shifted, state, round );
+                    if( round != 0 )
+                    {
+                         for( int column = 0; column < 4; column++ )
+                         {
+                              unsigned char* c = state + 4 * column;
+                              unsigned char a0 = c[ 0 ], a1 = c[ 1 ], a2 = c[ 2 ], a3 = c[ 3 ];
+                              c[ 0 ] = gmul( a0, 14 ) ^ gmul( a1, 11 ) ^ gmul( a2, 13 ) ^ gmul( a3, 9 );
+                              c[ 1 ] = gmul( a0, 9 ) ^ gmul( a1, 14 ) ^ gmul( a2, 11 ) ^ gmul( a3, 13 );
+                              c[ 2 ] = gmul( a0, 13 ) ^ gmul( a1, 9 ) ^ gmul( a2, 14 ) ^ gmul( a3, 11 );
+                              c[ 3 ] = gmul( a0, 11 ) ^ gmul( a1, 13 ) ^ gmul( a2, 9 ) ^ gmul( a3, 14 );
+                         }
+                    }
+               }
+               memcpy( dst, state, 16 );
+          }
+
+          std::vector< unsigned char > encryptEcb( const std::vector< unsigned char >& data ) const
+          {
+               std::vector< unsigned char > result( data.size() );
+               for( size_t block = 0; block < data.size(); block += 16 )
+               {
+                    encrypt( data.data() + block, result.data() + block );
+               }
+               return result;
+          }
+
+          std::vector< unsigned char > encryptCbc( const std::vector< unsigned char >& data, const std::vector< unsigned char >& iv ) const
+          {
+               std::vector< unsigned char > result( data.size() );
+               unsigned char chain[ 16 ];
+               std::copy( iv.begin(), iv.end(), chain );
+               for( size_t block = 0; block < data.size(); block += 16 )
+               {
+                    for( int idx = 0; idx < 16; idx++ )
+                    {
+                         chain[ idx ] ^= data[ block + idx ];
+                    }
+                    encrypt( chain, chain );
+                    memcpy( result.data() + block, chain, 16 );
+               }
+               return result;
+          }
+
+          std::vector< unsigned char > encryptCtr( const std::vector< unsigned char >& data, const std::vector< unsigned char >& iv ) const
+          {
+               std::vector< unsigned char > result( data.size() );
+               unsigned char counter[ 16 ];
+               std::copy( iv.begin(), iv.end(), counter );
+               for( size_t block = 0; block < data.size(); block += 16 )
+               {
+                    unsigned char keystream[ 16 ];
+                    encrypt( counter, keystream );
+                    for( size_t idx = 0; idx < 16 && block + idx < data.size(); idx++ )
+                    {
+                         result[ block + idx ] = data[ block + idx ] ^ keystream[ idx ];
+                    }
+                    for( int idx = 15; idx >= 0 && ++counter[ idx ] == 0; idx-- )
+                    {
+                    }
+               }
+               return result;
+          }
+
+          std::vector< unsigned char > decryptEcb( const std::vector< unsigned char >& data ) const
+          {
+               std::vector< unsigned char > result( data.size() );
+               for( size_t block = 0; block < data.size(); block += 16 )
+               {
+                    decrypt( data.data() + block, result.data() + block );
+               }
+               return result;
+          }
+
+     private:
+          void addRoundKey( const unsigned char* src, unsigned char* dst, int round ) const
+          {
+               for( int idx = 0; idx < 16; idx++ )
+               {
+                    dst[ idx ] = src[ idx ] ^ roundKeys_[ 16 * round + idx ];
+               }
+          }
+
+     private:
+          unsigned char sbox_[ 256 ];
+          unsigned char invSbox_[ 256 ];
+          std::vector< unsigned char > roundKeys_;
+          int rounds_;
+     };
+
+
+     struct KnownAnswer
+     {
+          const char* name;
+          const char* key;
+          const char* iv;               // пустая строка - режим ECB
+          const char* plain;
+          const char* cipher;
+     };
+
+     const char* const sp800Plain = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+                                    "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+
+     const KnownAnswer knownAnswers[] =
+     {
+          { "FIPS-197 C.1 AES-128", "000102030405060708090a0b0c0d0e0f", "",
+            "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a" },
+          { "FIPS-197 C.2 AES-192", "000102030405060708090a0b0c0d0e0f1011121314151617", "",
+            "00112233445566778899aabbccddeeff", "dda97ca4864cdfe06eaf70a0ec0d7191" },
+          { "FIPS-197 C.3 AES-256", "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "",
+            "00112233445566778899aabbccddeeff", "8ea2b7ca516745bfeafc49904b496089" },
+          { "SP 800-38A F.1.1 ECB-AES128", "2b7e151628aed2a6abf7158809cf4f3c", "", sp800Plain,
+            "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf"
+            "43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4" },
+          { "SP 800-38A F.1.3 ECB-AES192", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "", sp800Plain,
+            "bd334f1d6e45f25ff712a214571fa5cc974104846d0ad3ad7734ecb3ecee4eef"
+            "ef7afd2270e2e60adce0ba2face6444e9a4b41ba738d6c72fb16691603c18e0e" },
+          { "SP 800-38A F.1.5 ECB-AES256", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "", sp800Plain,
+            "f3eed1bdb5d2a03c064b5a7e3db181f8591ccb10d410ed26dc5ba74a31362870"
+            "b6ed21b99ca6f4f9f153e7b1beafed1d23304b7a39f9f3ff067d8d8f9e24ecc7" },
+          { "SP 800-38A F.2.1 CBC-AES128", "2b7e151628aed2a6abf7158809cf4f3c", "000102030405060708090a0b0c0d0e0f", sp800Plain,
+            "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+            "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+          { "SP 800-38A F.2.3 CBC-AES192", "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b", "000102030405060708090a0b0c0d0e0f", sp800Plain,
+            "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a"
+            "571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd" },
+          { "SP 800-38A F.2.5 CBC-AES256", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "000102030405060708090a0b0c0d0e0f", sp800Plain,
+            "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+            "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" },
+     };
+
+     // векторы режима CTR(SP 800-38A F.5): в поле iv - начальное значение счетчика
+     const KnownAnswer ctrAnswers[] =
+     {
+          { "SP 800-38A F.5.1 CTR-AES128", "2b7e151628aed2a6abf7158809cf4f3c", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", sp800Plain,
+            "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+            "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee" },
+          { "SP 800-38A F.5.5 CTR-AES256", "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", sp800Plain,
+            "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+            "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6" },
+     };
+
+     AesKeyLength keyLengthFromSize( size_t size )
+     {
+          return size == 16 ? AKL_128 : ( size == 24 ? AKL_192 : AKL_256 );
+     }
+
+     std::vector< unsigned char > randomBytes( std::mt19937& rng, size_t size )
+     {
+          std::vector< unsigned char > result( size );
+          for( unsigned char& value: result )
+          {
+               value = static_cast< unsigned char >( rng() );
+          }
+          return result;
+     }
+
+     // данные, похожие на журнал: повторяющиеся фрагменты из небольшого словаря вперемешку со случайными байтами
+     std::vector< unsigned char > compressibleBytes( std::mt19937& rng, size_t size )
+     {
+          std::vector< std::vector< unsigned char > > words;
+          for( int idx = 0; idx < 16; idx++ )
+          {
+               words.push_back( randomBytes( rng, rng() % 40 + 1 ) );
+          }
+          std::vector< unsigned char > result;
+          while( result.size() < size )
+          {
+               if( rng() % 8 == 0 )
+               {
+                    result.push_back( static_cast< unsigned char >( rng() ) );
+                    continue;
+               }
+               const std::vector< unsigned char >& word = words[ rng() % words.size() ];
+               result.insert( result.end(), word.begin(), word.end() );
+          }
+          result.resize( size );
+          return result;
+     }
+
+     // случайное разбиение size байт на части, кратные размеру блока
+     std::vector< size_t > randomSplits( std::mt19937& rng, size_t size )
+     {
+          std::vector< size_t > result;
+          while( size != 0 )
+          {
+               size_t part = std::min( size, 16 * ( rng() % 40 + 1 ) );
+               result.push_back( part );
+               size -= part;
+          }
+          return result;
+     }
+
+     std::vector< unsigned char > withPadding( std::vector< unsigned char > data )
+     {
+          size_t paddingSize = 16 - data.size() % 16;
+          data.insert( data.end(), paddingSize, static_cast< unsigned char >( paddingSize ) );
+          return data;
+     }
+
+     std::vector< unsigned char > readWholeFile( const std::string& path )
+     {
+          PosixFile file = PosixFile::openRead( path );
+          std::vector< unsigned char > result( file.size() );
+          file.readAt( result.data(), result.size(), 0 );
+          return result;
+     }
+
+     void writeWholeFile( const std::string& path, const std::vector< unsigned char >& data )
+     {
+          PosixFile file = PosixFile::create( path );
+          file.writeAt( data.data(), data.size(), 0 );
+     }
+}
+
+
+SelfTest::SelfTest( std::ostream& log )
+:log_( log )
+{
+}
+
+
+bool SelfTest::run( const Options& options )
+{
+     uint32_t seed = options.seed != 0 ? options.seed : std::random_device()();
+     log_ << "seed: " << seed << std::endl;
+
+     runKnownAnswerTests();
+     runDifferentialTests( options.iterations, seed );
+     runBackendTests( std::max< size_t >( options.iterations / 4, 1 ), seed );
+     runFileTests( std::max< size_t >( options.iterations / 10, 1 ), seed );
+     runThreadPoolTests( options.iterations, seed );
+     runDirectoryTests( std::max< size_t >( options.iterations / 25, 1 ), seed );
+     runAsyncTests( std::max< size_t >( options.iterations / 10, 1 ), seed );
+     runLibraryTests( std::max< size_t >( options.iterations / 4, 1 ), seed );
+     runRandomGeneratorTests();
+     runThroughputGates( options.minMbps, options.perfStats );
+
+     log_ << checks_ - failures_ << " of " << checks_ << " checks passed" << std::endl;
+     return failures_ == 0;
+}
+
+
+void SelfTest::runKnownAnswerTests()
+{
+     for( const KnownAnswer& answer: knownAnswers )
+     {
+          std::vector< unsigned char > key = FileEncryptor::hexToArray( answer.key );
+          std::vector< unsigned char > iv = FileEncryptor::hexToArray( answer.iv );
+          std::vector< unsigned char > plain = FileEncryptor::hexToArray( answer.plain );
+          std::vector< unsigned char > cipher = FileEncryptor::hexToArray( answer.cipher );
+
+          AESCryptography crypt( keyLengthFromSize( key.size() ) );
+          bool cbc = !iv.empty();
+          std::vector< unsigned char > encrypted = cbc ? crypt.cryptDataCBC( plain, key, iv ) : crypt.cryptDataECB( plain, key );
+          std::vector< unsigned char > decrypted = cbc ? crypt.decryptDataCBC( cipher, key, iv ) : crypt.decryptDataECB( cipher, key );
+          check( std::string( answer.name ) + " encrypt", encrypted == cipher );
+          check( std::string( answer.name ) + " decrypt", decrypted == plain );
+
+          ReferenceAes reference( key );
+          check( std::string( answer.name ) + " reference", ( cbc ? reference.encryptCbc( plain, iv ) : reference.encryptEcb( plain ) ) == cipher );
+     }
+
+     for( const KnownAnswer& answer: ctrAnswers )
+     {
+          std::vector< unsigned char > key = FileEncryptor::hexToArray( answer.key );
+          std::vector< unsigned char > plain = FileEncryptor::hexToArray( answer.plain );
+          std::vector< unsigned char > cipher = FileEncryptor::hexToArray( answer.cipher );
+
+          AESCryptography crypt( keyLengthFromSize( key.size() ) );
+          AesRoundKeys roundKeys = crypt.expandKey( key );
+          std::vector< unsigned char > encrypted( plain.size() );
+          std::vector< unsigned char > counter = FileEncryptor::hexToArray( answer.iv );
+          crypt.cryptBlocksCTR( plain.data(), encrypted.data(), plain.size(), roundKeys, counter.data() );
+          check( std::string( answer.name ) + " encrypt", encrypted == cipher );
+          check( std::string( answer.name ) + " reference", ReferenceAes( key ).encryptCtr( plain, FileEncryptor::hexToArray( answer.iv ) ) == cipher );
+     }
+
+     // контрольные значения CRC32C(RFC 3720, B.4) и xxHash64
+     const unsigned char digits[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+     std::vector< unsigned char > zeros( 32 );
+     check( "CRC32C check value", Crc32c::hash( digits, sizeof( digits ) ) == 0xE3069283 );
+     check( "CRC32C 32 zero bytes", Crc32c::hash( zeros.data(), zeros.size() ) == 0x8A9136AA );
+     check( "XXH64 empty input", Xxh64::hash( nullptr, 0 ) == 0xEF46DB3751D8E999ULL );
+}
+
+
+void SelfTest::runBackendTests( size_t iterations, uint32_t seed )
+{
+     const AesBackend previous = AESCryptography::backend();
+     for( AesBackend backend: { ABPortable, ABTable, ABAesNi } )
+     {
+          if( !AESCryptography::backendSupported( backend ) )
+          {
+               continue;
+          }
+          AESCryptography::setBackend( backend );
+          const std::string name = std::string( "backend " ) + AESCryptography::backendName( backend );
+
+          bool answers = true;
+          for( const KnownAnswer& answer: knownAnswers )
+          {
+               std::vector< unsigned char > key = FileEncryptor::hexToArray( answer.key );
+               std::vector< unsigned char > iv = FileEncryptor::hexToArray( answer.iv );
+               std::vector< unsigned char > plain = FileEncryptor::hexToArray( answer.plain );
+               std::vector< unsigned char > cipher = FileEncryptor::hexToArray( answer.cipher );
+               AESCryptography crypt( keyLengthFromSize( key.size() ) );
+               bool cbc = !iv.empty();
+               answers &= ( cbc ? crypt.cryptDataCBC( plain, key, iv ) : crypt.cryptDataECB( plain, key ) ) == cipher;
+               answers &= ( cbc ? crypt.decryptDataCBC( cipher, key, iv ) : crypt.decryptDataECB( cipher, key ) ) == plain;
+          }
+          check( name + " known answers", answers );
+
+          // случайные данные на месте: в каждом режиме есть хвосты короче пачки из четырех блоков
+          std::mt19937 rng( seed ^ backend );
+          size_t mismatches = 0;
+          for( size_t iteration = 0; iteration < iterations; iteration++ )
+          {
+               std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+               std::vector< unsigned char > iv = randomBytes( rng, 16 );
+               std::vector< unsigned char > plain = randomBytes( rng, 16 * ( rng() % 40 ) + ( rng() % 2 ) * ( rng() % 16 ) );
+               std::vector< unsigned char > aligned( plain.begin(), plain.begin() + plain.size() / 16 * 16 );
+               ReferenceAes reference( key );
+               AESCryptography crypt( keyLengthFromSize( key.size() ) );
+               AesRoundKeys roundKeys = crypt.expandKey( key );
+
+               std::vector< unsigned char > data = aligned;
+               crypt.cryptBlocksECB( data.data(), data.data(), data.size(), roundKeys );
+               mismatches += data != reference.encryptEcb( aligned );
+               crypt.decryptBlocksECB( data.data(), data.data(), data.size(), roundKeys );
+               mismatches += data != aligned;
+
+               unsigned char chain[ 16 ];
+               std::copy( iv.begin(), iv.end(), chain );
+               crypt.cryptBlocksCBC( data.data(), data.data(), data.size(), roundKeys, chain );
+               mismatches += data != reference.encryptCbc( aligned, iv );
+               std::copy( iv.begin(), iv.end(), chain );
+               crypt.decryptBlocksCBC( data.data(), data.data(), data.size(), roundKeys, chain );
+               mismatches += data != aligned;
+
+               data = plain;
+               std::copy( iv.begin(), iv.end(), chain );
+               crypt.cryptBlocksCTR( data.data(), data.data(), data.size(), roundKeys, chain );
+               mismatches += data != reference.encryptCtr( plain, iv );
+          }
+          check( name + " matches reference", mismatches == 0 );
+
+          // пакетное развертывание при любом размере группы, в том числе неполной и с остатком после полных, дает те же
+          // расписания. Развертывание только для шифрования дает те же ключи шифрования, а ключи расшифрования достраиваются
+          size_t batchMismatches = 0;
+          for( AesKeyLength length: { AKL_128, AKL_192, AKL_256 } )
+          {
+               AESCryptography crypt( length );
+               const size_t keySize = 16 + 8 * length;
+               for( size_t count = 1; count <= 2 * AESCryptography::keyLanes + 1; count++ )
+               {
+                    std::vector< unsigned char > keys = randomBytes( rng, keySize * count );
+                    std::vector< AesRoundKeys > batch( count );
+                    std::vector< AesRoundKeys > encryptOnly( count );
+                    crypt.expandKeys( keys.data(), count, batch.data() );
+                    crypt.expandKeys( keys.data(), count, encryptOnly.data(), false );
+                    for( size_t idx = 0; idx < count; idx++ )
+                    {
+                         std::vector< unsigned char > key( keys.begin() + idx * keySize, keys.begin() + ( idx + 1 ) * keySize );
+                         AesRoundKeys single = crypt.expandKey( key );
+                         const size_t scheduleSize = 16 * ( single.rounds + 1 );
+                         batchMismatches += batch[ idx ].rounds != single.rounds || memcmp( batch[ idx ].bytes, single.bytes, scheduleSize ) != 0 ||
+                                            memcmp( batch[ idx ].decryptionBytes, single.decryptionBytes, scheduleSize ) != 0;
+                         batchMismatches += encryptOnly[ idx ].decryption || encryptOnly[ idx ].rounds != single.rounds ||
+                                            memcmp( encryptOnly[ idx ].bytes, single.bytes, scheduleSize ) != 0;
+                         crypt.expandDecryptionKeys( encryptOnly[ idx ] );
+                         batchMismatches += memcmp( encryptOnly[ idx ].decryptionBytes, single.decryptionBytes, scheduleSize ) != 0;
+
+                         std::vector< unsigned char > block = randomBytes( rng, 16 );
+                         std::vector< unsigned char > data = block;
+                         crypt.cryptBlocksECB( data.data(), data.data(), 16, batch[ idx ] );
+                         batchMismatches += data != ReferenceAes( key ).encryptEcb( block );
+                         crypt.decryptBlocksECB( data.data(), data.data(), 16, batch[ idx ] );
+                         batchMismatches += data != block;
+                    }
+               }
+          }
+          check( name + " batch key expansion", batchMismatches == 0 );
+
+          // ключи только для шифрования не годятся для расшифрования
+          bool refused = false;
+          try
+          {
+               AESCryptography crypt( AKL_128 );
+               AesRoundKeys encryptOnly = crypt.expandKey( std::vector< unsigned char >( 16, 0x33 ), false );
+               unsigned char block[ 16 ] = {};
+               crypt.decryptBlocksECB( block, block, 16, encryptOnly );
+          }
+          catch( const std::runtime_error& )
+          {
+               refused = true;
+          }
+          check( name + " refuses decryption with encrypt-only keys", refused );
+     }
+     AESCryptography::setBackend( previous );
+}
+
+
+void SelfTest::runDifferentialTests( size_t iterations, uint32_t seed )
+{
+     std::mt19937 rng( seed );
+     size_t mismatches[ 7 ] = {};
+     const char* names[ 7 ] = { "ECB encrypt", "ECB decrypt", "CBC encrypt", "CBC decrypt", "in-place", "vector API", "CTR" };
+
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > iv = randomBytes( rng, 16 );
+          std::vector< unsigned char > plain = randomBytes( rng, 16 * ( rng() % 300 ) );
+          const size_t size = plain.size();
+
+          ReferenceAes reference( key );
+          std::vector< unsigned char > expectedEcb = reference.encryptEcb( plain );
+          std::vector< unsigned char > expectedCbc = reference.encryptCbc( plain, iv );
+
+          AESCryptography crypt( keyLengthFromSize( key.size() ) );
+          AesRoundKeys roundKeys = crypt.expandKey( key );
+
+          // входные и выходные данные размещаются со случайным смещением, чтобы проверить невыровненный доступ
+          size_t srcOffset = rng() % 16;
+          size_t dstOffset = rng() % 16;
+          std::vector< unsigned char > src( size + 16 );
+          std::vector< unsigned char > dst( size + 16 );
+
+          std::copy( plain.begin(), plain.end(), src.begin() + srcOffset );
+          crypt.cryptBlocksECB( src.data() + srcOffset, dst.data() + dstOffset, size, roundKeys );
+          mismatches[ 0 ] += !std::equal( expectedEcb.begin(), expectedEcb.end(), dst.begin() + dstOffset );
+
+          std::copy( expectedEcb.begin(), expectedEcb.end(), src.begin() + srcOffset );
+          crypt.decryptBlocksECB( src.data() + srcOffset, dst.data() + dstOffset, size, roundKeys );
+          mismatches[ 1 ] += !std::equal( plain.begin(), plain.end(), dst.begin() + dstOffset );
+
+          // CBC обрабатывается случайными частями, цепочка передается через iv
+          unsigned char chain[ 16 ];
+          std::copy( iv.begin(), iv.end(), chain );
+          std::copy( plain.begin(), plain.end(), src.begin() + srcOffset );
+          size_t offset = 0;
+          for( size_t part: randomSplits( rng, size ) )
+          {
+               crypt.cryptBlocksCBC( src.data() + srcOffset + offset, dst.data() + dstOffset + offset, part, roundKeys, chain );
+               offset += part;
+          }
+          mismatches[ 2 ] += !std::equal( expectedCbc.begin(), expectedCbc.end(), dst.begin() + dstOffset );
+
+          std::copy( iv.begin(), iv.end(), chain );
+          std::copy( expectedCbc.begin(), expectedCbc.end(), src.begin() + srcOffset );
+          offset = 0;
+          for( size_t part: randomSplits( rng, size ) )
+          {
+               crypt.decryptBlocksCBC( src.data() + srcOffset + offset, dst.data() + dstOffset + offset, part, roundKeys, chain );
+               offset += part;
+          }
+          mismatches[ 3 ] += !std::equal( plain.begin(), plain.end(), dst.begin() + dstOffset );
+
+          // обработка на месте
+          std::vector< unsigned char > inPlace = plain;
+          std::copy( iv.begin(), iv.end(), chain );
+          crypt.cryptBlocksCBC( inPlace.data(), inPlace.data(), size, roundKeys, chain );
+          bool inPlaceValid = inPlace == expectedCbc;
+          std::copy( iv.begin(), iv.end(), chain );
+          crypt.decryptBlocksCBC( inPlace.data(), inPlace.data(), size, roundKeys, chain );
+          inPlaceValid = inPlaceValid && inPlace == plain;
+          mismatches[ 4 ] += !inPlaceValid;
+
+          bool vectorValid = crypt.cryptDataECB( plain, key ) == expectedEcb && crypt.cryptDataCBC( plain, key, iv ) == expectedCbc &&
+                             crypt.decryptDataECB( expectedEcb, key ) == plain && crypt.decryptDataCBC( expectedCbc, key, iv ) == plain;
+          mismatches[ 5 ] += !vectorValid;
+
+          // CTR на длине, не кратной блоку: все части, кроме последней, кратны блоку
+          std::vector< unsigned char > ctrPlain = plain;
+          ctrPlain.resize( size + rng() % 16 );
+          std::vector< unsigned char > expectedCtr = reference.encryptCtr( ctrPlain, iv );
+          std::vector< unsigned char > ctr = ctrPlain;
+          std::copy( iv.begin(), iv.end(), chain );
+          offset = 0;
+          for( size_t part: randomSplits( rng, size ) )
+          {
+               crypt.cryptBlocksCTR( ctr.data() + offset, ctr.data() + offset, part, roundKeys, chain );
+               offset += part;
+          }
+          crypt.cryptBlocksCTR( ctr.data() + offset, ctr.data() + offset, ctr.size() - offset, roundKeys, chain );
+          mismatches[ 6 ] += ctr != expectedCtr;
+     }
+
+     for( int idx = 0; idx < 7; idx++ )
+     {
+          check( std::string( "differential " ) + names[ idx ], mismatches[ idx ] == 0 );
+     }
+
+     // сжатие: распаковка восстанавливает данные, повторяющиеся данные сжимаются, а случайные не раздуваются.
+     // Степень сжатия проверяется только для повторяющихся данных от 16 КиБ: в коротких мало повторов
+     size_t lzMismatches = 0;
+     size_t lzUncompressed = 0;
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          const bool compressible = rng() % 4 != 0;
+          std::vector< unsigned char > plain = compressible ? compressibleBytes( rng, rng() % 70000 ) : randomBytes( rng, rng() % 70000 );
+          std::vector< unsigned char > packed( plain.size() + 1 );
+          size_t packedSize = LzCodec::compress( plain.data(), plain.size(), packed.data(), packed.size() );
+          std::vector< unsigned char > unpacked( plain.size() );
+          lzMismatches += packedSize != 0 && ( !LzCodec::decompress( packed.data(), packedSize, unpacked.data(), unpacked.size() ) || unpacked != plain );
+          lzUncompressed += compressible && plain.size() >= 16 * 1024 && ( packedSize == 0 || packedSize > plain.size() / 2 );
+     }
+     check( "differential LZ round trip", lzMismatches == 0 );
+     check( "LZ compresses repetitive data", lzUncompressed == 0 );
+}
+
+
+void SelfTest::runFileTests( size_t iterations, uint32_t seed )
+{
+     std::mt19937 rng( seed ^ 0x5eed );
+
+     // маленькие блоки пула, чтобы файлы пересекали границы частей
+     BufferPool pool( 4096 );
+     std::string plainPath = tempPath( "plain" );
+     std::string cipherPath = tempPath( "cipher" );
+     std::string decryptedPath = tempPath( "decrypted" );
+     std::string journalPath = tempPath( "journal" );
+     std::string verifyPath = tempPath( "verify" );
+
+     // проверка без записи открытого текста: путь результата не должен появиться ни при успехе, ни при ошибке
+     size_t verifyMismatches = 0;
+     size_t wipeMisses = 0;
+     auto verifies = [ & ]( const std::function< void( FileEncryptor& ) >& verify )
+     {
+          FileEncryptor verifier( cipherPath, verifyPath, pool );
+          verifier.setThreadCount( rng() % 4 + 1 );
+          bool passed = true;
+          try
+          {
+               verify( verifier );
+          }
+          catch( const std::exception& )
+          {
+               passed = false;
+          }
+          verifyMismatches += access( verifyPath.c_str(), F_OK ) == 0;
+          return passed;
+     };
+
+     size_t mismatches[ 9 ] = {};
+     size_t tamperMisses = 0;
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > iv = randomBytes( rng, 16 );
+          std::vector< unsigned char > plain = randomBytes( rng, rng() % 20000 );
+          writeWholeFile( plainPath, plain );
+
+          ReferenceAes reference( key );
+          for( CryptMode mode: { CMEcb, CMCbc } )
+          {
+               FileEncryptor( plainPath, cipherPath, pool ).cryptFile( key, mode, iv );
+               std::vector< unsigned char > expected = mode == CMCbc ? reference.encryptCbc( withPadding( plain ), iv )
+                                                                     : reference.encryptEcb( withPadding( plain ) );
+               FileEncryptor( cipherPath, decryptedPath, pool ).decryptFile( key, mode, iv );
+               mismatches[ mode == CMCbc ? 1 : 0 ] += readWholeFile( cipherPath ) != expected || readWholeFile( decryptedPath ) != plain;
+               // блок с открытым текстом возвращается в пул стертым, и следующий файл получает именно его
+               {
+                    PoolBuffer reused = pool.acquire();
+                    wipeMisses += std::any_of( reused.data(), reused.data() + reused.size(), []( unsigned char byte ) { return byte != 0; } );
+               }
+               VerifyStrength strength = VSFull;
+               verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier ) { strength = verifier.verifyFile( key, mode, iv ).strength; } ) ||
+                                   strength != VSPadding;
+          }
+          // шифртекст CTR без суммы нечем проверить: результат не должен выглядеть как успешная проверка
+          FileEncryptor( plainPath, cipherPath, pool ).cryptFile( key, CMCtr, iv );
+          verifyMismatches += FileEncryptor( cipherPath, verifyPath, pool ).verifyFile( key, CMCtr, iv ).strength != VSNone;
+
+          // в CBC последний байт открытого текста - байт дополнения p: после xor предыдущего блока шифртекста(или IV) с p
+          // он становится нулем, и дополнение заведомо неверно
+          std::vector< unsigned char > corrupted = readWholeFile( cipherPath );
+          std::vector< unsigned char > corruptedIv = iv;
+          const unsigned char paddingSize = static_cast< unsigned char >( 16 - plain.size() % 16 );
+          ( corrupted.size() >= 32 ? corrupted[ corrupted.size() - 17 ] : corruptedIv[ 15 ] ) ^= paddingSize;
+          writeWholeFile( cipherPath, corrupted );
+          verifyMismatches += verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFile( key, CMCbc, corruptedIv ); } );
+
+          // CTR: потоковый режим и шифрование на месте через журнал должны давать одинаковый шифртекст
+          std::vector< unsigned char > expectedCtr = reference.encryptCtr( plain, iv );
+          FileEncryptor ctrCrypt( plainPath, cipherPath, pool );
+          ctrCrypt.setThreadCount( rng() % 4 + 1 );
+          ctrCrypt.cryptFile( key, CMCtr, iv );
+          FileEncryptor( cipherPath, decryptedPath, pool ).decryptFile( key, CMCtr, iv );
+          mismatches[ 4 ] += readWholeFile( cipherPath ) != expectedCtr || readWholeFile( decryptedPath ) != plain;
+
+          FileEncryptor( decryptedPath, journalPath, pool ).cryptFileInPlace( key, iv );
+          bool inPlaceValid = readWholeFile( decryptedPath ) == expectedCtr;
+          FileEncryptor( decryptedPath, journalPath, pool ).decryptFileInPlace( key, iv );
+          mismatches[ 5 ] += !inPlaceValid || readWholeFile( decryptedPath ) != plain || access( journalPath.c_str(), F_OK ) == 0;
+
+          // прерванный запуск с другим блоком пула: журнал с частями по 8 КиБ и записью первой части, которая не дошла
+          // до файла. Продолжение берет размер части из журнала, повторяет запись и дошифровывает остальное
+          if( plain.size() > 8192 )
+          {
+               CryptJournal::Header header;
+               header.operation = 1;
+               header.fileSize = plain.size();
+               header.chunkSize = 8192;
+               unsigned char idData[ 25 ] = {};
+               std::copy( iv.begin(), iv.end(), idData );
+               idData[ 16 ] = 1;
+               for( int idx = 0; idx < 8; idx++ )
+               {
+                    idData[ 17 + idx ] = static_cast< unsigned char >( header.fileSize >> ( 8 * idx ) );
+               }
+               AESCryptography crypt( keyLengthFromSize( key.size() ) );
+               crypt.cmac( idData, sizeof( idData ), crypt.expandKey( key ), header.id );
+               CryptJournal::create( journalPath, header ).append( 0, expectedCtr.data(), 8192 );
+               FileEncryptor( decryptedPath, journalPath, pool ).cryptFileInPlace( key, iv );
+               mismatches[ 5 ] += readWholeFile( decryptedPath ) != expectedCtr || access( journalPath.c_str(), F_OK ) == 0;
+          }
+
+          // сжатие перед шифрованием вместе с контрольной суммой: записи пересекают границы частей пула
+          std::vector< unsigned char > logLike = compressibleBytes( rng, rng() % 60000 );
+          writeWholeFile( plainPath, logLike );
+          CryptMode compressMode = rng() % 2 ? CMCbc : CMCtr;
+          FileEncryptor compressCrypt( plainPath, cipherPath, pool );
+          compressCrypt.setCompression( true );
+          compressCrypt.setChecksum( CTCrc32c );
+          compressCrypt.setThreadCount( rng() % 4 + 1 );
+          compressCrypt.cryptFile( key, compressMode, iv );
+          size_t compressedSize = readWholeFile( cipherPath ).size();
+          FileEncryptor compressDecrypt( cipherPath, decryptedPath, pool );
+          compressDecrypt.setCompression( true );
+          compressDecrypt.decryptFile( key, compressMode, iv );
+          mismatches[ 8 ] += readWholeFile( decryptedPath ) != logLike || ( logLike.size() > 4096 && compressedSize > logLike.size() );
+          verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier )
+          {
+               verifier.setCompression( true );
+               verifier.verifyFile( key, compressMode, iv );
+          } );
+          // сжатие находится по метке в потоке и без setCompression, а файл без метки при заданном сжатии отвергается
+          FileEncryptor detectDecrypt( cipherPath, decryptedPath, pool );
+          detectDecrypt.decryptFile( key, compressMode, iv );
+          mismatches[ 8 ] += readWholeFile( decryptedPath ) != logLike;
+          verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFile( key, compressMode, iv ); } );
+          FileEncryptor( plainPath, cipherPath, pool ).cryptFile( key, compressMode, iv );
+          try
+          {
+               FileEncryptor mismatchDecrypt( cipherPath, decryptedPath, pool );
+               mismatchDecrypt.setCompression( true );
+               mismatchDecrypt.decryptFile( key, compressMode, iv );
+               mismatches[ 8 ]++;
+          }
+          catch( const std::runtime_error& )
+          {
+          }
+          writeWholeFile( plainPath, plain );
+
+          // контрольная сумма в концевике: шифртекст перед концевиком не меняется, сумма совпадает с вычисленной отдельно,
+          // а измененный байт шифртекста обнаруживается при расшифровании
+          ChecksumType checksumType = rng() % 2 ? CTCrc32c : CTXxh64;
+          FileEncryptor checksumCrypt( plainPath, cipherPath, pool );
+          checksumCrypt.setChecksum( checksumType );
+          checksumCrypt.cryptFile( key, CMCtr, iv );
+          uint64_t expectedChecksum = checksumType == CTCrc32c ? Crc32c::hash( plain.data(), plain.size() ) : Xxh64::hash( plain.data(), plain.size() );
+          std::vector< unsigned char > sealed = readWholeFile( cipherPath );
+          FileEncryptor checksumDecrypt( cipherPath, decryptedPath, pool );
+          checksumDecrypt.setChecksum( checksumType );
+          checksumDecrypt.decryptFile( key, CMCtr, iv );
+          mismatches[ 7 ] += checksumCrypt.lastChecksum() != expectedChecksum || checksumDecrypt.lastChecksum() != expectedChecksum ||
+                             !std::equal( expectedCtr.begin(), expectedCtr.end(), sealed.begin() ) || readWholeFile( decryptedPath ) != plain;
+          uint64_t verifiedChecksum = 0;
+          verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier )
+          {
+               verifier.verifyFile( key, CMCtr, iv );
+               verifiedChecksum = verifier.lastChecksum();
+          } ) || verifiedChecksum != expectedChecksum;
+          // неверный ключ в CTR обнаруживается только по контрольной сумме, если открытый текст не пуст
+          if( !plain.empty() )
+          {
+               std::vector< unsigned char > wrongKey = key;
+               wrongKey[ rng() % wrongKey.size() ] ^= 0x01;
+               verifyMismatches += verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFile( wrongKey, CMCtr, iv ); } );
+          }
+          // концевик в шестнадцатеричном виде
+          FileEncryptor armoredCrypt( plainPath, cipherPath, pool );
+          armoredCrypt.setHexArmor( true );
+          armoredCrypt.setChecksum( checksumType );
+          armoredCrypt.cryptFile( key, CMCbc, iv );
+          FileEncryptor armoredDecrypt( cipherPath, decryptedPath, pool );
+          armoredDecrypt.setHexArmor( true );
+          armoredDecrypt.decryptFile( key, CMCbc, iv );
+          mismatches[ 7 ] += armoredDecrypt.lastChecksum() != expectedChecksum || readWholeFile( decryptedPath ) != plain;
+          verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier )
+          {
+               verifier.setHexArmor( true );
+               verifier.verifyFile( key, CMCbc, iv );
+          } );
+
+          if( !plain.empty() )
+          {
+               sealed[ rng() % plain.size() ] ^= static_cast< unsigned char >( 1 << ( rng() % 8 ) );
+               writeWholeFile( cipherPath, sealed );
+               try
+               {
+                    FileEncryptor( cipherPath, decryptedPath, pool ).decryptFile( key, CMCtr, iv );
+                    tamperMisses++;
+               }
+               catch( const std::exception& )
+               {
+               }
+               verifyMismatches += verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFile( key, CMCtr, iv ); } );
+          }
+
+          // инкрементальное шифрование: после изменения одного байта заново шифруется только его сегмент
+          unlink( cipherPath.c_str() );
+          FileEncryptor( plainPath, cipherPath, pool ).cryptFileIncremental( key, iv, 1024 );
+          std::vector< unsigned char > changed = plain;
+          if( !changed.empty() )
+          {
+               changed[ rng() % changed.size() ] ^= 0x01;
+          }
+          writeWholeFile( plainPath, changed );
+          FileEncryptor::IncrementalStats stats = FileEncryptor( plainPath, cipherPath, pool ).cryptFileIncremental( key, iv, 1024 );
+          FileEncryptor( cipherPath, decryptedPath, pool ).decryptFileSegmented( key, iv );
+          mismatches[ 6 ] += readWholeFile( decryptedPath ) != changed || stats.encrypted != ( plain.empty() ? 0 : 1 );
+          unlink( ( cipherPath + ".manifest" ).c_str() );
+          writeWholeFile( plainPath, plain );
+
+          // перешифрование CBC -> случайный режим на новом ключе должно совпадать с шифрованием открытого текста новым ключом
+          std::vector< unsigned char > newKey = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > newIv = randomBytes( rng, 16 );
+          CryptMode newMode = rng() % 2 ? CMCbc : CMEcb;
+          FileEncryptor( plainPath, cipherPath, pool ).cryptFile( key, CMCbc, iv );
+          FileEncryptor reencrypt( cipherPath, decryptedPath, pool );
+          reencrypt.setThreadCount( rng() % 4 + 1 );
+          reencrypt.reencryptFile( key, CMCbc, iv, newKey, newMode, newIv );
+          ReferenceAes newReference( newKey );
+          std::vector< unsigned char > expected = newMode == CMCbc ? newReference.encryptCbc( withPadding( plain ), newIv )
+                                                                   : newReference.encryptEcb( withPadding( plain ) );
+          mismatches[ 3 ] += readWholeFile( decryptedPath ) != expected;
+
+          // концевик с контрольной суммой переносится: расшифрование на новом ключе проверяет суммы
+          FileEncryptor checksumSource( plainPath, cipherPath, pool );
+          checksumSource.setChecksum( checksumType );
+          checksumSource.cryptFile( key, CMCbc, iv );
+          FileEncryptor checksumReencrypt( cipherPath, decryptedPath, pool );
+          checksumReencrypt.reencryptFile( key, CMCbc, iv, newKey, newMode, newIv );
+          FileEncryptor checksumTarget( decryptedPath, cipherPath, pool );
+          checksumTarget.setChecksum( checksumType );
+          checksumTarget.decryptFile( newKey, newMode, newIv );
+          mismatches[ 3 ] += readWholeFile( cipherPath ) != plain || checksumReencrypt.lastChecksum() != expectedChecksum ||
+                             checksumTarget.lastChecksum() != expectedChecksum;
+          // поврежденный шифртекст с верным дополнением(как и неверный старый ключ, прошедший проверку дополнения)
+          // обнаруживается по суммам концевика, а результат не создается
+          if( plain.size() >= 48 )
+          {
+               checksumSource.cryptFile( key, CMCbc, iv );
+               std::vector< unsigned char > damaged = readWholeFile( cipherPath );
+               damaged[ rng() % 16 ] ^= 0x01;
+               writeWholeFile( cipherPath, damaged );
+               unlink( decryptedPath.c_str() );
+               try
+               {
+                    FileEncryptor( cipherPath, decryptedPath, pool ).reencryptFile( key, CMCbc, iv, newKey, newMode, newIv );
+                    mismatches[ 3 ]++;
+               }
+               catch( const std::exception& )
+               {
+               }
+               mismatches[ 3 ] += access( decryptedPath.c_str(), F_OK ) == 0 || access( ( decryptedPath + ".tmp" ).c_str(), F_OK ) == 0;
+          }
+
+          FileEncryptor segmentedCrypt( plainPath, cipherPath, pool );
+          segmentedCrypt.setThreadCount( rng() % 4 + 1 );
+          segmentedCrypt.cryptFileSegmented( key, iv, rng() % 8 + 1 );
+          FileEncryptor( cipherPath, decryptedPath, pool ).decryptFileSegmented( key, iv );
+          mismatches[ 2 ] += readWholeFile( decryptedPath ) != plain;
+          try
+          {
+               FileEncryptor( cipherPath, decryptedPath, pool ).reencryptFile( key, CMCbc, iv, newKey, newMode, newIv );
+               mismatches[ 3 ]++;
+          }
+          catch( const std::exception& )
+          {
+          }
+          verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFileSegmented( key, iv ); } );
+
+          // любое изменение заголовка сегментированного файла должно обнаруживаться
+          std::vector< unsigned char > cipher = readWholeFile( cipherPath );
+          cipher[ rng() % 40 ] ^= static_cast< unsigned char >( 1 << ( rng() % 8 ) );
+          writeWholeFile( cipherPath, cipher );
+          try
+          {
+               FileEncryptor( cipherPath, decryptedPath, pool ).decryptFileSegmented( key, iv );
+               tamperMisses++;
+          }
+          catch( const std::exception& )
+          {
+          }
+          verifyMismatches += verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFileSegmented( key, iv ); } );
+     }
+
+     // разреженный файл: участки с данными шифруются как в обычном CTR, дыры остаются нулями(и дырами),
+     // расшифрование восстанавливает файл, а измененная карта участков обнаруживается
+     size_t sparseMismatches = 0;
+     for( size_t iteration = 0; iteration < std::max< size_t >( iterations / 8, 1 ); iteration++ )
+     {
+          std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > iv = randomBytes( rng, 16 );
+          const uint64_t fileSize = rng() % ( 1 << 20 ) + 1;
+          {
+               PosixFile plain = PosixFile::create( plainPath );
+               for( int extent = rng() % 4; extent > 0; extent-- )
+               {
+                    std::vector< unsigned char > data = randomBytes( rng, rng() % 20000 + 1 );
+                    uint64_t offset = rng() % fileSize / 4096 * 4096;
+                    plain.writeAt( data.data(), std::min< uint64_t >( data.size(), fileSize - offset ), offset );
+               }
+               plain.truncate( fileSize );
+          }
+
+          FileEncryptor sparseCrypt( plainPath, cipherPath, pool );
+          sparseCrypt.setThreadCount( rng() % 4 + 1 );
+          sparseCrypt.cryptFileSparse( key, iv );
+          FileEncryptor( cipherPath, decryptedPath, pool ).decryptFileSparse( key, iv );
+
+          std::vector< unsigned char > plain = readWholeFile( plainPath );
+          std::vector< unsigned char > cipher = readWholeFile( cipherPath );
+          std::vector< unsigned char > expected = ReferenceAes( key ).encryptCtr( plain, iv );
+          bool layoutMatches = cipher.size() > plain.size();
+          for( size_t idx = 0; layoutMatches && idx < plain.size(); idx++ )
+          {
+               layoutMatches = cipher[ idx ] == expected[ idx ] || ( cipher[ idx ] == 0 && plain[ idx ] == 0 );
+          }
+          uint64_t plainData = 0;
+          uint64_t decryptedData = 0;
+          for( const FileExtent& extent: PosixFile::openRead( plainPath ).dataExtents() )
+          {
+               plainData += extent.size;
+          }
+          for( const FileExtent& extent: PosixFile::openRead( decryptedPath ).dataExtents() )
+          {
+               decryptedData += extent.size;
+          }
+          sparseMismatches += !layoutMatches || readWholeFile( decryptedPath ) != plain || decryptedData > plainData;
+          verifyMismatches += !verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFileSparse( key, iv ); } );
+
+          cipher[ plain.size() + rng() % ( cipher.size() - plain.size() - 8 ) ] ^= static_cast< unsigned char >( 1 << ( rng() % 8 ) );
+          writeWholeFile( cipherPath, cipher );
+          try
+          {
+               FileEncryptor( cipherPath, decryptedPath, pool ).decryptFileSparse( key, iv );
+               tamperMisses++;
+          }
+          catch( const std::exception& )
+          {
+          }
+          verifyMismatches += verifies( [ & ]( FileEncryptor& verifier ) { verifier.verifyFileSparse( key, iv ); } );
+     }
+
+     check( "file ECB", mismatches[ 0 ] == 0 );
+     check( "file CBC", mismatches[ 1 ] == 0 );
+     check( "file segmented CBC", mismatches[ 2 ] == 0 );
+     check( "file reencrypt", mismatches[ 3 ] == 0 );
+     check( "file CTR", mismatches[ 4 ] == 0 );
+     check( "file CTR in place", mismatches[ 5 ] == 0 );
+     check( "file incremental segmented CBC", mismatches[ 6 ] == 0 );
+     check( "file CTR with checksum trailer", mismatches[ 7 ] == 0 );
+     check( "file compress then encrypt", mismatches[ 8 ] == 0 );
+     check( "file CTR sparse", sparseMismatches == 0 );
+     check( "segmented header, checksum and sparse map tamper detection", tamperMisses == 0 );
+     check( "file verify without output", verifyMismatches == 0 );
+     check( "buffer pool wipes released plaintext", wipeMisses == 0 );
+
+     unlink( plainPath.c_str() );
+     unlink( cipherPath.c_str() );
+     unlink( decryptedPath.c_str() );
+}
+
+
+void SelfTest::runThreadPoolTests( size_t iterations, uint32_t seed )
+{
+     std::mt19937 rng( seed ^ 0x9001 );
+
+     // вложенные задачи короткие, поэтому рабочий поток, дождавшийся своих задач, сразу выходит из parallelFor:
+     // это проверяет, что завершающая задача не обращается к кадру стека parallelFor после его выхода
+     ThreadPool pool( rng() % 4 + 2 );
+     size_t nestedMismatches = 0;
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          const size_t outer = rng() % 16 + 2;
+          const size_t inner = rng() % 16 + 2;
+          std::vector< std::atomic< size_t > > counts( outer );
+          pool.parallelFor( outer, [ & ]( size_t outerIdx )
+          {
+               pool.parallelFor( inner, [ & ]( size_t innerIdx )
+               {
+                    counts[ outerIdx ] += innerIdx + 1;
+               } );
+          } );
+          for( const std::atomic< size_t >& count: counts )
+          {
+               nestedMismatches += count != inner * ( inner + 1 ) / 2;
+          }
+     }
+     check( "thread pool nested parallelFor", nestedMismatches == 0 );
+
+     // исключение вложенной задачи доходит до внешнего вызывающего после завершения остальных задач
+     size_t errorMisses = 0;
+     for( size_t iteration = 0; iteration < std::max< size_t >( iterations / 10, 1 ); iteration++ )
+     {
+          const size_t failing = rng() % 8;
+          std::atomic< size_t > finished( 0 );
+          try
+          {
+               pool.parallelFor( 8, [ & ]( size_t outerIdx )
+               {
+                    pool.parallelFor( 4, [ & ]( size_t innerIdx )
+                    {
+                         if( outerIdx == failing && innerIdx == 0 )
+                         {
+                              throw std::runtime_error( "nested task failure" );
+                         }
+                         finished++;
+                    } );
+               } );
+               errorMisses++;
+          }
+          catch( const std::runtime_error& )
+          {
+               errorMisses += finished != 8 * 4 - 1;
+          }
+     }
+     check( "thread pool nested exception", errorMisses == 0 );
+}
+
+
+void SelfTest::runDirectoryTests( size_t iterations, uint32_t seed )
+{
+     namespace fs = std::filesystem;
+     std::mt19937 rng( seed ^ 0xd1 );
+
+     // маленькие блоки пула, чтобы большие файлы делились на части, которые шифруются вложенными задачами
+     BufferPool pool( 4096 );
+     const std::string srcDir = tempPath( "dir_plain" );
+     const std::string cipherDir = tempPath( "dir_cipher" );
+     const std::string decryptedDir = tempPath( "dir_decrypted" );
+
+     size_t mismatches = 0;
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          fs::remove_all( srcDir );
+          fs::remove_all( cipherDir );
+          fs::remove_all( decryptedDir );
+          fs::create_directories( srcDir + "/nested/deeper" );
+          fs::create_directories( srcDir + "/empty" );
+
+          std::vector< std::pair< std::string, std::vector< unsigned char > > > files;
+          const char* dirs[] = { "", "/nested", "/nested/deeper" };
+          for( size_t idx = 0; idx < 40; idx++ )
+          {
+               files.emplace_back( std::string( dirs[ idx % 3 ] ) + "/small" + std::to_string( idx ), randomBytes( rng, rng() % 3000 ) );
+          }
+          for( size_t idx = 0; idx < 3; idx++ )
+          {
+               files.emplace_back( std::string( dirs[ idx ] ) + "/large" + std::to_string( idx ), randomBytes( rng, 100000 + rng() % 300000 ) );
+          }
+          for( const auto& [ name, data ]: files )
+          {
+               writeWholeFile( srcDir + name, data );
+          }
+
+          std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > iv = randomBytes( rng, 16 );
+          CryptMode mode = static_cast< CryptMode >( rng() % 3 );
+          bool segmented = mode == CMCbc && rng() % 2 == 0;
+          bool compression = !segmented && rng() % 2 == 0;
+          ChecksumType checksum = segmented ? CTNone : static_cast< ChecksumType >( rng() % 3 );
+          size_t threads = rng() % 4 + 2;
+          auto process = [ & ]( const std::string& from, const std::string& to, bool decrypt )
+          {
+               std::ostringstream progress;
+               DirectoryEncryptor directoryCrypt( from, to, progress );
+               directoryCrypt.setBufferPool( pool );
+               directoryCrypt.setThreadCount( threads );
+               directoryCrypt.setSegmented( segmented, 3 );
+               directoryCrypt.setCompression( compression );
+               directoryCrypt.setChecksum( checksum );
+               if( decrypt )
+               {
+                    directoryCrypt.decryptDirectory( key, mode, iv );
+               }
+               else
+               {
+                    directoryCrypt.cryptDirectory( key, mode, iv );
+               }
+          };
+          process( srcDir, cipherDir, false );
+          process( cipherDir, decryptedDir, true );
+
+          mismatches += !fs::is_directory( decryptedDir + "/empty" );
+          for( const auto& [ name, data ]: files )
+          {
+               std::vector< unsigned char > cipher = readWholeFile( cipherDir + name );
+               mismatches += readWholeFile( decryptedDir + name ) != data || ( !data.empty() && cipher == data );
+          }
+     }
+     check( "directory round trip", mismatches == 0 );
+
+     fs::remove_all( srcDir );
+     fs::remove_all( cipherDir );
+     fs::remove_all( decryptedDir );
+}
+
+
+void SelfTest::runAsyncTests( size_t iterations, uint32_t seed )
+{
+     std::mt19937 rng( seed ^ 0xa5c );
+
+     BufferPool pool( 4096 );
+     RunLoop loop;
+     AsyncCryptEngine engine( loop, 2, 2, 3, pool );
+     const size_t fileCount = 3;
+
+     size_t fileMismatches = 0;
+     size_t streamMismatches = 0;
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > iv = randomBytes( rng, 16 );
+          CryptMode mode = static_cast< CryptMode >( rng() % 3 );
+
+          // несколько файлов шифруются и расшифровываются одновременно в одном цикле. Шифртекст должен совпадать с cryptFile
+          std::vector< std::vector< unsigned char > > plains;
+          std::vector< std::exception_ptr > errors( fileCount );
+          for( size_t idx = 0; idx < fileCount; idx++ )
+          {
+               plains.push_back( randomBytes( rng, rng() % 20000 ) );
+               writeWholeFile( tempPath( "async_plain" + std::to_string( idx ) ), plains.back() );
+               AsyncCryptParams params;
+               params.key = key;
+               params.mode = mode;
+               params.iv = iv;
+               params.pipelineDepth = rng() % 3 + 1;
+               SpawnedTask::spawn( loop, engine.encryptAsync( tempPath( "async_plain" + std::to_string( idx ) ), tempPath( "async_cipher" + std::to_string( idx ) ), params ),
+                                   [ &errors, idx ]( std::exception_ptr error ) { errors[ idx ] = error; } );
+          }
+          loop.run();
+          for( size_t idx = 0; idx < fileCount; idx++ )
+          {
+               AsyncCryptParams params;
+               params.key = key;
+               params.mode = mode;
+               params.iv = iv;
+               SpawnedTask::spawn( loop, engine.decryptAsync( tempPath( "async_cipher" + std::to_string( idx ) ), tempPath( "async_decrypted" + std::to_string( idx ) ), params ),
+                                   [ &errors, idx ]( std::exception_ptr error ) { errors[ idx ] = errors[ idx ] ? errors[ idx ] : error; } );
+          }
+          loop.run();
+          for( size_t idx = 0; idx < fileCount; idx++ )
+          {
+               std::string plainPath = tempPath( "async_plain" + std::to_string( idx ) );
+               std::string cipherPath = tempPath( "async_cipher" + std::to_string( idx ) );
+               std::string decryptedPath = tempPath( "async_decrypted" + std::to_string( idx ) );
+               FileEncryptor( plainPath, decryptedPath + ".sync", pool ).cryptFile( key, mode, iv );
+               fileMismatches += errors[ idx ] || readWholeFile( cipherPath ) != readWholeFile( decryptedPath + ".sync" ) ||
+                                 readWholeFile( decryptedPath ) != plains[ idx ];
+               unlink( plainPath.c_str() );
+               unlink( cipherPath.c_str() );
+               unlink( decryptedPath.c_str() );
+               unlink( ( decryptedPath + ".sync" ).c_str() );
+          }
+
+          // потоковый интерфейс на случайных частях любой длины
+          std::vector< unsigned char > plain = plains.front();
+          auto roundTrip = [ & ]() -> Task< std::vector< unsigned char > >
+          {
+               AsyncCryptStream encryptor( engine, false, key, mode, iv );
+               AsyncCryptStream decryptor( engine, true, key, mode, iv );
+               std::vector< unsigned char > result;
+               for( size_t offset = 0; offset < plain.size(); )
+               {
+                    size_t part = std::min< size_t >( plain.size() - offset, rng() % 3000 );
+                    std::vector< unsigned char > cipher = co_await encryptor.update( std::vector< unsigned char >( plain.begin() + offset, plain.begin() + offset + part ) );
+                    std::vector< unsigned char > decrypted = co_await decryptor.update( std::move( cipher ) );
+                    result.insert( result.end(), decrypted.begin(), decrypted.end() );
+                    offset += part;
+               }
+               std::vector< unsigned char > decrypted = co_await decryptor.update( co_await encryptor.finish() );
+               result.insert( result.end(), decrypted.begin(), decrypted.end() );
+               decrypted = co_await decryptor.finish();
+               result.insert( result.end(), decrypted.begin(), decrypted.end() );
+               co_return result;
+          };
+          streamMismatches += syncWait( loop, roundTrip() ) != plain;
+     }
+     check( "async concurrent file encryption", fileMismatches == 0 );
+     check( "async stream round trip", streamMismatches == 0 );
+
+     // отмена во время операции завершает ее исключением OperationCancelled, а частичный результат удаляется
+     std::string plainPath = tempPath( "async_plain" );
+     std::string cipherPath = tempPath( "async_cipher" );
+     // файл из многих частей: с быстрой реализацией шифра небольшой файл успевает зашифроваться до отмены
+     writeWholeFile( plainPath, randomBytes( rng, 16 << 20 ) );
+     std::atomic< uint64_t > progress( 0 );
+     AsyncCryptParams params;
+     params.key = randomBytes( rng, 32 );
+     params.mode = CMEcb;
+     params.progress = &progress;
+     auto cancelAfterStart = [ & ]() -> Task<>
+     {
+          while( progress == 0 )
+          {
+               co_await loop.schedule();
+          }
+          params.cancel.cancel();
+     };
+     SpawnedTask::spawn( loop, cancelAfterStart(), []( std::exception_ptr ) {} );
+     bool cancelled = false;
+     try
+     {
+          syncWait( loop, engine.encryptAsync( plainPath, cipherPath, params ) );
+     }
+     catch( const OperationCancelled& )
+     {
+          cancelled = true;
+     }
+     check( "async cancellation", cancelled && progress < ( 16 << 20 ) && access( cipherPath.c_str(), F_OK ) != 0 );
+     unlink( plainPath.c_str() );
+}
+
+
+void SelfTest::runLibraryTests( size_t iterations, uint32_t seed )
+{
+     std::mt19937 rng( seed ^ 0x11b );
+
+     size_t messageMismatches = 0;
+     size_t batchMismatches = 0;
+     size_t streamMismatches = 0;
+     size_t fileMismatches = 0;
+     bool errorCodes = true;
+     for( size_t iteration = 0; iteration < iterations; iteration++ )
+     {
+          std::vector< unsigned char > key = randomBytes( rng, 16 + 8 * ( rng() % 3 ) );
+          std::vector< unsigned char > iv = randomBytes( rng, 16 );
+          aescrypt_mode mode = static_cast< aescrypt_mode >( rng() % 3 );
+          ReferenceAes reference( key );
+          auto expectedCipher = [ & ]( const std::vector< unsigned char >& plain, const std::vector< unsigned char >& messageIv )
+          {
+               return mode == AESCRYPT_MODE_CTR ? reference.encryptCtr( plain, messageIv ) :
+                      mode == AESCRYPT_MODE_CBC ? reference.encryptCbc( withPadding( plain ), messageIv ) : reference.encryptEcb( withPadding( plain ) );
+          };
+
+          aescrypt_key* handle = nullptr;
+          if( aescrypt_key_create( key.data(), key.size(), &handle ) != AESCRYPT_OK )
+          {
+               messageMismatches++;
+               continue;
+          }
+
+          // сообщение целиком, расшифрование на месте
+          std::vector< unsigned char > plain = randomBytes( rng, rng() % 2000 );
+          std::vector< unsigned char > expected = expectedCipher( plain, iv );
+          std::vector< unsigned char > cipher( aescrypt_encrypted_size( mode, plain.size() ) );
+          size_t cipherSize = 0;
+          size_t plainSize = 0;
+          int status = aescrypt_encrypt( handle, mode, iv.data(), plain.data(), plain.size(), cipher.data(), cipher.size(), &cipherSize );
+          cipher.resize( cipherSize );
+          std::vector< unsigned char > decrypted = cipher;
+          status |= aescrypt_decrypt( handle, mode, iv.data(), decrypted.data(), decrypted.size(), decrypted.data(), decrypted.size(), &plainSize );
+          decrypted.resize( plainSize );
+          messageMismatches += status != AESCRYPT_OK || cipher != expected || decrypted != plain;
+
+          // пакет: каждый четвертый достаточно велик, чтобы сообщения распределялись между потоками
+          const size_t count = rng() % 8 + 1;
+          const size_t maxSize = iteration % 4 == 0 ? 100000 : 600;
+          std::vector< std::vector< unsigned char > > plains;
+          std::vector< std::vector< unsigned char > > ivs;
+          std::vector< std::vector< unsigned char > > outputs( count );
+          std::vector< aescrypt_message > messages( count );
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               plains.push_back( randomBytes( rng, rng() % maxSize ) );
+               ivs.push_back( randomBytes( rng, 16 ) );
+               outputs[ idx ].resize( aescrypt_encrypted_size( mode, plains[ idx ].size() ) );
+               messages[ idx ] = { plains[ idx ].data(), plains[ idx ].size(), ivs[ idx ].data(), outputs[ idx ].data(), outputs[ idx ].size(), 0, 0 };
+          }
+          status = aescrypt_encrypt_batch( handle, mode, messages.data(), messages.size() );
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               outputs[ idx ].resize( messages[ idx ].dstSize );
+               batchMismatches += outputs[ idx ] != expectedCipher( plains[ idx ], ivs[ idx ] );
+               messages[ idx ].src = outputs[ idx ].data();
+               messages[ idx ].srcSize = outputs[ idx ].size();
+          }
+          status |= aescrypt_decrypt_batch( handle, mode, messages.data(), messages.size() );
+          for( size_t idx = 0; idx < count; idx++ )
+          {
+               outputs[ idx ].resize( messages[ idx ].dstSize );
+               batchMismatches += status != AESCRYPT_OK || outputs[ idx ] != plains[ idx ];
+          }
+
+          // поток на частях случайной длины, в том числе пустых
+          auto streamCrypt = [ & ]( bool decrypt, const std::vector< unsigned char >& input, bool& ok )
+          {
+               std::vector< unsigned char > result;
+               aescrypt_stream* stream = nullptr;
+               ok = aescrypt_stream_create( handle, mode, iv.data(), decrypt, &stream ) == AESCRYPT_OK;
+               for( size_t offset = 0; ok && offset <= input.size(); )
+               {
+                    size_t part = std::min< size_t >( input.size() - offset, rng() % 100 );
+                    std::vector< unsigned char > output( part + 16 );
+                    size_t outputSize = 0;
+                    if( offset == input.size() )
+                    {
+                         ok = aescrypt_stream_finish( stream, output.data(), output.size(), &outputSize ) == AESCRYPT_OK;
+                         offset++;
+                    }
+                    else
+                    {
+                         ok = aescrypt_stream_update( stream, input.data() + offset, part, output.data(), output.size(), &outputSize ) == AESCRYPT_OK;
+                         offset += part;
+                    }
+                    result.insert( result.end(), output.begin(), output.begin() + outputSize );
+               }
+               aescrypt_stream_destroy( stream );
+               return result;
+          };
+          bool encrypted = false;
+          bool streamDecrypted = false;
+          streamMismatches += streamCrypt( false, plain, encrypted ) != expected || streamCrypt( true, expected, streamDecrypted ) != plain ||
+                              !encrypted || !streamDecrypted;
+
+          // файловый интерфейс дает тот же шифртекст, что и FileEncryptor
+          std::string plainPath = tempPath( "capi_plain" );
+          std::string cipherPath = tempPath( "capi_cipher" );
+          writeWholeFile( plainPath, plain );
+          aescrypt_file_options options;
+          aescrypt_file_options_init( &options );
+          options.mode = mode;
+          options.iv = iv.data();
+          options.checksum = AESCRYPT_CHECKSUM_CRC32C;
+          aescrypt_file_result fileResult{};
+          status = aescrypt_encrypt_file( handle, plainPath.c_str(), cipherPath.c_str(), &options, &fileResult );
+          FileEncryptor fileCrypt( plainPath, cipherPath + ".sync" );
+          fileCrypt.setChecksum( CTCrc32c );
+          fileCrypt.cryptFile( key, mode == AESCRYPT_MODE_CBC ? CMCbc : mode == AESCRYPT_MODE_CTR ? CMCtr : CMEcb, iv );
+          fileMismatches += status != AESCRYPT_OK || readWholeFile( cipherPath ) != readWholeFile( cipherPath + ".sync" ) ||
+                            fileResult.checksumType != AESCRYPT_CHECKSUM_CRC32C || fileResult.checksum != fileCrypt.lastChecksum();
+          aescrypt_file_result verifyResult{};
+          fileMismatches += aescrypt_verify_file( handle, cipherPath.c_str(), &options, &verifyResult ) != AESCRYPT_OK ||
+                            verifyResult.checksum != fileResult.checksum || verifyResult.verifyStrength != AESCRYPT_VERIFY_FULL;
+
+          // остальные форматы и перешифрование тоже доступны через C-интерфейс
+          std::string outputPath = cipherPath + ".out";
+          aescrypt_file_options formatOptions;
+          aescrypt_file_options_init( &formatOptions );
+          formatOptions.mode = mode;
+          formatOptions.iv = iv.data();
+          if( mode == AESCRYPT_MODE_CBC )
+          {
+               formatOptions.format = AESCRYPT_FORMAT_SEGMENTED;
+               formatOptions.segments = rng() % 4 + 1;
+               aescrypt_file_result segmentedResult{};
+               fileMismatches += aescrypt_encrypt_file( handle, plainPath.c_str(), cipherPath.c_str(), &formatOptions, nullptr ) != AESCRYPT_OK ||
+                                 aescrypt_decrypt_file( handle, cipherPath.c_str(), outputPath.c_str(), &formatOptions, nullptr ) != AESCRYPT_OK ||
+                                 readWholeFile( outputPath ) != plain ||
+                                 aescrypt_verify_file( handle, cipherPath.c_str(), &formatOptions, &segmentedResult ) != AESCRYPT_OK ||
+                                 segmentedResult.verifyStrength != AESCRYPT_VERIFY_FULL;
+               formatOptions.format = AESCRYPT_FORMAT_STREAM;
+          }
+          if( mode != AESCRYPT_MODE_CTR )
+          {
+               // концевик переносится на новый режим, расшифрование в новом режиме проверяет суммы
+               aescrypt_file_options ecbOptions = formatOptions;
+               ecbOptions.mode = AESCRYPT_MODE_ECB;
+               ecbOptions.checksum = AESCRYPT_CHECKSUM_CRC32C;
+               aescrypt_file_result reencryptResult{};
+               status = aescrypt_encrypt_file( handle, plainPath.c_str(), cipherPath.c_str(), &options, nullptr );
+               fileMismatches += status != AESCRYPT_OK ||
+                                 aescrypt_reencrypt_file( handle, &options, handle, &ecbOptions, cipherPath.c_str(), outputPath.c_str(), &reencryptResult ) != AESCRYPT_OK ||
+                                 reencryptResult.checksum != fileResult.checksum ||
+                                 aescrypt_decrypt_file( handle, outputPath.c_str(), plainPath.c_str(), &ecbOptions, nullptr ) != AESCRYPT_OK ||
+                                 readWholeFile( plainPath ) != plain;
+          }
+          else
+          {
+               // шифртекст CTR без суммы проверить нечем
+               fileMismatches += aescrypt_encrypt_file( handle, plainPath.c_str(), cipherPath.c_str(), &formatOptions, nullptr ) != AESCRYPT_OK ||
+                                 aescrypt_verify_file( handle, cipherPath.c_str(), &formatOptions, nullptr ) != AESCRYPT_ERROR_UNVERIFIED;
+          }
+          unlink( plainPath.c_str() );
+          unlink( cipherPath.c_str() );
+          unlink( outputPath.c_str() );
+          unlink( ( cipherPath + ".sync" ).c_str() );
+
+          // нехватка места сообщает требуемый размер, поврежденное дополнение - ошибку данных
+          if( mode != AESCRYPT_MODE_CTR )
+          {
+               size_t required = 0;
+               errorCodes &= aescrypt_encrypt( handle, mode, iv.data(), plain.data(), plain.size(), cipher.data(), expected.size() - 1, &required ) == AESCRYPT_ERROR_BUFFER &&
+                             required == expected.size();
+               cipher = expected;
+               cipher.back() ^= 0x80;
+               std::vector< unsigned char > output( cipher.size() );
+               int corrupted = aescrypt_decrypt( handle, mode, iv.data(), cipher.data(), cipher.size(), output.data(), output.size(), &plainSize );
+               // в CBC искажается только байт дополнения, в ECB - весь блок, который изредка случайно дает верное дополнение
+               errorCodes &= corrupted == AESCRYPT_ERROR_DATA || ( mode == AESCRYPT_MODE_ECB && corrupted == AESCRYPT_OK );
+               errorCodes &= aescrypt_decrypt( handle, mode, iv.data(), cipher.data(), cipher.size() - 1, output.data(), output.size(), &plainSize ) == AESCRYPT_ERROR_DATA;
+          }
+          aescrypt_key_destroy( handle );
+     }
+     errorCodes &= aescrypt_key_create( nullptr, 16, nullptr ) == AESCRYPT_ERROR_ARGUMENT && aescrypt_abi_version() == AESCRYPT_ABI_VERSION;
+
+     // ключи, созданные пакетом, шифруют так же, как созданные по одному
+     const size_t keyCount = 5;
+     std::vector< unsigned char > keys = randomBytes( rng, 24 * keyCount );
+     std::vector< unsigned char > block = randomBytes( rng, 16 );
+     aescrypt_key* handles[ keyCount ] = {};
+     bool batchKeys = aescrypt_key_create_batch( keys.data(), 24, keyCount, handles ) == AESCRYPT_OK;
+     for( size_t idx = 0; batchKeys && idx < keyCount; idx++ )
+     {
+          unsigned char cipher[ 16 ];
+          batchKeys &= aescrypt_encrypt_blocks( handles[ idx ], AESCRYPT_MODE_ECB, nullptr, block.data(), cipher, 16 ) == AESCRYPT_OK &&
+                       std::vector< unsigned char >( cipher, cipher + 16 ) ==
+                       ReferenceAes( std::vector< unsigned char >( keys.begin() + 24 * idx, keys.begin() + 24 * ( idx + 1 ) ) ).encryptEcb( block );
+          aescrypt_key_destroy( handles[ idx ] );
+     }
+     errorCodes &= aescrypt_key_create_batch( keys.data(), 20, keyCount, handles ) == AESCRYPT_ERROR_ARGUMENT;
+
+     check( "C API message encryption", messageMismatches == 0 );
+     check( "C API batch encryption", batchMismatches == 0 );
+     check( "C API batch key creation", batchKeys );
+     check( "C API stream in random pieces", streamMismatches == 0 );
+     check( "C API file encryption", fileMismatches == 0 );
+     check( "C API error codes", errorCodes );
+}
+
+
+void SelfTest::runRandomGeneratorTests()
+{
+     const size_t ivCount = 1 << 16;
+     std::vector< unsigned char > ivs( 16 * ivCount );
+
+     auto start = std::chrono::steady_clock::now();
+     for( size_t idx = 0; idx < ivCount; idx++ )
+     {
+          CtrDrbg::threadLocal().generate( ivs.data() + 16 * idx, 16 );
+     }
+     std::chrono::duration< double > elapsed = std::chrono::steady_clock::now() - start;
+     log_ << "IV generation: " << std::fixed << std::setprecision( 0 ) << ivCount / elapsed.count() << " IV/s" << std::endl;
+
+     std::set< std::string > unique;
+     size_t histogram[ 256 ] = {};
+     for( size_t idx = 0; idx < ivCount; idx++ )
+     {
+          unique.emplace( ivs.begin() + 16 * idx, ivs.begin() + 16 * idx + 16 );
+     }
+     for( unsigned char value: ivs )
+     {
+          histogram[ value ]++;
+     }
+     check( "CTR_DRBG unique IVs", unique.size() == ivCount );
+
+     // хи-квадрат с 255 степенями свободы: значение выше 400 практически невозможно для равномерного распределения
+     double expected = ivs.size() / 256.0;
+     double chiSquare = 0;
+     for( size_t count: histogram )
+     {
+          chiSquare += ( count - expected ) * ( count - expected ) / expected;
+     }
+     check( "CTR_DRBG byte distribution", chiSquare < 400 );
+
+     unsigned char otherThread[ 16 ];
+     std::thread( [ &otherThread ]() { CtrDrbg::threadLocal().generate( otherThread, 16 ); } ).join();
+     unsigned char thisThread[ 16 ];
+     CtrDrbg::threadLocal().generate( thisThread, 16 );
+     check( "CTR_DRBG per-thread state", memcmp( otherThread, thisThread, 16 ) != 0 );
+}
+
+
+void SelfTest::runThroughputGates( const double minMbps[ 3 ], bool perfStats )
+{
+     std::vector< unsigned char > data( 1 << 20, 0x5a );
+     std::vector< unsigned char > key( 32, 0x11 );
+     AESCryptography crypt( AKL_256 );
+     AesRoundKeys roundKeys = crypt.expandKey( key );
+
+     // замеряются все реализации шифра, каждая со своей нижней границей: медленная реализация используется там, где нет
+     // AES-NI, и ее регрессия не должна проходить незамеченной. По счетчикам промахов видно, на чем она теряет
+     std::unique_ptr< PerfCounters > counters( perfStats ? new PerfCounters() : nullptr );
+     if( counters && !counters->unavailableReason().empty() )
+     {
+          log_ << "hardware counters unavailable(" << counters->unavailableReason() << "), partial or timing only" << std::endl;
+     }
+
+     const AesBackend active = AESCryptography::backend();
+     const char* names[ 5 ] = { "ECB encrypt", "ECB decrypt", "CBC encrypt", "CBC decrypt", "CTR" };
+     for( AesBackend backend: { ABPortable, ABTable, ABAesNi } )
+     {
+          if( !AESCryptography::backendSupported( backend ) )
+          {
+               continue;
+          }
+          AESCryptography::setBackend( backend );
+          // побайтовая реализация в сотни раз медленнее, поэтому замеряется на меньшем участке
+          const size_t size = backend == ABPortable ? 1 << 16 : data.size();
+
+          for( int operation = 0; operation < 5; operation++ )
+          {
+               // повторяем операцию, пока не наберется достаточно времени для устойчивого замера
+               size_t processed = 0;
+               PerfReading startReading = counters ? counters->read() : PerfReading();
+               auto start = std::chrono::steady_clock::now();
+               std::chrono::duration< double > elapsed( 0 );
+               while( elapsed.count() < 0.2 )
+               {
+                    unsigned char chain[ 16 ] = {};
+                    switch( operation )
+                    {
+                         case 0: crypt.cryptBlocksECB( data.data(), data.data(), size, roundKeys ); break;
+                         case 1: crypt.decryptBlocksECB( data.data(), data.data(), size, roundKeys ); break;
+                         case 2: crypt.cryptBlocksCBC( data.data(), data.data(), size, roundKeys, chain ); break;
+                         case 3: crypt.decryptBlocksCBC( data.data(), data.data(), size, roundKeys, chain ); break;
+                         case 4: crypt.cryptBlocksCTR( data.data(), data.data(), size, roundKeys, chain ); break;
+                    }
+                    processed += size;
+                    elapsed = std::chrono::steady_clock::now() - start;
+               }
+
+               std::string name = std::string( AESCryptography::backendName( backend ) ) + " " + names[ operation ];
+               if( counters )
+               {
+                    PerfStats::reportLine( log_, *counters, name, counters->read() - startReading, processed );
+               }
+
+               double mbps = processed / elapsed.count() / ( 1 << 20 );
+               log_ << "throughput " << name << " AES-256: " << std::fixed << std::setprecision( 1 ) << mbps << " MB/s" << std::endl;
+               if( minMbps[ backend ] > 0 )
+               {
+                    check( "throughput gate " + name, mbps >= minMbps[ backend ] );
+               }
+          }
+     }
+     AESCryptography::setBackend( active );
+
+     // развертывание ключа, который меняется с каждым сообщением, должно стоить меньше шифрования одного блока. Ключи
+     // разворачиваются пакетом и только для шифрования(CTR, CMAC). Замеры чередуются, берется лучший из нескольких, чтобы
+     // фоновая нагрузка не решала исход сравнения. Цель поставлена для AES-NI, остальные реализации только выводятся
+     const size_t keyBatch = AESCryptography::keyLanes;
+     for( AesKeyLength length: { AKL_128, AKL_192, AKL_256 } )
+     {
+          AESCryptography lengthCrypt( length );
+          const size_t keySize = 16 + 8 * length;
+          std::vector< unsigned char > keys( keySize * keyBatch, 0x22 );
+          std::vector< AesRoundKeys > schedules( keyBatch );
+          AesRoundKeys blockKeys = lengthCrypt.expandKey( std::vector< unsigned char >( keys.begin(), keys.begin() + keySize ) );
+          unsigned char block[ 16 ] = {};
+          double best[ 2 ] = { 1e9, 1e9 };
+          for( int attempt = 0; attempt < 5; attempt++ )
+          {
+               for( int operation = 0; operation < 2; operation++ )
+               {
+                    const size_t repeats = operation == 0 ? 1000 : 1000 * keyBatch;
+                    auto start = std::chrono::steady_clock::now();
+                    for( size_t repeat = 0; repeat < repeats; repeat++ )
+                    {
+                         if( operation == 0 )
+                         {
+                              lengthCrypt.expandKeys( keys.data(), keyBatch, schedules.data(), false );
+                              keys[ repeat % keys.size() ] ^= schedules[ 0 ].bytes[ 16 ];
+                         }
+                         else
+                         {
+                              lengthCrypt.cryptBlocksECB( block, block, 16, blockKeys );
+                         }
+                    }
+                    std::chrono::duration< double > elapsed = std::chrono::steady_clock::now() - start;
+                    best[ operation ] = std::min( best[ operation ], elapsed.count() * 1e9 / ( 1000 * keyBatch ) );
+               }
+          }
+          const std::string bits = std::to_string( 128 + 64 * length );
+          log_ << "key setup AES-" << bits << ": " << std::fixed << std::setprecision( 1 ) << best[ 0 ] << " ns per key in batches of "
+               << keyBatch << ", one block " << best[ 1 ] << " ns" << std::endl;
+          if( active == ABAesNi )
+          {
+               check( "key setup AES-" + bits + " cheaper than one block", best[ 0 ] < best[ 1 ] );
+          }
+     }
+}
+
+
+void SelfTest::check( const std::string& name, bool passed )
+{
+     checks_++;
+     if( !passed )
+     {
+          failures_++;
+     }
+     log_ << ( passed ? "[  OK  ] " : "[ FAIL ] " ) << name << std::endl;
+}
+
+
+std::string SelfTest::tempPath( const std::string& suffix ) const
+{
+     const char* dir = getenv( "TMPDIR" );
+     return std::string( dir != nullptr ? dir : "/tmp" ) + "/crypto_tests_" + std::to_string( getpid() ) + "_" + suffix;
+}
@@ -0,0 +1,70 @@
+/// @file
+/// @brief Самопроверка реализации: известные ответы, дифференциальное тестирование и контроль производительности
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+
+class SelfTest
+{
+public:
+     struct Options
+     {
+          size_t iterations = 200;      // число случайных проверок каждого режима
+          uint32_t seed = 0;            // 0 - случайное зерно(выводится в журнал для воспроизведения)
+          double minMbps[ 3 ] = {};     // минимально допустимая производительность каждой реализации шифра(индекс - AesBackend),
+                                        // МБ/с. 0 - не проверяется
+          bool perfStats = false;       // аппаратные счетчики в замерах производительности всех реализаций шифра
+     };
+
+     explicit SelfTest( std::ostream& log );
+
+     // выполняет все проверки. Возвращает false, если хотя бы одна из них не пройдена
+     bool run( const Options& options );
+
+private:
+     // векторы FIPS-197(приложение C) и NIST SP 800-38A(F.1, F.2) для всех длин ключа
+     void runKnownAnswerTests();
+
+     // сравнение всех путей шифрования с эталонной реализацией на случайных длинах, выравниваниях и разбиениях
+     void runDifferentialTests( size_t iterations, uint32_t seed );
+
+     // все реализации блочного шифра(см. AesBackend), поддерживаемые процессором: известные ответы и сравнение с эталоном
+     void runBackendTests( size_t iterations, uint32_t seed );
+
+     // сравнение файловых режимов FileEncryptor с эталонной реализацией
+     void runFileTests( size_t iterations, uint32_t seed );
+
+     // пул потоков: вложенные parallelFor из рабочих потоков, порядок завершения и проброс исключений
+     void runThreadPoolTests( size_t iterations, uint32_t seed );
+
+     // DirectoryEncryptor: дерево из мелких(пакетами) и больших(частями во вложенных задачах) файлов после шифрования
+     // и расшифрования совпадает с исходным
+     void runDirectoryTests( size_t iterations, uint32_t seed );
+
+     // асинхронный API: одновременное шифрование нескольких файлов в одном цикле, потоковый интерфейс и отмена
+     void runAsyncTests( size_t iterations, uint32_t seed );
+
+     // C-интерфейс libaescrypt: сообщения, пакеты, потоки и файлы в сравнении с эталоном и FileEncryptor
+     void runLibraryTests( size_t iterations, uint32_t seed );
+
+     // проверка генератора IV: отсутствие повторов, равномерность байтов, независимость потоков
+     void runRandomGeneratorTests();
+
+     // замеры производительности режимов во всех поддерживаемых реализациях шифра с проверкой нижней границы
+     // каждой реализации. perfStats - с аппаратными счетчиками
+     void runThroughputGates( const double minMbps[ 3 ], bool perfStats );
+
+     void check( const std::string& name, bool passed );
+
+     std::string tempPath( const std::string& suffix ) const;
+
+private:
+     std::ostream& log_;
+     size_t checks_ = 0;
+     size_t failures_ = 0;
+};
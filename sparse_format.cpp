@@ -0,0 +1,188 @@
+/// @file
+/// @brief Формат разреженного файла, зашифрованного в режиме CTR: участки с данными на прежних местах и карта участков
+
+#include "sparse_format.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+     const char magic[ 8 ] = { 'A', 'E', 'S', 'S', 'P', 'R', '0', '1' };
+     const size_t extentSize = 16;
+     const size_t macSize = 16;
+
+     // plainSize, число участков, резерв, CMAC, сигнатура
+     const size_t fixedTrailerSize = 8 + 4 + 4 + macSize + sizeof( magic );
+
+     void putUint32( unsigned char* dst, uint32_t value )
+     {
+          for( int idx = 0; idx < 4; idx++ )
+          {
+               dst[ idx ] = static_cast< unsigned char >( value >> ( 8 * idx ) );
+          }
+     }
+
+     void putUint64( unsigned char* dst, uint64_t value )
+     {
+          for( int idx = 0; idx < 8; idx++ )
+          {
+               dst[ idx ] = static_cast< unsigned char >( value >> ( 8 * idx ) );
+          }
+     }
+
+     uint32_t getUint32( const unsigned char* src )
+     {
+          uint32_t value = 0;
+          for( int idx = 3; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | src[ idx ];
+          }
+          return value;
+     }
+
+     uint64_t getUint64( const unsigned char* src )
+     {
+          uint64_t value = 0;
+          for( int idx = 7; idx >= 0; idx-- )
+          {
+               value = ( value << 8 ) | src[ idx ];
+          }
+          return value;
+     }
+}
+
+
+size_t SparseMap::trailerSize() const
+{
+     return extents.size() * extentSize + fixedTrailerSize;
+}
+
+
+SparseFormat::SparseFormat( AesKeyLength keyLength, const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv )
+:crypt_( keyLength )
+{
+     if( iv.size() != 16 )
+     {
+          throw std::runtime_error( "iv has not valid size" );
+     }
+     memcpy( iv_, iv.data(), 16 );
+
+     // ключ имитовставки: E_K( "SPR" || счетчик ), усеченный до длины основного ключа. Метка отличается от
+     // сегментированного формата, чтобы ключи имитовставок разных форматов не совпадали
+     roundKeys_ = crypt_.expandKey( key );
+     std::vector< unsigned char > macKey( 32 );
+     for( unsigned char counter = 0; counter < 2; counter++ )
+     {
+          unsigned char block[ 16 ] = { 'S', 'P', 'R' };
+          block[ 15 ] = counter;
+          crypt_.cryptBlocksECB( block, macKey.data() + 16 * counter, 16, roundKeys_ );
+     }
+     macKey.resize( key.size() );
+     macKeys_ = crypt_.expandKey( macKey, false );
+}
+
+
+const AESCryptography& SparseFormat::crypt() const
+{
+     return crypt_;
+}
+
+
+const AesRoundKeys& SparseFormat::roundKeys() const
+{
+     return roundKeys_;
+}
+
+
+std::vector< unsigned char > SparseFormat::serialize( const SparseMap& map ) const
+{
+     std::vector< unsigned char > result( map.trailerSize() );
+     unsigned char* entry = result.data();
+     for( const FileExtent& extent: map.extents )
+     {
+          putUint64( entry, extent.offset );
+          putUint64( entry + 8, extent.size );
+          entry += extentSize;
+     }
+     putUint64( entry, map.plainSize );
+     putUint32( entry + 8, static_cast< uint32_t >( map.extents.size() ) );
+     putUint32( entry + 12, 0 );
+
+     // имитовставка вычисляется над картой и IV
+     std::vector< unsigned char > authenticated( result.data(), entry + 16 );
+     authenticated.insert( authenticated.end(), iv_, iv_ + 16 );
+     crypt_.cmac( authenticated.data(), authenticated.size(), macKeys_, entry + 16 );
+     memcpy( entry + 16 + macSize, magic, sizeof( magic ) );
+     return result;
+}
+
+
+bool SparseFormat::detect( const PosixFile& file )
+{
+     const uint64_t fileSize = file.size();
+     unsigned char signature[ sizeof( magic ) ];
+     return fileSize >= sizeof( magic ) && file.readAt( signature, sizeof( signature ), fileSize - sizeof( magic ) ) == sizeof( signature ) &&
+            memcmp( signature, magic, sizeof( magic ) ) == 0;
+}
+
+
+SparseMap SparseFormat::read( const PosixFile& file ) const
+{
+     const uint64_t fileSize = file.size();
+
+     unsigned char fixed[ fixedTrailerSize ];
+     if( fileSize < fixedTrailerSize || file.readAt( fixed, fixedTrailerSize, fileSize - fixedTrailerSize ) != fixedTrailerSize ||
+         memcmp( fixed + fixedTrailerSize - sizeof( magic ), magic, sizeof( magic ) ) != 0 )
+     {
+          throw std::runtime_error( "Input file is not a sparse encrypted file" );
+     }
+
+     SparseMap map;
+     map.plainSize = getUint64( fixed );
+     uint32_t count = getUint32( fixed + 8 );
+     const uint64_t trailerSize = count * static_cast< uint64_t >( extentSize ) + fixedTrailerSize;
+     if( count > maxExtents || fileSize < trailerSize || fileSize - trailerSize != map.plainSize )
+     {
+          throw std::runtime_error( "Sparse map corrupted" );
+     }
+     map.extents.resize( count );
+
+     std::vector< unsigned char > trailer( map.trailerSize() );
+     if( file.readAt( trailer.data(), trailer.size(), map.plainSize ) != trailer.size() )
+     {
+          throw std::runtime_error( "Sparse map corrupted" );
+     }
+
+     // проверяем имитовставку до разбора карты. Сравнение без раннего выхода
+     const size_t authenticatedSize = count * extentSize + 16;
+     std::vector< unsigned char > authenticated( trailer.begin(), trailer.begin() + authenticatedSize );
+     authenticated.insert( authenticated.end(), iv_, iv_ + 16 );
+     unsigned char mac[ macSize ];
+     crypt_.cmac( authenticated.data(), authenticated.size(), macKeys_, mac );
+     unsigned char difference = 0;
+     for( size_t idx = 0; idx < macSize; idx++ )
+     {
+          difference |= mac[ idx ] ^ trailer[ authenticatedSize + idx ];
+     }
+     if( difference != 0 )
+     {
+          throw std::runtime_error( "Sparse map corrupted or wrong key/iv" );
+     }
+
+     // карта подлинная, но все равно проверяем, что участки упорядочены, не пересекаются и лежат внутри файла
+     uint64_t end = 0;
+     for( uint32_t idx = 0; idx < count; idx++ )
+     {
+          FileExtent& extent = map.extents[ idx ];
+          extent.offset = getUint64( trailer.data() + idx * extentSize );
+          extent.size = getUint64( trailer.data() + idx * extentSize + 8 );
+          if( extent.offset < end || extent.offset % 16 != 0 || extent.offset > map.plainSize || extent.size == 0 ||
+              extent.size > map.plainSize - extent.offset )
+          {
+               throw std::runtime_error( "Sparse map corrupted" );
+          }
+          end = extent.offset + extent.size;
+     }
+     return map;
+}
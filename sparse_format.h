@@ -0,0 +1,54 @@
+/// @file
+/// @brief Формат разреженного файла, зашифрованного в режиме CTR: участки с данными на прежних местах и карта участков
+#pragma once
+
+#include "AES_cryptography.h"
+#include "file_io.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// карта разреженного файла: размер открытого текста и участки с данными, все остальное - дыры
+struct SparseMap
+{
+     uint64_t plainSize = 0;
+     std::vector< FileExtent > extents;
+
+     // размер концевика с картой, записываемого после шифртекста
+     size_t trailerSize() const;
+};
+
+
+// Формат файла(все числа в little-endian):
+//   шифртекст размером plainSize | участки по 16 байт: смещение(8), размер(8) | plainSize(8) | число участков(4) |
+//   резерв(4) | CMAC(16) | "AESSPR01"
+// Участки зашифрованы CTR со счетчиком IV + смещение / 16 и лежат на тех же смещениях, что в открытом тексте, а дыры
+// остаются дырами. Смещения участков кратны 16 байтам. CMAC вычисляется на отдельном ключе над концевиком и IV,
+// поэтому измененная карта, неверный ключ или IV обнаруживаются до расшифрования
+class SparseFormat
+{
+public:
+     SparseFormat( AesKeyLength keyLength, const std::vector< unsigned char >& key, const std::vector< unsigned char >& iv );
+
+     const AESCryptography& crypt() const;
+     const AesRoundKeys& roundKeys() const;
+
+     // формирует концевик с имитовставкой
+     std::vector< unsigned char > serialize( const SparseMap& map ) const;
+
+     // читает концевик, проверяет имитовставку и согласованность карты с размером файла
+     SparseMap read( const PosixFile& file ) const;
+
+     // true, если файл заканчивается сигнатурой разреженного формата. Ключ не нужен
+     static bool detect( const PosixFile& file );
+
+     // максимальное число участков, которое принимается при чтении
+     static const uint32_t maxExtents = 1 << 24;
+
+private:
+     AESCryptography crypt_;
+     AesRoundKeys roundKeys_;
+     AesRoundKeys macKeys_;
+     unsigned char iv_[ 16 ];
+};
@@ -0,0 +1,282 @@
+/// @file
+/// @brief Пул потоков с перехватом задач(work stealing) для параллельной обработки файлов и их частей
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <exception>
+#include <unistd.h>
+
+namespace
+{
+     // пул и номер рабочего потока, в котором выполняется код. Для внешних потоков - nullptr
+     thread_local const void* currentPool = nullptr;
+     thread_local size_t currentWorker = 0;
+}
+
+
+ThreadPool::ThreadPool( size_t threadCount, NumaPolicy policy )
+:policy_( policy )
+{
+     if( threadCount == 0 )
+     {
+          threadCount = hardwareThreads();
+     }
+     workerNodes_.assign( threadCount, 0 );
+     workerCpus_.assign( threadCount, -1 );
+     if( policy_ != NPOff )
+     {
+          // потоки делятся между узлами непрерывными диапазонами, внутри узла занимают ядра по порядку
+          const NumaTopology& topology = NumaTopology::host();
+          size_t firstOnNode = 0;
+          for( size_t idx = 0; idx < threadCount; idx++ )
+          {
+               size_t node = idx * topology.nodeCount() / threadCount;
+               if( idx == 0 || node != workerNodes_[ idx - 1 ] )
+               {
+                    firstOnNode = idx;
+               }
+               const std::vector< int >& cpus = topology.nodeCpus( node );
+               workerNodes_[ idx ] = node;
+               workerCpus_[ idx ] = cpus[ ( idx - firstOnNode ) % cpus.size() ];
+          }
+     }
+     for( size_t idx = 0; idx < threadCount; idx++ )
+     {
+          queues_.emplace_back( new WorkerQueue() );
+     }
+     workers_.reserve( threadCount );
+     for( size_t idx = 0; idx < threadCount; idx++ )
+     {
+          workers_.emplace_back( &ThreadPool::workerLoop, this, idx );
+     }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+     {
+          std::lock_guard< std::mutex > lock( sleepMutex_ );
+          stopped_ = true;
+     }
+     wake_.notify_all();
+     for( std::thread& worker: workers_ )
+     {
+          worker.join();
+     }
+}
+
+
+size_t ThreadPool::threadCount() const
+{
+     return workers_.size();
+}
+
+
+void ThreadPool::parallelFor( size_t taskCount, const std::function< void( size_t ) >& task )
+{
+     // одна задача выполняется сразу в вызывающем потоке
+     if( taskCount == 1 )
+     {
+          task( 0 );
+          return;
+     }
+
+     std::mutex doneMutex;
+     std::condition_variable doneCondition;
+     std::atomic< size_t > remaining( taskCount );
+     std::exception_ptr error;
+
+     // задачи внешнего потока раздаются непрерывными диапазонами: задача idx попадает к потоку idx * threadCount / taskCount
+     const bool external = currentPool != this;
+     for( size_t idx = 0; idx < taskCount; idx++ )
+     {
+          push( external ? idx * queues_.size() / taskCount : currentWorker, [ &, idx ]()
+          {
+               std::exception_ptr taskError;
+               try
+               {
+                    task( idx );
+               }
+               catch( ... )
+               {
+                    taskError = std::current_exception();
+               }
+
+               // счетчик уменьшается и условие оповещается под doneMutex: после того как ожидающий поток захватит
+               // doneMutex и увидит ноль, последняя задача больше не обращается к его кадру стека
+               std::lock_guard< std::mutex > doneLock( doneMutex );
+               if( taskError && !error )
+               {
+                    error = taskError;
+               }
+               if( --remaining == 0 )
+               {
+                    doneCondition.notify_all();
+               }
+          } );
+     }
+
+     if( currentPool == this )
+     {
+          // рабочий поток помогает выполнять задачи, пока не завершатся его собственные. Чтение счетчика без мьютекса
+          // только подсказывает, что ждать больше нечего: окончательная проверка ниже выполняется под doneMutex
+          while( remaining != 0 )
+          {
+               if( !runOneTask( currentWorker ) )
+               {
+                    std::this_thread::yield();
+               }
+          }
+     }
+
+     std::unique_lock< std::mutex > doneLock( doneMutex );
+     doneCondition.wait( doneLock, [ & ]() { return remaining == 0; } );
+     if( error )
+     {
+          std::rethrow_exception( error );
+     }
+}
+
+
+size_t ThreadPool::hardwareThreads()
+{
+     size_t count = std::thread::hardware_concurrency();
+     return count == 0 ? 1 : count;
+}
+
+
+void ThreadPool::placeMemory( unsigned char* data, size_t size ) const
+{
+     if( policy_ == NPOff || size == 0 )
+     {
+          return;
+     }
+
+     const NumaTopology& topology = NumaTopology::host();
+     if( policy_ == NPInterleave )
+     {
+          std::vector< size_t > nodes( workerNodes_.begin(), workerNodes_.end() );
+          nodes.erase( std::unique( nodes.begin(), nodes.end() ), nodes.end() );
+          topology.bindMemory( data, size, nodes, true );
+          return;
+     }
+
+     // вложенный parallelFor оставляет задачи в очереди вызывающего потока: весь буфер размещается на его узле
+     if( currentPool == this )
+     {
+          topology.bindMemory( data, size, { workerNodes_[ currentWorker ] }, false );
+          return;
+     }
+
+     // диапазоны потоков одного узла объединяются, границы округляются до страницы
+     const size_t pageSize = sysconf( _SC_PAGESIZE );
+     const size_t threadCount = workerNodes_.size();
+     size_t begin = 0;
+     for( size_t idx = 0; idx < threadCount; idx++ )
+     {
+          if( idx + 1 < threadCount && workerNodes_[ idx + 1 ] == workerNodes_[ idx ] )
+          {
+               continue;
+          }
+          size_t end = idx + 1 == threadCount ? size : ( size * ( idx + 1 ) / threadCount ) / pageSize * pageSize;
+          if( end > begin )
+          {
+               topology.bindMemory( data + begin, end - begin, { workerNodes_[ idx ] }, false );
+               begin = end;
+          }
+     }
+}
+
+
+NumaPolicy ThreadPool::numaPolicy() const
+{
+     return policy_;
+}
+
+
+void ThreadPool::submit( std::function< void() > task )
+{
+     push( currentPool == this ? currentWorker : nextQueue_++ % queues_.size(), std::move( task ) );
+}
+
+
+void ThreadPool::push( size_t target, std::function< void() > task )
+{
+     {
+          std::lock_guard< std::mutex > lock( queues_[ target ]->mutex );
+          queues_[ target ]->tasks.push_back( std::move( task ) );
+     }
+     pending_++;
+
+     std::lock_guard< std::mutex > lock( sleepMutex_ );
+     wake_.notify_one();
+}
+
+
+bool ThreadPool::runOneTask( size_t self )
+{
+     std::function< void() > task;
+     {
+          WorkerQueue& own = *queues_[ self ];
+          std::lock_guard< std::mutex > lock( own.mutex );
+          if( !own.tasks.empty() )
+          {
+               task = std::move( own.tasks.back() );
+               own.tasks.pop_back();
+          }
+     }
+
+     // сначала перехватываем у потоков своего узла: их данные лежат в той же памяти
+     for( int remote = 0; !task && remote < 2; remote++ )
+     {
+          for( size_t shift = 1; !task && shift < queues_.size(); shift++ )
+          {
+               size_t victimIdx = ( self + shift ) % queues_.size();
+               if( ( workerNodes_[ victimIdx ] != workerNodes_[ self ] ) != ( remote != 0 ) )
+               {
+                    continue;
+               }
+               WorkerQueue& victim = *queues_[ victimIdx ];
+               std::lock_guard< std::mutex > lock( victim.mutex );
+               if( !victim.tasks.empty() )
+               {
+                    task = std::move( victim.tasks.front() );
+                    victim.tasks.pop_front();
+               }
+          }
+     }
+
+     if( !task )
+     {
+          return false;
+     }
+     pending_--;
+     task();
+     return true;
+}
+
+
+void ThreadPool::workerLoop( size_t index )
+{
+     currentPool = this;
+     currentWorker = index;
+     if( workerCpus_[ index ] >= 0 )
+     {
+          NumaTopology::pinCurrentThread( workerCpus_[ index ] );
+     }
+     while( true )
+     {
+          if( runOneTask( index ) )
+          {
+               continue;
+          }
+
+          std::unique_lock< std::mutex > lock( sleepMutex_ );
+          wake_.wait( lock, [ this ]() { return stopped_ || pending_ != 0; } );
+          if( stopped_ && pending_ == 0 )
+          {
+               return;
+          }
+     }
+}
@@ -0,0 +1,79 @@
+/// @file
+/// @brief Пул потоков с перехватом задач(work stealing) для параллельной обработки файлов и их частей
+#pragma once
+
+#include "numa_topology.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// у каждого рабочего потока своя очередь. Поток берет задачи с конца своей очереди(последние поставленные данные
+// еще в кэше), а при ее опустошении перехватывает задачи из начала очередей других потоков.
+// parallelFor, вызванный из рабочего потока, не блокирует его: пока задачи не выполнены, поток выполняет задачи пула,
+// поэтому задачи могут порождать вложенные задачи(файл -> его части) без взаимной блокировки.
+// С политикой NUMA потоки закрепляются за ядрами, соседние номера - на одном узле, и перехватывают задачи сначала
+// у потоков своего узла. parallelFor раздает задачи внешнего потока по очередям непрерывными диапазонами, поэтому
+// placeMemory может заранее разместить каждую часть буфера на узле потока, который будет ее обрабатывать
+class ThreadPool
+{
+public:
+     // threadCount == 0 - по числу аппаратных потоков
+     explicit ThreadPool( size_t threadCount = 0, NumaPolicy policy = NPOff );
+     ~ThreadPool();
+
+     ThreadPool( const ThreadPool& ) = delete;
+     ThreadPool& operator=( const ThreadPool& ) = delete;
+
+     size_t threadCount() const;
+
+     // выполняет task( idx ) для idx из [0, taskCount) и дожидается завершения всех задач.
+     // первое возникшее исключение пробрасывается вызывающему после завершения остальных задач
+     void parallelFor( size_t taskCount, const std::function< void( size_t ) >& task );
+
+     // ставит задачу в очередь текущего рабочего потока или, для внешних потоков, в очереди по кругу.
+     // Не дожидается выполнения: задача сама должна сообщить о завершении и перехватить свои исключения
+     void submit( std::function< void() > task );
+
+     // размещает страницы буфера [data, data + size), который будет обработан parallelFor равными частями,
+     // по политике пула: каждую часть на узле ее потока или вперемешку. Без политики ничего не делает
+     void placeMemory( unsigned char* data, size_t size ) const;
+
+     NumaPolicy numaPolicy() const;
+
+     static size_t hardwareThreads();
+
+private:
+     struct WorkerQueue
+     {
+          std::mutex mutex;
+          std::deque< std::function< void() > > tasks;
+     };
+
+     // выполняет одну задачу из своей очереди или перехваченную у другого потока. false - задач нет
+     bool runOneTask( size_t self );
+
+     void workerLoop( size_t index );
+
+     void push( size_t target, std::function< void() > task );
+
+private:
+     std::vector< std::unique_ptr< WorkerQueue > > queues_;
+     std::vector< std::thread > workers_;
+     NumaPolicy policy_;
+     std::vector< size_t > workerNodes_;     // порядковый номер узла топологии каждого потока
+     std::vector< int > workerCpus_;         // ядро каждого потока, -1 - не закреплен
+
+     std::atomic< size_t > pending_{ 0 };
+     std::atomic< size_t > nextQueue_{ 0 };
+     std::mutex sleepMutex_;
+     std::condition_variable wake_;
+     bool stopped_ = false;
+};
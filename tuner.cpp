@@ -0,0 +1,199 @@
+/// @file
+/// @brief Подбор реализации шифра, числа потоков и размера части данных короткими замерами на текущем процессоре
+
+#include "tuner.h"
+#include "file_crypt.h"
+#include "file_io.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+#include <random>
+#include <unistd.h>
+
+namespace
+{
+     // размер данных для сравнения реализаций шифра: помещается в кэш L2, поэтому замер не зависит от памяти
+     const size_t backendBufferSize = 64 * 1024;
+
+     // доли секунды, на которые рассчитывается объем данных замеров потоков и частей
+     const double threadsSeconds = 0.02;
+     const double chunkSeconds = 0.1;
+
+     const size_t chunkCandidates[] = { 64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1 << 20, 2 << 20, 4 << 20, 8 << 20 };
+
+     std::vector< unsigned char > randomBytes( size_t size )
+     {
+          std::mt19937 rng( 0x7a11 );
+          std::vector< unsigned char > result( size );
+          for( unsigned char& value: result )
+          {
+               value = static_cast< unsigned char >( rng() );
+          }
+          return result;
+     }
+
+     // объем данных, который обрабатывается со скоростью mbps примерно за seconds, в пределах [minSize, maxSize]
+     size_t sizeForTime( double mbps, double seconds, size_t minSize, size_t maxSize )
+     {
+          size_t size = static_cast< size_t >( mbps * 1e6 * seconds ) / 16 * 16;
+          return std::min( std::max( size, minSize ), maxSize );
+     }
+}
+
+
+Tuner::Tuner( std::ostream& log, const std::string& workDir )
+:log_( log ), workDir_( workDir )
+{
+}
+
+
+TuningProfile Tuner::run()
+{
+     TuningProfile profile;
+     profile.cpuModel = TuningProfile::hostCpuModel();
+     log_ << "CPU: " << profile.cpuModel << std::endl;
+     log_ << std::fixed << std::setprecision( 1 );
+
+     // реализации перечислены по возрастанию требований к процессору
+     double bestBackend = 0;
+     for( AesBackend backend: { ABPortable, ABTable, ABAesNi } )
+     {
+          if( !AESCryptography::backendSupported( backend ) )
+          {
+               continue;
+          }
+          double mbps = measureBackend( backend );
+          log_ << "backend " << AESCryptography::backendName( backend ) << ": " << mbps << " MB/s" << std::endl;
+          if( mbps > bestBackend )
+          {
+               bestBackend = mbps;
+               profile.backend = backend;
+          }
+     }
+     AESCryptography::setBackend( profile.backend );
+
+     // лишние потоки не ускоряют работу, упирающуюся в память, но мешают другим процессам
+     const size_t hardwareThreads = ThreadPool::hardwareThreads();
+     const size_t threadsSize = sizeForTime( bestBackend * hardwareThreads, threadsSeconds, 1 << 20, 64 << 20 );
+     double bestThreads = 0;
+     for( size_t threadCount = 1; ; threadCount = std::min( 2 * threadCount, hardwareThreads ) )
+     {
+          double mbps = measureThreads( threadCount, threadsSize );
+          log_ << "threads " << threadCount << ": " << mbps << " MB/s" << std::endl;
+          if( clearlyFaster( mbps, bestThreads ) )
+          {
+               bestThreads = mbps;
+               profile.threadCount = threadCount;
+          }
+          if( threadCount == hardwareThreads )
+          {
+               break;
+          }
+     }
+
+     // размер части проверяется на настоящем файле: в него входят системные вызовы и синхронизация потоков
+     const uint64_t fileSize = sizeForTime( bestThreads, chunkSeconds, 8 << 20, 256 << 20 );
+     const std::string plainPath = workDir_ + "/crypto_2_tune_" + std::to_string( getpid() );
+     {
+          std::vector< unsigned char > data = randomBytes( 1 << 20 );
+          PosixFile plain = PosixFile::create( plainPath );
+          for( uint64_t offset = 0; offset < fileSize; offset += data.size() )
+          {
+               plain.writeAt( data.data(), std::min< uint64_t >( data.size(), fileSize - offset ), offset );
+          }
+     }
+     try
+     {
+          double bestChunk = 0;
+          for( size_t chunkSize: chunkCandidates )
+          {
+               double mbps = measureChunkSize( chunkSize, profile.threadCount, plainPath, fileSize );
+               log_ << "chunk " << chunkSize / 1024 << " KiB: " << mbps << " MB/s" << std::endl;
+               if( clearlyFaster( mbps, bestChunk ) )
+               {
+                    bestChunk = mbps;
+                    profile.chunkSize = chunkSize;
+               }
+          }
+     }
+     catch( ... )
+     {
+          unlink( plainPath.c_str() );
+          unlink( ( plainPath + ".out" ).c_str() );
+          throw;
+     }
+     unlink( plainPath.c_str() );
+     unlink( ( plainPath + ".out" ).c_str() );
+     return profile;
+}
+
+
+double Tuner::measureBackend( AesBackend backend )
+{
+     AESCryptography::setBackend( backend );
+     AESCryptography crypt( AKL_256 );
+     AesRoundKeys roundKeys = crypt.expandKey( randomBytes( 32 ) );
+     std::vector< unsigned char > data = randomBytes( backendBufferSize );
+     unsigned char chain[ 16 ] = {};
+
+     double encrypt = throughput( data.size(), [ & ]() { crypt.cryptBlocksCBC( data.data(), data.data(), data.size(), roundKeys, chain ); } );
+     double decrypt = throughput( data.size(), [ & ]() { crypt.decryptBlocksCBC( data.data(), data.data(), data.size(), roundKeys, chain ); } );
+     double ctr = throughput( data.size(), [ & ]() { crypt.cryptBlocksCTR( data.data(), data.data(), data.size(), roundKeys, chain ); } );
+     return 3 / ( 1 / encrypt + 1 / decrypt + 1 / ctr );
+}
+
+
+double Tuner::measureThreads( size_t threadCount, size_t size )
+{
+     ThreadPool workers( threadCount );
+     AESCryptography crypt( AKL_256 );
+     AesRoundKeys roundKeys = crypt.expandKey( randomBytes( 32 ) );
+     std::vector< unsigned char > data = randomBytes( size );
+     unsigned char counter[ 16 ] = {};
+     return throughput( data.size(), [ & ]()
+     {
+          FileEncryptor::cryptBlocksParallel( crypt, roundKeys, CMCtr, data.data(), data.size(), counter, workers );
+     } );
+}
+
+
+double Tuner::measureChunkSize( size_t chunkSize, size_t threadCount, const std::string& plainPath, uint64_t size )
+{
+     BufferPool pool( chunkSize );
+     std::vector< unsigned char > key = randomBytes( 32 );
+     std::vector< unsigned char > iv = randomBytes( 16 );
+     return throughput( size, [ & ]()
+     {
+          FileEncryptor fileCrypt( plainPath, plainPath + ".out", pool );
+          fileCrypt.setThreadCount( threadCount );
+          fileCrypt.cryptFile( key, CMCtr, iv );
+     } );
+}
+
+
+double Tuner::throughput( size_t bytes, const std::function< void() >& operation )
+{
+     // первый вызов прогревает кэши, таблицы и страницы буферов и не учитывается
+     operation();
+
+     size_t calls = 0;
+     double elapsed = 0;
+     auto start = std::chrono::steady_clock::now();
+     do
+     {
+          operation();
+          calls++;
+          elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+     }
+     while( elapsed < measureSeconds );
+     return static_cast< double >( bytes ) * calls / elapsed / 1e6;
+}
+
+
+bool Tuner::clearlyFaster( double candidate, double best )
+{
+     return candidate > best * 1.03;
+}
@@ -0,0 +1,45 @@
+/// @file
+/// @brief Подбор реализации шифра, числа потоков и размера части данных короткими замерами на текущем процессоре
+#pragma once
+
+#include "tuning_profile.h"
+
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <string>
+
+
+// Замеры выполняются последовательно: сначала выбирается реализация шифра(по одному потоку), затем с ней - число
+// потоков для параллельных режимов и, наконец, размер части данных на шифровании временного файла в workDir.
+// Объем данных каждого замера подбирается по скорости реализации, поэтому весь подбор занимает несколько секунд
+class Tuner
+{
+public:
+     Tuner( std::ostream& log, const std::string& workDir );
+
+     // выполняет замеры и возвращает лучший профиль для этого процессора. Выбранная реализация шифра остается активной
+     TuningProfile run();
+
+private:
+     // скорость реализации в МБ/с: среднее гармоническое шифрования и расшифрования CBC и режима CTR
+     double measureBackend( AesBackend backend );
+
+     // скорость CTR в threadCount потоках на буфере size байт
+     double measureThreads( size_t threadCount, size_t size );
+
+     // скорость шифрования файла size байт частями по chunkSize байт
+     double measureChunkSize( size_t chunkSize, size_t threadCount, const std::string& plainPath, uint64_t size );
+
+     // повторяет operation над bytes байт, пока не наберется measureSeconds. Возвращает МБ/с
+     static double throughput( size_t bytes, const std::function< void() >& operation );
+
+     // среди упорядоченных по возрастанию стоимости вариантов дорогой выбирается, только если он быстрее заметно
+     static bool clearlyFaster( double candidate, double best );
+
+private:
+     static constexpr double measureSeconds = 0.1;
+
+     std::ostream& log_;
+     const std::string workDir_;
+};
@@ -0,0 +1,242 @@
+/// @file
+/// @brief Профиль настройки под процессор: реализация шифра, размер части данных и число потоков
+
+#include "tuning_profile.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace
+{
+     const char* const profileHeader = "# crypto_2 tuning profile, written by 'crypto_2 tune'";
+
+     struct ActiveProfile
+     {
+          std::mutex mutex;
+          TuningProfile profile;
+          bool loaded = false;
+     };
+
+     ActiveProfile& activeProfile()
+     {
+          static ActiveProfile active;
+          return active;
+     }
+
+     std::string trim( const std::string& value )
+     {
+          size_t begin = value.find_first_not_of( " \t\r" );
+          size_t end = value.find_last_not_of( " \t\r" );
+          return begin == std::string::npos ? std::string() : value.substr( begin, end - begin + 1 );
+     }
+
+     // создает каталог path вместе с недостающими родительскими каталогами
+     void makeDirectories( const std::string& path )
+     {
+          for( size_t pos = path.find( '/', 1 ); ; pos = path.find( '/', pos + 1 ) )
+          {
+               std::string part = path.substr( 0, pos );
+               if( mkdir( part.c_str(), 0755 ) != 0 && errno != EEXIST )
+               {
+                    throw std::runtime_error( "Could not create directory: " + part );
+               }
+               if( pos == std::string::npos )
+               {
+                    break;
+               }
+          }
+     }
+}
+
+
+TuningProfile TuningProfile::active()
+{
+     ActiveProfile& active = activeProfile();
+     std::lock_guard< std::mutex > lock( active.mutex );
+     if( !active.loaded )
+     {
+          active.loaded = true;
+
+          // поврежденный профиль по умолчанию не мешает работе: используются значения по умолчанию
+          TuningProfile profile;
+          try
+          {
+               if( load( defaultPath(), profile ) )
+               {
+                    AESCryptography::setBackend( profile.backend );
+                    active.profile = profile;
+               }
+          }
+          catch( const std::exception& )
+          {
+          }
+     }
+     return active.profile;
+}
+
+
+bool TuningProfile::loadActive( const std::string& path )
+{
+     TuningProfile profile;
+     if( !load( path, profile ) )
+     {
+          return false;
+     }
+     ActiveProfile& active = activeProfile();
+     std::lock_guard< std::mutex > lock( active.mutex );
+     AESCryptography::setBackend( profile.backend );
+     active.profile = profile;
+     active.loaded = true;
+     return true;
+}
+
+
+bool TuningProfile::load( const std::string& path, TuningProfile& profile )
+{
+     std::ifstream inp( path );
+     if( !inp )
+     {
+          return false;
+     }
+
+     TuningProfile result;
+     bool backendFound = false;
+     bool backendSupported = true;
+     std::string line;
+     while( std::getline( inp, line ) )
+     {
+          line = trim( line );
+          if( line.empty() || line[ 0 ] == '#' )
+          {
+               continue;
+          }
+          size_t separator = line.find( '=' );
+          if( separator == std::string::npos )
+          {
+               throw std::runtime_error( "Incorrect tuning profile: " + path );
+          }
+          std::string name = trim( line.substr( 0, separator ) );
+          std::string value = trim( line.substr( separator + 1 ) );
+
+          // неизвестные ключи пропускаются: профиль может быть записан более новой версией
+          try
+          {
+               if( name == "cpu" )
+               {
+                    result.cpuModel = value;
+               }
+               else if( name == "backend" )
+               {
+                    for( AesBackend backend: { ABPortable, ABTable, ABAesNi } )
+                    {
+                         if( value == AESCryptography::backendName( backend ) )
+                         {
+                              result.backend = backend;
+                              backendFound = true;
+                              backendSupported = AESCryptography::backendSupported( backend );
+                         }
+                    }
+                    if( !backendFound )
+                    {
+                         throw std::runtime_error( "unknown backend" );
+                    }
+               }
+               else if( name == "chunk_size" )
+               {
+                    result.chunkSize = std::stoull( value );
+               }
+               else if( name == "threads" )
+               {
+                    result.threadCount = std::stoull( value );
+               }
+          }
+          catch( const std::exception& )
+          {
+               throw std::runtime_error( "Incorrect tuning profile: " + path );
+          }
+     }
+     if( !backendFound || result.chunkSize < minChunkSize || result.chunkSize > maxChunkSize )
+     {
+          throw std::runtime_error( "Incorrect tuning profile: " + path );
+     }
+
+     if( result.cpuModel != hostCpuModel() || !backendSupported )
+     {
+          return false;
+     }
+     profile = result;
+     return true;
+}
+
+
+void TuningProfile::save( const std::string& path ) const
+{
+     size_t separator = path.rfind( '/' );
+     if( separator != std::string::npos && separator != 0 )
+     {
+          makeDirectories( path.substr( 0, separator ) );
+     }
+
+     std::ofstream out( path, std::ios::trunc );
+     out << profileHeader << "\n"
+         << "cpu=" << cpuModel << "\n"
+         << "backend=" << AESCryptography::backendName( backend ) << "\n"
+         << "chunk_size=" << chunkSize << "\n"
+         << "threads=" << threadCount << "\n";
+     out.flush();
+     if( !out )
+     {
+          throw std::runtime_error( "Could not write tuning profile: " + path );
+     }
+}
+
+
+std::string TuningProfile::defaultPath()
+{
+     if( const char* path = getenv( "AESCRYPT_PROFILE" ) )
+     {
+          return path;
+     }
+     if( const char* config = getenv( "XDG_CONFIG_HOME" ) )
+     {
+          return std::string( config ) + "/crypto_2/profile";
+     }
+     const char* home = getenv( "HOME" );
+     return std::string( home != nullptr ? home : "." ) + "/.config/crypto_2/profile";
+}
+
+
+std::string TuningProfile::hostCpuModel()
+{
+     static const std::string model = []()
+     {
+          // на x86 модель указана в "model name", на ARM - идентификатор ядра
+          std::ifstream inp( "/proc/cpuinfo" );
+          std::string line;
+          std::string result;
+          while( std::getline( inp, line ) )
+          {
+               size_t separator = line.find( ':' );
+               if( separator == std::string::npos )
+               {
+                    continue;
+               }
+               std::string name = trim( line.substr( 0, separator ) );
+               std::string value = trim( line.substr( separator + 1 ) );
+               if( name == "model name" )
+               {
+                    return value;
+               }
+               if( result.empty() && name == "CPU part" )
+               {
+                    result = "CPU part " + value;
+               }
+          }
+          return result.empty() ? std::string( "unknown" ) : result;
+     }();
+     return model;
+}
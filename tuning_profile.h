@@ -0,0 +1,43 @@
+/// @file
+/// @brief Профиль настройки под процессор: реализация шифра, размер части данных и число потоков
+#pragma once
+
+#include "AES_cryptography.h"
+#include "buffer_pool.h"
+
+#include <cstddef>
+#include <string>
+
+
+// Профиль записывается командой tune(см. Tuner) и загружается утилитой и библиотекой при первом обращении.
+// Профиль, снятый на другой модели процессора, не применяется: оптимальные значения сильно различаются между поколениями
+struct TuningProfile
+{
+     AesBackend backend = AESCryptography::bestBackend();
+     size_t chunkSize = BufferPool::defaultBlockSize;     // размер блока пула буферов по умолчанию, байт
+     size_t threadCount = 0;                             // потоков для параллельных режимов. 0 - по числу аппаратных потоков
+     std::string cpuModel;                               // модель процессора, на котором сняты замеры
+
+     // активный профиль процесса. При первом вызове загружается из defaultPath() и выбирает реализацию шифра
+     static TuningProfile active();
+
+     // загружает профиль из path и делает его активным. Размер блока пула по умолчанию меняется, только если пул
+     // еще не создан. Возвращает false, если файла нет или профиль снят на другом процессоре
+     static bool loadActive( const std::string& path );
+
+     // читает профиль. Бросает исключение для поврежденного файла, false - файла нет или профиль с другого процессора
+     static bool load( const std::string& path, TuningProfile& profile );
+
+     // записывает профиль, создавая недостающий каталог
+     void save( const std::string& path ) const;
+
+     // $AESCRYPT_PROFILE, иначе $XDG_CONFIG_HOME/crypto_2/profile или ~/.config/crypto_2/profile
+     static std::string defaultPath();
+
+     // модель процессора из /proc/cpuinfo
+     static std::string hostCpuModel();
+
+     // допустимые размеры части данных
+     static const size_t minChunkSize = 64 * 1024;
+     static const size_t maxChunkSize = 64 * 1024 * 1024;
+};